@@ -19,6 +19,10 @@ require_relative 'dogstatsd_reporter'
 # This doesn't seem to be clearly documented anywhere, you just see people rediscovering it on the web, for instance
 # in https://gist.github.com/carlos8f/3473107 . If you're curious, the ports show up using the `netstat` tool.
 # Behavior on Linux seems to be different (or at least the defaults are way higher).
+#
+# Besides the default case (where the transport keeps reusing the same native exporter across reports), the
+# "new exporter per export" case resets the transport before every report, which forces it to rebuild the native
+# exporter and its tags, as the transport used to do on every report.
 
 class ProfilerHttpTransportBenchmark
   def initialize
@@ -49,7 +53,16 @@ class ProfilerHttpTransportBenchmark
       pprof_data: '', # Random.new(0).bytes(32_000),
       code_provenance_file_name: 'example_code_provenance_file_name.json',
       code_provenance_data: '', # Random.new(1).bytes(4_000),
-      tags_as_array: [],
+      tags_as_array: [
+        %w[language ruby],
+        %w[process_id 12345],
+        %w[runtime-id 2cc3a5f4-8df2-4b9c-a01e-a64c9f1d5a2e],
+        %w[service profiler-benchmark],
+        %w[env benchmarking],
+        %w[version 1.0.0],
+        %w[host example-host],
+        ['profiler_version', Datadog::VERSION::STRING],
+      ],
     )
   end
 
@@ -84,6 +97,11 @@ class ProfilerHttpTransportBenchmark
         run_once
       end
 
+      x.report("http_transport new exporter per export #{ENV['CONFIG']}") do
+        @transport.reset_after_fork
+        run_once
+      end
+
       x.save! 'profiler-http-transport-results.json' unless VALIDATE_BENCHMARK_MODE
       x.compare!
     end
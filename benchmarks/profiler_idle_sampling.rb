@@ -0,0 +1,64 @@
+# Used to quickly run benchmark under RSpec as part of the usual test suite, to validate it didn't bitrot
+VALIDATE_BENCHMARK_MODE = ENV['VALIDATE_BENCHMARK'] == 'true'
+
+return unless __FILE__ == $PROGRAM_NAME || VALIDATE_BENCHMARK_MODE
+
+require 'ddtrace'
+require 'pry'
+
+# This benchmark measures the tick-to-sample latency of the CpuAndWallTimeWorker for idle processes.
+#
+# When no thread is holding the Global VM Lock, every time the CpuAndWallTimeWorker background thread wants to sample
+# it asks the IdleSamplingHelper to grab the Global VM Lock and simulate getting a SIGPROF. This benchmark keeps all
+# threads sleeping, and reports:
+# * the delay between the request and the sample starting (`idle_sample_delay_ns_percentiles`);
+# * how many of the requests turned into samples; and
+# * how much cpu-time the (otherwise idle) process used.
+
+class ProfilerIdleSamplingBenchmark
+  def initialize
+    @duration_seconds = VALIDATE_BENCHMARK_MODE ? 0.1 : 10
+  end
+
+  def run_benchmark
+    sleeping_threads = Array.new(4) { Thread.new { sleep } }
+
+    recorder = Datadog::Profiling::StackRecorder.new(cpu_time_enabled: true, alloc_samples_enabled: false)
+    worker = Datadog::Profiling::Collectors::CpuAndWallTimeWorker.new(
+      recorder: recorder,
+      max_frames: 400,
+      tracer: nil,
+      gc_profiling_enabled: false,
+      allocation_counting_enabled: false,
+    )
+
+    cpu_time_before = Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID)
+    worker.start
+    sleep(@duration_seconds)
+    worker.stop
+    cpu_time_used = Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID) - cpu_time_before
+
+    sleeping_threads.each(&:kill).each(&:join)
+    recorder.serialize
+
+    report(worker.stats, cpu_time_used)
+  end
+
+  def report(stats, cpu_time_used)
+    attempts = stats.fetch(:trigger_simulated_signal_delivery_attempts)
+    delivered = stats.fetch(:simulated_signal_delivery)
+    percentiles = stats.fetch(:idle_sample_delay_ns_percentiles) || {}
+
+    latencies_us = percentiles.map { |percentile, value_ns| "#{percentile}=#{(value_ns / 1000.0).round(1)}" }
+
+    puts "Simulated signal delivery: #{delivered} of #{attempts} attempts"
+    puts "  Tick-to-sample latency (us): #{latencies_us.join(' ')}"
+    puts "  Process cpu-time used: #{(cpu_time_used * 1000).round(1)}ms over #{@duration_seconds}s"
+  end
+end
+
+puts "Current pid is #{Process.pid}"
+
+ProfilerIdleSamplingBenchmark.new.instance_exec do
+  run_benchmark
+end
@@ -0,0 +1,83 @@
+# Used to quickly run benchmark under RSpec as part of the usual test suite, to validate it didn't bitrot
+VALIDATE_BENCHMARK_MODE = ENV['VALIDATE_BENCHMARK'] == 'true'
+
+return unless __FILE__ == $PROGRAM_NAME || VALIDATE_BENCHMARK_MODE
+
+require 'benchmark/ips'
+require 'ddtrace'
+require 'pry'
+require_relative 'dogstatsd_reporter'
+
+# This benchmark compares recording samples in a StackRecorder with pre-aggregation enabled against one with
+# pre-aggregation disabled (where every sample goes directly to `ddog_prof_Profile_add`).
+#
+# The samples are taken from a few threads with deep stacks that don't change, which is the case pre-aggregation is
+# meant for (e.g. web server threads waiting for requests).
+
+class ProfilerPreAggregationBenchmark
+  METRIC_VALUES = { 'cpu-time' => 123, 'cpu-samples' => 1, 'wall-time' => 456 }.freeze
+
+  def create_recorders
+    @recorders = {
+      'pre-aggregation' => new_recorder(pre_aggregation_enabled: true),
+      'ddog_prof_Profile_add' => new_recorder(pre_aggregation_enabled: false),
+    }
+  end
+
+  def new_recorder(pre_aggregation_enabled:)
+    Datadog::Profiling::StackRecorder.new(
+      cpu_time_enabled: true,
+      alloc_samples_enabled: false,
+      pre_aggregation_enabled: pre_aggregation_enabled,
+    )
+  end
+
+  def thread_with_very_deep_stack(depth: 200)
+    deep_stack = proc do |n|
+      if n > 0
+        deep_stack.call(n - 1)
+      else
+        sleep
+      end
+    end
+
+    Thread.new { deep_stack.call(depth) }.tap { |t| t.name = "Deep stack #{depth}" }
+  end
+
+  def sample_all(recorder)
+    @threads.each do |thread|
+      Datadog::Profiling::Collectors::Stack::Testing._native_sample(
+        thread, recorder, METRIC_VALUES, [['thread name', thread.name]], [], 400, false
+      )
+    end
+  end
+
+  def run_benchmark
+    Benchmark.ips do |x|
+      benchmark_time = VALIDATE_BENCHMARK_MODE ? {time: 0.01, warmup: 0} : {time: 10, warmup: 2}
+      x.config(
+        **benchmark_time,
+        suite: report_to_dogstatsd_if_enabled_via_environment_variable(benchmark_name: 'profiler_pre_aggregation')
+      )
+
+      @recorders.each do |name, recorder|
+        x.report(name) { sample_all(recorder) }
+      end
+
+      x.save! 'profiler-pre-aggregation-results.json' unless VALIDATE_BENCHMARK_MODE
+      x.compare!
+    end
+
+    @recorders.each_value(&:serialize)
+  end
+end
+
+puts "Current pid is #{Process.pid}"
+
+ProfilerPreAggregationBenchmark.new.instance_exec do
+  create_recorders
+  @threads = [100, 200, 300, 400].map { |depth| thread_with_very_deep_stack(depth: depth) }
+  sleep(0.1) # Give the threads time to reach the bottom of their stacks
+  run_benchmark
+  @threads.each(&:kill).each(&:join)
+end
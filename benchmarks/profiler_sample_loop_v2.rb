@@ -18,7 +18,13 @@ class ProfilerSampleLoopBenchmark
 
   def create_profiler
     @recorder = Datadog::Profiling::StackRecorder.new(cpu_time_enabled: true, alloc_samples_enabled: true)
-    @collector = Datadog::Profiling::Collectors::ThreadContext.new(recorder: @recorder, max_frames: 400, tracer: nil)
+    @collector = Datadog::Profiling::Collectors::ThreadContext.new(
+      recorder: @recorder,
+      max_frames: 400,
+      tracer: nil,
+      # Folds the deep recursive stacks of the threads below; set to compare the cost of sampling them
+      recursion_folding_enabled: ENV['RECURSION_FOLDING'] == 'true',
+    )
   end
 
   def thread_with_very_deep_stack(depth: 500)
@@ -33,6 +39,32 @@ class ProfilerSampleLoopBenchmark
     Thread.new { deep_stack.call(depth) }.tap { |t| t.name = "Deep stack #{depth}" }
   end
 
+  # Similar to the above, but the top of the stack keeps changing, while the bottom stays the same (like a web server
+  # or background job worker thread). This exercises the profiler's reuse of information for the unchanged part of
+  # the stack.
+  def thread_with_very_deep_stack_and_changing_top(depth: 500)
+    deep_stack = proc do |n|
+      if n > 0
+        deep_stack.call(n - 1)
+      else
+        loop do
+          changing_top_a { sleep(0.0001) }
+          changing_top_b { sleep(0.0001) }
+        end
+      end
+    end
+
+    Thread.new { deep_stack.call(depth) }.tap { |t| t.name = "Deep stack with changing top #{depth}" }
+  end
+
+  def changing_top_a
+    yield
+  end
+
+  def changing_top_b
+    yield
+  end
+
   def run_benchmark
     Benchmark.ips do |x|
       benchmark_time = VALIDATE_BENCHMARK_MODE ? {time: 0.01, warmup: 0} : {time: 10, warmup: 2}
@@ -63,6 +95,7 @@ puts "Current pid is #{Process.pid}"
 ProfilerSampleLoopBenchmark.new.instance_exec do
   create_profiler
   4.times { thread_with_very_deep_stack }
+  2.times { thread_with_very_deep_stack_and_changing_top }
   if ARGV.include?('--forever')
     run_forever
   else
@@ -0,0 +1,93 @@
+# Used to quickly run benchmark under RSpec as part of the usual test suite, to validate it didn't bitrot
+VALIDATE_BENCHMARK_MODE = ENV['VALIDATE_BENCHMARK'] == 'true'
+
+return unless __FILE__ == $PROGRAM_NAME || VALIDATE_BENCHMARK_MODE
+
+require 'benchmark/ips'
+require 'ddtrace'
+require 'pry'
+require_relative 'dogstatsd_reporter'
+
+# This benchmark measures how the performance of the stack sampling loop of the profiler scales with the number of
+# threads, e.g. to evaluate the cost of keeping track of per-thread state.
+#
+# For each thread count, it also compares looking up the per-thread contexts in the collector's table against looking
+# them up in an st_table (which is what the collector used before), using the same threads.
+
+class ProfilerSampleManyThreadsBenchmark
+  # This is needed because we're directly invoking the collector through a testing interface; in normal
+  # use a profiler thread is automatically used.
+  PROFILER_OVERHEAD_STACK_THREAD = Thread.new { sleep }
+
+  THREAD_COUNTS = [10, 100, 1000].freeze
+  LOOKUP_ROUNDS = 100
+
+  def initialize
+    @threads = []
+  end
+
+  def create_profiler
+    @recorder = Datadog::Profiling::StackRecorder.new(cpu_time_enabled: true, alloc_samples_enabled: true)
+    @collector = Datadog::Profiling::Collectors::ThreadContext.new(recorder: @recorder, max_frames: 400, tracer: nil)
+  end
+
+  def grow_threads_to(thread_count)
+    @threads << Thread.new { sleep } while @threads.size < thread_count
+  end
+
+  def run_benchmark
+    THREAD_COUNTS.each do |thread_count|
+      grow_threads_to(thread_count)
+
+      Benchmark.ips do |x|
+        benchmark_time = VALIDATE_BENCHMARK_MODE ? {time: 0.01, warmup: 0} : {time: 10, warmup: 2}
+        x.config(
+          **benchmark_time,
+          suite: report_to_dogstatsd_if_enabled_via_environment_variable(benchmark_name: 'profiler_sample_many_threads')
+        )
+
+        x.report("sample #{thread_count} threads #{ENV['CONFIG']}") do
+          Datadog::Profiling::Collectors::ThreadContext::Testing._native_sample(@collector, PROFILER_OVERHEAD_STACK_THREAD)
+        end
+
+        x.save! "profiler-sample-many-threads-#{thread_count}-results.json" unless VALIDATE_BENCHMARK_MODE
+        x.compare!
+      end
+
+      @recorder.serialize
+
+      Benchmark.ips do |x|
+        benchmark_time = VALIDATE_BENCHMARK_MODE ? {time: 0.01, warmup: 0} : {time: 10, warmup: 2}
+        x.config(
+          **benchmark_time,
+          suite: report_to_dogstatsd_if_enabled_via_environment_variable(
+            benchmark_name: 'profiler_sample_many_threads_lookups'
+          )
+        )
+
+        { 'per_thread_context_table' => false, 'st_table' => true }.each do |implementation, use_st_table|
+          x.report("#{LOOKUP_ROUNDS}x lookup #{thread_count} threads #{implementation} #{ENV['CONFIG']}") do
+            Datadog::Profiling::Collectors::ThreadContext::Testing._native_benchmark_context_lookups(
+              @collector, @threads, use_st_table, LOOKUP_ROUNDS
+            )
+          end
+        end
+
+        x.save! "profiler-sample-many-threads-lookups-#{thread_count}-results.json" unless VALIDATE_BENCHMARK_MODE
+        x.compare!
+      end
+    end
+  end
+
+  def stop_threads
+    @threads.each(&:kill).each(&:join)
+  end
+end
+
+puts "Current pid is #{Process.pid}"
+
+ProfilerSampleManyThreadsBenchmark.new.instance_exec do
+  create_profiler
+  run_benchmark
+  stop_threads
+end
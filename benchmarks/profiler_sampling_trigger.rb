@@ -0,0 +1,86 @@
+# Used to quickly run benchmark under RSpec as part of the usual test suite, to validate it didn't bitrot
+VALIDATE_BENCHMARK_MODE = ENV['VALIDATE_BENCHMARK'] == 'true'
+
+return unless __FILE__ == $PROGRAM_NAME || VALIDATE_BENCHMARK_MODE
+
+require 'ddtrace'
+require 'pry'
+
+# This benchmark compares the two ways the CpuAndWallTimeWorker can use to trigger samples: the default background
+# thread loop (which sleeps and then sends a SIGPROF to the thread holding the Global VM Lock) and the kernel timer
+# (`timer_trigger_enabled`).
+#
+# For each trigger, it reports:
+# * how close the number of samples got to the expected one (one every 10ms), which reflects the sample interval
+#   accuracy; and
+# * how often the SIGPROF landed on a thread that was not holding the Global VM Lock (`signal_handler_wrong_thread`).
+#
+# The workload mixes threads burning CPU with threads that keep switching in and out of IO, to keep the Global VM Lock
+# moving between threads.
+
+class ProfilerSamplingTriggerBenchmark
+  EXPECTED_INTERVAL_SECONDS = 0.01
+
+  def initialize
+    @duration_seconds = VALIDATE_BENCHMARK_MODE ? 0.1 : 10
+    @triggers = { 'loop' => false }
+    @triggers['timer'] = true if RUBY_PLATFORM.include?('linux')
+  end
+
+  def start_workload
+    @workload_threads = []
+    @workload_threads += Array.new(2) { Thread.new { loop { burn_cpu } } }
+    @workload_threads += Array.new(4) { Thread.new { loop { IO.select(nil, nil, nil, 0.001) } } }
+  end
+
+  def stop_workload
+    @workload_threads.each(&:kill).each(&:join)
+  end
+
+  def burn_cpu
+    i = 0
+    i += 1 while i < 10_000
+  end
+
+  def run_benchmark
+    @triggers.each do |trigger_name, timer_trigger_enabled|
+      recorder = Datadog::Profiling::StackRecorder.new(cpu_time_enabled: true, alloc_samples_enabled: false)
+      worker = Datadog::Profiling::Collectors::CpuAndWallTimeWorker.new(
+        recorder: recorder,
+        max_frames: 400,
+        tracer: nil,
+        gc_profiling_enabled: false,
+        allocation_counting_enabled: false,
+        timer_trigger_enabled: timer_trigger_enabled,
+      )
+
+      start_workload
+      worker.start
+      sleep(@duration_seconds)
+      worker.stop
+      stop_workload
+      recorder.serialize
+
+      report(trigger_name, worker.stats)
+    end
+  end
+
+  def report(trigger_name, stats)
+    expected_samples = (@duration_seconds / EXPECTED_INTERVAL_SECONDS).round
+    enqueued = stats.fetch(:signal_handler_enqueued_sample)
+    wrong_thread = stats.fetch(:signal_handler_wrong_thread)
+    signals = enqueued + wrong_thread
+
+    puts "Trigger: #{trigger_name}"
+    puts "  Samples: #{stats.fetch(:sampled)} (expected ~#{expected_samples})"
+    puts "  Signals handled: #{signals}, wrong thread: #{wrong_thread} " \
+      "(#{signals.zero? ? 0 : (100.0 * wrong_thread / signals).round(2)}%)"
+    puts "  Forwarded: #{stats.fetch(:signal_handler_forwarded)}, timer retargeted: #{stats.fetch(:timer_retargeted)}"
+  end
+end
+
+puts "Current pid is #{Process.pid}"
+
+ProfilerSamplingTriggerBenchmark.new.instance_exec do
+  run_benchmark
+end
@@ -2,6 +2,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
 // Contains the operating-system specific identifier needed to fetch CPU-time, and a flag to indicate if we failed to fetch it
@@ -16,6 +17,13 @@ typedef struct thread_cpu_time {
   long result_ns;
 } thread_cpu_time;
 
+// Contains a timer that fires based on the cpu time of a thread, and a flag to indicate if we failed to create it
+typedef struct thread_cpu_timer {
+  bool valid;
+  int error; // errno value for why we failed to create the timer, or 0 when not available
+  timer_t timer_id;
+} thread_cpu_timer;
+
 void self_test_clock_id(void);
 
 // TODO: Remove this after the OldStack profiler gets removed
@@ -23,4 +31,9 @@ VALUE clock_id_for(VALUE self, VALUE thread);
 
 // Safety: This function is assumed never to raise exceptions by callers
 thread_cpu_time_id thread_cpu_time_id_for(VALUE thread);
-thread_cpu_time thread_cpu_time_for(thread_cpu_time_id time_id);
\ No newline at end of file
+thread_cpu_time thread_cpu_time_for(thread_cpu_time_id time_id);
+
+bool thread_cpu_timers_supported(void);
+// Safety: These functions are assumed never to raise exceptions by callers
+thread_cpu_timer thread_cpu_timer_create(thread_cpu_time_id time_id, uint64_t native_thread_id, int signal, int signal_value, long interval_ns);
+void thread_cpu_timer_delete(thread_cpu_timer *timer);
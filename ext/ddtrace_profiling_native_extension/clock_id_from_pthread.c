@@ -73,4 +73,48 @@ thread_cpu_time thread_cpu_time_for(thread_cpu_time_id time_id) {
   return (thread_cpu_time) {.valid = true, .result_ns = current_cpu.tv_nsec + SECONDS_AS_NS(current_cpu.tv_sec)};
 }
 
+// Creating a timer that targets a thread (SIGEV_THREAD_ID) needs the kernel thread id for that thread, which Ruby only
+// keeps track of on Ruby 3.1+ (see native_thread_id_for)
+#if defined(HAVE_TIMER_CREATE) && !defined(NO_THREAD_TID)
+
+bool thread_cpu_timers_supported(void) { return true; }
+
+// Creates a timer that sends `signal` to the thread every time it uses `interval_ns` of cpu time.
+// The `signal_value` is made available to the signal handler as `siginfo_t.si_value.sival_int`.
+thread_cpu_timer thread_cpu_timer_create(thread_cpu_time_id time_id, uint64_t native_thread_id, int signal, int signal_value, long interval_ns) {
+  if (!time_id.valid) return (thread_cpu_timer) {.valid = false};
+
+  timer_t timer_id;
+  int error = thread_timer_create(time_id.clock_id, (pid_t) native_thread_id, signal, signal_value, interval_ns, &timer_id);
+
+  if (error != 0) return (thread_cpu_timer) {.valid = false, .error = error};
+
+  return (thread_cpu_timer) {.valid = true, .timer_id = timer_id};
+}
+
+void thread_cpu_timer_delete(thread_cpu_timer *timer) {
+  if (!timer->valid) return;
+
+  timer_delete(timer->timer_id);
+  timer->valid = false;
+}
+
+#else
+
+bool thread_cpu_timers_supported(void) { return false; }
+
+thread_cpu_timer thread_cpu_timer_create(
+  DDTRACE_UNUSED thread_cpu_time_id _time_id,
+  DDTRACE_UNUSED uint64_t _native_thread_id,
+  DDTRACE_UNUSED int _signal,
+  DDTRACE_UNUSED int _signal_value,
+  DDTRACE_UNUSED long _interval_ns
+) {
+  return (thread_cpu_timer) {.valid = false};
+}
+
+void thread_cpu_timer_delete(DDTRACE_UNUSED thread_cpu_timer *_timer) { } // Nothing to delete
+
+#endif
+
 #endif
\ No newline at end of file
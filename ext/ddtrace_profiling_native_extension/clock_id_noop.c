@@ -20,4 +20,18 @@ thread_cpu_time thread_cpu_time_for(DDTRACE_UNUSED thread_cpu_time_id _time_id)
   return (thread_cpu_time) {.valid = false};
 }
 
+bool thread_cpu_timers_supported(void) { return false; }
+
+thread_cpu_timer thread_cpu_timer_create(
+  DDTRACE_UNUSED thread_cpu_time_id _time_id,
+  DDTRACE_UNUSED uint64_t _native_thread_id,
+  DDTRACE_UNUSED int _signal,
+  DDTRACE_UNUSED int _signal_value,
+  DDTRACE_UNUSED long _interval_ns
+) {
+  return (thread_cpu_timer) {.valid = false};
+}
+
+void thread_cpu_timer_delete(DDTRACE_UNUSED thread_cpu_timer *_timer) { } // Nothing to delete
+
 #endif
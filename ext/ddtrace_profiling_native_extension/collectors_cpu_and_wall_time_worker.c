@@ -3,19 +3,28 @@
 #include <ruby/thread.h>
 #include <ruby/thread_native.h>
 #include <ruby/debug.h>
+#include "extconf.h"
 #include <stdbool.h>
 #include <stdatomic.h>
 #include <signal.h>
 #include <errno.h>
+#include <math.h>
+#ifdef HAVE_TIMER_CREATE
+  #include <time.h>
+  #include <unistd.h>
+  #include <sys/syscall.h>
+#endif
 
 #include "helpers.h"
 #include "ruby_helpers.h"
 #include "collectors_thread_context.h"
 #include "collectors_dynamic_sampling_rate.h"
 #include "collectors_idle_sampling_helper.h"
+#include "latency_histogram.h"
 #include "private_vm_api_access.h"
 #include "setup_signal_handler.h"
 #include "time_helpers.h"
+#include "clock_id.h"
 
 // Used to trigger the execution of Collectors::ThreadState, which implements all of the sampling logic
 // itself; this class only implements the "when to do it" part.
@@ -64,6 +73,60 @@
 // 4. The Ruby VM calls our `sample_from_postponed_job` from a thread holding the global VM lock. A sample is recorded by
 // calling `thread_context_collector_sample`.
 //
+// ### Timer-based sampling trigger
+//
+// On Linux, when `timer_trigger_enabled` is set, step 1 above works differently: rather than having the
+// `CpuAndWallTimeWorker` background thread wake up and send a `SIGPROF`, we ask the kernel to do it, using a POSIX
+// timer (`timer_create` with `CLOCK_MONOTONIC` and `SIGEV_THREAD_ID`) that sends `SIGPROF` directly to a specific thread.
+// Because the kernel keeps the timer going on a fixed schedule, the time between signals doesn't depend on when the
+// background thread gets scheduled, or on how long it took to do its work.
+//
+// The timer targets the thread that was holding the global VM lock the last time we sampled. The global VM lock often
+// moves between threads, so:
+// * If the timer signal lands on a thread that is no longer holding the global VM lock (e.g. because it's blocked on
+//   I/O), `handle_sampling_signal` disarms the timer, so that it doesn't keep interrupting that thread, and forwards
+//   the signal to the current owner (`timer_settime` and `pthread_kill` are both async-signal safe).
+// * When a sample triggered by a real signal runs on a thread that is not the current target, the timer gets recreated
+//   targeting that thread instead (the target of a POSIX timer can't be changed after it gets created). This happens
+//   outside of the signal handler, as `timer_create` is not async-signal safe. A disarmed timer also gets recreated
+//   this way, even if it was targeting the same thread.
+//
+// The signal handler may be disarming the timer on one thread while the thread holding the global VM lock recreates
+// it. To avoid the handler disarming a timer that was already deleted (or a different timer that reused its id), the
+// timer fields are guarded by `sampling_timer.generation`: it's odd while a thread is using or changing them, and
+// otherwise tags the current timer, which carries it as its `si_value`. The signal handler never waits: it skips
+// disarming if it can't claim the fields, or if the signal came from a timer other than the current one.
+//
+// The background thread is still needed in this mode, but only as a backstop: it still asks the IdleSamplingHelper to
+// sample when no thread is holding the global VM lock, and if it sees no timer signals arriving for a while (e.g.
+// because the timer target thread died), it sends a `SIGPROF` itself, which gets the timer recreated as described above.
+//
+// ### CPU-time sampling
+//
+// When `cpu_time_sampling_enabled` is set (Linux with Ruby 3.1+ only), every thread additionally gets a timer that is
+// driven by its own cpu-time clock, rather than by the wall clock (see "Per-thread cpu-time timers" in
+// collectors_thread_context.c). Every `CPU_TIME_SAMPLING_INTERVAL_NS` of cpu-time a thread uses, the kernel sends it a
+// `SIGPROF`, and `handle_sampling_signal` enqueues `sample_cpu_time_from_postponed_job`, which samples only that thread.
+// This means that busy threads get sampled more often than idle ones, and a thread that only ran for a short burst
+// between two iterations of the background thread loop still gets sampled.
+//
+// These signals are told apart from the ones sent by the background thread and by the timer-based sampling trigger by
+// their `si_value` (`CPU_TIME_TIMER_SIGNAL_VALUE`). Because the timers only fire while threads are using cpu, the
+// background thread loop is still needed to sample wall-time and to discover new threads, but runs less often in
+// this mode (see `WALL_TIME_SAMPLING_INTERVAL_WITH_CPU_TIME_SAMPLING_NS`).
+//
+// A cpu-time timer may fire while its thread is running without the global VM lock (e.g. in a C extension that released
+// it). We can't sample in that case, and we don't forward the signal to the thread holding the global VM lock either,
+// as that thread is not the one using the cpu; instead this gets counted in the `cpu_time_timer_wrong_thread` stat.
+//
+// ### CPU overhead controller
+//
+// When `cpu_overhead_controller_enabled` is set, the dynamic sampling rate module paces samples based on the cpu-time
+// the profiler uses, rather than the wall-time samples take (see "CPU overhead controller" in
+// collectors_dynamic_sampling_rate.c). For this, the time spent sampling on application threads gets measured using
+// the thread cpu-time clock, and the background thread loop periodically updates the controller with its own
+// cpu-time and the process cpu-time.
+//
 // ### TracePoints and Forking
 //
 // When the Ruby VM forks, the CPU/Wall-time profiling stops naturally because it's triggered by a background thread
@@ -74,6 +137,69 @@
 // always remember consider this case of -- the worker thread may not be alive but the `TracePoint`s can continue to
 // trigger samples.
 //
+// ### Allocation sampling
+//
+// The `RUBY_INTERNAL_EVENT_NEWOBJ` tracepoint gets called for every object allocation, so we need to be careful to
+// keep it cheap. For most allocations, the `on_newobj_event` function only decrements a countdown; once the countdown
+// reaches zero we take an allocation sample and pick when the next sample should be taken.
+//
+// The tracepoint gets called while the VM is still creating the object, so it can't allocate or raise. Thus, it only
+// asks the ThreadContext collector to copy the stack of the current thread, and the sample gets recorded a bit later
+// by `sample_allocation_from_postponed_job` (see "Allocation sampling" in collectors_thread_context.c for details).
+// Allocations that happen while a sample is waiting to be recorded (or while it's being recorded) get counted towards
+// the weight of the next sample.
+//
+// The distance between samples is picked randomly (using an exponential distribution, i.e. a Poisson process) with
+// an average of `allocation_sample_every` allocations. This avoids biasing our samples towards code that allocates
+// in a regular pattern that happens to line up with a fixed sampling interval.
+//
+// Each sample gets a weight of how many allocations happened since the last sample, and thus the total
+// `alloc-samples` in a profile is an estimate of the total number of allocations.
+//
+// Allocation sampling is disabled when `allocation_sample_every` is nil; otherwise it must be >= 1 and <= UINT_MAX.
+//
+// When heap profiling is enabled, the objects picked for allocation samples also get tracked by the StackRecorder
+// until they get freed. To find out when that happens, we use the `RUBY_INTERNAL_EVENT_FREEOBJ` tracepoint. This one
+// gets called for every object that gets freed, while the GC is running, so it can't allocate or raise, nor call
+// Ruby APIs that may do so. Thus, the worker keeps a pointer to the StackRecorder's heap recorder, and hands the freed
+// objects directly to it.
+//
+// Objects only stop being tracked when this tracepoint tells us they got freed. Thus, whenever the tracepoint gets
+// disabled (e.g. when the worker stops), the heap recorder gets cleared: otherwise it would keep reporting (and
+// measuring the size of) objects that may since have been freed, or whose memory may have been reused.
+//
+// ### GVL wait profiling
+//
+// On Ruby 3.2+, we can use the internal thread event hooks to find out when a thread is waiting to acquire the Global
+// VM Lock. The `RUBY_INTERNAL_THREAD_EVENT_READY` event gets triggered (without the GVL) on a thread when it becomes
+// ready to run, and the `RUBY_INTERNAL_THREAD_EVENT_RESUMED` event gets triggered (now with the GVL) on that same thread
+// when it finally gets to run. The time between both is time the thread spent waiting on the GVL.
+//
+// Because both events are triggered on the thread itself, we keep the timestamps in thread-local variables, and
+// thus don't need any other bookkeeping in the hook.
+//
+// We can't sample directly from the `RESUMED` event -- the VM is still in the middle of switching threads -- so
+// instead we accumulate the waiting time and use a postponed job to record it a bit later. Because the postponed job
+// may end up running on a different thread, the accumulated time is only reset by the thread that owns it; any
+// waiting time that's not recorded in one go gets picked up in a later sample for that same thread.
+//
+// ### Sampling latency histograms
+//
+// Besides the min/max/total sampling time, the stats include percentiles from histograms (see latency_histogram.c) of:
+// * how long each sample took (`sampling_time_ns_percentiles`), as measured in `rescued_sample_from_postponed_job`;
+// * how long each sample after a GC took (`gc_sampling_time_ns_percentiles`), as measured in
+//   `after_gc_from_postponed_job`;
+// * the delay between the signal handler enqueuing a sample and `sample_from_postponed_job` starting to run
+//   (`signal_to_sample_delay_ns_percentiles`). This is how long the VM took to get to a point where it was safe to
+//   sample, and thus how much "skid" samples have.
+// * the delay between the background thread asking the IdleSamplingHelper to sample (when no thread is holding the
+//   global VM lock) and the simulated signal delivery running (`idle_sample_delay_ns_percentiles`). This is the
+//   tick-to-sample latency for idle processes, and includes acquiring the global VM lock.
+//
+// Because `rb_postponed_job_register_one` does not enqueue a sample if there's one already pending, the signal handler
+// only records the time for the first signal that got a sample enqueued, and `sample_from_postponed_job` clears it.
+// The same applies to the IdleSamplingHelper, which ignores requests while there's one already pending.
+//
 // ---
 
 // Contains state for a single CpuAndWallTimeWorker instance
@@ -82,11 +208,26 @@ struct cpu_and_wall_time_worker_state {
 
   bool gc_profiling_enabled;
   bool allocation_counting_enabled;
+  bool gvl_profiling_enabled;
+  // When 0, allocation sampling is disabled
+  unsigned int allocation_sample_every;
+  bool heap_profiling_enabled;
+  // NULL unless heap profiling is enabled. Owned by the StackRecorder, which gets kept alive (via the
+  // thread_context_collector_instance) for as long as this worker.
+  heap_recorder *heap_recorder;
+  bool timer_trigger_enabled;
+  bool cpu_time_sampling_enabled;
   VALUE self_instance;
   VALUE thread_context_collector_instance;
   VALUE idle_sampling_helper_instance;
   VALUE owner_thread;
   dynamic_sampling_rate_state dynamic_sampling_rate;
+  // When the signal handler enqueued the currently-pending sample; 0 when there's none. See "Sampling latency
+  // histograms" section above.
+  atomic_long sample_enqueued_at_ns;
+  // When the background thread asked the IdleSamplingHelper to sample; 0 when there's no pending request. See
+  // "Sampling latency histograms" section above.
+  atomic_long idle_sample_requested_at_ns;
 
   // When something goes wrong during sampling, we record the Ruby exception here, so that it can be "re-raised" on
   // the CpuAndWallTimeWorker thread
@@ -98,6 +239,42 @@ struct cpu_and_wall_time_worker_state {
   VALUE gc_tracepoint;
 
   VALUE object_allocation_tracepoint;
+  VALUE object_free_tracepoint;
+
+  #ifndef NO_THREAD_EVENT_HOOKS
+    // Used to get GVL waiting information, see "GVL wait profiling" section above
+    rb_internal_thread_event_hook_t *gvl_profiling_hook;
+  #endif
+
+  #ifdef HAVE_TIMER_CREATE
+    // See "Timer-based sampling trigger" section above
+    struct sampling_timer {
+      // Guards the timer_id, target_tid and disarmed fields, see "Timer-based sampling trigger" section above
+      atomic_uint generation;
+      timer_t timer_id;
+      // Linux thread id the timer is currently targeting; 0 when there's no timer
+      pid_t target_tid;
+      // Set by the signal handler when it disarms the timer, because its target released the global VM lock
+      bool disarmed;
+      // Linux thread id of the last thread where the signal handler enqueued a sample
+      atomic_int requested_tid;
+      // Incremented by the signal handler every time a timer signal arrives; used by the background thread to
+      // notice when the timer stopped working
+      atomic_uint signals_received;
+    } sampling_timer;
+  #endif
+
+  // See "Allocation sampling" section above
+  struct allocation_sampling {
+    // Allocations left until the next sample
+    uint64_t countdown;
+    // Allocations since the last sample, used as the weight of the next sample
+    uint64_t allocations_since_last_sample;
+    // State for the random number generator used to pick the distance between samples
+    uint64_t random_state;
+    // Used to avoid sampling if we allocate while we're sampling
+    bool during_sample;
+  } allocation_sampling;
 
   struct stats {
     // How many times we tried to trigger a sample
@@ -116,6 +293,25 @@ struct cpu_and_wall_time_worker_state {
     uint64_t sampling_time_ns_min;
     uint64_t sampling_time_ns_max;
     uint64_t sampling_time_ns_total;
+    // See "Sampling latency histograms" section above
+    latency_histogram sampling_time_ns_histogram;
+    latency_histogram gc_sampling_time_ns_histogram;
+    latency_histogram signal_to_sample_delay_ns_histogram;
+    latency_histogram idle_sample_delay_ns_histogram;
+    // How many times we recorded time spent waiting on the GVL
+    unsigned int gvl_wait_sampled;
+    // How many times the signal handler forwarded a timer signal to the thread holding the GVL
+    unsigned int signal_handler_forwarded;
+    // How many times we created a timer targeting a new thread
+    unsigned int timer_retargeted;
+    // How many times the timer got disarmed because its target thread was no longer holding the global VM lock
+    unsigned int timer_disarmed;
+    // How many times a cpu-time timer signal arrived on a thread that was not holding the GVL
+    unsigned int cpu_time_timer_wrong_thread;
+    // How many times we sampled a thread due to its cpu-time timer
+    unsigned int cpu_time_sampled;
+    // How many allocation samples we took
+    unsigned int allocation_sampled;
   } stats;
 };
 
@@ -126,13 +322,22 @@ static VALUE _native_initialize(
   VALUE thread_context_collector_instance,
   VALUE gc_profiling_enabled,
   VALUE idle_sampling_helper_instance,
-  VALUE allocation_counting_enabled
+  VALUE allocation_counting_enabled,
+  VALUE gvl_profiling_enabled,
+  VALUE allocation_sample_every,
+  VALUE heap_profiling_enabled,
+  VALUE timer_trigger_enabled,
+  VALUE cpu_time_sampling_enabled,
+  VALUE cpu_overhead_controller_enabled,
+  VALUE overhead_target_percentage,
+  VALUE cpu_quota_cores
 );
 static void cpu_and_wall_time_worker_typed_data_mark(void *state_ptr);
 static VALUE _native_sampling_loop(VALUE self, VALUE instance);
 static VALUE _native_stop(DDTRACE_UNUSED VALUE _self, VALUE self_instance, VALUE worker_thread);
 static VALUE stop(VALUE self_instance, VALUE optional_exception);
-static void handle_sampling_signal(DDTRACE_UNUSED int _signal, DDTRACE_UNUSED siginfo_t *_info, DDTRACE_UNUSED void *_ucontext);
+static void handle_sampling_signal(DDTRACE_UNUSED int _signal, DDTRACE_UNUSED siginfo_t *info, DDTRACE_UNUSED void *_ucontext);
+static void process_sampling_signal(siginfo_t *info);
 static void *run_sampling_trigger_loop(void *state_ptr);
 static void interrupt_sampling_trigger_loop(void *state_ptr);
 static void sample_from_postponed_job(DDTRACE_UNUSED void *_unused);
@@ -159,8 +364,29 @@ static void grab_gvl_and_sample(void);
 static void reset_stats(struct cpu_and_wall_time_worker_state *state);
 static void sleep_for(uint64_t time_ns);
 static VALUE _native_allocation_count(DDTRACE_UNUSED VALUE self);
-static void on_newobj_event(DDTRACE_UNUSED VALUE tracepoint_data, DDTRACE_UNUSED void *unused);
+static void on_newobj_event(VALUE tracepoint_data, DDTRACE_UNUSED void *unused);
+static void sample_allocation_from_postponed_job(DDTRACE_UNUSED void *_unused);
+static VALUE rescued_sample_allocation(VALUE self_instance);
+static void on_freeobj_event(VALUE tracepoint_data, DDTRACE_UNUSED void *unused);
+static uint64_t next_allocation_sample_countdown(struct cpu_and_wall_time_worker_state *state);
 static void disable_tracepoints(struct cpu_and_wall_time_worker_state *state);
+static bool is_cpu_time_timer_signal(siginfo_t *info);
+static void sample_cpu_time_from_postponed_job(DDTRACE_UNUSED void *_unused);
+static VALUE rescued_sample_cpu_time_from_postponed_job(VALUE self_instance);
+#ifdef HAVE_TIMER_CREATE
+static bool is_timer_signal(siginfo_t *info);
+static pid_t current_tid(void);
+static void retarget_sampling_timer_to_current_thread(struct cpu_and_wall_time_worker_state *state);
+static void delete_sampling_timer(struct cpu_and_wall_time_worker_state *state);
+static void disarm_sampling_timer(struct cpu_and_wall_time_worker_state *state, siginfo_t *info);
+static bool try_claim_sampling_timer(struct cpu_and_wall_time_worker_state *state, unsigned int *generation);
+static unsigned int claim_sampling_timer(struct cpu_and_wall_time_worker_state *state);
+#endif
+#ifndef NO_THREAD_EVENT_HOOKS
+static void on_gvl_event(rb_event_flag_t event, const rb_internal_thread_event_data_t *_unused1, void *_unused2);
+static void sample_gvl_wait_from_postponed_job(DDTRACE_UNUSED void *_unused);
+static VALUE rescued_sample_gvl_wait_from_postponed_job(VALUE self_instance);
+#endif
 
 // Note on sampler global state safety:
 //
@@ -180,6 +406,28 @@ static struct cpu_and_wall_time_worker_state *active_sampler_instance_state = NU
 // API documented in profiling.rb .
 __thread uint64_t allocation_count = 0;
 
+#ifndef NO_THREAD_EVENT_HOOKS
+  // Used to implement GVL wait profiling, see "GVL wait profiling" section above. Same note about carryover as for
+  // `allocation_count` applies.
+  static __thread long gvl_waiting_since_ns = 0;
+  static __thread long gvl_wait_pending_ns = 0;
+
+  // To avoid enqueueing a postponed job for every single thread switch, we only do it once a thread has accumulated
+  // at least this much waiting time.
+  #define MINIMUM_GVL_WAIT_TO_SAMPLE_NS MILLIS_AS_NS(1)
+#endif
+
+#define MINIMUM_TIME_BETWEEN_SIGNALS_NS MILLIS_AS_NS(10)
+// If the background thread sees no timer signals for this many iterations, it assumes the timer is not working
+// (e.g. because it's targeting a thread that died) and signals the thread holding the GVL itself
+#define TIMER_SIGNALS_MISSING_ITERATIONS 3
+
+// See "CPU-time sampling" section above
+#define CPU_TIME_SAMPLING_INTERVAL_NS MILLIS_AS_NS(10)
+#define WALL_TIME_SAMPLING_INTERVAL_WITH_CPU_TIME_SAMPLING_NS MILLIS_AS_NS(100)
+// Used as the `si_value` for signals sent by cpu-time timers. Signals from other sources have a `si_value` of 0.
+#define CPU_TIME_TIMER_SIGNAL_VALUE 1
+
 void collectors_cpu_and_wall_time_worker_init(VALUE profiling_module) {
   rb_global_variable(&active_sampler_instance);
 
@@ -198,7 +446,7 @@ void collectors_cpu_and_wall_time_worker_init(VALUE profiling_module) {
   // https://bugs.ruby-lang.org/issues/18007 for a discussion around this.
   rb_define_alloc_func(collectors_cpu_and_wall_time_worker_class, _native_new);
 
-  rb_define_singleton_method(collectors_cpu_and_wall_time_worker_class, "_native_initialize", _native_initialize, 5);
+  rb_define_singleton_method(collectors_cpu_and_wall_time_worker_class, "_native_initialize", _native_initialize, 13);
   rb_define_singleton_method(collectors_cpu_and_wall_time_worker_class, "_native_sampling_loop", _native_sampling_loop, 1);
   rb_define_singleton_method(collectors_cpu_and_wall_time_worker_class, "_native_stop", _native_stop, 2);
   rb_define_singleton_method(collectors_cpu_and_wall_time_worker_class, "_native_reset_after_fork", _native_reset_after_fork, 1);
@@ -234,14 +482,37 @@ static VALUE _native_new(VALUE klass) {
   atomic_init(&state->should_run, false);
   state->gc_profiling_enabled = false;
   state->allocation_counting_enabled = false;
+  state->gvl_profiling_enabled = false;
+  state->allocation_sample_every = 0;
+  state->heap_profiling_enabled = false;
+  state->heap_recorder = NULL;
+  state->timer_trigger_enabled = false;
+  state->cpu_time_sampling_enabled = false;
   state->thread_context_collector_instance = Qnil;
   state->idle_sampling_helper_instance = Qnil;
   state->owner_thread = Qnil;
   dynamic_sampling_rate_init(&state->dynamic_sampling_rate);
+  atomic_init(&state->sample_enqueued_at_ns, 0);
+  atomic_init(&state->idle_sample_requested_at_ns, 0);
   state->failure_exception = Qnil;
   state->stop_thread = Qnil;
   state->gc_tracepoint = Qnil;
   state->object_allocation_tracepoint = Qnil;
+  state->object_free_tracepoint = Qnil;
+  #ifndef NO_THREAD_EVENT_HOOKS
+    state->gvl_profiling_hook = NULL;
+  #endif
+  #ifdef HAVE_TIMER_CREATE
+    atomic_init(&state->sampling_timer.generation, 0);
+    state->sampling_timer.target_tid = 0;
+    state->sampling_timer.disarmed = false;
+    atomic_init(&state->sampling_timer.requested_tid, 0);
+    atomic_init(&state->sampling_timer.signals_received, 0);
+  #endif
+  state->allocation_sampling = (struct allocation_sampling) {
+    // Seed doesn't need to be good, just needs to be non-zero for xorshift
+    .random_state = ((uint64_t) monotonic_wall_time_now_ns(DO_NOT_RAISE_ON_FAILURE)) | 1,
+  };
   reset_stats(state);
 
   return state->self_instance = TypedData_Wrap_Struct(klass, &cpu_and_wall_time_worker_typed_data, state);
@@ -253,20 +524,72 @@ static VALUE _native_initialize(
   VALUE thread_context_collector_instance,
   VALUE gc_profiling_enabled,
   VALUE idle_sampling_helper_instance,
-  VALUE allocation_counting_enabled
+  VALUE allocation_counting_enabled,
+  VALUE gvl_profiling_enabled,
+  VALUE allocation_sample_every,
+  VALUE heap_profiling_enabled,
+  VALUE timer_trigger_enabled,
+  VALUE cpu_time_sampling_enabled,
+  VALUE cpu_overhead_controller_enabled,
+  VALUE overhead_target_percentage,
+  VALUE cpu_quota_cores
 ) {
   ENFORCE_BOOLEAN(gc_profiling_enabled);
   ENFORCE_BOOLEAN(allocation_counting_enabled);
+  ENFORCE_BOOLEAN(gvl_profiling_enabled);
+  if (allocation_sample_every != Qnil) ENFORCE_TYPE(allocation_sample_every, T_FIXNUM);
+  ENFORCE_BOOLEAN(heap_profiling_enabled);
+  ENFORCE_BOOLEAN(timer_trigger_enabled);
+  ENFORCE_BOOLEAN(cpu_time_sampling_enabled);
+  ENFORCE_BOOLEAN(cpu_overhead_controller_enabled);
+  ENFORCE_TYPE(overhead_target_percentage, T_FLOAT);
+  if (cpu_quota_cores != Qnil) ENFORCE_TYPE(cpu_quota_cores, T_FLOAT);
+
+  if (allocation_sample_every != Qnil && (NUM2LONG(allocation_sample_every) < 1 || NUM2LONG(allocation_sample_every) > UINT_MAX)) {
+    rb_raise(
+      rb_eArgError,
+      "Unexpected allocation_sample_every, expected nil (to disable allocation sampling) or a value between 1 and %u",
+      UINT_MAX
+    );
+  }
+  if (!(NUM2DBL(overhead_target_percentage) > 0 && NUM2DBL(overhead_target_percentage) <= 100)) {
+    rb_raise(rb_eArgError, "Unexpected overhead_target_percentage, expected a value > 0 and <= 100");
+  }
+
+  #ifdef NO_THREAD_EVENT_HOOKS
+    if (gvl_profiling_enabled == Qtrue) rb_raise(rb_eArgError, "GVL profiling is only supported on Ruby 3.2 and above");
+  #endif
+  #ifndef HAVE_TIMER_CREATE
+    if (timer_trigger_enabled == Qtrue) rb_raise(rb_eArgError, "The timer sampling trigger is only supported on Linux");
+  #endif
+  if (cpu_time_sampling_enabled == Qtrue && !thread_cpu_timers_supported()) {
+    rb_raise(rb_eArgError, "CPU-time sampling is only supported on Linux with Ruby 3.1 and above");
+  }
 
   struct cpu_and_wall_time_worker_state *state;
   TypedData_Get_Struct(self_instance, struct cpu_and_wall_time_worker_state, &cpu_and_wall_time_worker_typed_data, state);
 
   state->gc_profiling_enabled = (gc_profiling_enabled == Qtrue);
   state->allocation_counting_enabled = (allocation_counting_enabled == Qtrue);
+  state->gvl_profiling_enabled = (gvl_profiling_enabled == Qtrue);
+  state->allocation_sample_every = allocation_sample_every == Qnil ? 0 : NUM2UINT(allocation_sample_every);
+  state->heap_profiling_enabled = (heap_profiling_enabled == Qtrue);
+  state->timer_trigger_enabled = (timer_trigger_enabled == Qtrue);
+  state->cpu_time_sampling_enabled = (cpu_time_sampling_enabled == Qtrue);
+  dynamic_sampling_rate_configure(
+    &state->dynamic_sampling_rate,
+    cpu_overhead_controller_enabled == Qtrue ? CPU_OVERHEAD_CONTROLLER : WALL_TIME_OVERHEAD_CONTROLLER,
+    NUM2DBL(overhead_target_percentage),
+    cpu_quota_cores == Qnil ? 0 : NUM2DBL(cpu_quota_cores)
+  );
+  state->allocation_sampling.countdown = next_allocation_sample_countdown(state);
+  state->allocation_sampling.allocations_since_last_sample = 0;
   state->thread_context_collector_instance = enforce_thread_context_collector_instance(thread_context_collector_instance);
+  state->heap_recorder = state->heap_profiling_enabled ? thread_context_collector_heap_recorder(state->thread_context_collector_instance) : NULL;
   state->idle_sampling_helper_instance = idle_sampling_helper_instance;
   state->gc_tracepoint = rb_tracepoint_new(Qnil, RUBY_INTERNAL_EVENT_GC_ENTER | RUBY_INTERNAL_EVENT_GC_EXIT, on_gc_event, NULL /* unused */);
   state->object_allocation_tracepoint = rb_tracepoint_new(Qnil, RUBY_INTERNAL_EVENT_NEWOBJ, on_newobj_event, NULL /* unused */);
+  state->object_free_tracepoint = rb_tracepoint_new(Qnil, RUBY_INTERNAL_EVENT_FREEOBJ, on_freeobj_event, NULL /* unused */);
 
   return Qtrue;
 }
@@ -282,6 +605,7 @@ static void cpu_and_wall_time_worker_typed_data_mark(void *state_ptr) {
   rb_gc_mark(state->stop_thread);
   rb_gc_mark(state->gc_tracepoint);
   rb_gc_mark(state->object_allocation_tracepoint);
+  rb_gc_mark(state->object_free_tracepoint);
 }
 
 // Called in a background thread created in CpuAndWallTimeWorker#start
@@ -314,6 +638,9 @@ static VALUE _native_sampling_loop(DDTRACE_UNUSED VALUE _self, VALUE instance) {
 
   // Reset the dynamic sampling rate state, if any (reminder: the monotonic clock reference may change after a fork)
   dynamic_sampling_rate_reset(&state->dynamic_sampling_rate);
+  // Same as above, the monotonic clock reference may change after a fork
+  atomic_store(&state->sample_enqueued_at_ns, 0);
+  atomic_store(&state->idle_sample_requested_at_ns, 0);
 
   // This write to a global is thread-safe BECAUSE we're still holding on to the global VM lock at this point
   active_sampler_instance_state = state;
@@ -332,6 +659,20 @@ static VALUE _native_sampling_loop(DDTRACE_UNUSED VALUE _self, VALUE instance) {
 
   disable_tracepoints(state);
 
+  #ifdef HAVE_TIMER_CREATE
+    // This is safe to do here BECAUSE we're holding on to the global VM lock, and thus no postponed job can be
+    // recreating the timer concurrently
+    delete_sampling_timer(state);
+  #endif
+  // Same as above, this is safe to do here BECAUSE we're holding on to the global VM lock
+  if (state->cpu_time_sampling_enabled) thread_context_collector_disable_cpu_timers(state->thread_context_collector_instance);
+
+  // Samples that the ThreadContext collector is holding on to would otherwise only get recorded when the next profile
+  // gets serialized. This happens after disabling the tracepoints, so no new ones show up after this.
+  if (!exception_state) {
+    rb_protect(thread_context_collector_flush_pending_samples, state->thread_context_collector_instance, &exception_state);
+  }
+
   active_sampler_instance_state = NULL;
   active_sampler_instance = Qnil;
   state->owner_thread = Qnil;
@@ -391,18 +732,56 @@ static VALUE stop(VALUE self_instance, VALUE optional_exception) {
 // NOTE: Remember that this will run in the thread and within the scope of user code, including user C code.
 // We need to be careful not to change any state that may be observed OR to restore it if we do. For instance, if anything
 // we do here can set `errno`, then we must be careful to restore the old `errno` after the fact.
-static void handle_sampling_signal(DDTRACE_UNUSED int _signal, DDTRACE_UNUSED siginfo_t *_info, DDTRACE_UNUSED void *_ucontext) {
+static void handle_sampling_signal(DDTRACE_UNUSED int _signal, DDTRACE_UNUSED siginfo_t *info, DDTRACE_UNUSED void *_ucontext) {
+  int saved_errno = errno;
+  process_sampling_signal(info);
+  errno = saved_errno;
+}
+
+// Called by handle_sampling_signal, which takes care of restoring `errno` (e.g. `timer_settime` or `syscall` may change
+// it), no matter where this function returns from
+static void process_sampling_signal(siginfo_t *info) {
   struct cpu_and_wall_time_worker_state *state = active_sampler_instance_state; // Read from global variable, see "sampler global state safety" note above
 
   // This can potentially happen if the CpuAndWallTimeWorker was stopped while the signal delivery was happening; nothing to do
   if (state == NULL) return;
 
+  if (is_cpu_time_timer_signal(info)) {
+    // See "CPU-time sampling" section above
+    if (!ruby_native_thread_p() || !is_current_thread_holding_the_gvl() || !ddtrace_rb_ractor_main_p()) {
+      state->stats.cpu_time_timer_wrong_thread++;
+      return;
+    }
+
+    rb_postponed_job_register_one(0, sample_cpu_time_from_postponed_job, NULL);
+    return;
+  }
+
+  #ifdef HAVE_TIMER_CREATE
+    bool from_timer = is_timer_signal(info);
+    if (from_timer) atomic_fetch_add(&state->sampling_timer.signals_received, 1);
+  #endif
+
   if (
     !ruby_native_thread_p() || // Not a Ruby thread
     !is_current_thread_holding_the_gvl() || // Not safe to enqueue a sample from this thread
     !ddtrace_rb_ractor_main_p() // We're not on the main Ractor; we currently don't support profiling non-main Ractors
   ) {
     state->stats.signal_handler_wrong_thread++;
+
+    #ifdef HAVE_TIMER_CREATE
+      // See "Timer-based sampling trigger" section above. We only forward signals that came from the timer, so a forwarded
+      // signal that still arrives on the wrong thread does not get forwarded again.
+      if (from_timer) disarm_sampling_timer(state, info);
+      if (from_timer && ruby_native_thread_p()) {
+        current_gvl_owner owner = gvl_owner();
+        if (owner.valid && !pthread_equal(owner.owner, pthread_self())) {
+          state->stats.signal_handler_forwarded++;
+          pthread_kill(owner.owner, SIGPROF);
+        }
+      }
+    #endif
+
     return;
   }
 
@@ -417,6 +796,16 @@ static void handle_sampling_signal(DDTRACE_UNUSED int _signal, DDTRACE_UNUSED si
 
   state->stats.signal_handler_enqueued_sample++;
 
+  long expected_sample_enqueued_at_ns = 0;
+  atomic_compare_exchange_strong(
+    &state->sample_enqueued_at_ns, &expected_sample_enqueued_at_ns, monotonic_wall_time_now_ns(DO_NOT_RAISE_ON_FAILURE)
+  );
+
+  #ifdef HAVE_TIMER_CREATE
+    // Only real signals (not simulated ones, e.g. from the IdleSamplingHelper) should cause the timer to be retargeted
+    if (state->timer_trigger_enabled && info != NULL) atomic_store(&state->sampling_timer.requested_tid, current_tid());
+  #endif
+
   // Note: If we ever want to get rid of rb_postponed_job_register_one, remember not to clobber Ruby exceptions, as
   // this function does this helpful job for us now -- https://github.com/ruby/ruby/commit/a98e343d39c4d7bf1e2190b076720f32d9f298b3.
   /*int result =*/ rb_postponed_job_register_one(0, sample_from_postponed_job, NULL);
@@ -427,15 +816,47 @@ static void handle_sampling_signal(DDTRACE_UNUSED int _signal, DDTRACE_UNUSED si
 static void *run_sampling_trigger_loop(void *state_ptr) {
   struct cpu_and_wall_time_worker_state *state = (struct cpu_and_wall_time_worker_state *) state_ptr;
 
-  uint64_t minimum_time_between_signals = MILLIS_AS_NS(10);
+  uint64_t minimum_time_between_signals = state->cpu_time_sampling_enabled ?
+    WALL_TIME_SAMPLING_INTERVAL_WITH_CPU_TIME_SAMPLING_NS : MINIMUM_TIME_BETWEEN_SIGNALS_NS;
+  #ifdef HAVE_TIMER_CREATE
+    unsigned int timer_signals_last_seen = 0;
+    int iterations_without_timer_signals = 0;
+  #endif
 
   while (atomic_load(&state->should_run)) {
-    state->stats.trigger_sample_attempts++;
-
     // TODO: This is still a placeholder for a more complex mechanism. In particular:
     // * We want to do more than having a fixed sampling rate
 
+    // See "CPU overhead controller" section above
+    if (dynamic_sampling_rate_tracks_cpu_time(&state->dynamic_sampling_rate)) {
+      dynamic_sampling_rate_update_controller(
+        &state->dynamic_sampling_rate,
+        monotonic_wall_time_now_ns(DO_NOT_RAISE_ON_FAILURE),
+        process_cpu_time_now_ns(DO_NOT_RAISE_ON_FAILURE),
+        current_thread_cpu_time_now_ns(DO_NOT_RAISE_ON_FAILURE)
+      );
+    }
+
     current_gvl_owner owner = gvl_owner();
+
+    #ifdef HAVE_TIMER_CREATE
+      if (state->timer_trigger_enabled && owner.valid) {
+        // See "Timer-based sampling trigger" section above. The timer takes care of signaling the thread holding the
+        // GVL, so we only need to step in if it looks like it's not working.
+        unsigned int timer_signals = atomic_load(&state->sampling_timer.signals_received);
+        iterations_without_timer_signals = timer_signals == timer_signals_last_seen ? iterations_without_timer_signals + 1 : 0;
+        timer_signals_last_seen = timer_signals;
+
+        if (iterations_without_timer_signals < TIMER_SIGNALS_MISSING_ITERATIONS) {
+          sleep_for(minimum_time_between_signals);
+          continue;
+        }
+        iterations_without_timer_signals = 0;
+      }
+    #endif
+
+    state->stats.trigger_sample_attempts++;
+
     if (owner.valid) {
       // Note that reading the GVL owner and sending them a signal is a race -- the Ruby VM keeps on executing while
       // we're doing this, so we may still not signal the correct thread from time to time, but our signal handler
@@ -450,6 +871,10 @@ static void *run_sampling_trigger_loop(void *state_ptr) {
       // for an uncontrolled amount of time. (This can still happen to the IdleSamplingHelper, but the
       // CpuAndWallTimeWorker will still be free to interrupt the Ruby VM and keep sampling for the entire blocking period).
       state->stats.trigger_simulated_signal_delivery_attempts++;
+      long expected_idle_sample_requested_at_ns = 0;
+      atomic_compare_exchange_strong(
+        &state->idle_sample_requested_at_ns, &expected_idle_sample_requested_at_ns, monotonic_wall_time_now_ns(DO_NOT_RAISE_ON_FAILURE)
+      );
       idle_sampling_helper_request_action(state->idle_sampling_helper_instance, grab_gvl_and_sample);
     }
 
@@ -477,15 +902,29 @@ static void interrupt_sampling_trigger_loop(void *state_ptr) {
 static void sample_from_postponed_job(DDTRACE_UNUSED void *_unused) {
   struct cpu_and_wall_time_worker_state *state = active_sampler_instance_state; // Read from global variable, see "sampler global state safety" note above
 
-  // This can potentially happen if the CpuAndWallTimeWorker was stopped while the postponed job was waiting to be executed; nothing to do
+  // This can potentially happen if the CpuAndWallTimeWorker was stopped while the postponed job was waiting to be executed;
+  // nothing to do (`sample_enqueued_at_ns` gets cleared when the worker starts again)
   if (state == NULL) return;
 
+  // Cleared even if we skip the sample below, otherwise the next sample would record a delay that started with this one
+  long sample_enqueued_at_ns = atomic_exchange(&state->sample_enqueued_at_ns, 0);
+
   // @ivoanjo: I'm not sure this can ever happen because `handle_sampling_signal` only enqueues this callback if
   // it's running on the main Ractor, but just in case...
   if (!ddtrace_rb_ractor_main_p()) {
     return; // We're not on the main Ractor; we currently don't support profiling non-main Ractors
   }
 
+  if (sample_enqueued_at_ns > 0) {
+    long delay_ns = monotonic_wall_time_now_ns(DO_NOT_RAISE_ON_FAILURE) - sample_enqueued_at_ns;
+    // Guard against wall-time going backwards (or failing to be read), same as for the sampling time
+    if (delay_ns >= 0) latency_histogram_record(&state->stats.signal_to_sample_delay_ns_histogram, delay_ns);
+  }
+
+  #ifdef HAVE_TIMER_CREATE
+    if (state->timer_trigger_enabled) retarget_sampling_timer_to_current_thread(state);
+  #endif
+
   // Rescue against any exceptions that happen during sampling
   safely_call(rescued_sample_from_postponed_job, state->self_instance, state->self_instance);
 }
@@ -503,9 +942,19 @@ static VALUE rescued_sample_from_postponed_job(VALUE self_instance) {
 
   state->stats.sampled++;
 
+  bool tracks_cpu_time = dynamic_sampling_rate_tracks_cpu_time(&state->dynamic_sampling_rate);
+  long cpu_time_ns_before_sample = tracks_cpu_time ? current_thread_cpu_time_now_ns(DO_NOT_RAISE_ON_FAILURE) : 0;
+
   VALUE profiler_overhead_stack_thread = state->owner_thread; // Used to attribute profiler overhead to a different stack
   thread_context_collector_sample(state->thread_context_collector_instance, wall_time_ns_before_sample, profiler_overhead_stack_thread);
 
+  if (tracks_cpu_time) {
+    long cpu_time_ns_after_sample = current_thread_cpu_time_now_ns(DO_NOT_RAISE_ON_FAILURE);
+    if (cpu_time_ns_before_sample > 0) {
+      dynamic_sampling_rate_add_profiler_cpu_time(&state->dynamic_sampling_rate, cpu_time_ns_after_sample - cpu_time_ns_before_sample);
+    }
+  }
+
   long wall_time_ns_after_sample = monotonic_wall_time_now_ns(RAISE_ON_FAILURE);
   long delta_ns = wall_time_ns_after_sample - wall_time_ns_before_sample;
 
@@ -515,6 +964,60 @@ static VALUE rescued_sample_from_postponed_job(VALUE self_instance) {
   state->stats.sampling_time_ns_min = uint64_min_of(sampling_time_ns, state->stats.sampling_time_ns_min);
   state->stats.sampling_time_ns_max = uint64_max_of(sampling_time_ns, state->stats.sampling_time_ns_max);
   state->stats.sampling_time_ns_total += sampling_time_ns;
+  latency_histogram_record(&state->stats.sampling_time_ns_histogram, sampling_time_ns);
+
+  dynamic_sampling_rate_after_sample(&state->dynamic_sampling_rate, wall_time_ns_after_sample, sampling_time_ns);
+
+  // Return a dummy VALUE because we're called from rb_rescue2 which requires it
+  return Qnil;
+}
+
+static bool is_cpu_time_timer_signal(siginfo_t *info) {
+  return info != NULL && info->si_code == SI_TIMER && info->si_value.sival_int == CPU_TIME_TIMER_SIGNAL_VALUE;
+}
+
+static void sample_cpu_time_from_postponed_job(DDTRACE_UNUSED void *_unused) {
+  struct cpu_and_wall_time_worker_state *state = active_sampler_instance_state; // Read from global variable, see "sampler global state safety" note above
+
+  // This can potentially happen if the CpuAndWallTimeWorker was stopped while the postponed job was waiting to be executed; nothing to do
+  if (state == NULL) return;
+
+  // Same as for `sample_from_postponed_job`, just in case
+  if (!ddtrace_rb_ractor_main_p()) return;
+
+  // Rescue against any exceptions that happen during sampling
+  safely_call(rescued_sample_cpu_time_from_postponed_job, state->self_instance, state->self_instance);
+}
+
+static VALUE rescued_sample_cpu_time_from_postponed_job(VALUE self_instance) {
+  struct cpu_and_wall_time_worker_state *state;
+  TypedData_Get_Struct(self_instance, struct cpu_and_wall_time_worker_state, &cpu_and_wall_time_worker_typed_data, state);
+
+  long wall_time_ns_before_sample = monotonic_wall_time_now_ns(RAISE_ON_FAILURE);
+
+  // Sampling still has a cost, so we respect the dynamic sampling rate here as well. The cpu-time that doesn't get
+  // sampled now is not lost -- it gets included in the next sample for the thread.
+  if (!dynamic_sampling_rate_should_sample(&state->dynamic_sampling_rate, wall_time_ns_before_sample)) return Qnil;
+
+  state->stats.cpu_time_sampled++;
+
+  bool tracks_cpu_time = dynamic_sampling_rate_tracks_cpu_time(&state->dynamic_sampling_rate);
+  long cpu_time_ns_before_sample = tracks_cpu_time ? current_thread_cpu_time_now_ns(DO_NOT_RAISE_ON_FAILURE) : 0;
+
+  thread_context_collector_sample_current_thread(state->thread_context_collector_instance, wall_time_ns_before_sample);
+
+  if (tracks_cpu_time) {
+    long cpu_time_ns_after_sample = current_thread_cpu_time_now_ns(DO_NOT_RAISE_ON_FAILURE);
+    if (cpu_time_ns_before_sample > 0) {
+      dynamic_sampling_rate_add_profiler_cpu_time(&state->dynamic_sampling_rate, cpu_time_ns_after_sample - cpu_time_ns_before_sample);
+    }
+  }
+
+  long wall_time_ns_after_sample = monotonic_wall_time_now_ns(RAISE_ON_FAILURE);
+  long delta_ns = wall_time_ns_after_sample - wall_time_ns_before_sample;
+
+  // Guard against wall-time going backwards, see https://github.com/DataDog/dd-trace-rb/pull/2336 for discussion.
+  uint64_t sampling_time_ns = delta_ns < 0 ? 0 : delta_ns;
 
   dynamic_sampling_rate_after_sample(&state->dynamic_sampling_rate, wall_time_ns_after_sample, sampling_time_ns);
 
@@ -554,7 +1057,27 @@ static VALUE release_gvl_and_run_sampling_trigger_loop(VALUE instance) {
   // because they may raise exceptions.
   install_sigprof_signal_handler(handle_sampling_signal, "handle_sampling_signal");
   if (state->gc_profiling_enabled) rb_tracepoint_enable(state->gc_tracepoint);
-  if (state->allocation_counting_enabled) rb_tracepoint_enable(state->object_allocation_tracepoint);
+  if (state->allocation_counting_enabled || state->allocation_sample_every > 0) {
+    rb_tracepoint_enable(state->object_allocation_tracepoint);
+  }
+  if (state->heap_recorder != NULL && state->allocation_sample_every > 0) rb_tracepoint_enable(state->object_free_tracepoint);
+  #ifndef NO_THREAD_EVENT_HOOKS
+    if (state->gvl_profiling_enabled) {
+      state->gvl_profiling_hook = rb_internal_thread_add_event_hook(
+        on_gvl_event,
+        RUBY_INTERNAL_THREAD_EVENT_READY | RUBY_INTERNAL_THREAD_EVENT_RESUMED,
+        NULL /* unused */
+      );
+    }
+  #endif
+  if (state->cpu_time_sampling_enabled) {
+    thread_context_collector_enable_cpu_timers(
+      state->thread_context_collector_instance,
+      CPU_TIME_SAMPLING_INTERVAL_NS,
+      SIGPROF,
+      CPU_TIME_TIMER_SIGNAL_VALUE
+    );
+  }
 
   rb_thread_call_without_gvl(run_sampling_trigger_loop, state, interrupt_sampling_trigger_loop, state);
 
@@ -673,8 +1196,16 @@ static void after_gc_from_postponed_job(DDTRACE_UNUSED void *_unused) {
     return; // We're not on the main Ractor; we currently don't support profiling non-main Ractors
   }
 
+  long wall_time_ns_before_sample = monotonic_wall_time_now_ns(DO_NOT_RAISE_ON_FAILURE);
+
   // Trigger sampling using the Collectors::ThreadState; rescue against any exceptions that happen during sampling
   safely_call(thread_context_collector_sample_after_gc, state->thread_context_collector_instance, state->self_instance);
+
+  long delta_ns = monotonic_wall_time_now_ns(DO_NOT_RAISE_ON_FAILURE) - wall_time_ns_before_sample;
+  // Guard against wall-time going backwards (or failing to be read), same as for the other samples
+  if (wall_time_ns_before_sample > 0 && delta_ns >= 0) {
+    latency_histogram_record(&state->stats.gc_sampling_time_ns_histogram, delta_ns);
+  }
 }
 
 // Equivalent to Ruby begin/rescue call, where we call a C function and jump to the exception handler if an
@@ -720,7 +1251,17 @@ static VALUE _native_reset_after_fork(DDTRACE_UNUSED VALUE self, VALUE instance)
   // Disable all tracepoints, so that there are no more attempts to mutate the profile
   disable_tracepoints(state);
 
+  #ifdef HAVE_TIMER_CREATE
+    // Timers are not inherited by the child process, so we just forget about the one from the parent
+    // (and the generation may have been odd, if the fork happened while a thread was using the timer)
+    atomic_store(&state->sampling_timer.generation, 0);
+    state->sampling_timer.target_tid = 0;
+    state->sampling_timer.disarmed = false;
+    atomic_store(&state->sampling_timer.requested_tid, 0);
+  #endif
+
   reset_stats(state);
+  dynamic_sampling_rate_reset(&state->dynamic_sampling_rate);
 
   // Remove all state from the `Collectors::ThreadState` and connected downstream components
   rb_funcall(state->thread_context_collector_instance, rb_intern("reset_after_fork"), 0);
@@ -741,6 +1282,8 @@ static VALUE _native_stats(DDTRACE_UNUSED VALUE self, VALUE instance) {
   VALUE pretty_sampling_time_ns_total = state->stats.sampling_time_ns_total == 0 ? Qnil : ULL2NUM(state->stats.sampling_time_ns_total);
   VALUE pretty_sampling_time_ns_avg =
     state->stats.sampled == 0 ? Qnil : DBL2NUM(((double) state->stats.sampling_time_ns_total) / state->stats.sampled);
+  double achieved_overhead_percentage = dynamic_sampling_rate_achieved_overhead_percentage(&state->dynamic_sampling_rate);
+  VALUE pretty_achieved_overhead_percentage = achieved_overhead_percentage < 0 ? Qnil : DBL2NUM(achieved_overhead_percentage);
 
   VALUE stats_as_hash = rb_hash_new();
   VALUE arguments[] = {
@@ -754,6 +1297,18 @@ static VALUE _native_stats(DDTRACE_UNUSED VALUE self, VALUE instance) {
     ID2SYM(rb_intern("sampling_time_ns_max")),                       /* => */ pretty_sampling_time_ns_max,
     ID2SYM(rb_intern("sampling_time_ns_total")),                     /* => */ pretty_sampling_time_ns_total,
     ID2SYM(rb_intern("sampling_time_ns_avg")),                       /* => */ pretty_sampling_time_ns_avg,
+    ID2SYM(rb_intern("gvl_wait_sampled")),                           /* => */ UINT2NUM(state->stats.gvl_wait_sampled),
+    ID2SYM(rb_intern("allocation_sampled")),                         /* => */ UINT2NUM(state->stats.allocation_sampled),
+    ID2SYM(rb_intern("signal_handler_forwarded")),                   /* => */ UINT2NUM(state->stats.signal_handler_forwarded),
+    ID2SYM(rb_intern("timer_retargeted")),                           /* => */ UINT2NUM(state->stats.timer_retargeted),
+    ID2SYM(rb_intern("timer_disarmed")),                             /* => */ UINT2NUM(state->stats.timer_disarmed),
+    ID2SYM(rb_intern("cpu_time_timer_wrong_thread")),                /* => */ UINT2NUM(state->stats.cpu_time_timer_wrong_thread),
+    ID2SYM(rb_intern("cpu_time_sampled")),                           /* => */ UINT2NUM(state->stats.cpu_time_sampled),
+    ID2SYM(rb_intern("sampling_time_ns_percentiles")),               /* => */ latency_histogram_percentiles_as_hash(&state->stats.sampling_time_ns_histogram),
+    ID2SYM(rb_intern("gc_sampling_time_ns_percentiles")),            /* => */ latency_histogram_percentiles_as_hash(&state->stats.gc_sampling_time_ns_histogram),
+    ID2SYM(rb_intern("signal_to_sample_delay_ns_percentiles")),      /* => */ latency_histogram_percentiles_as_hash(&state->stats.signal_to_sample_delay_ns_histogram),
+    ID2SYM(rb_intern("idle_sample_delay_ns_percentiles")),           /* => */ latency_histogram_percentiles_as_hash(&state->stats.idle_sample_delay_ns_histogram),
+    ID2SYM(rb_intern("achieved_overhead_percentage")),               /* => */ pretty_achieved_overhead_percentage,
   };
   for (long unsigned int i = 0; i < VALUE_COUNT(arguments); i += 2) rb_hash_aset(stats_as_hash, arguments[i], arguments[i+1]);
   return stats_as_hash;
@@ -767,6 +1322,12 @@ void *simulate_sampling_signal_delivery(DDTRACE_UNUSED void *_unused) {
 
   state->stats.simulated_signal_delivery++;
 
+  long idle_sample_requested_at_ns = atomic_exchange(&state->idle_sample_requested_at_ns, 0);
+  if (idle_sample_requested_at_ns > 0) {
+    long delay_ns = monotonic_wall_time_now_ns(DO_NOT_RAISE_ON_FAILURE) - idle_sample_requested_at_ns;
+    if (delay_ns >= 0) latency_histogram_record(&state->stats.idle_sample_delay_ns_histogram, delay_ns);
+  }
+
   // @ivoanjo: We could instead directly call sample_from_postponed_job, but I chose to go through the signal handler
   // so that the simulated case is as close to the original one as well (including any metrics increases, etc).
   handle_sampling_signal(0, NULL, NULL);
@@ -807,16 +1368,288 @@ static VALUE _native_allocation_count(DDTRACE_UNUSED VALUE self) {
 
 // Implements memory-related profiling events. This function is called by Ruby via the `object_allocation_tracepoint`
 // when the RUBY_INTERNAL_EVENT_NEWOBJ event is triggered.
-static void on_newobj_event(DDTRACE_UNUSED VALUE tracepoint_data, DDTRACE_UNUSED void *unused) {
+//
+// This gets called for every single allocation, so make sure the common path stays cheap! See "Allocation sampling"
+// section above.
+static void on_newobj_event(VALUE tracepoint_data, DDTRACE_UNUSED void *unused) {
   // Update thread-local allocation count
   if (RB_UNLIKELY(allocation_count == UINT64_MAX)) {
     allocation_count = 0;
   } else {
     allocation_count++;
   }
+
+  struct cpu_and_wall_time_worker_state *state = active_sampler_instance_state; // Read from global variable, see "sampler global state safety" note above
+
+  // This can potentially happen if the CpuAndWallTimeWorker was stopped while the tracepoint was still active (e.g. after a fork)
+  if (state == NULL || state->allocation_sample_every == 0) return;
+
+  state->allocation_sampling.allocations_since_last_sample++;
+
+  if (RB_LIKELY(--state->allocation_sampling.countdown > 0)) return;
+
+  // We don't sample allocations that happen while we're sampling; these will be counted towards the weight of the next sample
+  if (state->allocation_sampling.during_sample) {
+    state->allocation_sampling.countdown = 1;
+    return;
+  }
+
+  state->allocation_sampling.countdown = next_allocation_sample_countdown(state);
+
+  if (!ddtrace_rb_ractor_main_p()) {
+    // We're not on the main Ractor; we currently don't support profiling non-main Ractors
+    return;
+  }
+
+  uint64_t allocations_since_last_sample = state->allocation_sampling.allocations_since_last_sample;
+  unsigned int sample_weight = allocations_since_last_sample > UINT32_MAX ? UINT32_MAX : (unsigned int) allocations_since_last_sample;
+  VALUE new_object = rb_tracearg_object(rb_tracearg_from_tracepoint(tracepoint_data));
+
+  // If nothing gets captured (e.g. the previous sample is still pending), these allocations will be counted towards the
+  // weight of the next sample
+  if (thread_context_collector_prepare_allocation_sample(state->thread_context_collector_instance, sample_weight, new_object)) {
+    state->allocation_sampling.allocations_since_last_sample = 0;
+    state->stats.allocation_sampled++;
+  }
+
+  // We also get here when there's a pending sample, in case its postponed job got dropped (e.g. because the worker
+  // was stopped and started again before it ran)
+  //
+  // Note: If we ever want to get rid of rb_postponed_job_register_one, remember not to clobber Ruby exceptions, as
+  // this function does this helpful job for us now -- https://github.com/ruby/ruby/commit/a98e343d39c4d7bf1e2190b076720f32d9f298b3.
+  rb_postponed_job_register_one(0, sample_allocation_from_postponed_job, NULL);
+}
+
+static void sample_allocation_from_postponed_job(DDTRACE_UNUSED void *_unused) {
+  struct cpu_and_wall_time_worker_state *state = active_sampler_instance_state; // Read from global variable, see "sampler global state safety" note above
+
+  // This can potentially happen if the CpuAndWallTimeWorker was stopped while the postponed job was waiting to be executed; nothing to do
+  if (state == NULL) return;
+
+  // Same as for `sample_from_postponed_job`, just in case
+  if (!ddtrace_rb_ractor_main_p()) return;
+
+  state->allocation_sampling.during_sample = true;
+  // Rescue against any exceptions that happen during sampling
+  safely_call(rescued_sample_allocation, state->self_instance, state->self_instance);
+  state->allocation_sampling.during_sample = false;
+}
+
+static VALUE rescued_sample_allocation(VALUE self_instance) {
+  struct cpu_and_wall_time_worker_state *state;
+  TypedData_Get_Struct(self_instance, struct cpu_and_wall_time_worker_state, &cpu_and_wall_time_worker_typed_data, state);
+
+  thread_context_collector_sample_allocation(state->thread_context_collector_instance);
+
+  // Return a dummy VALUE because we're called from rb_rescue2 which requires it
+  return Qnil;
+}
+
+// Implements heap profiling, see "Allocation sampling" section above. This function is called by Ruby via the
+// `object_free_tracepoint` when the RUBY_INTERNAL_EVENT_FREEOBJ event is triggered.
+//
+// Safety: This function gets called while Ruby is doing garbage collection, see the notes on `on_gc_event`.
+static void on_freeobj_event(VALUE tracepoint_data, DDTRACE_UNUSED void *unused) {
+  struct cpu_and_wall_time_worker_state *state = active_sampler_instance_state; // Read from global variable, see "sampler global state safety" note above
+
+  // This can potentially happen if the CpuAndWallTimeWorker was stopped while the tracepoint was still active (e.g. after a fork)
+  if (state == NULL || state->heap_recorder == NULL) return;
+
+  VALUE freed_object = rb_tracearg_object(rb_tracearg_from_tracepoint(tracepoint_data));
+
+  heap_recorder_on_object_freed(state->heap_recorder, freed_object);
+}
+
+// Picks how many allocations to skip before taking the next sample, see "Allocation sampling" section above.
+static uint64_t next_allocation_sample_countdown(struct cpu_and_wall_time_worker_state *state) {
+  if (state->allocation_sample_every <= 1) return 1;
+
+  // xorshift64, see https://en.wikipedia.org/wiki/Xorshift ; we don't need a great random number generator here
+  uint64_t x = state->allocation_sampling.random_state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  state->allocation_sampling.random_state = x;
+
+  // Uniform in (0, 1]
+  double uniform = ((double) (x >> 11) + 1.0) / 9007199254740992.0 /* 2^53 */;
+  double next_sample_in = -log(uniform) * state->allocation_sample_every;
+
+  return next_sample_in < 1.0 ? 1 : (uint64_t) next_sample_in;
 }
 
 static void disable_tracepoints(struct cpu_and_wall_time_worker_state *state) {
   rb_tracepoint_disable(state->gc_tracepoint);
   rb_tracepoint_disable(state->object_allocation_tracepoint);
-}
\ No newline at end of file
+  rb_tracepoint_disable(state->object_free_tracepoint);
+  // See "Allocation sampling" section above. This also discards an allocation that is waiting to be recorded.
+  if (state->heap_recorder != NULL) heap_recorder_clear(state->heap_recorder);
+
+  #ifndef NO_THREAD_EVENT_HOOKS
+    if (state->gvl_profiling_hook != NULL) {
+      rb_internal_thread_remove_event_hook(state->gvl_profiling_hook);
+      state->gvl_profiling_hook = NULL;
+    }
+  #endif
+}
+
+#ifndef NO_THREAD_EVENT_HOOKS
+  // Implements GVL wait profiling, see "GVL wait profiling" section above.
+  //
+  // Safety: The `RUBY_INTERNAL_THREAD_EVENT_READY` event gets triggered WITHOUT the GVL, so we can't call any Ruby
+  // APIs from it, nor access any shared state.
+  static void on_gvl_event(
+    rb_event_flag_t event,
+    DDTRACE_UNUSED const rb_internal_thread_event_data_t *_unused1,
+    DDTRACE_UNUSED void *_unused2
+  ) {
+    if (event == RUBY_INTERNAL_THREAD_EVENT_READY) {
+      gvl_waiting_since_ns = monotonic_wall_time_now_ns(DO_NOT_RAISE_ON_FAILURE);
+      return;
+    }
+
+    // From here on, we're handling RUBY_INTERNAL_THREAD_EVENT_RESUMED, and thus we're holding the GVL
+
+    // The thread may have started waiting before the hook was installed; or we may have failed to read the time
+    if (gvl_waiting_since_ns == 0) return;
+
+    long gvl_wait_ns = monotonic_wall_time_now_ns(DO_NOT_RAISE_ON_FAILURE) - gvl_waiting_since_ns;
+    gvl_waiting_since_ns = 0;
+
+    // Guard against wall-time going backwards, see https://github.com/DataDog/dd-trace-rb/pull/2336 for discussion.
+    if (gvl_wait_ns <= 0) return;
+
+    gvl_wait_pending_ns += gvl_wait_ns;
+
+    if (gvl_wait_pending_ns >= MINIMUM_GVL_WAIT_TO_SAMPLE_NS && ddtrace_rb_ractor_main_p()) {
+      rb_postponed_job_register_one(0, sample_gvl_wait_from_postponed_job, NULL);
+    }
+  }
+
+  static void sample_gvl_wait_from_postponed_job(DDTRACE_UNUSED void *_unused) {
+    struct cpu_and_wall_time_worker_state *state = active_sampler_instance_state; // Read from global variable, see "sampler global state safety" note above
+
+    // This can potentially happen if the CpuAndWallTimeWorker was stopped while the postponed job was waiting to be executed; nothing to do
+    if (state == NULL) return;
+
+    if (!ddtrace_rb_ractor_main_p()) {
+      return; // We're not on the main Ractor; we currently don't support profiling non-main Ractors
+    }
+
+    // The postponed job may run on a different thread than the one that enqueued it; in that case, the current thread
+    // may not have anything to record (see "GVL wait profiling" section above)
+    if (gvl_wait_pending_ns == 0) return;
+
+    // Rescue against any exceptions that happen during sampling
+    safely_call(rescued_sample_gvl_wait_from_postponed_job, state->self_instance, state->self_instance);
+  }
+
+  static VALUE rescued_sample_gvl_wait_from_postponed_job(VALUE self_instance) {
+    struct cpu_and_wall_time_worker_state *state;
+    TypedData_Get_Struct(self_instance, struct cpu_and_wall_time_worker_state, &cpu_and_wall_time_worker_typed_data, state);
+
+    long gvl_wait_ns = gvl_wait_pending_ns;
+    gvl_wait_pending_ns = 0;
+
+    state->stats.gvl_wait_sampled++;
+
+    thread_context_collector_sample_gvl_wait(state->thread_context_collector_instance, gvl_wait_ns);
+
+    // Return a dummy VALUE because we're called from rb_rescue2 which requires it
+    return Qnil;
+  }
+#endif
+
+#ifdef HAVE_TIMER_CREATE
+  static bool is_timer_signal(siginfo_t *info) { return info != NULL && info->si_code == SI_TIMER; }
+
+  static pid_t current_tid(void) { return (pid_t) syscall(SYS_gettid); }
+
+  // See "Timer-based sampling trigger" section above.
+  //
+  // Assumption: This function is called in a thread that is holding the Global VM Lock (and thus there can be no
+  // concurrent calls to it).
+  static void retarget_sampling_timer_to_current_thread(struct cpu_and_wall_time_worker_state *state) {
+    pid_t tid = current_tid();
+
+    // Only retarget if this sample was triggered by a real signal on this thread
+    if (atomic_load(&state->sampling_timer.requested_tid) != tid) return;
+
+    unsigned int generation = claim_sampling_timer(state);
+
+    if (state->sampling_timer.target_tid == tid && !state->sampling_timer.disarmed) {
+      atomic_store(&state->sampling_timer.generation, generation);
+      return;
+    }
+
+    if (state->sampling_timer.target_tid != 0) timer_delete(state->sampling_timer.timer_id);
+    state->sampling_timer.target_tid = 0;
+
+    // Signals from the timer we just deleted may still be pending, and must not match the new timer
+    generation += 2;
+
+    timer_t timer_id;
+    // If we fail to create the timer, the background thread will notice the lack of timer signals and keep on
+    // sampling, so we just try again on the next sample
+    if (thread_timer_create(CLOCK_MONOTONIC, tid, SIGPROF, (int) generation, MINIMUM_TIME_BETWEEN_SIGNALS_NS, &timer_id) == 0) {
+      state->sampling_timer.timer_id = timer_id;
+      state->sampling_timer.target_tid = tid;
+      state->sampling_timer.disarmed = false;
+      state->stats.timer_retargeted++;
+    }
+
+    atomic_store(&state->sampling_timer.generation, generation);
+  }
+
+  // Stops the timer from sending signals to a thread that released the global VM lock, see "Timer-based sampling
+  // trigger" section above. Called from the signal handler, so this must stay async-signal safe and never wait.
+  static void disarm_sampling_timer(struct cpu_and_wall_time_worker_state *state, siginfo_t *info) {
+    unsigned int generation;
+    if (!try_claim_sampling_timer(state, &generation)) return;
+
+    bool from_current_timer = info->si_value.sival_int == (int) generation;
+    if (from_current_timer && state->sampling_timer.target_tid != 0 && !state->sampling_timer.disarmed) {
+      struct itimerspec disarm = {0};
+      timer_settime(state->sampling_timer.timer_id, 0, &disarm, NULL);
+      state->sampling_timer.disarmed = true;
+      state->stats.timer_disarmed++;
+    }
+
+    atomic_store(&state->sampling_timer.generation, generation);
+  }
+
+  // Assumption: This function is called in a thread that is holding the Global VM Lock
+  static void delete_sampling_timer(struct cpu_and_wall_time_worker_state *state) {
+    unsigned int generation = claim_sampling_timer(state);
+
+    if (state->sampling_timer.target_tid != 0) {
+      timer_delete(state->sampling_timer.timer_id);
+      state->sampling_timer.target_tid = 0;
+    }
+
+    // Signals from the deleted timer may still be pending, and must not match any future timer
+    atomic_store(&state->sampling_timer.generation, generation + 2);
+  }
+
+  // Gets exclusive access to the timer fields if nobody else is using them, see "Timer-based sampling trigger" section
+  // above. On success, the caller MUST store `generation` (or a later even value) back when done.
+  static bool try_claim_sampling_timer(struct cpu_and_wall_time_worker_state *state, unsigned int *generation) {
+    unsigned int current = atomic_load(&state->sampling_timer.generation);
+    if (current % 2 != 0) return false;
+    if (!atomic_compare_exchange_strong(&state->sampling_timer.generation, &current, current + 1)) return false;
+
+    *generation = current;
+    return true;
+  }
+
+  // Same as try_claim_sampling_timer, but waits for the signal handler to be done, if it's using the timer fields. This
+  // never takes long, as the handler only holds on to them while disarming the timer.
+  //
+  // Assumption: This function is called in a thread that is holding the Global VM Lock, and thus the only other
+  // thread that may be holding on to the timer fields is one running the signal handler.
+  static unsigned int claim_sampling_timer(struct cpu_and_wall_time_worker_state *state) {
+    unsigned int generation;
+    while (!try_claim_sampling_timer(state, &generation)) { /* Spin */ }
+    return generation;
+  }
+#endif
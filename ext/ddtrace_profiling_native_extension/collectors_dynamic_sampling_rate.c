@@ -1,5 +1,6 @@
 
 #include <ruby.h>
+#include <math.h>
 
 #include "collectors_dynamic_sampling_rate.h"
 #include "helpers.h"
@@ -38,22 +39,84 @@
 // Finally, as an additional optimization, there's a `dynamic_sampling_rate_get_sleep()` which, given the current
 // wall-time, will return the time remaining (*there's an exception, check below) until the next sample.
 //
+// How `dynamic_sampling_rate_after_sample()` picks the time of the next sample depends on the controller in use:
+//
+// * The `WALL_TIME_OVERHEAD_CONTROLLER` (the default) targets a % of wall-time spent sampling, using only the time the
+//   last sample took.
+// * The `CPU_OVERHEAD_CONTROLLER` targets a % of cpu-time spent by the profiler, see below.
+//
+// ### CPU overhead controller
+//
+// Wall-time spent sampling is not a great signal on containers with CPU limits: when a container is being throttled,
+// samples take longer (in wall-time) even though the profiler is not using any more cpu.
+//
+// Instead, this controller periodically (see `CONTROLLER_WINDOW_NS`) compares the cpu-time used by the profiler --
+// the worker thread plus the time spent sampling on application threads, as reported via
+// `dynamic_sampling_rate_add_profiler_cpu_time()` -- with the cpu-time used by the whole process. To avoid throttling
+// mostly-idle applications (where the profiler may well be a big % of a very small number), the process cpu-time
+// is considered to be at least one core's worth, or the cgroup cpu quota, if that's smaller.
+//
+// The resulting achieved overhead feeds a PID-style loop that picks the minimum interval between samples. Because
+// overhead is inversely proportional to the interval, the loop works with the logarithm of both: the error is
+// log(achieved / target), and the output is log(interval / MIN_SAMPLE_INTERVAL_NS). The integral term is clamped to
+// avoid it accumulating while the interval can't go any lower (or higher).
+//
+// The controller is updated by the `CpuAndWallTimeWorker` background thread via
+// `dynamic_sampling_rate_update_controller()`, which is why it's also the thread whose cpu-time gets measured directly.
+//
 // ---
 
-// This is the wall-time overhead we're targeting. E.g. we target to spend no more than 2%, or 1.2 seconds per minute,
+// This is the default overhead we're targeting. E.g. we target to spend no more than 2%, or 1.2 seconds per minute,
 // taking profiling samples.
-#define WALL_TIME_OVERHEAD_TARGET_PERCENTAGE 2.0 // %
+#define DEFAULT_OVERHEAD_TARGET_PERCENTAGE 2.0 // %
 // See `dynamic_sampling_rate_get_sleep()` for details
 #define MAX_SLEEP_TIME_NS MILLIS_AS_NS(100)
 // See `dynamic_sampling_rate_after_sample()` for details
 #define MAX_TIME_UNTIL_NEXT_SAMPLE_NS SECONDS_AS_NS(10)
 
+// The following are used by the CPU_OVERHEAD_CONTROLLER, see "CPU overhead controller" section above.
+// How often the controller measures the achieved overhead and updates the sample interval
+#define CONTROLLER_WINDOW_NS SECONDS_AS_NS(1)
+// Same as the CpuAndWallTimeWorker's default; an interval at or below this one means "don't slow down sampling"
+#define MIN_SAMPLE_INTERVAL_NS MILLIS_AS_NS(10)
+#define MAX_SAMPLE_INTERVAL_NS MAX_TIME_UNTIL_NEXT_SAMPLE_NS
+#define CONTROLLER_KP 0.3
+#define CONTROLLER_KI 0.5
+#define CONTROLLER_KD 0.1
+// Clamps the error so that a single window with an outlier value (e.g. 0 overhead) doesn't cause a huge swing
+#define CONTROLLER_MAX_ERROR 2.0
+
 void dynamic_sampling_rate_init(dynamic_sampling_rate_state *state) {
   atomic_init(&state->next_sample_after_monotonic_wall_time_ns, 0);
+  state->controller = WALL_TIME_OVERHEAD_CONTROLLER;
+  state->overhead_target_percentage = DEFAULT_OVERHEAD_TARGET_PERCENTAGE;
+  state->cpu_quota_cores = 0;
+  atomic_init(&state->sample_interval_ns, 0);
+  atomic_init(&state->profiler_cpu_time_ns, 0);
+  dynamic_sampling_rate_reset(state);
+}
+
+void dynamic_sampling_rate_configure(
+  dynamic_sampling_rate_state *state,
+  dynamic_sampling_rate_controller controller,
+  double overhead_target_percentage,
+  double cpu_quota_cores
+) {
+  state->controller = controller;
+  state->overhead_target_percentage = overhead_target_percentage;
+  state->cpu_quota_cores = cpu_quota_cores > 0 ? cpu_quota_cores : 0;
 }
 
 void dynamic_sampling_rate_reset(dynamic_sampling_rate_state *state) {
   atomic_store(&state->next_sample_after_monotonic_wall_time_ns, 0);
+  atomic_store(&state->sample_interval_ns, 0);
+  atomic_store(&state->profiler_cpu_time_ns, 0);
+  state->window_started_at_wall_time_ns = 0;
+  state->window_started_at_process_cpu_time_ns = 0;
+  state->window_started_at_worker_cpu_time_ns = 0;
+  state->error_integral = 0;
+  state->previous_error = 0;
+  state->achieved_overhead_percentage = -1;
 }
 
 uint64_t dynamic_sampling_rate_get_sleep(dynamic_sampling_rate_state *state, long current_monotonic_wall_time_ns) {
@@ -77,7 +140,15 @@ bool dynamic_sampling_rate_should_sample(dynamic_sampling_rate_state *state, lon
 }
 
 void dynamic_sampling_rate_after_sample(dynamic_sampling_rate_state *state, long wall_time_ns_after_sample, uint64_t sampling_time_ns) {
-  double overhead_target = (double) WALL_TIME_OVERHEAD_TARGET_PERCENTAGE;
+  if (state->controller == CPU_OVERHEAD_CONTROLLER) {
+    // The controller already picked the interval, so the next sample should happen that long after this one started
+    long sample_interval_ns = atomic_load(&state->sample_interval_ns);
+    long next_sample_after_ns = sample_interval_ns == 0 ? 0 : wall_time_ns_after_sample - sampling_time_ns + sample_interval_ns;
+    atomic_store(&state->next_sample_after_monotonic_wall_time_ns, next_sample_after_ns);
+    return;
+  }
+
+  double overhead_target = state->overhead_target_percentage;
 
   // The idea here is that we're targeting a maximum % of wall-time spent sampling.
   // So for instance, if sampling_time_ns is 2% of the time we spend working, how much is the 98% we should spend
@@ -91,12 +162,93 @@ void dynamic_sampling_rate_after_sample(dynamic_sampling_rate_state *state, long
   atomic_store(&state->next_sample_after_monotonic_wall_time_ns, wall_time_ns_after_sample + time_to_sleep_ns);
 }
 
+bool dynamic_sampling_rate_tracks_cpu_time(dynamic_sampling_rate_state *state) {
+  return state->controller == CPU_OVERHEAD_CONTROLLER;
+}
+
+void dynamic_sampling_rate_add_profiler_cpu_time(dynamic_sampling_rate_state *state, long cpu_time_ns) {
+  if (cpu_time_ns > 0) atomic_fetch_add(&state->profiler_cpu_time_ns, cpu_time_ns);
+}
+
+static void start_controller_window(
+  dynamic_sampling_rate_state *state,
+  long current_monotonic_wall_time_ns,
+  long process_cpu_time_ns,
+  long worker_cpu_time_ns
+) {
+  state->window_started_at_wall_time_ns = current_monotonic_wall_time_ns;
+  state->window_started_at_process_cpu_time_ns = process_cpu_time_ns;
+  state->window_started_at_worker_cpu_time_ns = worker_cpu_time_ns;
+}
+
+// See "CPU overhead controller" section above.
+//
+// Safety: This function gets called without holding the GVL, and must not raise exceptions.
+void dynamic_sampling_rate_update_controller(
+  dynamic_sampling_rate_state *state,
+  long current_monotonic_wall_time_ns,
+  long process_cpu_time_ns,
+  long worker_cpu_time_ns
+) {
+  if (state->controller != CPU_OVERHEAD_CONTROLLER) return;
+
+  long wall_time_delta_ns = current_monotonic_wall_time_ns - state->window_started_at_wall_time_ns;
+
+  if (state->window_started_at_wall_time_ns == 0 || wall_time_delta_ns < 0) {
+    atomic_store(&state->profiler_cpu_time_ns, 0);
+    start_controller_window(state, current_monotonic_wall_time_ns, process_cpu_time_ns, worker_cpu_time_ns);
+    return;
+  }
+
+  if (wall_time_delta_ns < CONTROLLER_WINDOW_NS) return;
+
+  long process_cpu_time_delta_ns = process_cpu_time_ns - state->window_started_at_process_cpu_time_ns;
+  long worker_cpu_time_delta_ns = worker_cpu_time_ns - state->window_started_at_worker_cpu_time_ns;
+  long app_threads_profiler_cpu_time_ns = atomic_exchange(&state->profiler_cpu_time_ns, 0);
+  start_controller_window(state, current_monotonic_wall_time_ns, process_cpu_time_ns, worker_cpu_time_ns);
+
+  // Something went wrong reading the clocks; skip this window
+  if (process_cpu_time_delta_ns < 0 || worker_cpu_time_delta_ns < 0) return;
+
+  double idle_process_cores = state->cpu_quota_cores > 0 ? fmin(state->cpu_quota_cores, 1.0) : 1.0;
+  double process_cpu_time = fmax(process_cpu_time_delta_ns, idle_process_cores * wall_time_delta_ns);
+  double profiler_cpu_time = worker_cpu_time_delta_ns + app_threads_profiler_cpu_time_ns;
+
+  double achieved_overhead_percentage = 100.0 * profiler_cpu_time / process_cpu_time;
+  state->achieved_overhead_percentage = achieved_overhead_percentage;
+
+  // Positive error means we're over the target, and thus need to sample less often
+  double error = log(fmax(achieved_overhead_percentage, 1e-9) / state->overhead_target_percentage);
+  error = fmax(-CONTROLLER_MAX_ERROR, fmin(error, CONTROLLER_MAX_ERROR));
+
+  double max_output = log((double) MAX_SAMPLE_INTERVAL_NS / MIN_SAMPLE_INTERVAL_NS);
+  state->error_integral = fmax(0, fmin(state->error_integral + error, max_output / CONTROLLER_KI));
+  double derivative = error - state->previous_error;
+  state->previous_error = error;
+
+  double output = CONTROLLER_KP * error + CONTROLLER_KI * state->error_integral + CONTROLLER_KD * derivative;
+  output = fmax(0, fmin(output, max_output));
+
+  long sample_interval_ns = MIN_SAMPLE_INTERVAL_NS * exp(output);
+  atomic_store(&state->sample_interval_ns, sample_interval_ns <= MIN_SAMPLE_INTERVAL_NS ? 0 : sample_interval_ns);
+}
+
+double dynamic_sampling_rate_achieved_overhead_percentage(dynamic_sampling_rate_state *state) {
+  return state->achieved_overhead_percentage;
+}
+
 // ---
 // Below here is boilerplate to expose the above code to Ruby so that we can test it with RSpec as usual.
 
 VALUE _native_get_sleep(DDTRACE_UNUSED VALUE self, VALUE simulated_next_sample_after_monotonic_wall_time_ns, VALUE current_monotonic_wall_time_ns);
 VALUE _native_should_sample(DDTRACE_UNUSED VALUE self, VALUE simulated_next_sample_after_monotonic_wall_time_ns, VALUE wall_time_ns_before_sample);
 VALUE _native_after_sample(DDTRACE_UNUSED VALUE self, VALUE wall_time_ns_after_sample, VALUE sampling_time_ns);
+VALUE _native_cpu_overhead_controller(
+  DDTRACE_UNUSED VALUE self,
+  VALUE overhead_target_percentage,
+  VALUE cpu_quota_cores,
+  VALUE windows
+);
 
 void collectors_dynamic_sampling_rate_init(VALUE profiling_module) {
   VALUE collectors_module = rb_define_module_under(profiling_module, "Collectors");
@@ -106,6 +258,7 @@ void collectors_dynamic_sampling_rate_init(VALUE profiling_module) {
   rb_define_singleton_method(testing_module, "_native_get_sleep", _native_get_sleep, 2);
   rb_define_singleton_method(testing_module, "_native_should_sample", _native_should_sample, 2);
   rb_define_singleton_method(testing_module, "_native_after_sample", _native_after_sample, 2);
+  rb_define_singleton_method(testing_module, "_native_cpu_overhead_controller", _native_cpu_overhead_controller, 3);
 }
 
 VALUE _native_get_sleep(DDTRACE_UNUSED VALUE self, VALUE simulated_next_sample_after_monotonic_wall_time_ns, VALUE current_monotonic_wall_time_ns) {
@@ -140,4 +293,46 @@ VALUE _native_after_sample(DDTRACE_UNUSED VALUE self, VALUE wall_time_ns_after_s
   dynamic_sampling_rate_after_sample(&state, NUM2LONG(wall_time_ns_after_sample), NUM2ULL(sampling_time_ns));
 
   return ULL2NUM(atomic_load(&state.next_sample_after_monotonic_wall_time_ns));
-}
\ No newline at end of file
+}
+
+// Simulates running the CPU_OVERHEAD_CONTROLLER through the given windows, where each window is an array of
+// [wall_time_ns, process_cpu_time_ns, worker_cpu_time_ns, app_threads_profiler_cpu_time_ns] (the first three being
+// clock readings, and the last one being the cpu-time spent sampling since the previous window).
+//
+// Returns [sample_interval_ns, achieved_overhead_percentage] after the last window.
+VALUE _native_cpu_overhead_controller(
+  DDTRACE_UNUSED VALUE self,
+  VALUE overhead_target_percentage,
+  VALUE cpu_quota_cores,
+  VALUE windows
+) {
+  ENFORCE_TYPE(overhead_target_percentage, T_FLOAT);
+  ENFORCE_TYPE(cpu_quota_cores, T_FLOAT);
+  ENFORCE_TYPE(windows, T_ARRAY);
+
+  dynamic_sampling_rate_state state;
+  dynamic_sampling_rate_init(&state);
+  dynamic_sampling_rate_configure(&state, CPU_OVERHEAD_CONTROLLER, NUM2DBL(overhead_target_percentage), NUM2DBL(cpu_quota_cores));
+
+  for (long i = 0; i < RARRAY_LEN(windows); i++) {
+    VALUE window = rb_ary_entry(windows, i);
+    ENFORCE_TYPE(window, T_ARRAY);
+    if (RARRAY_LEN(window) != 4) rb_raise(rb_eArgError, "Expected window to have 4 elements");
+
+    dynamic_sampling_rate_add_profiler_cpu_time(&state, NUM2LONG(rb_ary_entry(window, 3)));
+    dynamic_sampling_rate_update_controller(
+      &state,
+      NUM2LONG(rb_ary_entry(window, 0)),
+      NUM2LONG(rb_ary_entry(window, 1)),
+      NUM2LONG(rb_ary_entry(window, 2))
+    );
+  }
+
+  double achieved_overhead_percentage = dynamic_sampling_rate_achieved_overhead_percentage(&state);
+
+  return rb_ary_new_from_args(
+    2,
+    LONG2NUM(atomic_load(&state.sample_interval_ns)),
+    achieved_overhead_percentage < 0 ? Qnil : DBL2NUM(achieved_overhead_percentage)
+  );
+}
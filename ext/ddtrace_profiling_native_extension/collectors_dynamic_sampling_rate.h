@@ -3,12 +3,51 @@
 #include <stdatomic.h>
 #include <stdbool.h>
 
+// See "Dynamic Sampling Rate" section in collectors_dynamic_sampling_rate.c for details
+typedef enum {
+  WALL_TIME_OVERHEAD_CONTROLLER,
+  CPU_OVERHEAD_CONTROLLER,
+} dynamic_sampling_rate_controller;
+
 typedef struct {
   atomic_long next_sample_after_monotonic_wall_time_ns;
+  dynamic_sampling_rate_controller controller;
+  double overhead_target_percentage;
+
+  // The fields below are only used by the CPU_OVERHEAD_CONTROLLER, see "CPU overhead controller" section
+  // 0 when there's no quota (or it's unknown)
+  double cpu_quota_cores;
+  // 0 when we're under the overhead target and thus don't need to slow down sampling
+  atomic_long sample_interval_ns;
+  // Cpu-time spent sampling on application threads since the last controller update
+  atomic_long profiler_cpu_time_ns;
+  // 0 when no window has been started yet
+  long window_started_at_wall_time_ns;
+  long window_started_at_process_cpu_time_ns;
+  long window_started_at_worker_cpu_time_ns;
+  double error_integral;
+  double previous_error;
+  // Negative when no window has been completed yet
+  double achieved_overhead_percentage;
 } dynamic_sampling_rate_state;
 
 void dynamic_sampling_rate_init(dynamic_sampling_rate_state *state);
+void dynamic_sampling_rate_configure(
+  dynamic_sampling_rate_state *state,
+  dynamic_sampling_rate_controller controller,
+  double overhead_target_percentage,
+  double cpu_quota_cores
+);
 void dynamic_sampling_rate_reset(dynamic_sampling_rate_state *state);
 uint64_t dynamic_sampling_rate_get_sleep(dynamic_sampling_rate_state *state, long current_monotonic_wall_time_ns);
 bool dynamic_sampling_rate_should_sample(dynamic_sampling_rate_state *state, long wall_time_ns_before_sample);
 void dynamic_sampling_rate_after_sample(dynamic_sampling_rate_state *state, long wall_time_ns_after_sample, uint64_t sampling_time_ns);
+bool dynamic_sampling_rate_tracks_cpu_time(dynamic_sampling_rate_state *state);
+void dynamic_sampling_rate_add_profiler_cpu_time(dynamic_sampling_rate_state *state, long cpu_time_ns);
+void dynamic_sampling_rate_update_controller(
+  dynamic_sampling_rate_state *state,
+  long current_monotonic_wall_time_ns,
+  long process_cpu_time_ns,
+  long worker_cpu_time_ns
+);
+double dynamic_sampling_rate_achieved_overhead_percentage(dynamic_sampling_rate_state *state);
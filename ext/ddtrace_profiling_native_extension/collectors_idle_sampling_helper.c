@@ -1,8 +1,16 @@
 
 #include <ruby.h>
 #include <ruby/thread.h>
-#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <unistd.h>
+
+#ifdef HAVE_EVENTFD
+  #include <sys/eventfd.h>
+#endif
 
 #include "helpers.h"
 #include "ruby_helpers.h"
@@ -14,23 +22,49 @@
 // trigger a sample, but the VM is otherwise idle. See implementation of CpuAndWallTimeWorker for details.
 //
 // The IdleSamplingHelper keeps a background thread that waits for functions to run on a single-element "queue".
-// Other threads communicate with it by asking it to ACTION_RUN a `requested_action` or ACTION_STOP to terminate.
+// Other threads communicate with it by asking it to run a function, or by asking it to stop (`ACTION_STOP`).
+//
+// ---
+// ## Lock-free mailbox
+//
+// When no thread is holding the global VM lock, the CpuAndWallTimeWorker requests an action on every sampling interval,
+// so this needs to be cheap, and should never block the CpuAndWallTimeWorker background thread.
+//
+// The single-element "queue" is the `requested_action` atomic: it's NULL when empty, and requesting an action is a
+// compare-and-swap from NULL to the function to run. If there's already a pending action, the request is dropped (same
+// as a pending `rb_postponed_job_register_one`). Stopping swaps in `ACTION_STOP` unconditionally, so it overrides any
+// pending action.
+//
+// After a successful request, the background thread is woken up by writing to a file descriptor -- an eventfd on Linux,
+// or the write end of a non-blocking pipe elsewhere. Neither of these blocks the writer: if the eventfd counter or the
+// pipe buffer is somehow full, the background thread is already due to wake up anyway. The background thread waits
+// for the file descriptor to become readable with `poll`, and drains it before checking `requested_action` again, so
+// that no wakeup gets lost.
+//
+// The file descriptors get recreated on every `_native_reset`, as otherwise after a fork the parent and child processes
+// would share them.
 //
-// The state is protected by the `wakeup_mutex`, and the background thread is woken up after changes using the
-// `wakeup` condition variable.
+// ---
 
-typedef enum { ACTION_WAIT, ACTION_RUN, ACTION_STOP } action;
+typedef void (*action_function)(void);
+
+// Never actually called; used as a marker value for `requested_action`
+static void action_stop(void) { }
+#define ACTION_STOP action_stop
 
 // Contains state for a single CpuAndWallTimeWorker instance
 struct idle_sampling_loop_state {
-  pthread_mutex_t wakeup_mutex;
-  pthread_cond_t wakeup;
-  action requested_action;
-  void (*run_action_function)(void);
+  _Atomic(action_function) requested_action;
+  // When using an eventfd, both of these are the same file descriptor; -1 when not open
+  int wakeup_read_fd;
+  int wakeup_write_fd;
 };
 
 static VALUE _native_new(VALUE klass);
+static void idle_sampling_helper_typed_data_free(void *state_ptr);
 static void reset_state(struct idle_sampling_loop_state *state);
+static void close_wakeup_fds(struct idle_sampling_loop_state *state);
+static void wake_up_idle_sampling_loop(struct idle_sampling_loop_state *state);
 static VALUE _native_idle_sampling_loop(DDTRACE_UNUSED VALUE self, VALUE self_instance);
 static VALUE _native_stop(DDTRACE_UNUSED VALUE self, VALUE self_instance);
 static void *run_idle_sampling_loop(void *state_ptr);
@@ -69,7 +103,7 @@ static const rb_data_type_t idle_sampling_helper_typed_data = {
   .wrap_struct_name = "Datadog::Profiling::Collectors::IdleSamplingHelper",
   .function = {
     .dmark = NULL, // We don't store references to Ruby objects so we don't need to mark any of them
-    .dfree = RUBY_DEFAULT_FREE,
+    .dfree = idle_sampling_helper_typed_data_free,
     .dsize = NULL, // We don't track memory usage (although it'd be cool if we did!)
     //.dcompact = NULL, // Not needed -- we don't store references to Ruby objects
   },
@@ -79,21 +113,59 @@ static const rb_data_type_t idle_sampling_helper_typed_data = {
 static VALUE _native_new(VALUE klass) {
   struct idle_sampling_loop_state *state = ruby_xcalloc(1, sizeof(struct idle_sampling_loop_state));
 
-  reset_state(state);
+  atomic_init(&state->requested_action, NULL);
+  // The file descriptors only get created by `_native_reset`, which gets called before starting the background thread
+  state->wakeup_read_fd = -1;
+  state->wakeup_write_fd = -1;
 
   return TypedData_Wrap_Struct(klass, &idle_sampling_helper_typed_data, state);
 }
 
+static void idle_sampling_helper_typed_data_free(void *state_ptr) {
+  struct idle_sampling_loop_state *state = (struct idle_sampling_loop_state *) state_ptr;
+
+  close_wakeup_fds(state);
+
+  ruby_xfree(state);
+}
+
+static void close_wakeup_fds(struct idle_sampling_loop_state *state) {
+  if (state->wakeup_read_fd >= 0) close(state->wakeup_read_fd);
+  if (state->wakeup_write_fd >= 0 && state->wakeup_write_fd != state->wakeup_read_fd) close(state->wakeup_write_fd);
+  state->wakeup_read_fd = -1;
+  state->wakeup_write_fd = -1;
+}
+
+// Safety: This function gets called with the global VM lock, and may raise exceptions
 static void reset_state(struct idle_sampling_loop_state *state) {
-  state->wakeup_mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
-  state->wakeup = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
-  state->requested_action = ACTION_WAIT;
-  state->run_action_function = NULL;
+  atomic_store(&state->requested_action, NULL);
+
+  close_wakeup_fds(state);
+
+  #ifdef HAVE_EVENTFD
+    int wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wakeup_fd < 0) ENFORCE_SUCCESS_GVL(errno);
+    state->wakeup_read_fd = wakeup_fd;
+    state->wakeup_write_fd = wakeup_fd;
+  #else
+    int wakeup_fds[2];
+    if (pipe(wakeup_fds) != 0) ENFORCE_SUCCESS_GVL(errno);
+    state->wakeup_read_fd = wakeup_fds[0];
+    state->wakeup_write_fd = wakeup_fds[1];
+
+    for (int i = 0; i < 2; i++) {
+      if (fcntl(wakeup_fds[i], F_SETFD, FD_CLOEXEC) != 0 || fcntl(wakeup_fds[i], F_SETFL, O_NONBLOCK) != 0) {
+        int error = errno;
+        close_wakeup_fds(state);
+        ENFORCE_SUCCESS_GVL(error);
+      }
+    }
+  #endif
 }
 
 // The same instance of the IdleSamplingHelper can be reused multiple times, and this resets it back to
-// a pristine state before recreating the worker thread (this includes resetting the mutex in case it was left
-// locked halfway through the VM forking)
+// a pristine state before recreating the worker thread (this includes recreating the wakeup file descriptors, which
+// would otherwise be shared with the parent process after a fork)
 static VALUE _native_reset(DDTRACE_UNUSED VALUE self, VALUE self_instance) {
   struct idle_sampling_loop_state *state;
   TypedData_Get_Struct(self_instance, struct idle_sampling_loop_state, &idle_sampling_helper_typed_data, state);
@@ -107,96 +179,74 @@ static VALUE _native_idle_sampling_loop(DDTRACE_UNUSED VALUE self, VALUE self_in
   struct idle_sampling_loop_state *state;
   TypedData_Get_Struct(self_instance, struct idle_sampling_loop_state, &idle_sampling_helper_typed_data, state);
 
+  if (state->wakeup_read_fd < 0) rb_raise(rb_eRuntimeError, "IdleSamplingHelper must be reset before starting");
+
   // Release GVL and run the loop waiting for requests
   rb_thread_call_without_gvl(run_idle_sampling_loop, state, interrupt_idle_sampling_loop, state);
 
   return Qtrue;
 }
 
+// Safety: This function is async-signal-safe, never blocks, and never raises
+static void wake_up_idle_sampling_loop(struct idle_sampling_loop_state *state) {
+  #ifdef HAVE_EVENTFD
+    uint64_t value = 1;
+  #else
+    char value = 0;
+  #endif
+
+  if (write(state->wakeup_write_fd, &value, sizeof(value)) < 0) {
+    // If this fails (e.g. because the eventfd counter or the pipe buffer is full) the background thread is already due
+    // to wake up, so there's nothing else to do
+  }
+}
+
 static void *run_idle_sampling_loop(void *state_ptr) {
   struct idle_sampling_loop_state *state = (struct idle_sampling_loop_state *) state_ptr;
-  int error = 0;
+  struct pollfd wakeup_pollfd = {.fd = state->wakeup_read_fd, .events = POLLIN};
+  char drain_buffer[64];
 
   while (true) {
-    ENFORCE_SUCCESS_NO_GVL(pthread_mutex_lock(&state->wakeup_mutex));
+    action_function next_action = atomic_exchange(&state->requested_action, NULL);
 
-    action next_action;
-    void (*run_action_function)(void);
-
-    // Await for an action
-    while ((next_action = state->requested_action) == ACTION_WAIT) {
-      error = pthread_cond_wait(&state->wakeup, &state->wakeup_mutex);
-      if (error) {
-        // If something went wrong, try to leave the mutex unlocked at least
-        pthread_mutex_unlock(&state->wakeup_mutex);
-        ENFORCE_SUCCESS_NO_GVL(error);
-      }
+    if (next_action == ACTION_STOP) {
+      return NULL;
+    } else if (next_action != NULL) {
+      next_action();
+      continue;
     }
 
-    // There's an action to be taken!
-
-    // Record function, if any
-    run_action_function = state->run_action_function;
-
-    // Reset buffer for next request
-    state->requested_action = ACTION_WAIT;
-
-    // Unlock the mutex immediately so other threads can continue to request actions without blocking
-    ENFORCE_SUCCESS_NO_GVL(pthread_mutex_unlock(&state->wakeup_mutex));
-
-    // Process pending action
-    if (next_action == ACTION_RUN) {
-      if (run_action_function == NULL) {
-        grab_gvl_and_raise(rb_eRuntimeError, "Unexpected NULL run_action_function in run_idle_sampling_loop");
-      }
+    // Await for an action
+    if (poll(&wakeup_pollfd, 1, -1) < 0 && errno != EINTR) ENFORCE_SUCCESS_NO_GVL(errno);
 
-      run_action_function();
-    } else { // ACTION_STOP
-      return NULL;
-    }
+    // Drain all pending wakeups; any action requested before this point will be picked up at the top of the loop.
+    // (For an eventfd, a single read resets the counter back to zero)
+    while (read(state->wakeup_read_fd, drain_buffer, sizeof(drain_buffer)) > 0) { }
   }
 }
 
 static void interrupt_idle_sampling_loop(void *state_ptr) {
   struct idle_sampling_loop_state *state = (struct idle_sampling_loop_state *) state_ptr;
-  int error = 0;
-
-  // Note about the error handling in this situation: Something bad happening at this stage is really really awkward to
-  // handle because we get called by the VM in a situation where we can't really raise exceptions, and the VM really really
-  // just wants us to stop what we're doing and return control of the thread to it.
-  //
-  // So if we return immediately on error, we may leave the VM hanging because we didn't actually interrupt the thread.
-  // We're also not at a great location to flag errors.
-  // That's why: a) I chose to log to stderr, as a last-ditch effort; b) even if something goes wrong we still try to
-  // ask the thread to stop, instead of exiting early.
-
-  error = pthread_mutex_lock(&state->wakeup_mutex);
-  if (error) { fprintf(stderr, "[ddtrace] Error during pthread_mutex_lock in interrupt_idle_sampling_loop (%s)\n", strerror(error)); }
 
-  state->requested_action = ACTION_STOP;
-
-  error = pthread_mutex_unlock(&state->wakeup_mutex);
-  if (error) { fprintf(stderr, "[ddtrace] Error during pthread_mutex_unlock in interrupt_idle_sampling_loop (%s)\n", strerror(error)); }
-
-  error = pthread_cond_broadcast(&state->wakeup);
-  if (error) { fprintf(stderr, "[ddtrace] Error during pthread_cond_broadcast in interrupt_idle_sampling_loop (%s)\n", strerror(error)); }
+  // We get called by the VM in a situation where we can't really raise exceptions; thankfully, none of the below can
+  // fail in a way that we could do anything about.
+  atomic_store(&state->requested_action, ACTION_STOP);
+  wake_up_idle_sampling_loop(state);
 }
 
 static VALUE _native_stop(DDTRACE_UNUSED VALUE self, VALUE self_instance) {
   struct idle_sampling_loop_state *state;
   TypedData_Get_Struct(self_instance, struct idle_sampling_loop_state, &idle_sampling_helper_typed_data, state);
 
-  ENFORCE_SUCCESS_GVL(pthread_mutex_lock(&state->wakeup_mutex));
-  state->requested_action = ACTION_STOP;
-  ENFORCE_SUCCESS_GVL(pthread_mutex_unlock(&state->wakeup_mutex));
-
-  // Wake up worker thread, if needed; It's OK to call broadcast after releasing the mutex
-  ENFORCE_SUCCESS_GVL(pthread_cond_broadcast(&state->wakeup));
+  atomic_store(&state->requested_action, ACTION_STOP);
+  if (state->wakeup_write_fd >= 0) wake_up_idle_sampling_loop(state);
 
   return Qtrue;
 }
 
 // Assumption: Function gets called without the global VM lock
+//
+// Safety: This function never blocks, see "Lock-free mailbox" section above
 void idle_sampling_helper_request_action(VALUE self_instance, void (*run_action_function)(void)) {
   struct idle_sampling_loop_state *state;
   if (!rb_typeddata_is_kind_of(self_instance, &idle_sampling_helper_typed_data)) {
@@ -205,15 +255,10 @@ void idle_sampling_helper_request_action(VALUE self_instance, void (*run_action_
   // This should never fail the the above check passes
   TypedData_Get_Struct(self_instance, struct idle_sampling_loop_state, &idle_sampling_helper_typed_data, state);
 
-  ENFORCE_SUCCESS_NO_GVL(pthread_mutex_lock(&state->wakeup_mutex));
-  if (state->requested_action == ACTION_WAIT) {
-    state->requested_action = ACTION_RUN;
-    state->run_action_function = run_action_function;
+  action_function expected_action = NULL;
+  if (atomic_compare_exchange_strong(&state->requested_action, &expected_action, run_action_function)) {
+    if (state->wakeup_write_fd >= 0) wake_up_idle_sampling_loop(state);
   }
-  ENFORCE_SUCCESS_NO_GVL(pthread_mutex_unlock(&state->wakeup_mutex));
-
-  // Wake up worker thread, if needed; It's OK to call broadcast after releasing the mutex
-  ENFORCE_SUCCESS_NO_GVL(pthread_cond_broadcast(&state->wakeup));
 }
 
 // Because the idle_sampling_helper_request_action is built to be called without the global VM lock, here we release it
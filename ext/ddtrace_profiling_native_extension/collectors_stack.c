@@ -7,15 +7,35 @@
 #include "private_vm_api_access.h"
 #include "stack_recorder.h"
 #include "collectors_stack.h"
+#include "time_helpers.h"
 
 // Gathers stack traces from running threads, storing them in a StackRecorder instance
 // This file implements the native bits of the Datadog::Profiling::Collectors::Stack class
 
 #define MAX_FRAMES_LIMIT            10000
 #define MAX_FRAMES_LIMIT_AS_STRING "10000"
+#define FRAME_CACHE_SIZE_BITS 11 // 2048 entries
+#define FRAME_CACHE_SIZE (1 << FRAME_CACHE_SIZE_BITS)
+// Pending idle samples get recorded at least this often, so that they show up in the profile covering that time
+#define IDLE_SAMPLE_MAX_PENDING_WALL_TIME_NS SECONDS_AS_NS(1)
+// See "Stack compaction" below
+#define RECURSION_MAX_CYCLE_LENGTH 8
+#define RECURSION_MARKER_SIZE sizeof("recursion x" MAX_FRAMES_LIMIT_AS_STRING)
 
 static VALUE missing_string = Qnil;
 
+// Stores the already-resolved name and filename for a given frame VALUE (iseq or cme), so that we don't need to go
+// through the `rb_profile_frame_...` APIs every time we see the same frame. See `cached_frame_info_for` for details.
+typedef struct {
+  VALUE frame; // 0 for empty entries
+  bool is_ruby_frame;
+  // The slices below point at the contents of these strings, so we keep (and mark) references to them as well
+  VALUE name;
+  VALUE filename;
+  ddog_CharSlice name_slice;
+  ddog_CharSlice filename_slice;
+} frame_cache_entry;
+
 // Used as scratch space during sampling
 struct sampling_buffer {
   unsigned int max_frames;
@@ -24,8 +44,28 @@ struct sampling_buffer {
   bool *is_ruby_frame;
   ddog_prof_Location *locations;
   ddog_prof_Line *lines;
+  // Direct-mapped cache (i.e. on collision the newest frame wins), with FRAME_CACHE_SIZE entries
+  frame_cache_entry *frame_cache;
+  frame_cache_stats frame_cache_stats;
+  // See "Stack compaction" below
+  bool recursion_folding_enabled;
+  char (*recursion_markers)[RECURSION_MARKER_SIZE]; // Filenames for the "recursion xN" frames; NULL unless folding is enabled
+  VALUE pruned_frame_prefixes; // Frozen array of frozen strings, or Qnil when pruning is disabled
 }; // Note: typedef'd in the header to sampling_buffer
 
+struct idle_sample {
+  bool pending;
+  uint64_t stack_hash;
+  int frame_count;
+  int frame_capacity;
+  // Raw frames, as returned by ddtrace_rb_profile_frames; while a sample is pending, the frames are kept alive by
+  // idle_sample_mark so that we can still resolve them when the sample gets recorded
+  VALUE *frames;
+  int *lines;
+  bool *is_ruby_frame;
+  sample_values pending_values;
+}; // Note: typedef'd in the header to idle_sample
+
 static VALUE _native_sample(
   VALUE self,
   VALUE thread,
@@ -47,6 +87,7 @@ static void record_placeholder_stack_in_native_code(
 );
 static void sample_thread_internal(
   VALUE thread,
+  stack_walk_cache *walk_cache,
   sampling_buffer* buffer,
   VALUE recorder_instance,
   sample_values values,
@@ -54,6 +95,17 @@ static void sample_thread_internal(
   sampling_buffer *record_buffer,
   int extra_frames_in_record_buffer
 );
+static frame_cache_entry *cached_frame_info_for(sampling_buffer *buffer, VALUE frame, bool is_ruby_frame);
+static void resolve_frames(sampling_buffer *buffer, int frame_count, VALUE *frames, int *lines, bool *is_ruby_frame);
+static uint64_t stack_hash_for(int frame_count, VALUE *frames, int *lines, bool *is_ruby_frame);
+static bool idle_sample_has_same_stack(idle_sample *idle_sample, sampling_buffer *buffer, int frame_count, uint64_t stack_hash);
+static void idle_sample_start(idle_sample *idle_sample, sampling_buffer *buffer, int frame_count, uint64_t stack_hash, sample_values values);
+static bool stack_compaction_enabled(sampling_buffer *buffer);
+static int compact_stack(sampling_buffer *buffer, int frame_count, VALUE *frames, int *lines, bool *is_ruby_frame);
+static int fold_recursion(sampling_buffer *buffer, int frame_count, VALUE *frames, int *lines, bool *is_ruby_frame);
+static bool same_frames(int first, int second, int count, VALUE *frames, int *lines, bool *is_ruby_frame);
+static int prune_frames(sampling_buffer *buffer, int frame_count);
+static bool is_pruned_frame(sampling_buffer *buffer, ddog_prof_Line *line);
 
 void collectors_stack_init(VALUE profiling_module) {
   VALUE collectors_module = rb_define_module_under(profiling_module, "Collectors");
@@ -89,6 +141,7 @@ static VALUE _native_sample(
     .cpu_samples   = NUM2UINT(rb_hash_lookup2(metric_values_hash, rb_str_new_cstr("cpu-samples"),   zero)),
     .wall_time_ns  = NUM2UINT(rb_hash_lookup2(metric_values_hash, rb_str_new_cstr("wall-time"),     zero)),
     .alloc_samples = NUM2UINT(rb_hash_lookup2(metric_values_hash, rb_str_new_cstr("alloc-samples"), zero)),
+    .gvl_wait_ns   = NUM2LONG(rb_hash_lookup2(metric_values_hash, rb_str_new_cstr("gvl-wait"),      zero)),
   };
 
   long labels_count = RARRAY_LEN(labels_array) + RARRAY_LEN(numeric_labels_array);
@@ -118,6 +171,7 @@ static VALUE _native_sample(
 
   sample_thread(
     thread,
+    NULL /* stack_walk_cache */,
     buffer,
     recorder_instance,
     values,
@@ -132,6 +186,7 @@ static VALUE _native_sample(
 
 void sample_thread(
   VALUE thread,
+  stack_walk_cache *walk_cache, // Optional, can be NULL
   sampling_buffer* buffer,
   VALUE recorder_instance,
   sample_values values,
@@ -142,7 +197,7 @@ void sample_thread(
   if (type == SAMPLE_REGULAR) {
     sampling_buffer *record_buffer = buffer;
     int extra_frames_in_record_buffer = 0;
-    sample_thread_internal(thread, buffer, recorder_instance, values, labels, record_buffer, extra_frames_in_record_buffer);
+    sample_thread_internal(thread, walk_cache, buffer, recorder_instance, values, labels, record_buffer, extra_frames_in_record_buffer);
     return;
   }
 
@@ -156,17 +211,19 @@ void sample_thread(
     };
     // To avoid changing sample_thread_internal, we just prepare a new buffer struct that uses the same underlying storage as the
     // original buffer, but has capacity one less, so that we can keep the above Garbage Collection frame untouched.
-    sampling_buffer thread_in_gc_buffer = (struct sampling_buffer) {
-      .max_frames = buffer->max_frames - 1,
-      .stack_buffer = buffer->stack_buffer + 1,
-      .lines_buffer = buffer->lines_buffer + 1,
-      .is_ruby_frame = buffer->is_ruby_frame + 1,
-      .locations = buffer->locations + 1,
-      .lines = buffer->lines + 1
-    };
+    // (The frame cache and the stack compaction configuration are shared with the original buffer.)
+    sampling_buffer thread_in_gc_buffer = *buffer;
+    thread_in_gc_buffer.max_frames = buffer->max_frames - 1;
+    thread_in_gc_buffer.stack_buffer = buffer->stack_buffer + 1;
+    thread_in_gc_buffer.lines_buffer = buffer->lines_buffer + 1;
+    thread_in_gc_buffer.is_ruby_frame = buffer->is_ruby_frame + 1;
+    thread_in_gc_buffer.locations = buffer->locations + 1;
+    thread_in_gc_buffer.lines = buffer->lines + 1;
+
     sampling_buffer *record_buffer = buffer; // We pass in the original buffer as the record_buffer, but not as the regular buffer
     int extra_frames_in_record_buffer = 1;
-    sample_thread_internal(thread, &thread_in_gc_buffer, recorder_instance, values, labels, record_buffer, extra_frames_in_record_buffer);
+    sample_thread_internal(thread, walk_cache, &thread_in_gc_buffer, recorder_instance, values, labels, record_buffer, extra_frames_in_record_buffer);
+    buffer->frame_cache_stats = thread_in_gc_buffer.frame_cache_stats;
     return;
   }
 
@@ -194,6 +251,7 @@ void sample_thread(
 // frames, and this function doesn't have to care about it.
 static void sample_thread_internal(
   VALUE thread,
+  stack_walk_cache *walk_cache,
   sampling_buffer* buffer,
   VALUE recorder_instance,
   sample_values values,
@@ -207,7 +265,8 @@ static void sample_thread_internal(
     buffer->max_frames,
     buffer->stack_buffer,
     buffer->lines_buffer,
-    buffer->is_ruby_frame
+    buffer->is_ruby_frame,
+    walk_cache
   );
 
   if (captured_frames == PLACEHOLDER_STACK_IN_NATIVE_CODE) {
@@ -222,61 +281,432 @@ static void sample_thread_internal(
     return;
   }
 
+  resolve_frames(buffer, captured_frames, buffer->stack_buffer, buffer->lines_buffer, buffer->is_ruby_frame);
+
+  // Used below; since we want to stack-allocate this, we must do it here rather than in maybe_add_placeholder_frames_omitted
+  const int frames_omitted_message_size = sizeof(MAX_FRAMES_LIMIT_AS_STRING " frames omitted");
+  char frames_omitted_message[frames_omitted_message_size];
+
+  // If we filled up the buffer, some frames may have been omitted. In that case, we'll add a placeholder frame
+  // with that info.
+  bool truncated = captured_frames == (long) buffer->max_frames;
+  if (truncated) {
+    maybe_add_placeholder_frames_omitted(thread, buffer, frames_omitted_message, frames_omitted_message_size);
+  }
+
+  int frames_to_record = captured_frames;
+
+  if (stack_compaction_enabled(buffer)) {
+    // When the stack was truncated, the last frame may be the placeholder added above, so it's kept as-is at the end
+    frames_to_record = compact_stack(
+      buffer, truncated ? captured_frames - 1 : captured_frames, buffer->stack_buffer, buffer->lines_buffer, buffer->is_ruby_frame
+    );
+    if (truncated) buffer->lines[frames_to_record++] = buffer->lines[captured_frames - 1];
+  }
+
+  record_sample(
+    recorder_instance,
+    (ddog_prof_Slice_Location) {.ptr = record_buffer->locations, .len = frames_to_record + extra_frames_in_record_buffer},
+    values,
+    labels
+  );
+}
+
+// Fills in `buffer->lines` with the names, filenames and line numbers for the given raw frames
+static void resolve_frames(sampling_buffer *buffer, int frame_count, VALUE *frames, int *lines, bool *is_ruby_frame) {
   // Ruby does not give us path and line number for methods implemented using native code.
   // The convention in Kernel#caller_locations is to instead use the path and line number of the first Ruby frame
   // on the stack that is below (e.g. directly or indirectly has called) the native method.
-  // Thus, we keep that frame here to able to replicate that behavior.
-  // (This is why we also iterate the sampling buffers backwards below -- so that it's easier to keep the last_ruby_frame)
-  VALUE last_ruby_frame = Qnil;
+  // Thus, we keep that frame's filename here to able to replicate that behavior.
+  // (This is why we also iterate the sampling buffers backwards below -- so that it's easier to keep the last_ruby_filename)
+  ddog_CharSlice last_ruby_filename = DDOG_CHARSLICE_C("");
   int last_ruby_line = 0;
 
-  for (int i = captured_frames - 1; i >= 0; i--) {
-    VALUE name, filename;
+  for (int i = frame_count - 1; i >= 0; i--) {
+    frame_cache_entry *frame_info = cached_frame_info_for(buffer, frames[i], is_ruby_frame[i]);
+    ddog_CharSlice filename;
     int line;
 
-    if (buffer->is_ruby_frame[i]) {
-      last_ruby_frame = buffer->stack_buffer[i];
-      last_ruby_line = buffer->lines_buffer[i];
+    if (is_ruby_frame[i]) {
+      last_ruby_filename = frame_info->filename_slice;
+      last_ruby_line = lines[i];
 
-      name = rb_profile_frame_base_label(buffer->stack_buffer[i]);
-      filename = rb_profile_frame_path(buffer->stack_buffer[i]);
-      line = buffer->lines_buffer[i];
+      filename = frame_info->filename_slice;
+      line = lines[i];
     } else {
-      name = ddtrace_rb_profile_frame_method_name(buffer->stack_buffer[i]);
-      filename = NIL_P(last_ruby_frame) ? Qnil : rb_profile_frame_path(last_ruby_frame);
+      filename = last_ruby_filename;
       line = last_ruby_line;
     }
 
-    name = NIL_P(name) ? missing_string : name;
-    filename = NIL_P(filename) ? missing_string : filename;
-
     buffer->lines[i] = (ddog_prof_Line) {
       .function = (ddog_prof_Function) {
-        .name = char_slice_from_ruby_string(name),
-        .filename = char_slice_from_ruby_string(filename)
+        .name = frame_info->name_slice,
+        .filename = filename
       },
       .line = line,
     };
   }
+}
 
-  // Used below; since we want to stack-allocate this, we must do it here rather than in maybe_add_placeholder_frames_omitted
-  const int frames_omitted_message_size = sizeof(MAX_FRAMES_LIMIT_AS_STRING " frames omitted");
-  char frames_omitted_message[frames_omitted_message_size];
+// Used instead of `sample_thread` for threads that the caller knows are idle. See "Coalescing idle samples" in
+// collectors_thread_context.c for details.
+//
+// If the stack of the thread is the same as the one in the pending `idle_sample`, the `values` just get added to it.
+// Otherwise, the pending sample (if any) gets recorded, and a new one gets started with the current stack.
+bool sample_idle_thread(
+  VALUE thread,
+  stack_walk_cache *walk_cache,
+  sampling_buffer* buffer,
+  VALUE recorder_instance,
+  sample_values values,
+  ddog_prof_Slice_Label labels,
+  idle_sample *idle_sample
+) {
+  int captured_frames = ddtrace_rb_profile_frames(
+    thread,
+    0 /* stack starting depth */,
+    buffer->max_frames,
+    buffer->stack_buffer,
+    buffer->lines_buffer,
+    buffer->is_ruby_frame,
+    walk_cache
+  );
 
-  // If we filled up the buffer, some frames may have been omitted. In that case, we'll add a placeholder frame
-  // with that info.
-  if (captured_frames == (long) buffer->max_frames) {
-    maybe_add_placeholder_frames_omitted(thread, buffer, frames_omitted_message, frames_omitted_message_size);
+  // Placeholder and truncated stacks are not expected to be common for idle threads, so we don't bother coalescing them
+  if (captured_frames <= 0 || captured_frames == (long) buffer->max_frames) {
+    idle_sample_flush(idle_sample, buffer, recorder_instance, labels);
+    sample_thread(thread, walk_cache, buffer, recorder_instance, values, labels, SAMPLE_REGULAR);
+    return false;
+  }
+
+  uint64_t stack_hash = stack_hash_for(captured_frames, buffer->stack_buffer, buffer->lines_buffer, buffer->is_ruby_frame);
+  bool coalesced = idle_sample_has_same_stack(idle_sample, buffer, captured_frames, stack_hash);
+
+  if (coalesced) {
+    idle_sample->pending_values.cpu_time_ns += values.cpu_time_ns;
+    idle_sample->pending_values.wall_time_ns += values.wall_time_ns;
+    idle_sample->pending_values.cpu_samples += values.cpu_samples;
+    idle_sample->pending_values.alloc_samples += values.alloc_samples;
+    idle_sample->pending_values.gvl_wait_ns += values.gvl_wait_ns;
+  } else {
+    // Note: This only touches buffer->lines/locations, so the raw frames we just got in the buffer are kept untouched
+    idle_sample_flush(idle_sample, buffer, recorder_instance, labels);
+    idle_sample_start(idle_sample, buffer, captured_frames, stack_hash, values);
+  }
+
+  if (idle_sample->pending_values.wall_time_ns >= IDLE_SAMPLE_MAX_PENDING_WALL_TIME_NS) {
+    idle_sample_flush(idle_sample, buffer, recorder_instance, labels);
   }
 
+  return coalesced;
+}
+
+// FNV-1a over the raw frames; frames are compared in full when the hash matches (see idle_sample_has_same_stack) so
+// this is only used to quickly tell apart different stacks
+static uint64_t stack_hash_for(int frame_count, VALUE *frames, int *lines, bool *is_ruby_frame) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (int i = 0; i < frame_count; i++) {
+    hash = (hash ^ (uint64_t) frames[i]) * 1099511628211ULL;
+    hash = (hash ^ (((uint64_t) lines[i] << 1) | is_ruby_frame[i])) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static bool idle_sample_has_same_stack(idle_sample *idle_sample, sampling_buffer *buffer, int frame_count, uint64_t stack_hash) {
+  return idle_sample->pending &&
+    idle_sample->stack_hash == stack_hash &&
+    idle_sample->frame_count == frame_count &&
+    memcmp(idle_sample->frames, buffer->stack_buffer, frame_count * sizeof(VALUE)) == 0 &&
+    memcmp(idle_sample->lines, buffer->lines_buffer, frame_count * sizeof(int)) == 0 &&
+    memcmp(idle_sample->is_ruby_frame, buffer->is_ruby_frame, frame_count * sizeof(bool)) == 0;
+}
+
+static void idle_sample_start(idle_sample *idle_sample, sampling_buffer *buffer, int frame_count, uint64_t stack_hash, sample_values values) {
+  if (frame_count > idle_sample->frame_capacity) {
+    idle_sample->frames = ruby_xrealloc2(idle_sample->frames, frame_count, sizeof(VALUE));
+    idle_sample->lines = ruby_xrealloc2(idle_sample->lines, frame_count, sizeof(int));
+    idle_sample->is_ruby_frame = ruby_xrealloc2(idle_sample->is_ruby_frame, frame_count, sizeof(bool));
+    idle_sample->frame_capacity = frame_count;
+  }
+
+  memcpy(idle_sample->frames, buffer->stack_buffer, frame_count * sizeof(VALUE));
+  memcpy(idle_sample->lines, buffer->lines_buffer, frame_count * sizeof(int));
+  memcpy(idle_sample->is_ruby_frame, buffer->is_ruby_frame, frame_count * sizeof(bool));
+
+  idle_sample->frame_count = frame_count;
+  idle_sample->stack_hash = stack_hash;
+  idle_sample->pending_values = values;
+  idle_sample->pending = true;
+}
+
+// Records the pending sample (if any) using the stack that was copied when it was started
+void idle_sample_flush(idle_sample *idle_sample, sampling_buffer* buffer, VALUE recorder_instance, ddog_prof_Slice_Label labels) {
+  if (!idle_sample->pending) return;
+
+  resolve_frames(buffer, idle_sample->frame_count, idle_sample->frames, idle_sample->lines, idle_sample->is_ruby_frame);
+
+  int frames_to_record = idle_sample->frame_count;
+  if (stack_compaction_enabled(buffer)) {
+    frames_to_record = compact_stack(buffer, frames_to_record, idle_sample->frames, idle_sample->lines, idle_sample->is_ruby_frame);
+  }
+
+  // Cleared before recording, so we don't try to record the same sample again if recording raises an exception.
+  // (But not before resolving the frames, as they're only kept alive by idle_sample_mark while the sample is pending.)
+  idle_sample->pending = false;
+
   record_sample(
     recorder_instance,
-    (ddog_prof_Slice_Location) {.ptr = record_buffer->locations, .len = captured_frames + extra_frames_in_record_buffer},
-    values,
+    (ddog_prof_Slice_Location) {.ptr = buffer->locations, .len = frames_to_record},
+    idle_sample->pending_values,
     labels
   );
 }
 
+idle_sample *idle_sample_new(void) {
+  // Note: never returns NULL; if out of memory, it calls the Ruby out-of-memory handlers
+  return ruby_xcalloc(1, sizeof(idle_sample));
+}
+
+// Used with idle_sample_capture, which can't grow the idle_sample
+idle_sample *idle_sample_new_with_capacity(unsigned int max_frames) {
+  idle_sample *idle_sample = idle_sample_new();
+
+  idle_sample->frames = ruby_xcalloc(max_frames, sizeof(VALUE));
+  idle_sample->lines = ruby_xcalloc(max_frames, sizeof(int));
+  idle_sample->is_ruby_frame = ruby_xcalloc(max_frames, sizeof(bool));
+  idle_sample->frame_capacity = max_frames;
+
+  return idle_sample;
+}
+
+// Copies the stack of `thread` into the idle_sample, so that it can be recorded later by idle_sample_flush.
+//
+// Safety: Unlike the other sampling functions, this one never allocates, raises nor calls the `rb_profile_frame_...`
+// APIs, so it's safe to call from the `RUBY_INTERNAL_EVENT_NEWOBJ` tracepoint.
+//
+// Returns false, leaving the idle_sample untouched, if there's already a pending sample or if the thread has no Ruby
+// stack to copy. Stacks that don't fit in the idle_sample get truncated (without the "frames omitted" placeholder
+// frame that sample_thread adds, as getting the total stack depth is not free).
+bool idle_sample_capture(VALUE thread, idle_sample *idle_sample, sample_values values) {
+  if (idle_sample->pending) return false;
+
+  int captured_frames = ddtrace_rb_profile_frames(
+    thread,
+    0 /* stack starting depth */,
+    idle_sample->frame_capacity,
+    idle_sample->frames,
+    idle_sample->lines,
+    idle_sample->is_ruby_frame,
+    NULL /* No walk cache, since updating it can allocate */
+  );
+
+  if (captured_frames <= 0) return false;
+
+  idle_sample->frame_count = captured_frames;
+  idle_sample->stack_hash = stack_hash_for(captured_frames, idle_sample->frames, idle_sample->lines, idle_sample->is_ruby_frame);
+  idle_sample->pending_values = values;
+  idle_sample->pending = true;
+
+  return true;
+}
+
+bool idle_sample_pending(idle_sample *idle_sample) {
+  return idle_sample->pending;
+}
+
+void idle_sample_free(idle_sample *idle_sample) {
+  ruby_xfree(idle_sample->frames);
+  ruby_xfree(idle_sample->lines);
+  ruby_xfree(idle_sample->is_ruby_frame);
+  ruby_xfree(idle_sample);
+}
+
+// Must be called from the dmark function of the object that owns the idle_sample
+void idle_sample_mark(idle_sample *idle_sample) {
+  if (!idle_sample->pending) return;
+
+  // These are pinned, since they get compared by address with the frames of later samples
+  for (int i = 0; i < idle_sample->frame_count; i++) rb_gc_mark(idle_sample->frames[i]);
+}
+
+// Resolving the name and filename for a frame is one of the most expensive parts of sampling, and the same frames
+// (e.g. the bottom of the stack of a web server thread) show up over and over again, so we cache the results.
+//
+// The cache is keyed by the frame VALUE (iseq or cme) AND by is_ruby_frame, because for native frames we only use the
+// name (their filename comes from the closest Ruby frame below them, see sample_thread_internal).
+//
+// Cache entries keep the frame and the resolved strings alive (see sampling_buffer_mark), so a key can never be reused
+// by a different object while it is in the cache. Because entries are keyed by object address, the cache gets dropped
+// whenever Ruby compacts the heap (see sampling_buffer_compact), and also after a fork.
+static frame_cache_entry *cached_frame_info_for(sampling_buffer *buffer, VALUE frame, bool is_ruby_frame) {
+  // Fibonacci hashing; the lower bits of a VALUE are mostly zeros due to alignment so we don't use them directly
+  uint64_t index = (((uint64_t) frame) * 11400714819323198485ULL) >> (64 - FRAME_CACHE_SIZE_BITS);
+  frame_cache_entry *entry = &buffer->frame_cache[index];
+
+  if (entry->frame == frame && entry->is_ruby_frame == is_ruby_frame) {
+    buffer->frame_cache_stats.hits++;
+    return entry;
+  }
+
+  buffer->frame_cache_stats.misses++;
+
+  VALUE name = is_ruby_frame ? rb_profile_frame_base_label(frame) : ddtrace_rb_profile_frame_method_name(frame);
+  VALUE filename = is_ruby_frame ? rb_profile_frame_path(frame) : Qnil;
+
+  name = NIL_P(name) ? missing_string : name;
+  filename = NIL_P(filename) ? missing_string : filename;
+
+  *entry = (frame_cache_entry) {
+    .frame = frame,
+    .is_ruby_frame = is_ruby_frame,
+    .name = name,
+    .filename = filename,
+    .name_slice = char_slice_from_ruby_string(name),
+    .filename_slice = char_slice_from_ruby_string(filename),
+  };
+
+  return entry;
+}
+
+// ---
+// ## Stack compaction
+//
+// Deeply recursive code (e.g. JSON encoders, GraphQL resolvers, or template renderers) produces very long stacks that
+// mostly repeat the same few frames. These take up space in the profile and time to serialize, and they often get
+// truncated at `max_frames`, hiding the frames at the bottom of the stack, which are the ones that tell us where the
+// work came from. Optionally, the sampling buffer compacts stacks after resolving them, in two passes:
+//
+// 1. **Recursion folding**: A run of consecutive repetitions of the same cycle of up to `RECURSION_MAX_CYCLE_LENGTH`
+// frames (A->A->A or A->B->A->B, ...) gets folded into the top-most repetition of the cycle followed by a placeholder
+// frame with the filename "recursion xN", where N is the number of repetitions. Frames are compared using their raw
+// frame, line and is_ruby_frame, so only calls made from the same line count as repetitions.
+//
+// 2. **Frame pruning**: A run of consecutive frames whose filename starts with one of the `pruned_frame_prefixes`
+// (e.g. the path to a gem) gets reduced to its bottom-most frame, e.g. the point where the application called into the
+// library. The top-most frame of the stack is always kept, so that samples are still attributed to the code that was
+// running.
+//
+// Both passes work in place on the resolved `lines`, and happen after the stack got truncated to `max_frames`, so they
+// don't give us back frames that were omitted; they only make it less likely that stacks need to be truncated in the
+// profile UI. The "N frames omitted" placeholder, if any, is kept at the bottom of the compacted stack.
+// ---
+
+// Raises if the configuration is invalid. Must be called with the GVL held.
+void sampling_buffer_configure_compaction(sampling_buffer *buffer, bool recursion_folding_enabled, VALUE pruned_frame_prefixes) {
+  ENFORCE_TYPE(pruned_frame_prefixes, T_ARRAY);
+
+  VALUE prefixes = rb_ary_new_capa(RARRAY_LEN(pruned_frame_prefixes));
+  for (long i = 0; i < RARRAY_LEN(pruned_frame_prefixes); i++) {
+    VALUE prefix = rb_ary_entry(pruned_frame_prefixes, i);
+    ENFORCE_TYPE(prefix, T_STRING);
+    if (RSTRING_LEN(prefix) == 0) rb_raise(rb_eArgError, "Invalid pruned_frame_prefixes: prefixes must not be empty");
+    rb_ary_push(prefixes, rb_str_new_frozen(prefix));
+  }
+
+  if (recursion_folding_enabled && buffer->recursion_markers == NULL) {
+    buffer->recursion_markers = ruby_xcalloc(buffer->max_frames, RECURSION_MARKER_SIZE);
+  }
+
+  buffer->recursion_folding_enabled = recursion_folding_enabled;
+  buffer->pruned_frame_prefixes = RARRAY_LEN(prefixes) > 0 ? rb_obj_freeze(prefixes) : Qnil;
+}
+
+static bool stack_compaction_enabled(sampling_buffer *buffer) {
+  return buffer->recursion_folding_enabled || buffer->pruned_frame_prefixes != Qnil;
+}
+
+// Compacts the first `frame_count` entries of `buffer->lines`, which must have been resolved from the given raw frames.
+// Returns how many entries are left.
+static int compact_stack(sampling_buffer *buffer, int frame_count, VALUE *frames, int *lines, bool *is_ruby_frame) {
+  if (buffer->recursion_folding_enabled) frame_count = fold_recursion(buffer, frame_count, frames, lines, is_ruby_frame);
+  if (buffer->pruned_frame_prefixes != Qnil) frame_count = prune_frames(buffer, frame_count);
+  return frame_count;
+}
+
+static int fold_recursion(sampling_buffer *buffer, int frame_count, VALUE *frames, int *lines, bool *is_ruby_frame) {
+  int next_write = 0;
+  int markers_count = 0;
+  int next_read = 0;
+
+  while (next_read < frame_count) {
+    // Picks the cycle that covers the most frames; on ties, the shortest cycle wins
+    int cycle_length = 0, repetitions = 0;
+
+    for (int length = 1; length <= RECURSION_MAX_CYCLE_LENGTH && next_read + 2 * length <= frame_count; length++) {
+      int count = 1;
+      while (
+        next_read + (count + 1) * length <= frame_count &&
+        same_frames(next_read, next_read + count * length, length, frames, lines, is_ruby_frame)
+      ) count++;
+
+      // Folding needs to save at least one frame, as it adds a marker frame
+      if (count * length > length + 1 && count * length > cycle_length * repetitions) {
+        cycle_length = length;
+        repetitions = count;
+      }
+    }
+
+    if (cycle_length == 0) {
+      buffer->lines[next_write++] = buffer->lines[next_read++];
+      continue;
+    }
+
+    // Writes never overtake reads: we keep `cycle_length` frames plus one marker out of at least 2 * cycle_length
+    for (int i = 0; i < cycle_length; i++) buffer->lines[next_write++] = buffer->lines[next_read + i];
+
+    char *marker = buffer->recursion_markers[markers_count++];
+    snprintf(marker, RECURSION_MARKER_SIZE, "recursion x%d", repetitions);
+    buffer->lines[next_write++] = (ddog_prof_Line) {
+      .function = (ddog_prof_Function) {.name = DDOG_CHARSLICE_C(""), .filename = {.ptr = marker, .len = strlen(marker)}},
+      .line = 0,
+    };
+
+    next_read += cycle_length * repetitions;
+  }
+
+  return next_write;
+}
+
+static bool same_frames(int first, int second, int count, VALUE *frames, int *lines, bool *is_ruby_frame) {
+  for (int i = 0; i < count; i++) {
+    bool same =
+      frames[first + i] == frames[second + i] &&
+      lines[first + i] == lines[second + i] &&
+      is_ruby_frame[first + i] == is_ruby_frame[second + i];
+    if (!same) return false;
+  }
+  return true;
+}
+
+static int prune_frames(sampling_buffer *buffer, int frame_count) {
+  int next_write = 0;
+  bool pruned = frame_count > 0 && is_pruned_frame(buffer, &buffer->lines[0]);
+
+  for (int i = 0; i < frame_count; i++) {
+    // The caller of this frame is the next one in the stack
+    bool caller_pruned = i + 1 < frame_count && is_pruned_frame(buffer, &buffer->lines[i + 1]);
+
+    bool keep = i == 0 || !pruned || !caller_pruned;
+    if (keep) buffer->lines[next_write++] = buffer->lines[i];
+
+    pruned = caller_pruned;
+  }
+
+  return next_write;
+}
+
+static bool is_pruned_frame(sampling_buffer *buffer, ddog_prof_Line *line) {
+  ddog_CharSlice filename = line->function.filename;
+
+  for (long i = 0; i < RARRAY_LEN(buffer->pruned_frame_prefixes); i++) {
+    VALUE prefix = RARRAY_AREF(buffer->pruned_frame_prefixes, i);
+    size_t prefix_len = RSTRING_LEN(prefix);
+    if (filename.len >= prefix_len && memcmp(filename.ptr, RSTRING_PTR(prefix), prefix_len) == 0) return true;
+  }
+
+  return false;
+}
+
 static void maybe_add_placeholder_frames_omitted(VALUE thread, sampling_buffer* buffer, char *frames_omitted_message, int frames_omitted_message_size) {
   ptrdiff_t frames_omitted = stack_depth_for(thread) - buffer->max_frames;
 
@@ -355,6 +785,12 @@ sampling_buffer *sampling_buffer_new(unsigned int max_frames) {
   buffer->is_ruby_frame = ruby_xcalloc(max_frames, sizeof(bool));
   buffer->locations     = ruby_xcalloc(max_frames, sizeof(ddog_prof_Location));
   buffer->lines         = ruby_xcalloc(max_frames, sizeof(ddog_prof_Line));
+  buffer->frame_cache   = ruby_xcalloc(FRAME_CACHE_SIZE, sizeof(frame_cache_entry));
+
+  // Stack compaction is disabled by default, see sampling_buffer_configure_compaction
+  buffer->recursion_folding_enabled = false;
+  buffer->recursion_markers = NULL;
+  buffer->pruned_frame_prefixes = Qnil;
 
   // Currently we have a 1-to-1 correspondence between lines and locations, so we just initialize the locations once
   // here and then only mutate the contents of the lines.
@@ -374,6 +810,46 @@ void sampling_buffer_free(sampling_buffer *buffer) {
   ruby_xfree(buffer->is_ruby_frame);
   ruby_xfree(buffer->locations);
   ruby_xfree(buffer->lines);
+  ruby_xfree(buffer->frame_cache);
+  ruby_xfree(buffer->recursion_markers);
 
   ruby_xfree(buffer);
 }
+
+// Must be called from the dmark function of the object that owns the buffer
+void sampling_buffer_mark(sampling_buffer *buffer) {
+  rb_gc_mark(buffer->pruned_frame_prefixes);
+
+  for (int i = 0; i < FRAME_CACHE_SIZE; i++) {
+    frame_cache_entry *entry = &buffer->frame_cache[i];
+    if (entry->frame == 0) continue;
+
+    #ifndef NO_GC_COMPACTION
+      // Frames are allowed to move; we drop the whole cache when that happens (see sampling_buffer_compact)
+      rb_gc_mark_movable(entry->frame);
+    #else
+      rb_gc_mark(entry->frame);
+    #endif
+    // ...but the strings are pinned, since the name_slice and filename_slice point at their contents
+    rb_gc_mark(entry->name);
+    rb_gc_mark(entry->filename);
+  }
+}
+
+// Must be called from the dcompact function of the object that owns the buffer
+void sampling_buffer_compact(sampling_buffer *buffer) {
+  // Rather than rehashing every entry with its new address, we just start from scratch
+  sampling_buffer_clear_frame_cache(buffer);
+}
+
+void sampling_buffer_clear_frame_cache(sampling_buffer *buffer) {
+  memset(buffer->frame_cache, 0, FRAME_CACHE_SIZE * sizeof(frame_cache_entry));
+}
+
+frame_cache_stats sampling_buffer_frame_cache_stats(sampling_buffer *buffer) {
+  return buffer->frame_cache_stats;
+}
+
+void sampling_buffer_reset_frame_cache_stats(sampling_buffer *buffer) {
+  buffer->frame_cache_stats = (frame_cache_stats) {};
+}
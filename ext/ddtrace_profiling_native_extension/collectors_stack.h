@@ -2,19 +2,55 @@
 
 #include <datadog/profiling.h>
 
+#include "private_vm_api_access.h"
 #include "stack_recorder.h"
 
 typedef struct sampling_buffer sampling_buffer;
 
 typedef enum { SAMPLE_REGULAR, SAMPLE_IN_GC } sample_type;
 
+typedef struct {
+  unsigned long hits;
+  unsigned long misses;
+} frame_cache_stats;
+
+// Keeps a copy of the stack of an idle thread, together with the sample values accumulated for it that were not yet
+// recorded. See "Coalescing idle samples" in collectors_thread_context.c for details.
+// Also used to defer recording allocation samples, see "Allocation sampling" in collectors_thread_context.c.
+typedef struct idle_sample idle_sample;
+
 void sample_thread(
   VALUE thread,
+  stack_walk_cache *walk_cache,
   sampling_buffer* buffer,
   VALUE recorder_instance,
   sample_values values,
   ddog_prof_Slice_Label labels,
   sample_type type
 );
+// Returns true if the values were added to an already-pending sample
+bool sample_idle_thread(
+  VALUE thread,
+  stack_walk_cache *walk_cache,
+  sampling_buffer* buffer,
+  VALUE recorder_instance,
+  sample_values values,
+  ddog_prof_Slice_Label labels,
+  idle_sample *idle_sample
+);
 sampling_buffer *sampling_buffer_new(unsigned int max_frames);
 void sampling_buffer_free(sampling_buffer *buffer);
+void sampling_buffer_configure_compaction(sampling_buffer *buffer, bool recursion_folding_enabled, VALUE pruned_frame_prefixes);
+void sampling_buffer_mark(sampling_buffer *buffer);
+void sampling_buffer_compact(sampling_buffer *buffer);
+void sampling_buffer_clear_frame_cache(sampling_buffer *buffer);
+frame_cache_stats sampling_buffer_frame_cache_stats(sampling_buffer *buffer);
+void sampling_buffer_reset_frame_cache_stats(sampling_buffer *buffer);
+idle_sample *idle_sample_new(void);
+idle_sample *idle_sample_new_with_capacity(unsigned int max_frames);
+void idle_sample_free(idle_sample *idle_sample);
+void idle_sample_mark(idle_sample *idle_sample);
+void idle_sample_flush(idle_sample *idle_sample, sampling_buffer* buffer, VALUE recorder_instance, ddog_prof_Slice_Label labels);
+// Returns false if nothing was captured, see the notes on the function for details
+bool idle_sample_capture(VALUE thread, idle_sample *idle_sample, sample_values values);
+bool idle_sample_pending(idle_sample *idle_sample);
@@ -1,5 +1,8 @@
 
 #include <ruby.h>
+#include <ruby/thread.h>
+#include <stdatomic.h>
+#include <string.h>
 
 #include "collectors_thread_context.h"
 #include "clock_id.h"
@@ -64,11 +67,113 @@
 // allowed to happen during Ruby's garbage collection start/finish hooks.
 // ---
 
+// ---
+// ## Cleaning up contexts for dead threads
+//
+// On Ruby 3.2+, we register a thread event hook for `RUBY_INTERNAL_THREAD_EVENT_EXITED`. This hook gets called
+// without the GVL being held, so it can't touch the `per_thread_contexts` directly; instead, it flags that there are
+// dead threads to be cleaned up, and the next call to `thread_context_collector_sample` does it.
+//
+// On older Rubies, there are no thread event hooks, so instead we look for dead threads every 100 samples.
+// ---
+
+// ---
+// ## Per-thread cpu-time timers
+//
+// When enabled by the `CpuAndWallTimeWorker` (see `thread_context_collector_enable_cpu_timers`), every thread we
+// have a context for also gets a timer that sends it a signal every time the thread uses a given amount of cpu-time.
+// This allows threads to get sampled in proportion to the cpu-time they actually use, rather than at a fixed rate.
+//
+// Because the contexts are where we keep track of which threads exist, the timers get created and deleted together
+// with them. This also means that a thread only gets a timer after it has been seen by the collector at least once.
+// ---
+
+// ---
+// ## Coalescing idle samples
+//
+// Applications often have many threads that spend most of their time blocked (e.g. thread pools waiting for work), and
+// thus are sampled with the exact same stack over and over again. When `idle_sample_coalescing_enabled` is set, instead
+// of recording each of these samples, we keep a copy of the stack of threads that are blocked (see `is_thread_stopped`)
+// in their context, and while their stack stays the same, new samples only add their values to a single pending
+// sample (see `sample_idle_thread` in collectors_stack.c).
+//
+// The pending sample gets recorded when the thread's stack changes, when the thread is sampled while not blocked, when
+// the thread dies, or after it accumulates a given amount of wall-time (so it doesn't get held back for too long).
+// Pending samples also get recorded by `thread_context_collector_flush_pending_samples`, which the StackRecorder calls
+// right before serializing a profile (see "Pending samples" in stack_recorder.c), and which the CpuAndWallTimeWorker
+// calls when it stops, so that they end up in the profile that covers the time they represent.
+//
+// Samples belonging to a trace are not coalesced, so that the pending sample only needs the "thread id" and
+// "thread name" labels (plus the "wait reason", if enabled), which we can rebuild when recording it.
+// ---
+
+// ---
+// ## Wait reason labels
+//
+// Wall-time samples for threads that are blocked all look alike (e.g. a lot of `sleep` or `IO#read`), so when
+// `wait_reason_labels_enabled` is set, every wall-time sample (e.g. every sample other than allocation samples) gets a
+// "wait reason" label that says why the thread was (or was not) running:
+//
+// * "running": The thread was executing Ruby code. This is the thread that holds the Global VM Lock (GVL) and is
+//   taking the sample.
+// * "gvl": The thread was ready to run, but waiting for the GVL, which is held by the thread taking the sample. Samples
+//   recording time spent waiting for the GVL (see `thread_context_collector_sample_gvl_wait`) also use this reason.
+// * "gc": The sample represents time spent in garbage collection.
+// * "io", "mutex" or "sleep": The thread was blocked (see `is_thread_stopped`) in a method that we know about.
+// * "other": The thread was blocked somewhere else, e.g. in native code that released the GVL.
+//
+// To categorize blocked threads, we get the owner and the method id of the method the thread is executing (see
+// `top_method_for`), and look them up in the `wait_reason_methods` table, which gets resolved from class and method
+// names into Ruby objects and ids when the collector is initialized. Methods of `IO` and its subclasses (e.g. `File`,
+// sockets) that are not in the table are categorized as "io". This way, sampling doesn't need to look at names at all.
+// ---
+
+// ---
+// ## Trace identifiers slot
+//
+// To correlate samples with traces, we need the ids of the local root span and of the active span for each thread
+// being sampled. Getting these by walking the tracer's objects (context -> trace -> spans) means a number of
+// `rb_ivar_get` calls for every thread on every sample, even though the active span only changes when spans start or
+// finish.
+//
+// Instead, when profiling is enabled, every `Datadog::Tracing::TraceOperation` gets a
+// `ThreadContext::TraceIdentifiersSlot` object, and publishes its root and active span to it whenever a span is
+// activated or deactivated, as well as whenever the trace resource gets set (the endpoint is usually only set near the
+// end of a request, e.g. by Rails or by the Rack middleware). On every publish, the slot stores the span ids as plain
+// integers, and the endpoint if the root span is a web request, so at sampling time we only need to get from the thread
+// to its active trace (as the tracer keeps it per fiber) and then only read from the slot.
+//
+// Traces without a slot (e.g. created before profiling was enabled) are handled by walking the tracer objects as
+// before.
+// ---
+
+// ---
+// ## Allocation sampling
+//
+// Allocation samples get triggered from the `RUBY_INTERNAL_EVENT_NEWOBJ` tracepoint, while the VM is in the middle of
+// creating an object, and thus where we must not allocate, raise, or call Ruby APIs that may do so. Resolving the
+// names and filenames of the frames in the stack (on a frame cache miss, see collectors_stack.c) does all of these, as
+// does building some of the labels.
+//
+// Thus, allocation samples are taken in two steps:
+// 1. `thread_context_collector_prepare_allocation_sample`, called from the tracepoint, only copies the raw frames of
+//    the current thread (together with the thread, the class of the new object and the sample weight) into the
+//    preallocated `pending_allocation`, and starts tracking the object for heap profiling.
+// 2. `thread_context_collector_sample_allocation`, called a bit later from a postponed job, resolves the frames and
+//    records the sample.
+//
+// There's only one pending allocation sample; while it's waiting to be recorded, no new one gets captured, and the
+// caller is expected to count those allocations towards the weight of the next sample.
+// ---
+
 #define INVALID_TIME -1
 #define THREAD_ID_LIMIT_CHARS 44 // Why 44? "#{2**64} (#{2**64})".size + 1 for \0
 #define IS_WALL_TIME true
 #define IS_NOT_WALL_TIME false
 #define MISSING_TRACER_CONTEXT_KEY 0
+#define INITIAL_PER_THREAD_CONTEXT_TABLE_CAPACITY 16 // Must be > 0
+#define EMPTY_SLOT -1
+#define WAIT_REASON_NAME(string) {.ptr = "" string, .len = sizeof(string) - 1}
 
 static ID at_active_span_id;  // id of :@active_span in Ruby
 static ID at_active_trace_id; // id of :@active_trace in Ruby
@@ -76,6 +181,122 @@ static ID at_id_id;           // id of :@id in Ruby
 static ID at_resource_id;     // id of :@resource in Ruby
 static ID at_root_span_id;    // id of :@root_span in Ruby
 static ID at_type_id;         // id of :@type in Ruby
+static ID at_profiling_slot_id; // id of :@profiling_slot in Ruby
+
+// See "Wait reason labels" notes above
+typedef enum {
+  WAIT_REASON_NONE, // No label gets added
+  WAIT_REASON_RUNNING,
+  WAIT_REASON_GVL,
+  WAIT_REASON_GC,
+  WAIT_REASON_IO,
+  WAIT_REASON_MUTEX,
+  WAIT_REASON_SLEEP,
+  WAIT_REASON_OTHER,
+} wait_reason;
+
+static const ddog_CharSlice wait_reason_names[] = {
+  [WAIT_REASON_NONE] = WAIT_REASON_NAME(""),
+  [WAIT_REASON_RUNNING] = WAIT_REASON_NAME("running"),
+  [WAIT_REASON_GVL] = WAIT_REASON_NAME("gvl"),
+  [WAIT_REASON_GC] = WAIT_REASON_NAME("gc"),
+  [WAIT_REASON_IO] = WAIT_REASON_NAME("io"),
+  [WAIT_REASON_MUTEX] = WAIT_REASON_NAME("mutex"),
+  [WAIT_REASON_SLEEP] = WAIT_REASON_NAME("sleep"),
+  [WAIT_REASON_OTHER] = WAIT_REASON_NAME("other"),
+};
+
+// Methods that threads usually get blocked in. The owner is the name of a top-level constant; when `singleton` is set,
+// the method is a class method (e.g. `IO.select`). Owners that are not defined (e.g. `Monitor`, if it wasn't required)
+// get skipped. Note that methods are matched by their original name, so aliases (e.g. `Queue#shift`) don't need entries.
+static const struct {
+  const char *owner;
+  bool singleton;
+  const char *method;
+  wait_reason reason;
+} wait_reason_methods[] = {
+  {"Kernel", false, "sleep", WAIT_REASON_SLEEP},
+  {"Thread", true, "stop", WAIT_REASON_SLEEP},
+  {"Thread", false, "join", WAIT_REASON_MUTEX},
+  {"Thread", false, "value", WAIT_REASON_MUTEX},
+  {"Mutex", false, "lock", WAIT_REASON_MUTEX},
+  {"Mutex", false, "synchronize", WAIT_REASON_MUTEX},
+  // Used by ConditionVariable#wait
+  {"Mutex", false, "sleep", WAIT_REASON_MUTEX},
+  {"ConditionVariable", false, "wait", WAIT_REASON_MUTEX},
+  {"Queue", false, "pop", WAIT_REASON_MUTEX},
+  {"SizedQueue", false, "pop", WAIT_REASON_MUTEX},
+  {"SizedQueue", false, "push", WAIT_REASON_MUTEX},
+  {"Monitor", false, "enter", WAIT_REASON_MUTEX},
+  {"Monitor", false, "synchronize", WAIT_REASON_MUTEX},
+  {"Monitor", false, "wait_for_cond", WAIT_REASON_MUTEX},
+  {"Kernel", false, "select", WAIT_REASON_IO},
+  {"Kernel", false, "gets", WAIT_REASON_IO},
+  {"Kernel", false, "readline", WAIT_REASON_IO},
+  {"IO", true, "select", WAIT_REASON_IO},
+};
+#define WAIT_REASON_METHODS_COUNT (sizeof(wait_reason_methods) / sizeof(wait_reason_methods[0]))
+
+// An entry of `wait_reason_methods`, resolved by `resolve_wait_reason_methods`
+struct wait_reason_method {
+  VALUE owner;
+  ID method_id;
+  wait_reason reason;
+};
+
+// Tracks per-thread state
+struct per_thread_context {
+  char thread_id[THREAD_ID_LIMIT_CHARS];
+  // Note: We don't keep a ddog_CharSlice pointing at `thread_id`, as contexts get moved around (see
+  // per_thread_context_table); use `thread_id_char_slice_for` instead
+  size_t thread_id_length;
+  thread_cpu_time_id thread_cpu_time_id;
+  thread_cpu_timer cpu_timer; // See "Per-thread cpu-time timers" notes above
+  long cpu_time_at_previous_sample_ns;  // Can be INVALID_TIME until initialized or if getting it fails for another reason
+  long wall_time_at_previous_sample_ns; // Can be INVALID_TIME until initialized
+  // Used to avoid redoing work for the parts of the stack that did not change since the previous sample
+  stack_walk_cache *stack_walk_cache;
+  // See "Coalescing idle samples" notes above; NULL until the thread is sampled while idle
+  idle_sample *idle_sample;
+  // Wait reason for the pending idle sample, if any; see "Wait reason labels" notes above
+  wait_reason idle_sample_wait_reason;
+
+  struct {
+    // Both of these fields are set by on_gc_start and kept until sample_after_gc is called.
+    // Outside of this window, they will be INVALID_TIME.
+    long cpu_time_at_start_ns;
+    long wall_time_at_start_ns;
+
+    // Both of these fields are set by on_gc_finish and kept until sample_after_gc is called.
+    // Outside of this window, they will be INVALID_TIME.
+    long cpu_time_at_finish_ns;
+    long wall_time_at_finish_ns;
+  } gc_tracking;
+};
+
+// Open-addressing hashmap <Thread Object, struct per_thread_context>, used instead of an st_table to avoid an extra
+// allocation and pointer chase per thread on every sample.
+//
+// The contexts are stored inline in the `entries` array, in insertion order (which usually matches the order in which
+// threads get sampled), and without gaps: removing a context moves the last entry into its place.
+// The `slots` array (with linear probing) maps a thread to its position in `entries`.
+//
+// IMPORTANT: Because contexts are stored inline, adding or removing contexts can move other contexts around, so
+// pointers to a context MUST NOT be kept across calls that can add or remove contexts.
+struct per_thread_context_entry {
+  VALUE thread;
+  struct per_thread_context context;
+};
+
+struct per_thread_context_table {
+  struct per_thread_context_entry *entries;
+  uint32_t size;     // Number of entries in use
+  uint32_t capacity; // Number of entries that fit in `entries`
+
+  // Position in `entries`, or EMPTY_SLOT. There's always at least twice as many slots as entries.
+  int32_t *slots;
+  uint32_t slots_mask; // Slot count - 1 (slot count is a power of two)
+};
 
 // Contains state for a single ThreadContext instance
 struct thread_context_collector_state {
@@ -85,7 +306,7 @@ struct thread_context_collector_state {
   // Required by Datadog::Profiling::Collectors::Stack as a scratch buffer during sampling
   sampling_buffer *sampling_buffer;
   // Hashmap <Thread Object, struct per_thread_context>
-  st_table *hash_map_per_thread_context;
+  struct per_thread_context_table per_thread_contexts;
   // Datadog::Profiling::StackRecorder instance
   VALUE recorder_instance;
   // If the tracer is available and enabled, this will be the fiber-local symbol for accessing its running context,
@@ -98,36 +319,46 @@ struct thread_context_collector_state {
   unsigned int sample_count;
   // Reusable array to get list of threads
   VALUE thread_list_buffer;
+  // See "Coalescing idle samples" notes above
+  bool idle_sample_coalescing_enabled;
+  // See "Wait reason labels" notes above
+  bool wait_reason_labels_enabled;
+  struct wait_reason_method wait_reason_methods[WAIT_REASON_METHODS_COUNT];
+  unsigned int wait_reason_methods_count;
+
+  #ifndef NO_THREAD_EVENT_HOOKS
+    // See "Cleaning up contexts for dead threads" notes above
+    rb_internal_thread_event_hook_t *thread_exited_hook;
+    atomic_bool dead_threads_pending;
+  #endif
+  // See "Allocation sampling" notes above
+  struct {
+    idle_sample *stack; // Has room for max_frames, so capturing a sample never needs to allocate; NULL until initialized
+    VALUE thread;
+    VALUE klass; // 0 for objects that are internal to the VM (e.g. T_IMEMO), as they don't have a class
+    unsigned int weight;
+  } pending_allocation;
+  // See "Per-thread cpu-time timers" notes above
+  struct {
+    long interval_ns; // When 0, cpu-time timers are disabled
+    int signal;
+    int signal_value;
+  } cpu_timers;
 
   struct stats {
     // Track how many garbage collection samples we've taken.
     unsigned int gc_samples;
     // See thread_context_collector_on_gc_start for details
     unsigned int gc_samples_missed_due_to_missing_context;
+    // How many times we failed to create a cpu-time timer for a thread
+    unsigned int cpu_timer_failures;
+    // errno value for the most recent failure to create a cpu-time timer, or 0 when not available
+    int cpu_timer_last_error;
+    // How many samples were added to a pending idle sample, rather than being recorded
+    unsigned int idle_samples_coalesced;
   } stats;
 };
 
-// Tracks per-thread state
-struct per_thread_context {
-  char thread_id[THREAD_ID_LIMIT_CHARS];
-  ddog_CharSlice thread_id_char_slice;
-  thread_cpu_time_id thread_cpu_time_id;
-  long cpu_time_at_previous_sample_ns;  // Can be INVALID_TIME until initialized or if getting it fails for another reason
-  long wall_time_at_previous_sample_ns; // Can be INVALID_TIME until initialized
-
-  struct {
-    // Both of these fields are set by on_gc_start and kept until sample_after_gc is called.
-    // Outside of this window, they will be INVALID_TIME.
-    long cpu_time_at_start_ns;
-    long wall_time_at_start_ns;
-
-    // Both of these fields are set by on_gc_finish and kept until sample_after_gc is called.
-    // Outside of this window, they will be INVALID_TIME.
-    long cpu_time_at_finish_ns;
-    long wall_time_at_finish_ns;
-  } gc_tracking;
-};
-
 // Used to correlate profiles with traces
 struct trace_identifiers {
   bool valid;
@@ -136,12 +367,32 @@ struct trace_identifiers {
   VALUE trace_endpoint;
 };
 
+// Contains the trace identifiers published by a TraceOperation, see "Trace identifiers slot" section above
+struct trace_identifiers_slot {
+  bool valid;
+  uint64_t local_root_span_id;
+  uint64_t span_id;
+  VALUE trace_endpoint; // Qnil when the root span is not a web request, or has no endpoint yet
+  VALUE trace_operation;
+};
+
 static void thread_context_collector_typed_data_mark(void *state_ptr);
 static void thread_context_collector_typed_data_free(void *state_ptr);
-static int hash_map_per_thread_context_mark(st_data_t key_thread, st_data_t _value, st_data_t _argument);
-static int hash_map_per_thread_context_free_values(st_data_t _thread, st_data_t value_per_thread_context, st_data_t _argument);
+#ifndef NO_GC_COMPACTION
+static void thread_context_collector_typed_data_compact(void *state_ptr);
+#endif
 static VALUE _native_new(VALUE klass);
-static VALUE _native_initialize(VALUE self, VALUE collector_instance, VALUE recorder_instance, VALUE max_frames, VALUE tracer_context_key);
+static VALUE _native_initialize(
+  VALUE self,
+  VALUE collector_instance,
+  VALUE recorder_instance,
+  VALUE max_frames,
+  VALUE tracer_context_key,
+  VALUE idle_sample_coalescing_enabled,
+  VALUE recursion_folding_enabled,
+  VALUE pruned_frame_prefixes,
+  VALUE wait_reason_labels_enabled
+);
 static VALUE _native_sample(VALUE self, VALUE collector_instance, VALUE profiler_overhead_stack_thread);
 static VALUE _native_on_gc_start(VALUE self, VALUE collector_instance);
 static VALUE _native_on_gc_finish(VALUE self, VALUE collector_instance);
@@ -160,28 +411,55 @@ static void trigger_sample_for_thread(
   VALUE stack_from_thread,
   struct per_thread_context *thread_context,
   sample_values values,
-  sample_type type
+  sample_type type,
+  ddog_CharSlice *allocated_class
 );
 static VALUE _native_thread_list(VALUE self);
 static struct per_thread_context *get_or_create_context_for(VALUE thread, struct thread_context_collector_state *state);
 static struct per_thread_context *get_context_for(VALUE thread, struct thread_context_collector_state *state);
 static void initialize_context(VALUE thread, struct per_thread_context *thread_context);
+static void free_context(struct per_thread_context* thread_context);
+static ddog_CharSlice thread_id_char_slice_for(struct per_thread_context *thread_context);
+static void start_cpu_timer(VALUE thread, struct per_thread_context *thread_context, struct thread_context_collector_state *state);
+static void flush_idle_sample(struct thread_context_collector_state *state, VALUE thread, struct per_thread_context *thread_context);
 static VALUE _native_inspect(VALUE self, VALUE collector_instance);
-static VALUE per_thread_context_st_table_as_ruby_hash(struct thread_context_collector_state *state);
-static int per_thread_context_as_ruby_hash(st_data_t key_thread, st_data_t value_context, st_data_t result_hash);
+static VALUE per_thread_context_table_as_ruby_hash(struct thread_context_collector_state *state);
+static VALUE per_thread_context_as_ruby_hash(struct per_thread_context *thread_context);
 static VALUE stats_as_ruby_hash(struct thread_context_collector_state *state);
 static void remove_context_for_dead_threads(struct thread_context_collector_state *state);
-static int remove_if_dead_thread(st_data_t key_thread, st_data_t value_context, st_data_t _argument);
+static void per_thread_context_table_init(struct per_thread_context_table *table, uint32_t capacity);
+static void per_thread_context_table_free(struct per_thread_context_table *table);
+static void per_thread_context_table_clear(struct per_thread_context_table *table);
+static void per_thread_context_table_reserve(struct per_thread_context_table *table, uint32_t needed_capacity);
+static struct per_thread_context *per_thread_context_table_lookup(struct per_thread_context_table *table, VALUE thread);
+static struct per_thread_context *per_thread_context_table_add(struct per_thread_context_table *table, VALUE thread);
+static void per_thread_context_table_remove_at(struct per_thread_context_table *table, uint32_t position);
+static uint32_t per_thread_context_table_find_slot(struct per_thread_context_table *table, VALUE thread);
+static uint32_t per_thread_context_table_home_slot(struct per_thread_context_table *table, VALUE thread);
 static VALUE _native_per_thread_context(VALUE self, VALUE collector_instance);
+static VALUE _native_benchmark_context_lookups(VALUE self, VALUE collector_instance, VALUE threads, VALUE use_st_table, VALUE rounds);
 static long update_time_since_previous_sample(long *time_at_previous_sample_ns, long current_time_ns, long gc_start_time_ns, bool is_wall_time);
 static long cpu_time_now_ns(struct per_thread_context *thread_context);
 static long thread_id_for(VALUE thread);
 static VALUE _native_stats(VALUE self, VALUE collector_instance);
 static void trace_identifiers_for(struct thread_context_collector_state *state, VALUE thread, struct trace_identifiers *trace_identifiers_result);
 static bool is_type_web(VALUE root_span_type);
+static VALUE trace_endpoint_for(VALUE trace_operation, VALUE root_span);
+static void trace_identifiers_slot_typed_data_mark(void *slot_ptr);
+static VALUE _native_slot_new(VALUE klass);
+static VALUE _native_slot_initialize(DDTRACE_UNUSED VALUE _self, VALUE slot_instance, VALUE trace_operation);
+static VALUE _native_slot_publish(DDTRACE_UNUSED VALUE _self, VALUE slot_instance, VALUE root_span, VALUE active_span);
 static VALUE _native_reset_after_fork(DDTRACE_UNUSED VALUE self, VALUE collector_instance);
 static VALUE thread_list(struct thread_context_collector_state *state);
-static VALUE _native_sample_allocation(VALUE self, VALUE collector_instance, VALUE sample_weight);
+static VALUE _native_sample_allocation(VALUE self, VALUE collector_instance, VALUE sample_weight, VALUE new_object);
+static ddog_CharSlice allocated_class_for(VALUE klass, VALUE *class_name);
+static VALUE _native_sample_gvl_wait(VALUE self, VALUE collector_instance, VALUE gvl_wait_ns);
+static bool should_remove_context_for_dead_threads(struct thread_context_collector_state *state);
+static void resolve_wait_reason_methods(struct thread_context_collector_state *state);
+static wait_reason wait_reason_for(struct thread_context_collector_state *state, VALUE thread, sample_values values, sample_type type);
+#ifndef NO_THREAD_EVENT_HOOKS
+static void on_thread_exited(rb_event_flag_t _event, const rb_internal_thread_event_data_t *_event_data, void *state_ptr);
+#endif
 
 void collectors_thread_context_init(VALUE profiling_module) {
   VALUE collectors_module = rb_define_module_under(profiling_module, "Collectors");
@@ -199,24 +477,32 @@ void collectors_thread_context_init(VALUE profiling_module) {
   // https://bugs.ruby-lang.org/issues/18007 for a discussion around this.
   rb_define_alloc_func(collectors_thread_context_class, _native_new);
 
-  rb_define_singleton_method(collectors_thread_context_class, "_native_initialize", _native_initialize, 4);
+  rb_define_singleton_method(collectors_thread_context_class, "_native_initialize", _native_initialize, 8);
   rb_define_singleton_method(collectors_thread_context_class, "_native_inspect", _native_inspect, 1);
   rb_define_singleton_method(collectors_thread_context_class, "_native_reset_after_fork", _native_reset_after_fork, 1);
   rb_define_singleton_method(testing_module, "_native_sample", _native_sample, 2);
-  rb_define_singleton_method(testing_module, "_native_sample_allocation", _native_sample_allocation, 2);
+  rb_define_singleton_method(testing_module, "_native_sample_allocation", _native_sample_allocation, 3);
+  rb_define_singleton_method(testing_module, "_native_sample_gvl_wait", _native_sample_gvl_wait, 2);
   rb_define_singleton_method(testing_module, "_native_on_gc_start", _native_on_gc_start, 1);
   rb_define_singleton_method(testing_module, "_native_on_gc_finish", _native_on_gc_finish, 1);
   rb_define_singleton_method(testing_module, "_native_sample_after_gc", _native_sample_after_gc, 1);
   rb_define_singleton_method(testing_module, "_native_thread_list", _native_thread_list, 0);
   rb_define_singleton_method(testing_module, "_native_per_thread_context", _native_per_thread_context, 1);
+  rb_define_singleton_method(testing_module, "_native_benchmark_context_lookups", _native_benchmark_context_lookups, 4);
   rb_define_singleton_method(testing_module, "_native_stats", _native_stats, 1);
 
+  VALUE trace_identifiers_slot_class = rb_define_class_under(collectors_thread_context_class, "TraceIdentifiersSlot", rb_cObject);
+  rb_define_alloc_func(trace_identifiers_slot_class, _native_slot_new);
+  rb_define_singleton_method(trace_identifiers_slot_class, "_native_initialize", _native_slot_initialize, 2);
+  rb_define_singleton_method(trace_identifiers_slot_class, "_native_publish", _native_slot_publish, 3);
+
   at_active_span_id = rb_intern_const("@active_span");
   at_active_trace_id = rb_intern_const("@active_trace");
   at_id_id = rb_intern_const("@id");
   at_resource_id = rb_intern_const("@resource");
   at_root_span_id = rb_intern_const("@root_span");
   at_type_id = rb_intern_const("@type");
+  at_profiling_slot_id = rb_intern_const("@profiling_slot");
 }
 
 // This structure is used to define a Ruby object that stores a pointer to a struct thread_context_collector_state
@@ -227,7 +513,20 @@ static const rb_data_type_t thread_context_collector_typed_data = {
     .dmark = thread_context_collector_typed_data_mark,
     .dfree = thread_context_collector_typed_data_free,
     .dsize = NULL, // We don't track profile memory usage (although it'd be cool if we did!)
-    //.dcompact = NULL, // FIXME: Add support for compaction
+    #ifndef NO_GC_COMPACTION
+      // Other than the sampling_buffer frame cache and the stack_walk_caches, all references we keep are pinned by our dmark function
+      .dcompact = thread_context_collector_typed_data_compact,
+    #endif
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static const rb_data_type_t trace_identifiers_slot_typed_data = {
+  .wrap_struct_name = "Datadog::Profiling::Collectors::ThreadContext::TraceIdentifiersSlot",
+  .function = {
+    .dmark = trace_identifiers_slot_typed_data_mark,
+    .dfree = RUBY_DEFAULT_FREE,
+    .dsize = NULL,
   },
   .flags = RUBY_TYPED_FREE_IMMEDIATELY
 };
@@ -239,10 +538,32 @@ static void thread_context_collector_typed_data_mark(void *state_ptr) {
 
   // Update this when modifying state struct
   rb_gc_mark(state->recorder_instance);
-  st_foreach(state->hash_map_per_thread_context, hash_map_per_thread_context_mark, 0 /* unused */);
+  // Note: Threads are used as keys in per_thread_contexts, and thus must not move
+  for (uint32_t i = 0; i < state->per_thread_contexts.size; i++) {
+    struct per_thread_context_entry *entry = &state->per_thread_contexts.entries[i];
+    rb_gc_mark(entry->thread);
+    if (entry->context.idle_sample != NULL) idle_sample_mark(entry->context.idle_sample);
+  }
   rb_gc_mark(state->thread_list_buffer);
+  if (state->sampling_buffer != NULL) sampling_buffer_mark(state->sampling_buffer);
+  if (state->pending_allocation.stack != NULL) idle_sample_mark(state->pending_allocation.stack);
+  rb_gc_mark(state->pending_allocation.thread);
+  rb_gc_mark(state->pending_allocation.klass);
+  // These are pinned, since they get compared by address with the owners of the methods threads are blocked in
+  for (unsigned int i = 0; i < state->wait_reason_methods_count; i++) rb_gc_mark(state->wait_reason_methods[i].owner);
 }
 
+#ifndef NO_GC_COMPACTION
+static void thread_context_collector_typed_data_compact(void *state_ptr) {
+  struct thread_context_collector_state *state = (struct thread_context_collector_state *) state_ptr;
+
+  if (state->sampling_buffer != NULL) sampling_buffer_compact(state->sampling_buffer);
+  for (uint32_t i = 0; i < state->per_thread_contexts.size; i++) {
+    stack_walk_cache_clear(state->per_thread_contexts.entries[i].context.stack_walk_cache);
+  }
+}
+#endif
+
 static void thread_context_collector_typed_data_free(void *state_ptr) {
   struct thread_context_collector_state *state = (struct thread_context_collector_state *) state_ptr;
 
@@ -251,27 +572,16 @@ static void thread_context_collector_typed_data_free(void *state_ptr) {
   // Important: Remember that we're only guaranteed to see here what's been set in _native_new, aka
   // pointers that have been set NULL there may still be NULL here.
   if (state->sampling_buffer != NULL) sampling_buffer_free(state->sampling_buffer);
+  if (state->pending_allocation.stack != NULL) idle_sample_free(state->pending_allocation.stack);
 
-  // Free each entry in the map
-  st_foreach(state->hash_map_per_thread_context, hash_map_per_thread_context_free_values, 0 /* unused */);
-  // ...and then the map
-  st_free_table(state->hash_map_per_thread_context);
-
-  ruby_xfree(state);
-}
+  #ifndef NO_THREAD_EVENT_HOOKS
+    // Note: This waits for any on_thread_exited calls still in progress, so it's safe to free the state afterwards
+    if (state->thread_exited_hook != NULL) rb_internal_thread_remove_event_hook(state->thread_exited_hook);
+  #endif
 
-// Mark Ruby thread references we keep as keys in hash_map_per_thread_context
-static int hash_map_per_thread_context_mark(st_data_t key_thread, DDTRACE_UNUSED st_data_t _value, DDTRACE_UNUSED st_data_t _argument) {
-  VALUE thread = (VALUE) key_thread;
-  rb_gc_mark(thread);
-  return ST_CONTINUE;
-}
+  per_thread_context_table_free(&state->per_thread_contexts);
 
-// Used to clear each of the per_thread_contexts inside the hash_map_per_thread_context
-static int hash_map_per_thread_context_free_values(DDTRACE_UNUSED st_data_t _thread, st_data_t value_per_thread_context, DDTRACE_UNUSED st_data_t _argument) {
-  struct per_thread_context *per_thread_context = (struct per_thread_context*) value_per_thread_context;
-  ruby_xfree(per_thread_context);
-  return ST_CONTINUE;
+  ruby_xfree(state);
 }
 
 static VALUE _native_new(VALUE klass) {
@@ -279,17 +589,41 @@ static VALUE _native_new(VALUE klass) {
 
   // Update this when modifying state struct
   state->sampling_buffer = NULL;
-  state->hash_map_per_thread_context =
-   // "numtable" is an awful name, but TL;DR it's what should be used when keys are `VALUE`s.
-    st_init_numtable();
+  per_thread_context_table_init(&state->per_thread_contexts, INITIAL_PER_THREAD_CONTEXT_TABLE_CAPACITY);
   state->recorder_instance = Qnil;
   state->tracer_context_key = MISSING_TRACER_CONTEXT_KEY;
   state->thread_list_buffer = rb_ary_new();
+  #ifndef NO_THREAD_EVENT_HOOKS
+    state->thread_exited_hook = NULL;
+    atomic_init(&state->dead_threads_pending, false);
+  #endif
+  state->cpu_timers.interval_ns = 0;
+  state->idle_sample_coalescing_enabled = false;
+  state->wait_reason_labels_enabled = false;
+  state->wait_reason_methods_count = 0;
+  state->pending_allocation.stack = NULL;
+  state->pending_allocation.thread = Qnil;
+  state->pending_allocation.klass = Qnil;
 
   return TypedData_Wrap_Struct(klass, &thread_context_collector_typed_data, state);
 }
 
-static VALUE _native_initialize(DDTRACE_UNUSED VALUE _self, VALUE collector_instance, VALUE recorder_instance, VALUE max_frames, VALUE tracer_context_key) {
+static VALUE _native_initialize(
+  DDTRACE_UNUSED VALUE _self,
+  VALUE collector_instance,
+  VALUE recorder_instance,
+  VALUE max_frames,
+  VALUE tracer_context_key,
+  VALUE idle_sample_coalescing_enabled,
+  VALUE recursion_folding_enabled,
+  VALUE pruned_frame_prefixes,
+  VALUE wait_reason_labels_enabled
+) {
+  ENFORCE_BOOLEAN(idle_sample_coalescing_enabled);
+  ENFORCE_BOOLEAN(recursion_folding_enabled);
+  ENFORCE_TYPE(pruned_frame_prefixes, T_ARRAY);
+  ENFORCE_BOOLEAN(wait_reason_labels_enabled);
+
   struct thread_context_collector_state *state;
   TypedData_Get_Struct(collector_instance, struct thread_context_collector_state, &thread_context_collector_typed_data, state);
 
@@ -298,8 +632,20 @@ static VALUE _native_initialize(DDTRACE_UNUSED VALUE _self, VALUE collector_inst
 
   // Update this when modifying state struct
   state->sampling_buffer = sampling_buffer_new(max_frames_requested);
-  // hash_map_per_thread_context is already initialized, nothing to do here
+  sampling_buffer_configure_compaction(state->sampling_buffer, recursion_folding_enabled == Qtrue, pruned_frame_prefixes);
+  if (state->pending_allocation.stack != NULL) idle_sample_free(state->pending_allocation.stack);
+  state->pending_allocation.stack = idle_sample_new_with_capacity(max_frames_requested);
+  // per_thread_contexts is already initialized, nothing to do here
   state->recorder_instance = enforce_recorder_instance(recorder_instance);
+  recorder_set_pending_samples_flusher(state->recorder_instance, thread_context_collector_flush_pending_samples, collector_instance);
+  state->idle_sample_coalescing_enabled = (idle_sample_coalescing_enabled == Qtrue);
+  state->wait_reason_labels_enabled = (wait_reason_labels_enabled == Qtrue);
+  if (state->wait_reason_labels_enabled) resolve_wait_reason_methods(state);
+  #ifndef NO_THREAD_EVENT_HOOKS
+    if (state->thread_exited_hook == NULL) {
+      state->thread_exited_hook = rb_internal_thread_add_event_hook(on_thread_exited, RUBY_INTERNAL_THREAD_EVENT_EXITED, state);
+    }
+  #endif
 
   if (RTEST(tracer_context_key)) {
     ENFORCE_TYPE(tracer_context_key, T_SYMBOL);
@@ -365,6 +711,7 @@ void thread_context_collector_sample(VALUE self_instance, long current_monotonic
   const long thread_count = RARRAY_LEN(threads);
   for (long i = 0; i < thread_count; i++) {
     VALUE thread = RARRAY_AREF(threads, i);
+    // Note: This can move other contexts around (including current_thread_context), see per_thread_context_table
     struct per_thread_context *thread_context = get_or_create_context_for(thread, state);
 
     // We account for cpu-time for the current thread in a different way -- we use the cpu-time at sampling start, to avoid
@@ -383,9 +730,10 @@ void thread_context_collector_sample(VALUE self_instance, long current_monotonic
 
   state->sample_count++;
 
-  // TODO: This seems somewhat overkill and inefficient to do often; right now we just do it every few samples
-  // but there's probably a better way to do this if we actually track when threads finish
-  if (state->sample_count % 100 == 0) remove_context_for_dead_threads(state);
+  if (should_remove_context_for_dead_threads(state)) remove_context_for_dead_threads(state);
+
+  // The context may have been moved since we got it above
+  current_thread_context = get_or_create_context_for(current_thread, state);
 
   update_metrics_and_sample(
     state,
@@ -397,6 +745,60 @@ void thread_context_collector_sample(VALUE self_instance, long current_monotonic
   );
 }
 
+// This function gets called from the Collectors::CpuAndWallTimeWorker when the cpu-time timer for the current thread
+// fires (see "Per-thread cpu-time timers" notes above). Unlike `thread_context_collector_sample`, it only samples the
+// current thread.
+//
+// Assumption 1: This function is called in a thread that is holding the Global VM Lock. Caller is responsible for enforcing this.
+// Assumption 2: This function is allowed to raise exceptions. Caller is responsible for handling them, if needed.
+// Assumption 3: This function IS NOT called from a signal handler. This function is not async-signal-safe.
+// Assumption 4: This function is called from the main Ractor (if Ruby has support for Ractors).
+void thread_context_collector_sample_current_thread(VALUE self_instance, long current_monotonic_wall_time_ns) {
+  struct thread_context_collector_state *state;
+  TypedData_Get_Struct(self_instance, struct thread_context_collector_state, &thread_context_collector_typed_data, state);
+
+  VALUE current_thread = rb_thread_current();
+  struct per_thread_context *thread_context = get_or_create_context_for(current_thread, state);
+
+  update_metrics_and_sample(
+    state,
+    /* thread_being_sampled: */ current_thread,
+    /* stack_from_thread: */ current_thread,
+    thread_context,
+    cpu_time_now_ns(thread_context),
+    current_monotonic_wall_time_ns
+  );
+}
+
+// Starts creating cpu-time timers for all threads (see "Per-thread cpu-time timers" notes above). Each timer sends
+// `signal` to its thread, with `signal_value` as the `si_value.sival_int`, every `interval_ns` of cpu-time used.
+//
+// Assumption: This function is called in a thread that is holding the Global VM Lock. Caller is responsible for enforcing this.
+void thread_context_collector_enable_cpu_timers(VALUE self_instance, long interval_ns, int signal, int signal_value) {
+  struct thread_context_collector_state *state;
+  TypedData_Get_Struct(self_instance, struct thread_context_collector_state, &thread_context_collector_typed_data, state);
+
+  state->cpu_timers.interval_ns = interval_ns;
+  state->cpu_timers.signal = signal;
+  state->cpu_timers.signal_value = signal_value;
+
+  struct per_thread_context_table *table = &state->per_thread_contexts;
+  for (uint32_t i = 0; i < table->size; i++) start_cpu_timer(table->entries[i].thread, &table->entries[i].context, state);
+}
+
+// Deletes all cpu-time timers, and stops creating them for new threads.
+//
+// Assumption: This function is called in a thread that is holding the Global VM Lock. Caller is responsible for enforcing this.
+void thread_context_collector_disable_cpu_timers(VALUE self_instance) {
+  struct thread_context_collector_state *state;
+  TypedData_Get_Struct(self_instance, struct thread_context_collector_state, &thread_context_collector_typed_data, state);
+
+  state->cpu_timers.interval_ns = 0;
+
+  struct per_thread_context_table *table = &state->per_thread_contexts;
+  for (uint32_t i = 0; i < table->size; i++) thread_cpu_timer_delete(&table->entries[i].context.cpu_timer);
+}
+
 void update_metrics_and_sample(
   struct thread_context_collector_state *state,
   VALUE thread_being_sampled,
@@ -424,7 +826,8 @@ void update_metrics_and_sample(
     stack_from_thread,
     thread_context,
     (sample_values) {.cpu_time_ns = cpu_time_elapsed_ns, .cpu_samples = 1, .wall_time_ns = wall_time_elapsed_ns},
-    SAMPLE_REGULAR
+    SAMPLE_REGULAR,
+    NULL
   );
 }
 
@@ -566,7 +969,8 @@ VALUE thread_context_collector_sample_after_gc(VALUE self_instance) {
       /* stack_from_thread: */ thread,
       thread_context,
       (sample_values) {.cpu_time_ns = gc_cpu_time_elapsed_ns, .cpu_samples = 1, .wall_time_ns = gc_wall_time_elapsed_ns},
-      SAMPLE_IN_GC
+      SAMPLE_IN_GC,
+      NULL
     );
 
     // Mark thread as no longer in GC
@@ -596,19 +1000,24 @@ static void trigger_sample_for_thread(
   VALUE stack_from_thread, // This can be different when attributing profiler overhead using a different stack
   struct per_thread_context *thread_context,
   sample_values values,
-  sample_type type
+  sample_type type,
+  ddog_CharSlice *allocated_class // Only set for allocation samples
 ) {
   int max_label_count =
     1 + // thread id
     1 + // thread name
     1 + // profiler overhead
+    1 + // allocation class
+    1 + // wait reason
     2;  // local root span id and span id
   ddog_prof_Label labels[max_label_count];
   int label_pos = 0;
 
+  // Note: "thread id" and "thread name" must be the first labels, see flush_idle_sample
+
   labels[label_pos++] = (ddog_prof_Label) {
     .key = DDOG_CHARSLICE_C("thread id"),
-    .str = thread_context->thread_id_char_slice
+    .str = thread_id_char_slice_for(thread_context)
   };
 
   VALUE thread_name = thread_name_for(thread);
@@ -619,6 +1028,14 @@ static void trigger_sample_for_thread(
     };
   }
 
+  wait_reason reason = wait_reason_for(state, thread, values, type);
+  if (reason != WAIT_REASON_NONE) {
+    labels[label_pos++] = (ddog_prof_Label) {
+      .key = DDOG_CHARSLICE_C("wait reason"),
+      .str = wait_reason_names[reason]
+    };
+  }
+
   struct trace_identifiers trace_identifiers_result = {.valid = false, .trace_endpoint = Qnil};
   trace_identifiers_for(state, thread, &trace_identifiers_result);
 
@@ -651,6 +1068,13 @@ static void trigger_sample_for_thread(
     };
   }
 
+  if (allocated_class != NULL) {
+    labels[label_pos++] = (ddog_prof_Label) {
+      .key = DDOG_CHARSLICE_C("allocation class"),
+      .str = *allocated_class
+    };
+  }
+
   // The number of times `label_pos++` shows up in this function needs to match `max_label_count`. To avoid "oops I
   // forgot to update max_label_count" in the future, we've also added this validation.
   // @ivoanjo: I wonder if C compilers are smart enough to statically prove when this check never triggers happens and
@@ -659,8 +1083,48 @@ static void trigger_sample_for_thread(
     rb_raise(rb_eRuntimeError, "BUG: Unexpected label_pos (%d) > max_label_count (%d)", label_pos, max_label_count);
   }
 
+  if (allocated_class != NULL) {
+    // The stack was already captured when the object got allocated, see "Allocation sampling" notes above
+    idle_sample_flush(
+      state->pending_allocation.stack,
+      state->sampling_buffer,
+      state->recorder_instance,
+      (ddog_prof_Slice_Label) {.ptr = labels, .len = label_pos}
+    );
+    return;
+  }
+
+  if (thread == stack_from_thread && type == SAMPLE_REGULAR && allocated_class == NULL) {
+    // See "Coalescing idle samples" notes above
+    if (state->idle_sample_coalescing_enabled && !trace_identifiers_result.valid && is_thread_stopped(thread)) {
+      if (thread_context->idle_sample == NULL) thread_context->idle_sample = idle_sample_new();
+
+      // A different wait reason means a different stack, and thus the pending sample (if any) would be recorded by
+      // sample_idle_thread below; we record it here instead, so that it keeps its own wait reason.
+      if (reason != thread_context->idle_sample_wait_reason) flush_idle_sample(state, thread, thread_context);
+      thread_context->idle_sample_wait_reason = reason;
+
+      bool coalesced = sample_idle_thread(
+        thread,
+        thread_context->stack_walk_cache,
+        state->sampling_buffer,
+        state->recorder_instance,
+        values,
+        (ddog_prof_Slice_Label) {.ptr = labels, .len = label_pos},
+        thread_context->idle_sample
+      );
+      if (coalesced) state->stats.idle_samples_coalesced++;
+
+      return;
+    }
+
+    flush_idle_sample(state, thread, thread_context);
+  }
+
   sample_thread(
     stack_from_thread,
+    // The cache is only valid for the thread it belongs to
+    thread == stack_from_thread ? thread_context->stack_walk_cache : NULL,
     state->sampling_buffer,
     state->recorder_instance,
     values,
@@ -678,36 +1142,31 @@ static VALUE _native_thread_list(DDTRACE_UNUSED VALUE _self) {
 }
 
 static struct per_thread_context *get_or_create_context_for(VALUE thread, struct thread_context_collector_state *state) {
-  struct per_thread_context* thread_context = NULL;
-  st_data_t value_context = 0;
+  struct per_thread_context* thread_context = per_thread_context_table_lookup(&state->per_thread_contexts, thread);
 
-  if (st_lookup(state->hash_map_per_thread_context, (st_data_t) thread, &value_context)) {
-    thread_context = (struct per_thread_context*) value_context;
-  } else {
-    thread_context = ruby_xcalloc(1, sizeof(struct per_thread_context));
+  if (thread_context == NULL) {
+    thread_context = per_thread_context_table_add(&state->per_thread_contexts, thread);
     initialize_context(thread, thread_context);
-    st_insert(state->hash_map_per_thread_context, (st_data_t) thread, (st_data_t) thread_context);
+    if (state->cpu_timers.interval_ns > 0) start_cpu_timer(thread, thread_context, state);
   }
 
   return thread_context;
 }
 
 static struct per_thread_context *get_context_for(VALUE thread, struct thread_context_collector_state *state) {
-  struct per_thread_context* thread_context = NULL;
-  st_data_t value_context = 0;
-
-  if (st_lookup(state->hash_map_per_thread_context, (st_data_t) thread, &value_context)) {
-    thread_context = (struct per_thread_context*) value_context;
-  }
-
-  return thread_context;
+  return per_thread_context_table_lookup(&state->per_thread_contexts, thread);
 }
 
 static void initialize_context(VALUE thread, struct per_thread_context *thread_context) {
   snprintf(thread_context->thread_id, THREAD_ID_LIMIT_CHARS, "%"PRIu64" (%lu)", native_thread_id_for(thread), (unsigned long) thread_id_for(thread));
-  thread_context->thread_id_char_slice = (ddog_CharSlice) {.ptr = thread_context->thread_id, .len = strlen(thread_context->thread_id)};
+  thread_context->thread_id_length = strlen(thread_context->thread_id);
 
   thread_context->thread_cpu_time_id = thread_cpu_time_id_for(thread);
+  thread_context->cpu_timer = (thread_cpu_timer) {.valid = false};
+
+  thread_context->stack_walk_cache = stack_walk_cache_new();
+  thread_context->idle_sample = NULL;
+  thread_context->idle_sample_wait_reason = WAIT_REASON_NONE;
 
   // These will get initialized during actual sampling
   thread_context->cpu_time_at_previous_sample_ns = INVALID_TIME;
@@ -720,6 +1179,65 @@ static void initialize_context(VALUE thread, struct per_thread_context *thread_c
   thread_context->gc_tracking.wall_time_at_finish_ns = INVALID_TIME;
 }
 
+// The returned slice is only valid until the context gets moved, e.g. until contexts get added to or removed from the
+// per_thread_contexts table
+static ddog_CharSlice thread_id_char_slice_for(struct per_thread_context *thread_context) {
+  return (ddog_CharSlice) {.ptr = thread_context->thread_id, .len = thread_context->thread_id_length};
+}
+
+// Note: The context itself is stored inline in the per_thread_contexts table, so only what it points to gets freed
+static void free_context(struct per_thread_context* thread_context) {
+  stack_walk_cache_free(thread_context->stack_walk_cache);
+  thread_cpu_timer_delete(&thread_context->cpu_timer);
+  if (thread_context->idle_sample != NULL) idle_sample_free(thread_context->idle_sample);
+}
+
+// Records the pending idle sample for the thread, if any. See "Coalescing idle samples" notes above.
+static void flush_idle_sample(struct thread_context_collector_state *state, VALUE thread, struct per_thread_context *thread_context) {
+  if (thread_context->idle_sample == NULL) return;
+
+  ddog_prof_Label labels[3];
+  int label_pos = 0;
+
+  labels[label_pos++] = (ddog_prof_Label) {.key = DDOG_CHARSLICE_C("thread id"), .str = thread_id_char_slice_for(thread_context)};
+
+  VALUE thread_name = thread_name_for(thread);
+  if (thread_name != Qnil) {
+    labels[label_pos++] = (ddog_prof_Label) {.key = DDOG_CHARSLICE_C("thread name"), .str = char_slice_from_ruby_string(thread_name)};
+  }
+
+  if (thread_context->idle_sample_wait_reason != WAIT_REASON_NONE) {
+    labels[label_pos++] = (ddog_prof_Label) {
+      .key = DDOG_CHARSLICE_C("wait reason"),
+      .str = wait_reason_names[thread_context->idle_sample_wait_reason]
+    };
+  }
+
+  idle_sample_flush(
+    thread_context->idle_sample,
+    state->sampling_buffer,
+    state->recorder_instance,
+    (ddog_prof_Slice_Label) {.ptr = labels, .len = label_pos}
+  );
+}
+
+static void start_cpu_timer(VALUE thread, struct per_thread_context *thread_context, struct thread_context_collector_state *state) {
+  if (thread_context->cpu_timer.valid) return;
+
+  thread_context->cpu_timer = thread_cpu_timer_create(
+    thread_context->thread_cpu_time_id,
+    native_thread_id_for(thread),
+    state->cpu_timers.signal,
+    state->cpu_timers.signal_value,
+    state->cpu_timers.interval_ns
+  );
+
+  if (!thread_context->cpu_timer.valid) {
+    state->stats.cpu_timer_failures++;
+    if (thread_context->cpu_timer.error != 0) state->stats.cpu_timer_last_error = thread_context->cpu_timer.error;
+  }
+}
+
 static VALUE _native_inspect(DDTRACE_UNUSED VALUE _self, VALUE collector_instance) {
   struct thread_context_collector_state *state;
   TypedData_Get_Struct(collector_instance, struct thread_context_collector_state, &thread_context_collector_typed_data, state);
@@ -727,28 +1245,29 @@ static VALUE _native_inspect(DDTRACE_UNUSED VALUE _self, VALUE collector_instanc
   VALUE result = rb_str_new2(" (native state)");
 
   // Update this when modifying state struct
-  rb_str_concat(result, rb_sprintf(" hash_map_per_thread_context=%"PRIsVALUE, per_thread_context_st_table_as_ruby_hash(state)));
+  rb_str_concat(result, rb_sprintf(" per_thread_contexts=%"PRIsVALUE, per_thread_context_table_as_ruby_hash(state)));
   rb_str_concat(result, rb_sprintf(" recorder_instance=%"PRIsVALUE, state->recorder_instance));
   VALUE tracer_context_key = state->tracer_context_key == MISSING_TRACER_CONTEXT_KEY ? Qnil : ID2SYM(state->tracer_context_key);
   rb_str_concat(result, rb_sprintf(" tracer_context_key=%+"PRIsVALUE, tracer_context_key));
   rb_str_concat(result, rb_sprintf(" sample_count=%u", state->sample_count));
+  rb_str_concat(result, rb_sprintf(" idle_sample_coalescing_enabled=%s", state->idle_sample_coalescing_enabled ? "true" : "false"));
+  rb_str_concat(result, rb_sprintf(" wait_reason_labels_enabled=%s", state->wait_reason_labels_enabled ? "true" : "false"));
   rb_str_concat(result, rb_sprintf(" stats=%"PRIsVALUE, stats_as_ruby_hash(state)));
 
   return result;
 }
 
-static VALUE per_thread_context_st_table_as_ruby_hash(struct thread_context_collector_state *state) {
+static VALUE per_thread_context_table_as_ruby_hash(struct thread_context_collector_state *state) {
   VALUE result = rb_hash_new();
-  st_foreach(state->hash_map_per_thread_context, per_thread_context_as_ruby_hash, result);
+  for (uint32_t i = 0; i < state->per_thread_contexts.size; i++) {
+    struct per_thread_context_entry *entry = &state->per_thread_contexts.entries[i];
+    rb_hash_aset(result, entry->thread, per_thread_context_as_ruby_hash(&entry->context));
+  }
   return result;
 }
 
-static int per_thread_context_as_ruby_hash(st_data_t key_thread, st_data_t value_context, st_data_t result_hash) {
-  VALUE thread = (VALUE) key_thread;
-  struct per_thread_context *thread_context = (struct per_thread_context*) value_context;
-  VALUE result = (VALUE) result_hash;
+static VALUE per_thread_context_as_ruby_hash(struct per_thread_context *thread_context) {
   VALUE context_as_hash = rb_hash_new();
-  rb_hash_aset(result, thread, context_as_hash);
 
   VALUE arguments[] = {
     ID2SYM(rb_intern("thread_id")),                       /* => */ rb_str_new2(thread_context->thread_id),
@@ -764,32 +1283,67 @@ static int per_thread_context_as_ruby_hash(st_data_t key_thread, st_data_t value
   };
   for (long unsigned int i = 0; i < VALUE_COUNT(arguments); i += 2) rb_hash_aset(context_as_hash, arguments[i], arguments[i+1]);
 
-  return ST_CONTINUE;
+  return context_as_hash;
 }
 
 static VALUE stats_as_ruby_hash(struct thread_context_collector_state *state) {
   // Update this when modifying state struct (stats inner struct)
   VALUE stats_as_hash = rb_hash_new();
+  frame_cache_stats cache_stats =
+    state->sampling_buffer != NULL ? sampling_buffer_frame_cache_stats(state->sampling_buffer) : (frame_cache_stats) {};
+  VALUE cpu_timer_last_error =
+    state->stats.cpu_timer_last_error != 0 ? rb_str_new_cstr(strerror(state->stats.cpu_timer_last_error)) : Qnil;
   VALUE arguments[] = {
     ID2SYM(rb_intern("gc_samples")),                               /* => */ UINT2NUM(state->stats.gc_samples),
     ID2SYM(rb_intern("gc_samples_missed_due_to_missing_context")), /* => */ UINT2NUM(state->stats.gc_samples_missed_due_to_missing_context),
+    ID2SYM(rb_intern("frame_cache_hits")),                         /* => */ ULONG2NUM(cache_stats.hits),
+    ID2SYM(rb_intern("frame_cache_misses")),                       /* => */ ULONG2NUM(cache_stats.misses),
+    ID2SYM(rb_intern("cpu_timer_failures")),                       /* => */ UINT2NUM(state->stats.cpu_timer_failures),
+    ID2SYM(rb_intern("cpu_timer_last_error")),                     /* => */ cpu_timer_last_error,
+    ID2SYM(rb_intern("idle_samples_coalesced")),                   /* => */ UINT2NUM(state->stats.idle_samples_coalesced),
   };
   for (long unsigned int i = 0; i < VALUE_COUNT(arguments); i += 2) rb_hash_aset(stats_as_hash, arguments[i], arguments[i+1]);
   return stats_as_hash;
 }
 
-static void remove_context_for_dead_threads(struct thread_context_collector_state *state) {
-  st_foreach(state->hash_map_per_thread_context, remove_if_dead_thread, 0 /* unused */);
+// See "Cleaning up contexts for dead threads" notes above
+static bool should_remove_context_for_dead_threads(struct thread_context_collector_state *state) {
+  #ifndef NO_THREAD_EVENT_HOOKS
+    return atomic_exchange(&state->dead_threads_pending, false);
+  #else
+    return state->sample_count % 100 == 0;
+  #endif
 }
 
-static int remove_if_dead_thread(st_data_t key_thread, st_data_t value_context, DDTRACE_UNUSED st_data_t _argument) {
-  VALUE thread = (VALUE) key_thread;
-  struct per_thread_context* thread_context = (struct per_thread_context*) value_context;
+#ifndef NO_THREAD_EVENT_HOOKS
+  // Safety: This gets called without the GVL, and thus MUST NOT use any Ruby APIs nor touch the per_thread_contexts.
+  static void on_thread_exited(
+    DDTRACE_UNUSED rb_event_flag_t _event,
+    DDTRACE_UNUSED const rb_internal_thread_event_data_t *_event_data,
+    void *state_ptr
+  ) {
+    struct thread_context_collector_state *state = (struct thread_context_collector_state *) state_ptr;
+    atomic_store(&state->dead_threads_pending, true);
+  }
+#endif
+
+static void remove_context_for_dead_threads(struct thread_context_collector_state *state) {
+  struct per_thread_context_table *table = &state->per_thread_contexts;
 
-  if (is_thread_alive(thread)) return ST_CONTINUE;
+  uint32_t i = 0;
+  while (i < table->size) {
+    struct per_thread_context_entry *entry = &table->entries[i];
 
-  ruby_xfree(thread_context);
-  return ST_DELETE;
+    if (is_thread_alive(entry->thread)) {
+      i++;
+    } else {
+      // Make sure the time the thread spent idle before dying is not lost
+      flush_idle_sample(state, entry->thread, &entry->context);
+      free_context(&entry->context);
+      // Moves the last entry into position i, so we don't advance i
+      per_thread_context_table_remove_at(table, i);
+    }
+  }
 }
 
 // This method exists only to enable testing Datadog::Profiling::Collectors::ThreadContext behavior using RSpec.
@@ -800,7 +1354,68 @@ static VALUE _native_per_thread_context(DDTRACE_UNUSED VALUE _self, VALUE collec
   struct thread_context_collector_state *state;
   TypedData_Get_Struct(collector_instance, struct thread_context_collector_state, &thread_context_collector_typed_data, state);
 
-  return per_thread_context_st_table_as_ruby_hash(state);
+  return per_thread_context_table_as_ruby_hash(state);
+}
+
+// This method exists only to enable comparing the per_thread_contexts table against the st_table that was used before
+// it in benchmarks/profiler_sample_many_threads.rb. It SHOULD NOT be used for other purposes.
+//
+// Looks up the context for each of the `threads`, `rounds` times. When `use_st_table` is true, the lookups instead go
+// through an st_table <Thread Object, separately-allocated copy of the context>, like the older implementation did.
+// The st_table gets built (and freed) in every call, so `rounds` should be big enough for the lookups to dominate.
+static VALUE _native_benchmark_context_lookups(
+  DDTRACE_UNUSED VALUE _self,
+  VALUE collector_instance,
+  VALUE threads,
+  VALUE use_st_table,
+  VALUE rounds
+) {
+  ENFORCE_TYPE(threads, T_ARRAY);
+  ENFORCE_BOOLEAN(use_st_table);
+
+  struct thread_context_collector_state *state;
+  TypedData_Get_Struct(collector_instance, struct thread_context_collector_state, &thread_context_collector_typed_data, state);
+
+  long thread_count = RARRAY_LEN(threads);
+  int round_count = NUM2INT(rounds);
+  for (long i = 0; i < thread_count; i++) get_or_create_context_for(RARRAY_AREF(threads, i), state);
+
+  st_table *baseline = NULL;
+  if (use_st_table == Qtrue) {
+    baseline = st_init_numtable();
+    for (long i = 0; i < thread_count; i++) {
+      VALUE thread = RARRAY_AREF(threads, i);
+      struct per_thread_context *copy = ruby_xmalloc(sizeof(struct per_thread_context));
+      *copy = *get_context_for(thread, state);
+      st_insert(baseline, (st_data_t) thread, (st_data_t) copy);
+    }
+  }
+
+  // Summing a field from each context makes sure the lookups can't be optimized away
+  long result = 0;
+  for (int round = 0; round < round_count; round++) {
+    for (long i = 0; i < thread_count; i++) {
+      VALUE thread = RARRAY_AREF(threads, i);
+      struct per_thread_context *thread_context = NULL;
+      if (baseline != NULL) {
+        st_data_t value = 0;
+        if (st_lookup(baseline, (st_data_t) thread, &value)) thread_context = (struct per_thread_context *) value;
+      } else {
+        thread_context = get_context_for(thread, state);
+      }
+      if (thread_context != NULL) result += thread_context->wall_time_at_previous_sample_ns;
+    }
+  }
+
+  if (baseline != NULL) {
+    for (long i = 0; i < thread_count; i++) {
+      st_data_t key = (st_data_t) RARRAY_AREF(threads, i), value = 0;
+      if (st_delete(baseline, &key, &value)) ruby_xfree((void *) value);
+    }
+    st_free_table(baseline);
+  }
+
+  return LONG2NUM(result);
 }
 
 static long update_time_since_previous_sample(long *time_at_previous_sample_ns, long current_time_ns, long gc_start_time_ns, bool is_wall_time) {
@@ -899,6 +1514,18 @@ static void trace_identifiers_for(struct thread_context_collector_state *state,
   VALUE active_trace = rb_ivar_get(current_context, at_active_trace_id /* @active_trace */);
   if (active_trace == Qnil) return;
 
+  VALUE slot_instance = rb_ivar_get(active_trace, at_profiling_slot_id /* @profiling_slot */);
+  if (slot_instance != Qnil && rb_typeddata_is_kind_of(slot_instance, &trace_identifiers_slot_typed_data)) {
+    struct trace_identifiers_slot *slot = RTYPEDDATA_DATA(slot_instance);
+    if (!slot->valid) return;
+
+    trace_identifiers_result->local_root_span_id = slot->local_root_span_id;
+    trace_identifiers_result->span_id = slot->span_id;
+    trace_identifiers_result->trace_endpoint = slot->trace_endpoint;
+    trace_identifiers_result->valid = true;
+    return;
+  }
+
   VALUE root_span = rb_ivar_get(active_trace, at_root_span_id /* @root_span */);
   VALUE active_span = rb_ivar_get(active_trace, at_active_span_id /* @active_span */);
   if (root_span == Qnil || active_span == Qnil) return;
@@ -915,13 +1542,18 @@ static void trace_identifiers_for(struct thread_context_collector_state *state,
   VALUE root_span_type = rb_ivar_get(root_span, at_type_id /* @type */);
   if (root_span_type == Qnil || !is_type_web(root_span_type)) return;
 
-  VALUE trace_resource = rb_ivar_get(active_trace, at_resource_id /* @resource */);
+  trace_identifiers_result->trace_endpoint = trace_endpoint_for(active_trace, root_span);
+}
+
+static VALUE trace_endpoint_for(VALUE trace_operation, VALUE root_span) {
+  VALUE trace_resource = rb_ivar_get(trace_operation, at_resource_id /* @resource */);
   if (RB_TYPE_P(trace_resource, T_STRING)) {
-    trace_identifiers_result->trace_endpoint = trace_resource;
+    return trace_resource;
   } else if (trace_resource == Qnil) {
     // Fall back to resource from span, if any
-    trace_identifiers_result->trace_endpoint = rb_ivar_get(root_span, at_resource_id /* @resource */);
+    return rb_ivar_get(root_span, at_resource_id /* @resource */);
   }
+  return Qnil;
 }
 
 static bool is_type_web(VALUE root_span_type) {
@@ -931,6 +1563,59 @@ static bool is_type_web(VALUE root_span_type) {
     (memcmp("web", StringValuePtr(root_span_type), strlen("web")) == 0);
 }
 
+static void trace_identifiers_slot_typed_data_mark(void *slot_ptr) {
+  struct trace_identifiers_slot *slot = (struct trace_identifiers_slot *) slot_ptr;
+
+  rb_gc_mark(slot->trace_endpoint);
+  rb_gc_mark(slot->trace_operation);
+}
+
+static VALUE _native_slot_new(VALUE klass) {
+  struct trace_identifiers_slot *slot = ruby_xcalloc(1, sizeof(struct trace_identifiers_slot));
+
+  slot->valid = false;
+  slot->trace_endpoint = Qnil;
+  slot->trace_operation = Qnil;
+
+  return TypedData_Wrap_Struct(klass, &trace_identifiers_slot_typed_data, slot);
+}
+
+static VALUE _native_slot_initialize(DDTRACE_UNUSED VALUE _self, VALUE slot_instance, VALUE trace_operation) {
+  struct trace_identifiers_slot *slot;
+  TypedData_Get_Struct(slot_instance, struct trace_identifiers_slot, &trace_identifiers_slot_typed_data, slot);
+
+  slot->trace_operation = trace_operation;
+
+  return Qtrue;
+}
+
+// Called by the TraceOperation whenever its active span or its resource changes. Any of the arguments can be nil, in
+// which case there are no trace identifiers to report until the next call.
+static VALUE _native_slot_publish(DDTRACE_UNUSED VALUE _self, VALUE slot_instance, VALUE root_span, VALUE active_span) {
+  struct trace_identifiers_slot *slot;
+  TypedData_Get_Struct(slot_instance, struct trace_identifiers_slot, &trace_identifiers_slot_typed_data, slot);
+
+  slot->valid = false;
+  slot->trace_endpoint = Qnil;
+
+  if (root_span == Qnil || active_span == Qnil) return Qnil;
+
+  VALUE numeric_local_root_span_id = rb_ivar_get(root_span, at_id_id /* @id */);
+  VALUE numeric_span_id = rb_ivar_get(active_span, at_id_id /* @id */);
+  if (numeric_local_root_span_id == Qnil || numeric_span_id == Qnil) return Qnil;
+
+  slot->local_root_span_id = NUM2ULL(numeric_local_root_span_id);
+  slot->span_id = NUM2ULL(numeric_span_id);
+  slot->valid = true;
+
+  VALUE root_span_type = rb_ivar_get(root_span, at_type_id /* @type */);
+  if (RB_TYPE_P(root_span_type, T_STRING) && is_type_web(root_span_type)) {
+    slot->trace_endpoint = trace_endpoint_for(slot->trace_operation, root_span);
+  }
+
+  return Qtrue;
+}
+
 // After the Ruby VM forks, this method gets called in the child process to clean up any leftover state from the parent.
 //
 // Assumption: This method gets called BEFORE restarting profiling -- e.g. there are no components attempting to
@@ -939,10 +1624,21 @@ static VALUE _native_reset_after_fork(DDTRACE_UNUSED VALUE self, VALUE collector
   struct thread_context_collector_state *state;
   TypedData_Get_Struct(collector_instance, struct thread_context_collector_state, &thread_context_collector_typed_data, state);
 
-  st_clear(state->hash_map_per_thread_context);
+  // Timers are not inherited by the child process, so we must not try to delete the ones that belonged to the parent
+  for (uint32_t i = 0; i < state->per_thread_contexts.size; i++) {
+    state->per_thread_contexts.entries[i].context.cpu_timer.valid = false;
+  }
+  state->cpu_timers.interval_ns = 0;
+
+  per_thread_context_table_clear(&state->per_thread_contexts);
 
   state->stats = (struct stats) {}; // Resets all stats back to zero
 
+  if (state->sampling_buffer != NULL) {
+    sampling_buffer_clear_frame_cache(state->sampling_buffer);
+    sampling_buffer_reset_frame_cache_stats(state->sampling_buffer);
+  }
+
   rb_funcall(state->recorder_instance, rb_intern("reset_after_fork"), 0);
 
   return Qtrue;
@@ -955,7 +1651,171 @@ static VALUE thread_list(struct thread_context_collector_state *state) {
   return result;
 }
 
-void thread_context_collector_sample_allocation(VALUE self_instance, unsigned int sample_weight) {
+// See "Wait reason labels" notes above
+static void resolve_wait_reason_methods(struct thread_context_collector_state *state) {
+  state->wait_reason_methods_count = 0;
+
+  for (unsigned int i = 0; i < WAIT_REASON_METHODS_COUNT; i++) {
+    ID owner_id = rb_intern(wait_reason_methods[i].owner);
+    if (!rb_const_defined(rb_cObject, owner_id)) continue;
+
+    VALUE owner = rb_const_get(rb_cObject, owner_id);
+    if (!RB_TYPE_P(owner, T_CLASS) && !RB_TYPE_P(owner, T_MODULE)) continue;
+    if (wait_reason_methods[i].singleton) owner = rb_singleton_class(owner);
+
+    state->wait_reason_methods[state->wait_reason_methods_count++] = (struct wait_reason_method) {
+      .owner = owner,
+      .method_id = rb_intern(wait_reason_methods[i].method),
+      .reason = wait_reason_methods[i].reason,
+    };
+  }
+}
+
+// See "Wait reason labels" notes above
+static wait_reason wait_reason_for(struct thread_context_collector_state *state, VALUE thread, sample_values values, sample_type type) {
+  if (!state->wait_reason_labels_enabled) return WAIT_REASON_NONE;
+  if (type == SAMPLE_IN_GC) return WAIT_REASON_GC;
+  if (values.alloc_samples > 0) return WAIT_REASON_NONE; // Not a wall-time sample
+  if (values.gvl_wait_ns > 0) return WAIT_REASON_GVL;
+
+  // Samples are always taken by the thread holding the GVL, so any other thread that is not blocked is waiting for it
+  if (thread == rb_thread_current()) return WAIT_REASON_RUNNING;
+  if (!is_thread_stopped(thread)) return WAIT_REASON_GVL;
+
+  VALUE owner;
+  ID method_id;
+  if (!top_method_for(thread, &owner, &method_id)) return WAIT_REASON_OTHER;
+
+  for (unsigned int i = 0; i < state->wait_reason_methods_count; i++) {
+    if (state->wait_reason_methods[i].method_id == method_id && state->wait_reason_methods[i].owner == owner) {
+      return state->wait_reason_methods[i].reason;
+    }
+  }
+
+  if (RB_TYPE_P(owner, T_CLASS) && RTEST(rb_class_inherited_p(owner, rb_cIO))) return WAIT_REASON_IO;
+
+  return WAIT_REASON_OTHER;
+}
+
+// Captures an allocation sample for the current thread, to be recorded later by thread_context_collector_sample_allocation.
+// The `sample_weight` is the number of allocations this sample represents (e.g. when only 1 in every N allocations
+// gets sampled, it should be ~N).
+//
+// Returns false if no sample was captured, e.g. because the previous one is still waiting to be recorded.
+//
+// Safety: This function gets called from the `RUBY_INTERNAL_EVENT_NEWOBJ` tracepoint, while the `new_object` is still
+// being initialized, so it must not allocate or raise. See "Allocation sampling" notes above.
+bool thread_context_collector_prepare_allocation_sample(VALUE self_instance, unsigned int sample_weight, VALUE new_object) {
+  struct thread_context_collector_state *state;
+  TypedData_Get_Struct(self_instance, struct thread_context_collector_state, &thread_context_collector_typed_data, state);
+
+  if (state->pending_allocation.stack == NULL) return false; // Not initialized yet
+
+  VALUE current_thread = rb_thread_current();
+  sample_values values = {.alloc_samples = sample_weight};
+
+  if (!idle_sample_capture(current_thread, state->pending_allocation.stack, values)) return false;
+
+  state->pending_allocation.thread = current_thread;
+  // The class of the new object is set by the VM before the tracepoint gets called
+  state->pending_allocation.klass = RBASIC_CLASS(new_object);
+  state->pending_allocation.weight = sample_weight;
+
+  // If heap profiling is enabled, the recorder starts tracking the object here, and associates it with the stack
+  // recorded later by thread_context_collector_sample_allocation
+  track_object(state->recorder_instance, new_object, sample_weight);
+
+  return true;
+}
+
+// Records the allocation sample captured by thread_context_collector_prepare_allocation_sample, if there's one pending.
+//
+// Assumption 1: This function is called in a thread that is holding the Global VM Lock. Caller is responsible for enforcing this.
+// Assumption 2: This function is allowed to raise exceptions. Caller is responsible for handling them, if needed.
+void thread_context_collector_sample_allocation(VALUE self_instance) {
+  struct thread_context_collector_state *state;
+  TypedData_Get_Struct(self_instance, struct thread_context_collector_state, &thread_context_collector_typed_data, state);
+
+  if (state->pending_allocation.stack == NULL || !idle_sample_pending(state->pending_allocation.stack)) return;
+
+  // Note: This may not be the current thread, as postponed jobs can run on a different thread than the one that
+  // registered them
+  VALUE thread = state->pending_allocation.thread;
+  VALUE class_name = Qnil;
+  ddog_CharSlice allocated_class = allocated_class_for(state->pending_allocation.klass, &class_name);
+
+  // These are only kept alive while the sample is pending; the locals above keep them alive until we're done
+  state->pending_allocation.thread = Qnil;
+  state->pending_allocation.klass = Qnil;
+
+  trigger_sample_for_thread(
+    state,
+    /* thread: */  thread,
+    /* stack_from_thread: */ thread,
+    get_or_create_context_for(thread, state),
+    (sample_values) {.alloc_samples = state->pending_allocation.weight},
+    SAMPLE_REGULAR,
+    &allocated_class
+  );
+
+  RB_GC_GUARD(thread);
+  RB_GC_GUARD(class_name);
+}
+
+// Records the samples that are waiting to be recorded: the allocation sample (if any, see
+// thread_context_collector_sample_allocation) and every thread's pending idle sample (see "Coalescing idle samples"
+// notes above).
+//
+// Assumption 1: This function is called in a thread that is holding the Global VM Lock. Caller is responsible for enforcing this.
+// Assumption 2: This function is allowed to raise exceptions. Caller is responsible for handling them, if needed.
+VALUE thread_context_collector_flush_pending_samples(VALUE self_instance) {
+  struct thread_context_collector_state *state;
+  TypedData_Get_Struct(self_instance, struct thread_context_collector_state, &thread_context_collector_typed_data, state);
+
+  thread_context_collector_sample_allocation(self_instance);
+
+  struct per_thread_context_table *table = &state->per_thread_contexts;
+  for (uint32_t i = 0; i < table->size; i++) {
+    struct per_thread_context_entry *entry = &table->entries[i];
+    flush_idle_sample(state, entry->thread, &entry->context);
+  }
+
+  // Return a dummy VALUE because we're called from rb_protect which requires it
+  return Qnil;
+}
+
+static ddog_CharSlice allocated_class_for(VALUE klass, VALUE *class_name) {
+  // Objects that are internal to the VM (e.g. T_IMEMO) don't have a class
+  if (klass == 0) return DDOG_CHARSLICE_C("(VM Internal)");
+
+  // Returns nil for anonymous classes
+  *class_name = rb_class_path_cached(rb_class_real(klass));
+  return *class_name != Qnil ? char_slice_from_ruby_string(*class_name) : DDOG_CHARSLICE_C("(Anonymous)");
+}
+
+// Returns NULL unless heap samples are enabled in the recorder. See recorder_heap_recorder for details.
+heap_recorder *thread_context_collector_heap_recorder(VALUE self_instance) {
+  struct thread_context_collector_state *state;
+  TypedData_Get_Struct(self_instance, struct thread_context_collector_state, &thread_context_collector_typed_data, state);
+
+  return recorder_heap_recorder(state->recorder_instance);
+}
+
+// This method exists only to enable testing Datadog::Profiling::Collectors::ThreadContext behavior using RSpec.
+// It SHOULD NOT be used for other purposes.
+static VALUE _native_sample_allocation(DDTRACE_UNUSED VALUE self, VALUE collector_instance, VALUE sample_weight, VALUE new_object) {
+  bool captured = thread_context_collector_prepare_allocation_sample(collector_instance, NUM2UINT(sample_weight), new_object);
+  thread_context_collector_sample_allocation(collector_instance);
+  return captured ? Qtrue : Qfalse;
+}
+
+// Records time the current thread spent waiting to acquire the Global VM Lock. The wait gets attributed to the stack
+// the thread has right after it resumed execution; the wall-time/cpu-time for this period will be accounted for by
+// the regular samples as usual.
+//
+// Assumption 1: This function is called in a thread that is holding the Global VM Lock. Caller is responsible for enforcing this.
+// Assumption 2: This function is allowed to raise exceptions. Caller is responsible for handling them, if needed.
+void thread_context_collector_sample_gvl_wait(VALUE self_instance, long gvl_wait_ns) {
   struct thread_context_collector_state *state;
   TypedData_Get_Struct(self_instance, struct thread_context_collector_state, &thread_context_collector_typed_data, state);
 
@@ -966,14 +1826,130 @@ void thread_context_collector_sample_allocation(VALUE self_instance, unsigned in
     /* thread: */  current_thread,
     /* stack_from_thread: */ current_thread,
     get_or_create_context_for(current_thread, state),
-    (sample_values) {.alloc_samples = sample_weight},
-    SAMPLE_REGULAR
+    (sample_values) {.gvl_wait_ns = gvl_wait_ns},
+    SAMPLE_REGULAR,
+    NULL
   );
 }
 
 // This method exists only to enable testing Datadog::Profiling::Collectors::ThreadContext behavior using RSpec.
 // It SHOULD NOT be used for other purposes.
-static VALUE _native_sample_allocation(DDTRACE_UNUSED VALUE self, VALUE collector_instance, VALUE sample_weight) {
-  thread_context_collector_sample_allocation(collector_instance, NUM2UINT(sample_weight));
+static VALUE _native_sample_gvl_wait(DDTRACE_UNUSED VALUE self, VALUE collector_instance, VALUE gvl_wait_ns) {
+  thread_context_collector_sample_gvl_wait(collector_instance, NUM2LONG(gvl_wait_ns));
   return Qtrue;
-}
\ No newline at end of file
+}
+static void per_thread_context_table_init(struct per_thread_context_table *table, uint32_t capacity) {
+  uint32_t slot_count = 1;
+  while (slot_count < capacity * 2) slot_count *= 2;
+
+  *table = (struct per_thread_context_table) {
+    .entries = ruby_xcalloc(capacity, sizeof(struct per_thread_context_entry)),
+    .size = 0,
+    .capacity = capacity,
+    .slots = ruby_xmalloc2(slot_count, sizeof(int32_t)),
+    .slots_mask = slot_count - 1,
+  };
+  for (uint32_t i = 0; i < slot_count; i++) table->slots[i] = EMPTY_SLOT;
+}
+
+// Frees the contexts as well as the table itself
+static void per_thread_context_table_free(struct per_thread_context_table *table) {
+  for (uint32_t i = 0; i < table->size; i++) free_context(&table->entries[i].context);
+  ruby_xfree(table->entries);
+  ruby_xfree(table->slots);
+}
+
+// Frees the contexts, but keeps the memory for the table around
+static void per_thread_context_table_clear(struct per_thread_context_table *table) {
+  for (uint32_t i = 0; i < table->size; i++) free_context(&table->entries[i].context);
+  table->size = 0;
+  for (uint32_t i = 0; i <= table->slots_mask; i++) table->slots[i] = EMPTY_SLOT;
+}
+
+// Grows the table, if needed, so that it can fit at least `needed_capacity` contexts
+static void per_thread_context_table_reserve(struct per_thread_context_table *table, uint32_t needed_capacity) {
+  if (needed_capacity <= table->capacity) return;
+
+  uint32_t new_capacity = table->capacity;
+  while (new_capacity < needed_capacity) new_capacity *= 2;
+
+  struct per_thread_context_table new_table;
+  per_thread_context_table_init(&new_table, new_capacity);
+
+  // The contexts keep the same positions, only their slots need to be recomputed
+  memcpy(new_table.entries, table->entries, table->size * sizeof(struct per_thread_context_entry));
+  new_table.size = table->size;
+  for (uint32_t i = 0; i < new_table.size; i++) {
+    new_table.slots[per_thread_context_table_find_slot(&new_table, new_table.entries[i].thread)] = i;
+  }
+
+  ruby_xfree(table->entries);
+  ruby_xfree(table->slots);
+  *table = new_table;
+}
+
+static struct per_thread_context *per_thread_context_table_lookup(struct per_thread_context_table *table, VALUE thread) {
+  int32_t position = table->slots[per_thread_context_table_find_slot(table, thread)];
+  return position == EMPTY_SLOT ? NULL : &table->entries[position].context;
+}
+
+// Assumption: thread is not in the table yet. Returns a zeroed context for the caller to initialize.
+static struct per_thread_context *per_thread_context_table_add(struct per_thread_context_table *table, VALUE thread) {
+  per_thread_context_table_reserve(table, table->size + 1);
+
+  uint32_t position = table->size++;
+  table->entries[position] = (struct per_thread_context_entry) {.thread = thread};
+  table->slots[per_thread_context_table_find_slot(table, thread)] = position;
+
+  return &table->entries[position].context;
+}
+
+// Caller is responsible for freeing the context at `position` before removing it
+static void per_thread_context_table_remove_at(struct per_thread_context_table *table, uint32_t position) {
+  uint32_t empty_slot = per_thread_context_table_find_slot(table, table->entries[position].thread);
+  table->slots[empty_slot] = EMPTY_SLOT;
+
+  // Because we use linear probing without tombstones, entries after the removed one that probed past it need to be
+  // moved back, otherwise lookups for them would stop at the now-empty slot
+  // (See https://en.wikipedia.org/wiki/Linear_probing#Deletion).
+  uint32_t slot = empty_slot;
+  while (true) {
+    slot = (slot + 1) & table->slots_mask;
+    if (table->slots[slot] == EMPTY_SLOT) break;
+
+    uint32_t home_slot = per_thread_context_table_home_slot(table, table->entries[table->slots[slot]].thread);
+    // Can the entry at `slot` be moved to `empty_slot`? Only if its home slot is not in the cyclic range (empty_slot, slot]
+    bool home_between_empty_and_current =
+      empty_slot <= slot ? (empty_slot < home_slot && home_slot <= slot) : (empty_slot < home_slot || home_slot <= slot);
+    if (home_between_empty_and_current) continue;
+
+    table->slots[empty_slot] = table->slots[slot];
+    table->slots[slot] = EMPTY_SLOT;
+    empty_slot = slot;
+  }
+
+  // Keep entries contiguous by moving the last entry into the removed position
+  uint32_t last_position = table->size - 1;
+  if (position != last_position) {
+    table->entries[position] = table->entries[last_position];
+    table->slots[per_thread_context_table_find_slot(table, table->entries[position].thread)] = position;
+  }
+  table->size--;
+}
+
+// Returns the slot where thread is, or the empty slot where it should be inserted
+static uint32_t per_thread_context_table_find_slot(struct per_thread_context_table *table, VALUE thread) {
+  uint32_t slot = per_thread_context_table_home_slot(table, thread);
+
+  // There's always at least one empty slot (see per_thread_context_table_reserve), so this loop will always stop
+  while (table->slots[slot] != EMPTY_SLOT && table->entries[table->slots[slot]].thread != thread) {
+    slot = (slot + 1) & table->slots_mask;
+  }
+
+  return slot;
+}
+
+static uint32_t per_thread_context_table_home_slot(struct per_thread_context_table *table, VALUE thread) {
+  uint64_t hash = ((uint64_t) thread) * 11400714819323198485ULL;
+  return (uint32_t) (hash >> 32) & table->slots_mask;
+}
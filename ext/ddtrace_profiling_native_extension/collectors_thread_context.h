@@ -1,14 +1,22 @@
 #pragma once
 
 #include <ruby.h>
+#include "heap_recorder.h"
 
 void thread_context_collector_sample(
   VALUE self_instance,
   long current_monotonic_wall_time_ns,
   VALUE profiler_overhead_stack_thread
 );
-void thread_context_collector_sample_allocation(VALUE self_instance, unsigned int sample_weight);
+void thread_context_collector_sample_current_thread(VALUE self_instance, long current_monotonic_wall_time_ns);
+void thread_context_collector_enable_cpu_timers(VALUE self_instance, long interval_ns, int signal, int signal_value);
+void thread_context_collector_disable_cpu_timers(VALUE self_instance);
+bool thread_context_collector_prepare_allocation_sample(VALUE self_instance, unsigned int sample_weight, VALUE new_object);
+void thread_context_collector_sample_allocation(VALUE self_instance);
+VALUE thread_context_collector_flush_pending_samples(VALUE self_instance);
+void thread_context_collector_sample_gvl_wait(VALUE self_instance, long gvl_wait_ns);
 VALUE thread_context_collector_sample_after_gc(VALUE self_instance);
 void thread_context_collector_on_gc_start(VALUE self_instance);
 void thread_context_collector_on_gc_finish(VALUE self_instance);
+heap_recorder *thread_context_collector_heap_recorder(VALUE self_instance);
 VALUE enforce_thread_context_collector_instance(VALUE object);
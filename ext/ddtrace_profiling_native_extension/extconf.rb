@@ -127,14 +127,36 @@ if RUBY_PLATFORM.include?('linux')
   # but a) it broke the build on Windows, b) on older Ruby versions (2.2 and below) and c) It's slower to build
   # so instead we just assume that we have the function we need on Linux, and nowhere else
   $defs << '-DHAVE_PTHREAD_GETCPUCLOCKID'
+
+  # Used by the timer-based sampling trigger (POSIX timers with SIGEV_THREAD_ID, which are Linux-specific). On older
+  # glibc versions these live in librt. `have_func` adds -DHAVE_TIMER_CREATE when it finds it.
+  if have_func('timer_create', 'time.h') || (have_library('rt') && have_func('timer_create', 'time.h'))
+    # Targeting a thread also needs the thread id field of `struct sigevent`, which musl and glibc 2.35+ expose as
+    # `sigev_notify_thread_id`, and older glibc versions only as `_sigev_un._tid` (see time_helpers.c). Older musl
+    # versions have neither, so we can't use timers there.
+    has_sigevent_thread_id =
+      have_struct_member('struct sigevent', 'sigev_notify_thread_id', 'signal.h') ||
+      have_struct_member('struct sigevent', '_sigev_un._tid', 'signal.h')
+    $defs.delete('-DHAVE_TIMER_CREATE') unless has_sigevent_thread_id
+  end
+
+  # Used by the IdleSamplingHelper to wake up its background thread; other platforms use a pipe instead
+  $defs << '-DHAVE_EVENTFD'
 end
 
+# The file sink (see file_sink.c) gzip-compresses the profiles it writes if zlib is available, and writes them
+# uncompressed otherwise
+$defs << '-DHAVE_ZLIB' if have_header('zlib.h') && have_library('z', 'gzdopen')
+
 # On older Rubies, there was no struct rb_native_thread. See private_vm_api_acccess.c for details.
 $defs << '-DNO_RB_NATIVE_THREAD' if RUBY_VERSION < '3.2'
 
 # On older Rubies, there was no struct rb_thread_sched (it was struct rb_global_vm_lock_struct)
 $defs << '-DNO_RB_THREAD_SCHED' if RUBY_VERSION < '3.2'
 
+# On older Rubies, there were no thread event hooks (rb_internal_thread_add_event_hook)
+$defs << '-DNO_THREAD_EVENT_HOOKS' if RUBY_VERSION < '3.2'
+
 # On older Rubies, there was no tid member in the internal thread structure
 $defs << '-DNO_THREAD_TID' if RUBY_VERSION < '3.1'
 
@@ -144,6 +166,9 @@ $defs << '-DUSE_BACKPORTED_RB_PROFILE_FRAME_METHOD_NAME' if RUBY_VERSION < '3'
 # On older Rubies, there are no Ractors
 $defs << '-DNO_RACTORS' if RUBY_VERSION < '3'
 
+# On older Rubies, there was no GC compaction (and thus no rb_gc_mark_movable nor dcompact)
+$defs << '-DNO_GC_COMPACTION' if RUBY_VERSION < '2.7'
+
 # On older Rubies, rb_global_vm_lock_struct did not include the owner field
 $defs << '-DNO_GVL_OWNER' if RUBY_VERSION < '2.6'
 
@@ -0,0 +1,427 @@
+#include <ruby.h>
+#include <ruby/thread.h>
+#include <ruby/util.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+  #include <zlib.h>
+#endif
+#include <datadog/profiling.h>
+#include "helpers.h"
+#include "libdatadog_helpers.h"
+#include "ruby_helpers.h"
+#include "stack_recorder.h"
+
+// Used to write profiles to a local directory, instead of reporting them to Datadog.
+// This file implements the native bits of the Datadog::Profiling::HttpTransport::FileSink class
+//
+// ---
+// ## Writing reports
+//
+// Each file in a report (the pprof, and the code provenance if available) gets written as
+// `ddprof-<finish timestamp>-<pid>-<file name>`, gzip-compressed (and with a `.gz` suffix) when the native extension
+// was built with zlib. The timestamp is zero-padded, so sorting the files by name also sorts them by age, and the pid
+// keeps processes sharing the same directory (e.g. after forking) from clobbering each other's files.
+//
+// Files are first written (and fsync'd) into hidden temporary files in the same directory, and only get renamed into
+// place once every file in the report was written, so that tools watching the directory never observe a
+// partially-written file. If writing or renaming any of them fails, the files for that report that were already
+// created (temporary or renamed) get deleted again, so a failed export never leaves an incomplete report behind.
+//
+// ## Retention
+//
+// After every report, the oldest reports in the directory get deleted, so that at most `max_reports` remain. Only
+// files matching the naming scheme above are considered, so the directory can be shared with other files.
+//
+// ## Threading
+//
+// All of the file I/O happens without the GVL and without touching the Ruby VM, so the app can keep running while a
+// report is being written. Retention is best-effort: failing to delete old reports does not fail the export.
+//
+// ---
+
+#define FILE_SINK_PREFIX "ddprof-"
+#define FILE_SINK_MAX_FILES 2
+#define FILE_SINK_ERROR_MESSAGE_SIZE 256
+// Large enough for the directory, a separator, the prefix, timestamp, pid and the ".gz" and temporary file decorations
+#define FILE_SINK_MAX_DIRECTORY_LENGTH (PATH_MAX - 128)
+#define FILE_SINK_MAX_FILE_NAME_LENGTH 64
+
+#ifdef HAVE_ZLIB
+  #define FILE_SINK_SUFFIX ".gz"
+#else
+  #define FILE_SINK_SUFFIX ""
+#endif
+
+static VALUE ok_symbol = Qnil; // :ok in Ruby
+static VALUE error_symbol = Qnil; // :error in Ruby
+
+// Contains the native state for the Datadog::Profiling::HttpTransport::FileSink class
+struct file_sink_state {
+  // Set when initialized, read-only afterwards
+  char *directory;
+  unsigned int max_reports;
+};
+
+typedef struct {
+  ddog_CharSlice name;
+  ddog_ByteSlice data;
+} file_sink_file;
+
+struct write_report_without_gvl_arguments {
+  // Set by caller
+  struct file_sink_state *state;
+  ddog_Timespec finish;
+  file_sink_file files[FILE_SINK_MAX_FILES];
+  int files_count;
+
+  // Set by callee
+  bool success;
+  char paths[FILE_SINK_MAX_FILES][PATH_MAX];
+  char error_message[FILE_SINK_ERROR_MESSAGE_SIZE];
+};
+
+static VALUE _native_new(VALUE klass);
+static void file_sink_typed_data_free(void *state_ptr);
+static VALUE _native_initialize(DDTRACE_UNUSED VALUE _self, VALUE file_sink, VALUE directory, VALUE max_reports);
+static VALUE _native_do_export(
+  DDTRACE_UNUSED VALUE _self,
+  VALUE file_sink,
+  VALUE upload_timeout_milliseconds,
+  VALUE start_timespec_seconds,
+  VALUE start_timespec_nanoseconds,
+  VALUE finish_timespec_seconds,
+  VALUE finish_timespec_nanoseconds,
+  VALUE pprof_file_name,
+  VALUE pprof_data,
+  VALUE code_provenance_file_name,
+  VALUE code_provenance_data
+);
+static ddog_CharSlice validate_file_name(VALUE file_name);
+static void *write_report_without_gvl(void *call_args);
+static bool write_temporary_file(const char *temporary_path, file_sink_file file, char *error_message);
+static bool write_data(int fd, ddog_ByteSlice data);
+static void apply_retention(struct file_sink_state *state);
+static int is_report_file(const struct dirent *entry);
+static size_t report_id_length(const char *file_name);
+static bool same_report(const char *file_name, const char *other_file_name);
+
+void file_sink_init(VALUE profiling_module) {
+  VALUE http_transport_class = rb_define_class_under(profiling_module, "HttpTransport", rb_cObject);
+  VALUE file_sink_class = rb_define_class_under(http_transport_class, "FileSink", rb_cObject);
+
+  // See stack_recorder.c for why we need to define the allocation function for TypedData objects
+  rb_define_alloc_func(file_sink_class, _native_new);
+  rb_define_singleton_method(file_sink_class, "_native_initialize", _native_initialize, 3);
+  rb_define_singleton_method(file_sink_class, "_native_do_export", _native_do_export, 10);
+
+  ok_symbol = ID2SYM(rb_intern_const("ok"));
+  error_symbol = ID2SYM(rb_intern_const("error"));
+}
+
+// This structure is used to define a Ruby object that stores the state of a FileSink
+static const rb_data_type_t file_sink_typed_data = {
+  .wrap_struct_name = "Datadog::Profiling::HttpTransport::FileSink",
+  .function = {
+    .dfree = file_sink_typed_data_free,
+    .dsize = NULL, // We don't track memory usage (although it'd be cool if we did!)
+    // No need to provide dmark nor dcompact, as there are no Ruby VALUEs being referenced
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE _native_new(VALUE klass) {
+  struct file_sink_state *state = ruby_xcalloc(1, sizeof(struct file_sink_state));
+  return TypedData_Wrap_Struct(klass, &file_sink_typed_data, state);
+}
+
+static void file_sink_typed_data_free(void *state_ptr) {
+  struct file_sink_state *state = (struct file_sink_state *) state_ptr;
+
+  ruby_xfree(state->directory);
+  ruby_xfree(state);
+}
+
+static VALUE _native_initialize(DDTRACE_UNUSED VALUE _self, VALUE file_sink, VALUE directory, VALUE max_reports) {
+  ENFORCE_TYPE(directory, T_STRING);
+  ENFORCE_TYPE(max_reports, T_FIXNUM);
+
+  struct file_sink_state *state;
+  TypedData_Get_Struct(file_sink, struct file_sink_state, &file_sink_typed_data, state);
+
+  if (state->directory != NULL) rb_raise(rb_eRuntimeError, "FileSink was already initialized");
+
+  const char *directory_path = StringValueCStr(directory);
+
+  if (NUM2INT(max_reports) <= 0) {
+    rb_raise(rb_eArgError, "Failed to initialize file sink: max_reports must be positive");
+  }
+  if (RSTRING_LEN(directory) == 0 || RSTRING_LEN(directory) > FILE_SINK_MAX_DIRECTORY_LENGTH) {
+    rb_raise(rb_eArgError, "Failed to initialize file sink: Invalid directory path '%s'", directory_path);
+  }
+
+  struct stat directory_stat;
+  if (stat(directory_path, &directory_stat) != 0 || !S_ISDIR(directory_stat.st_mode)) {
+    rb_raise(rb_eArgError, "Failed to initialize file sink: '%s' is not a directory", directory_path);
+  }
+  if (access(directory_path, W_OK | X_OK) != 0) {
+    rb_raise(
+      rb_eArgError, "Failed to initialize file sink: Cannot write to '%s' (%s)", directory_path, strerror(errno)
+    );
+  }
+
+  state->directory = ruby_strdup(directory_path);
+  state->max_reports = NUM2UINT(max_reports);
+
+  return Qtrue;
+}
+
+// Returns [:ok, [written file paths]] or [:error, error_details]. Takes the same arguments as
+// HttpTransport._native_do_export, with the FileSink in place of the native exporter.
+static VALUE _native_do_export(
+  DDTRACE_UNUSED VALUE _self,
+  VALUE file_sink,
+  VALUE upload_timeout_milliseconds,
+  VALUE start_timespec_seconds,
+  VALUE start_timespec_nanoseconds,
+  VALUE finish_timespec_seconds,
+  VALUE finish_timespec_nanoseconds,
+  VALUE pprof_file_name,
+  VALUE pprof_data,
+  VALUE code_provenance_file_name,
+  VALUE code_provenance_data
+) {
+  struct file_sink_state *state;
+  TypedData_Get_Struct(file_sink, struct file_sink_state, &file_sink_typed_data, state);
+
+  if (state->directory == NULL) rb_raise(rb_eRuntimeError, "Unexpected uninitialized FileSink");
+
+  // The timeout and the start of the profile are not used when writing files, but we still validate them, as
+  // callers are expected to pass in the same arguments as for HttpTransport._native_do_export
+  ENFORCE_TYPE(upload_timeout_milliseconds, T_FIXNUM);
+  ENFORCE_TYPE(start_timespec_seconds, T_FIXNUM);
+  ENFORCE_TYPE(start_timespec_nanoseconds, T_FIXNUM);
+  ENFORCE_TYPE(finish_timespec_seconds, T_FIXNUM);
+  ENFORCE_TYPE(finish_timespec_nanoseconds, T_FIXNUM);
+
+  // Code provenance can be disabled and in that case will be set to nil
+  bool have_code_provenance = !NIL_P(code_provenance_data);
+  if (have_code_provenance) ENFORCE_TYPE(code_provenance_data, T_STRING);
+
+  struct write_report_without_gvl_arguments args = {
+    .state = state,
+    .finish = {.seconds = NUM2LONG(finish_timespec_seconds), .nanoseconds = NUM2UINT(finish_timespec_nanoseconds)},
+    .files_count = 1 + (have_code_provenance ? 1 : 0),
+    .success = false,
+  };
+
+  ddog_ByteSlice pprof_bytes;
+  if (!encoded_profile_byte_slice(pprof_data, &pprof_bytes)) pprof_bytes = byte_slice_from_ruby_string(pprof_data);
+
+  args.files[0] = (file_sink_file) {.name = validate_file_name(pprof_file_name), .data = pprof_bytes};
+  if (have_code_provenance) {
+    args.files[1] = (file_sink_file) {
+      .name = validate_file_name(code_provenance_file_name),
+      .data = byte_slice_from_ruby_string(code_provenance_data)
+    };
+  }
+
+  // The data being written is kept alive (and pinned) by being arguments to this function, which is on the stack
+  // until we return.
+  //
+  // There's no unblocking function: writing to a local file is bounded, and write_report_without_gvl cleans up after
+  // itself, so nothing leaks if Ruby raises a pending exception once we get the GVL back.
+  rb_thread_call_without_gvl(write_report_without_gvl, &args, NULL, NULL);
+
+  if (!args.success) return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr(args.error_message));
+
+  VALUE paths = rb_ary_new_capa(args.files_count);
+  for (int i = 0; i < args.files_count; i++) rb_ary_push(paths, rb_str_new_cstr(args.paths[i]));
+
+  return rb_ary_new_from_args(2, ok_symbol, paths);
+}
+
+static ddog_CharSlice validate_file_name(VALUE file_name) {
+  ENFORCE_TYPE(file_name, T_STRING);
+
+  long length = RSTRING_LEN(file_name);
+  const char *name = RSTRING_PTR(file_name);
+
+  bool valid_name =
+    length > 0 && length <= FILE_SINK_MAX_FILE_NAME_LENGTH && !memchr(name, '/', length) && !memchr(name, '\0', length);
+
+  if (!valid_name) {
+    rb_raise(rb_eArgError, "Invalid file name for file sink: %"PRIsVALUE, rb_inspect(file_name));
+  }
+
+  return char_slice_from_ruby_string(file_name);
+}
+
+// Does not interact with the Ruby VM, and does not leak anything if it fails partway through.
+static void *write_report_without_gvl(void *call_args) {
+  struct write_report_without_gvl_arguments *args = (struct write_report_without_gvl_arguments *) call_args;
+  const char *directory = args->state->directory;
+  char temporary_paths[FILE_SINK_MAX_FILES][PATH_MAX];
+  int files_written = 0;
+  int files_renamed = 0;
+
+  for (int i = 0; i < args->files_count; i++) {
+    file_sink_file file = args->files[i];
+
+    snprintf(
+      args->paths[i],
+      PATH_MAX,
+      "%s/" FILE_SINK_PREFIX "%010lld%09u-%ld-%.*s" FILE_SINK_SUFFIX,
+      directory,
+      (long long) args->finish.seconds,
+      (unsigned int) args->finish.nanoseconds,
+      (long) getpid(),
+      (int) file.name.len,
+      file.name.ptr
+    );
+
+    snprintf(temporary_paths[i], PATH_MAX, "%s/.%s.tmp", directory, args->paths[i] + strlen(directory) + 1);
+
+    if (!write_temporary_file(temporary_paths[i], file, args->error_message)) break;
+    files_written++;
+  }
+
+  if (files_written == args->files_count) {
+    for (int i = 0; i < args->files_count; i++) {
+      if (rename(temporary_paths[i], args->paths[i]) != 0) {
+        snprintf(
+          args->error_message,
+          FILE_SINK_ERROR_MESSAGE_SIZE,
+          "Failed to rename %s: %s",
+          temporary_paths[i],
+          strerror(errno)
+        );
+        break;
+      }
+      files_renamed++;
+    }
+  }
+
+  if (files_renamed < args->files_count) {
+    for (int i = 0; i < files_renamed; i++) unlink(args->paths[i]);
+    for (int i = files_renamed; i < files_written; i++) unlink(temporary_paths[i]);
+    return NULL;
+  }
+
+  args->success = true;
+  apply_retention(args->state);
+
+  return NULL; // Unused
+}
+
+// Writes the file into a temporary file, which is deleted again if writing fails; see "Writing reports" above
+static bool write_temporary_file(const char *temporary_path, file_sink_file file, char *error_message) {
+  int fd = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    snprintf(error_message, FILE_SINK_ERROR_MESSAGE_SIZE, "Failed to create %s: %s", temporary_path, strerror(errno));
+    return false;
+  }
+
+  bool written;
+  #ifdef HAVE_ZLIB
+    // gzclose closes the file descriptor it was given, but we still need ours for the fsync below
+    int gzip_fd = dup(fd);
+    gzFile gzip_file = gzip_fd == -1 ? NULL : gzdopen(gzip_fd, "wb");
+    if (gzip_file == NULL && gzip_fd != -1) close(gzip_fd);
+
+    written = gzip_file != NULL;
+    const uint8_t *remaining = file.data.ptr;
+    size_t remaining_len = file.data.len;
+    while (written && remaining_len > 0) {
+      unsigned int chunk_len = remaining_len > INT_MAX ? INT_MAX : (unsigned int) remaining_len;
+      written = gzwrite(gzip_file, remaining, chunk_len) == (int) chunk_len;
+      remaining += chunk_len;
+      remaining_len -= chunk_len;
+    }
+    if (gzip_file != NULL) written = gzclose(gzip_file) == Z_OK && written;
+  #else
+    written = write_data(fd, file.data);
+  #endif
+
+  written = written && fsync(fd) == 0;
+  int saved_errno = errno;
+  written = close(fd) == 0 && written;
+
+  if (!written) {
+    snprintf(
+      error_message, FILE_SINK_ERROR_MESSAGE_SIZE, "Failed to write %s: %s", temporary_path, strerror(saved_errno)
+    );
+    unlink(temporary_path);
+    return false;
+  }
+
+  return true;
+}
+
+// Only used when building without zlib
+static bool write_data(int fd, ddog_ByteSlice data) {
+  const uint8_t *remaining = data.ptr;
+  size_t remaining_len = data.len;
+
+  while (remaining_len > 0) {
+    ssize_t result = write(fd, remaining, remaining_len);
+    if (result == -1 && errno == EINTR) continue;
+    if (result <= 0) return false;
+
+    remaining += result;
+    remaining_len -= result;
+  }
+
+  return true;
+}
+
+// Deletes the oldest reports in the directory, so that at most max_reports remain
+static void apply_retention(struct file_sink_state *state) {
+  struct dirent **entries;
+  int entries_count = scandir(state->directory, &entries, is_report_file, alphasort);
+  if (entries_count < 0) return; // Best-effort
+
+  unsigned int reports_count = 0;
+  for (int i = 0; i < entries_count; i++) {
+    if (i == 0 || !same_report(entries[i - 1]->d_name, entries[i]->d_name)) reports_count++;
+  }
+
+  unsigned int reports_to_delete = reports_count > state->max_reports ? reports_count - state->max_reports : 0;
+  unsigned int reports_deleted = 0;
+  char path[PATH_MAX];
+
+  for (int i = 0; i < entries_count; i++) {
+    if (i > 0 && !same_report(entries[i - 1]->d_name, entries[i]->d_name)) reports_deleted++;
+
+    if (reports_deleted < reports_to_delete) {
+      snprintf(path, PATH_MAX, "%s/%s", state->directory, entries[i]->d_name);
+      unlink(path);
+    }
+  }
+
+  for (int i = 0; i < entries_count; i++) free(entries[i]);
+  free(entries);
+}
+
+static int is_report_file(const struct dirent *entry) {
+  return strncmp(entry->d_name, FILE_SINK_PREFIX, strlen(FILE_SINK_PREFIX)) == 0;
+}
+
+// Files from the same report share the `ddprof-<finish timestamp>-<pid>-` part of their names
+static size_t report_id_length(const char *file_name) {
+  const char *separator = strchr(file_name + strlen(FILE_SINK_PREFIX), '-'); // After the timestamp
+  if (separator != NULL) separator = strchr(separator + 1, '-'); // After the pid
+  return separator == NULL ? strlen(file_name) : (size_t) (separator - file_name);
+}
+
+static bool same_report(const char *file_name, const char *other_file_name) {
+  size_t length = report_id_length(file_name);
+  return length == report_id_length(other_file_name) && strncmp(file_name, other_file_name, length) == 0;
+}
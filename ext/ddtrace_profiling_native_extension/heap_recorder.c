@@ -0,0 +1,493 @@
+#include <ruby.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap_recorder.h"
+#include "ruby_helpers.h"
+
+// Used to implement live heap profiling: reporting which stacks allocated objects that are still alive.
+//
+// ---
+// ## Design notes
+//
+// When an allocation gets sampled (see "Allocation sampling" in collectors_cpu_and_wall_time_worker.c), we start
+// tracking the new object here, keyed by its address, together with the stack that allocated it and the weight of
+// the allocation sample. When the Ruby GC frees a tracked object (`RUBY_INTERNAL_EVENT_FREEOBJ`), we stop tracking it.
+// Thus, at any point in time, the objects we track are the sampled objects that are still alive.
+//
+// Tracking an object is done in two steps because the stack only becomes available later in the sampling process:
+// 1. `heap_recorder_prepare_allocation` is called with the new object, before sampling its stack
+// 2. `heap_recorder_commit_allocation` is called with the stack, when the allocation sample gets recorded
+//
+// We can't key objects by object id: on Ruby 2.7+ getting an object id for the first time assigns it one, which
+// modifies (and may allocate memory for) the VM's object id tables, and that's not allowed from the NEWOBJ/FREEOBJ
+// hooks. Instead, when GC compaction moves objects, `heap_recorder_update_references` (called from the StackRecorder's
+// `dcompact`) updates their addresses and rehashes the table. As this happens during GC, it uses a spare table that
+// gets allocated together with the main one, rather than allocating a new one.
+//
+// Many tracked objects usually get allocated from the same stack, so stacks are deduplicated, and reference counted
+// by the objects using them.
+//
+// Safety: `heap_recorder_on_object_freed` and `heap_recorder_update_references` get called while Ruby is doing garbage
+// collection, so they can't allocate, raise, nor call Ruby APIs that may do so. For this reason, all memory in this
+// file is managed with malloc/free and not with ruby_xmalloc/ruby_xfree (which may trigger GC).
+// ---
+
+#define INITIAL_TABLE_CAPACITY 1024
+#define EMPTY_OBJECT 0 // Qfalse, which is never a heap object
+
+typedef struct {
+  ddog_CharSlice name;
+  ddog_CharSlice filename;
+  int64_t line;
+} heap_frame;
+
+typedef struct {
+  uint64_t hash;
+  uint32_t refcount; // How many tracked objects were allocated from this stack
+  uint32_t frames_count;
+  // Used by heap_recorder_for_each_live_stack
+  int64_t live_samples;
+  int64_t live_size;
+  // The strings for the frames get stored right after the frames, in the same memory block
+  heap_frame frames[];
+} heap_stack;
+
+typedef struct {
+  VALUE object; // EMPTY_OBJECT for unused slots
+  heap_stack *stack;
+  unsigned int weight;
+} heap_object;
+
+struct heap_recorder {
+  // Open-addressing hash table (with linear probing), keyed by object address
+  heap_object *objects;
+  size_t objects_count;
+  size_t objects_capacity; // Always a power of two
+  // Same capacity as objects; used by heap_recorder_update_references to rehash the table without allocating
+  heap_object *spare_objects;
+
+  // Open-addressing hash table (with linear probing) of heap_stack pointers, keyed by stack hash
+  heap_stack **stacks;
+  size_t stacks_count;
+  size_t stacks_capacity; // Always a power of two
+
+  // Set by heap_recorder_prepare_allocation, used by heap_recorder_commit_allocation
+  struct {
+    bool active;
+    VALUE object;
+    unsigned int weight;
+  } pending;
+
+  // Reused across calls to heap_recorder_for_each_live_stack
+  ddog_prof_Location *scratch_locations;
+  ddog_prof_Line *scratch_lines;
+  size_t scratch_capacity;
+};
+
+static uint64_t hash_locations(ddog_prof_Slice_Location locations, uint32_t *frames_count);
+static uint64_t hash_bytes(uint64_t hash, const void *bytes, size_t len);
+static heap_stack *intern_stack(heap_recorder *recorder, ddog_prof_Slice_Location locations);
+static heap_stack *new_stack(ddog_prof_Slice_Location locations, uint64_t hash, uint32_t frames_count);
+static bool stack_equals(heap_stack *stack, ddog_prof_Slice_Location locations, uint64_t hash, uint32_t frames_count);
+static void release_stack(heap_recorder *recorder, heap_stack *stack);
+static bool grow_objects(heap_recorder *recorder);
+static bool grow_stacks(heap_recorder *recorder);
+static heap_object *find_object_slot(heap_object *objects, size_t capacity, VALUE object);
+static size_t find_stack_slot(heap_stack **stacks, size_t capacity, heap_stack *stack);
+static void remove_object_at(heap_recorder *recorder, size_t position);
+static void remove_stack_at(heap_recorder *recorder, size_t position);
+static size_t object_home_slot(VALUE object, size_t capacity);
+static bool char_slice_equals(ddog_CharSlice a, ddog_CharSlice b);
+
+heap_recorder *heap_recorder_new(void) {
+  heap_recorder *recorder = calloc(1, sizeof(heap_recorder));
+  if (recorder == NULL) return NULL;
+
+  recorder->objects = calloc(INITIAL_TABLE_CAPACITY, sizeof(heap_object));
+  recorder->spare_objects = calloc(INITIAL_TABLE_CAPACITY, sizeof(heap_object));
+  recorder->objects_capacity = INITIAL_TABLE_CAPACITY;
+  recorder->stacks = calloc(INITIAL_TABLE_CAPACITY, sizeof(heap_stack *));
+  recorder->stacks_capacity = INITIAL_TABLE_CAPACITY;
+
+  if (recorder->objects == NULL || recorder->spare_objects == NULL || recorder->stacks == NULL) {
+    heap_recorder_free(recorder);
+    return NULL;
+  }
+
+  return recorder;
+}
+
+void heap_recorder_free(heap_recorder *recorder) {
+  if (recorder == NULL) return;
+
+  if (recorder->objects != NULL && recorder->stacks != NULL) heap_recorder_clear(recorder);
+
+  free(recorder->objects);
+  free(recorder->spare_objects);
+  free(recorder->stacks);
+  free(recorder->scratch_locations);
+  free(recorder->scratch_lines);
+  free(recorder);
+}
+
+// Stops tracking all objects. Used e.g. after a fork, when the child process starts profiling from scratch.
+void heap_recorder_clear(heap_recorder *recorder) {
+  for (size_t i = 0; i < recorder->stacks_capacity; i++) {
+    free(recorder->stacks[i]);
+    recorder->stacks[i] = NULL;
+  }
+  memset(recorder->objects, 0, recorder->objects_capacity * sizeof(heap_object));
+
+  recorder->objects_count = 0;
+  recorder->stacks_count = 0;
+  recorder->pending.active = false;
+}
+
+// Assumption 1: This function is called in a thread that is holding the Global VM Lock. Caller is responsible for enforcing this.
+// Assumption 2: This function is called from the RUBY_INTERNAL_EVENT_NEWOBJ tracepoint for the `new_object`, so it
+// must not call any Ruby APIs that modify the VM's state (e.g. rb_obj_id).
+void heap_recorder_prepare_allocation(heap_recorder *recorder, VALUE new_object, unsigned int weight) {
+  recorder->pending.active = true;
+  recorder->pending.object = new_object;
+  recorder->pending.weight = weight;
+}
+
+// Assumption: This function is called in a thread that is holding the Global VM Lock. Caller is responsible for enforcing this.
+void heap_recorder_commit_allocation(heap_recorder *recorder, ddog_prof_Slice_Location locations) {
+  if (!recorder->pending.active) return;
+  recorder->pending.active = false;
+
+  // We keep the load factor of the tables <= 50%
+  if ((recorder->objects_count + 1) * 2 > recorder->objects_capacity && !grow_objects(recorder)) return;
+
+  heap_stack *stack = intern_stack(recorder, locations);
+  if (stack == NULL) return; // Out of memory; we just skip tracking this object
+
+  heap_object *slot = find_object_slot(recorder->objects, recorder->objects_capacity, recorder->pending.object);
+  if (slot->object == EMPTY_OBJECT) {
+    recorder->objects_count++;
+  } else {
+    // The address belonged to an object that got freed without us getting notified. This shouldn't happen, as the
+    // recorder gets cleared whenever the FREEOBJ tracepoint gets disabled, but just in case we replace it.
+    release_stack(recorder, slot->stack);
+  }
+
+  *slot = (heap_object) {
+    .object = recorder->pending.object,
+    .stack = stack,
+    .weight = recorder->pending.weight,
+  };
+}
+
+// Safety: Gets called while Ruby is doing garbage collection, see the notes at the top of this file.
+void heap_recorder_on_object_freed(heap_recorder *recorder, VALUE object) {
+  // The object can get freed before its allocation sample gets recorded (e.g. if sampling the stack triggered GC)
+  if (recorder->pending.active && recorder->pending.object == object) recorder->pending.active = false;
+
+  if (recorder->objects_count == 0) return;
+
+  heap_object *slot = find_object_slot(recorder->objects, recorder->objects_capacity, object);
+  if (slot->object == EMPTY_OBJECT) return;
+
+  release_stack(recorder, slot->stack);
+  remove_object_at(recorder, slot - recorder->objects);
+}
+
+// Called when the Ruby GC compacts the heap, so we can update the addresses of the objects we're tracking. As the
+// table is keyed by address, the objects get moved to the spare table, which then becomes the main one.
+// Note that we don't mark these objects (we don't want to keep them alive!), but rb_gc_location still works for them.
+//
+// Safety: Gets called while Ruby is doing garbage collection, see the notes at the top of this file.
+void heap_recorder_update_references(heap_recorder *recorder) {
+  if (recorder->pending.active) recorder->pending.object = rb_gc_location(recorder->pending.object);
+
+  heap_object *updated_objects = recorder->spare_objects;
+  memset(updated_objects, 0, recorder->objects_capacity * sizeof(heap_object));
+
+  for (size_t i = 0; i < recorder->objects_capacity; i++) {
+    heap_object object = recorder->objects[i];
+    if (object.object == EMPTY_OBJECT) continue;
+
+    object.object = rb_gc_location(object.object);
+    *find_object_slot(updated_objects, recorder->objects_capacity, object.object) = object;
+  }
+
+  recorder->spare_objects = recorder->objects;
+  recorder->objects = updated_objects;
+}
+
+// Assumption: This function is called in a thread that is holding the Global VM Lock. Caller is responsible for enforcing this.
+bool heap_recorder_for_each_live_stack(
+  heap_recorder *recorder,
+  bool (*callback)(heap_recorder_live_stack live_stack, void *callback_arg),
+  void *callback_arg
+) {
+  for (size_t i = 0; i < recorder->stacks_capacity; i++) {
+    heap_stack *stack = recorder->stacks[i];
+    if (stack != NULL) stack->live_samples = stack->live_size = 0;
+  }
+
+  for (size_t i = 0; i < recorder->objects_capacity; i++) {
+    heap_object *object = &recorder->objects[i];
+    if (object->object == EMPTY_OBJECT) continue;
+
+    object->stack->live_samples += object->weight;
+    // Note: We measure the object's size now, and not when it's allocated, since at that point it's still empty
+    object->stack->live_size += (int64_t) ruby_obj_memsize_of(object->object) * object->weight;
+  }
+
+  for (size_t i = 0; i < recorder->stacks_capacity; i++) {
+    heap_stack *stack = recorder->stacks[i];
+    if (stack == NULL) continue;
+
+    if (stack->frames_count > recorder->scratch_capacity) {
+      ddog_prof_Location *locations = realloc(recorder->scratch_locations, stack->frames_count * sizeof(ddog_prof_Location));
+      if (locations != NULL) recorder->scratch_locations = locations;
+      ddog_prof_Line *lines = realloc(recorder->scratch_lines, stack->frames_count * sizeof(ddog_prof_Line));
+      if (lines != NULL) recorder->scratch_lines = lines;
+      if (locations == NULL || lines == NULL) return false;
+      recorder->scratch_capacity = stack->frames_count;
+    }
+
+    for (uint32_t j = 0; j < stack->frames_count; j++) {
+      heap_frame *frame = &stack->frames[j];
+      recorder->scratch_lines[j] = (ddog_prof_Line) {
+        .function = (ddog_prof_Function) {.name = frame->name, .filename = frame->filename},
+        .line = frame->line,
+      };
+      recorder->scratch_locations[j] = (ddog_prof_Location) {
+        .lines = (ddog_prof_Slice_Line) {.ptr = &recorder->scratch_lines[j], .len = 1},
+      };
+    }
+
+    heap_recorder_live_stack live_stack = {
+      .locations = (ddog_prof_Slice_Location) {.ptr = recorder->scratch_locations, .len = stack->frames_count},
+      .live_samples = stack->live_samples,
+      .live_size = stack->live_size,
+    };
+
+    if (!callback(live_stack, callback_arg)) return false;
+  }
+
+  return true;
+}
+
+size_t heap_recorder_tracked_objects_count(heap_recorder *recorder) { return recorder->objects_count; }
+size_t heap_recorder_tracked_stacks_count(heap_recorder *recorder) { return recorder->stacks_count; }
+
+// Note: Locations get flattened into frames, one per line. This is fine since all locations we get from
+// collectors_stack.c have exactly one line each.
+static uint64_t hash_locations(ddog_prof_Slice_Location locations, uint32_t *frames_count) {
+  uint64_t hash = 14695981039346656037ULL; // FNV-1a offset basis
+  *frames_count = 0;
+
+  for (size_t i = 0; i < locations.len; i++) {
+    ddog_prof_Slice_Line lines = locations.ptr[i].lines;
+    for (size_t j = 0; j < lines.len; j++) {
+      hash = hash_bytes(hash, lines.ptr[j].function.name.ptr, lines.ptr[j].function.name.len);
+      hash = hash_bytes(hash, lines.ptr[j].function.filename.ptr, lines.ptr[j].function.filename.len);
+      hash = hash_bytes(hash, &lines.ptr[j].line, sizeof(int64_t));
+      (*frames_count)++;
+    }
+  }
+
+  return hash;
+}
+
+static uint64_t hash_bytes(uint64_t hash, const void *bytes, size_t len) {
+  const unsigned char *data = bytes;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= data[i];
+    hash *= 1099511628211ULL; // FNV-1a prime
+  }
+  // Mark the end of this field, so that e.g. ("ab", "c") and ("a", "bc") hash differently
+  hash ^= 0xff;
+  hash *= 1099511628211ULL;
+  return hash;
+}
+
+static heap_stack *intern_stack(heap_recorder *recorder, ddog_prof_Slice_Location locations) {
+  uint32_t frames_count;
+  uint64_t hash = hash_locations(locations, &frames_count);
+
+  size_t mask = recorder->stacks_capacity - 1;
+  for (size_t i = hash & mask; recorder->stacks[i] != NULL; i = (i + 1) & mask) {
+    if (stack_equals(recorder->stacks[i], locations, hash, frames_count)) {
+      recorder->stacks[i]->refcount++;
+      return recorder->stacks[i];
+    }
+  }
+
+  if ((recorder->stacks_count + 1) * 2 > recorder->stacks_capacity && !grow_stacks(recorder)) return NULL;
+
+  heap_stack *stack = new_stack(locations, hash, frames_count);
+  if (stack == NULL) return NULL;
+
+  recorder->stacks[find_stack_slot(recorder->stacks, recorder->stacks_capacity, stack)] = stack;
+  recorder->stacks_count++;
+
+  return stack;
+}
+
+static heap_stack *new_stack(ddog_prof_Slice_Location locations, uint64_t hash, uint32_t frames_count) {
+  size_t strings_size = 0;
+  for (size_t i = 0; i < locations.len; i++) {
+    ddog_prof_Slice_Line lines = locations.ptr[i].lines;
+    for (size_t j = 0; j < lines.len; j++) strings_size += lines.ptr[j].function.name.len + lines.ptr[j].function.filename.len;
+  }
+
+  heap_stack *stack = malloc(sizeof(heap_stack) + frames_count * sizeof(heap_frame) + strings_size);
+  if (stack == NULL) return NULL;
+
+  *stack = (heap_stack) {.hash = hash, .refcount = 1, .frames_count = frames_count};
+
+  char *strings = (char *) &stack->frames[frames_count];
+  uint32_t next_frame = 0;
+
+  for (size_t i = 0; i < locations.len; i++) {
+    ddog_prof_Slice_Line lines = locations.ptr[i].lines;
+    for (size_t j = 0; j < lines.len; j++) {
+      ddog_CharSlice name = lines.ptr[j].function.name;
+      ddog_CharSlice filename = lines.ptr[j].function.filename;
+
+      if (name.len > 0) memcpy(strings, name.ptr, name.len);
+      if (filename.len > 0) memcpy(strings + name.len, filename.ptr, filename.len);
+
+      stack->frames[next_frame++] = (heap_frame) {
+        .name = (ddog_CharSlice) {.ptr = strings, .len = name.len},
+        .filename = (ddog_CharSlice) {.ptr = strings + name.len, .len = filename.len},
+        .line = lines.ptr[j].line,
+      };
+
+      strings += name.len + filename.len;
+    }
+  }
+
+  return stack;
+}
+
+static bool stack_equals(heap_stack *stack, ddog_prof_Slice_Location locations, uint64_t hash, uint32_t frames_count) {
+  if (stack->hash != hash || stack->frames_count != frames_count) return false;
+
+  uint32_t next_frame = 0;
+  for (size_t i = 0; i < locations.len; i++) {
+    ddog_prof_Slice_Line lines = locations.ptr[i].lines;
+    for (size_t j = 0; j < lines.len; j++) {
+      heap_frame *frame = &stack->frames[next_frame++];
+      if (
+        frame->line != lines.ptr[j].line ||
+        !char_slice_equals(frame->name, lines.ptr[j].function.name) ||
+        !char_slice_equals(frame->filename, lines.ptr[j].function.filename)
+      ) return false;
+    }
+  }
+
+  return true;
+}
+
+static void release_stack(heap_recorder *recorder, heap_stack *stack) {
+  if (--stack->refcount > 0) return;
+
+  remove_stack_at(recorder, find_stack_slot(recorder->stacks, recorder->stacks_capacity, stack));
+  free(stack);
+}
+
+static bool grow_objects(heap_recorder *recorder) {
+  size_t new_capacity = recorder->objects_capacity * 2;
+  heap_object *new_objects = calloc(new_capacity, sizeof(heap_object));
+  heap_object *new_spare_objects = calloc(new_capacity, sizeof(heap_object));
+  if (new_objects == NULL || new_spare_objects == NULL) {
+    free(new_objects);
+    free(new_spare_objects);
+    return false;
+  }
+
+  for (size_t i = 0; i < recorder->objects_capacity; i++) {
+    heap_object *object = &recorder->objects[i];
+    if (object->object != EMPTY_OBJECT) *find_object_slot(new_objects, new_capacity, object->object) = *object;
+  }
+
+  free(recorder->objects);
+  free(recorder->spare_objects);
+  recorder->objects = new_objects;
+  recorder->spare_objects = new_spare_objects;
+  recorder->objects_capacity = new_capacity;
+  return true;
+}
+
+static bool grow_stacks(heap_recorder *recorder) {
+  size_t new_capacity = recorder->stacks_capacity * 2;
+  heap_stack **new_stacks = calloc(new_capacity, sizeof(heap_stack *));
+  if (new_stacks == NULL) return false;
+
+  for (size_t i = 0; i < recorder->stacks_capacity; i++) {
+    heap_stack *stack = recorder->stacks[i];
+    if (stack != NULL) new_stacks[find_stack_slot(new_stacks, new_capacity, stack)] = stack;
+  }
+
+  free(recorder->stacks);
+  recorder->stacks = new_stacks;
+  recorder->stacks_capacity = new_capacity;
+  return true;
+}
+
+// Returns either the slot for the object, or the empty slot where it should be inserted
+static heap_object *find_object_slot(heap_object *objects, size_t capacity, VALUE object) {
+  size_t mask = capacity - 1;
+  size_t i = object_home_slot(object, capacity);
+  while (objects[i].object != EMPTY_OBJECT && objects[i].object != object) i = (i + 1) & mask;
+  return &objects[i];
+}
+
+// Returns either the slot for the stack, or the empty slot where it should be inserted
+static size_t find_stack_slot(heap_stack **stacks, size_t capacity, heap_stack *stack) {
+  size_t mask = capacity - 1;
+  size_t i = stack->hash & mask;
+  while (stacks[i] != NULL && stacks[i] != stack) i = (i + 1) & mask;
+  return i;
+}
+
+// Uses backward shift deletion, so that we don't need tombstones (and thus lookups never degrade over time)
+static void remove_object_at(heap_recorder *recorder, size_t position) {
+  size_t mask = recorder->objects_capacity - 1;
+  size_t hole = position;
+
+  for (size_t i = (hole + 1) & mask; recorder->objects[i].object != EMPTY_OBJECT; i = (i + 1) & mask) {
+    size_t home = object_home_slot(recorder->objects[i].object, recorder->objects_capacity);
+    // Move the entry into the hole if its home slot is not in the (cyclic) range (hole, i]
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      recorder->objects[hole] = recorder->objects[i];
+      hole = i;
+    }
+  }
+
+  recorder->objects[hole] = (heap_object) {.object = EMPTY_OBJECT};
+  recorder->objects_count--;
+}
+
+// See remove_object_at
+static void remove_stack_at(heap_recorder *recorder, size_t position) {
+  size_t mask = recorder->stacks_capacity - 1;
+  size_t hole = position;
+
+  for (size_t i = (hole + 1) & mask; recorder->stacks[i] != NULL; i = (i + 1) & mask) {
+    size_t home = recorder->stacks[i]->hash & mask;
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      recorder->stacks[hole] = recorder->stacks[i];
+      hole = i;
+    }
+  }
+
+  recorder->stacks[hole] = NULL;
+  recorder->stacks_count--;
+}
+
+static size_t object_home_slot(VALUE object, size_t capacity) {
+  // Addresses of objects are usually close together (and aligned), so we mix them a bit using Fibonacci hashing
+  return (size_t) ((((uint64_t) object) * 11400714819323198485ULL) >> 32) & (capacity - 1);
+}
+
+static bool char_slice_equals(ddog_CharSlice a, ddog_CharSlice b) {
+  return a.len == b.len && (a.len == 0 || memcmp(a.ptr, b.ptr, a.len) == 0);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <ruby.h>
+#include <datadog/profiling.h>
+
+// Tracks sampled objects until they get freed by the Ruby GC, so that we can report which stacks allocated objects
+// that are still alive. See heap_recorder.c for details.
+typedef struct heap_recorder heap_recorder;
+
+// A stack that allocated sampled objects that are still alive, as well as how many (and how much memory) they represent
+typedef struct {
+  ddog_prof_Slice_Location locations;
+  int64_t live_samples;
+  int64_t live_size;
+} heap_recorder_live_stack;
+
+heap_recorder *heap_recorder_new(void);
+void heap_recorder_free(heap_recorder *recorder);
+void heap_recorder_clear(heap_recorder *recorder);
+void heap_recorder_prepare_allocation(heap_recorder *recorder, VALUE new_object, unsigned int weight);
+void heap_recorder_commit_allocation(heap_recorder *recorder, ddog_prof_Slice_Location locations);
+void heap_recorder_on_object_freed(heap_recorder *recorder, VALUE object);
+void heap_recorder_update_references(heap_recorder *recorder);
+// Returns false if the callback returned false, which stops the iteration early
+bool heap_recorder_for_each_live_stack(
+  heap_recorder *recorder,
+  bool (*callback)(heap_recorder_live_stack live_stack, void *callback_arg),
+  void *callback_arg
+);
+size_t heap_recorder_tracked_objects_count(heap_recorder *recorder);
+size_t heap_recorder_tracked_stacks_count(heap_recorder *recorder);
@@ -1,33 +1,174 @@
 #include <ruby.h>
 #include <ruby/thread.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 #include <datadog/profiling.h>
 #include "helpers.h"
 #include "libdatadog_helpers.h"
 #include "ruby_helpers.h"
+#include "stack_recorder.h"
 
 // Used to report profiling data to Datadog.
 // This file implements the native bits of the Datadog::Profiling::HttpTransport class
+//
+// ---
+// ## Long-lived exporters
+//
+// Creating a `ddog_prof_Exporter` involves converting the profile tags and setting up an HTTP client; reusing it
+// across reports means that cost is paid only once, and that the HTTP client's connection pool gets reused.
+//
+// Thus, the HttpTransport keeps a `NativeExporter` object around, which owns a `shared_exporter`: a
+// `ddog_prof_Exporter` together with a mutex (only one request can be in progress for a given exporter) and a
+// reference count. Queued async exports (see below) hold a reference to the `shared_exporter` they are going to be
+// reported with, so it's only dropped after both the `NativeExporter` object was garbage collected and no queued
+// exports reference it anymore.
+//
+// The tags of the `ddog_prof_Exporter` are fixed when it gets created, so the HttpTransport creates a new
+// `NativeExporter` whenever the tags being reported change, as well as after forking (as the connection pool should
+// not be shared with the parent process).
+//
+// ## Asynchronous exports
+//
+// By default, reporting a profile blocks the calling thread (the `Scheduler`) for the whole HTTP round-trip, and if
+// the report fails, the profile is lost.
+//
+// The `HttpTransport::AsyncExporter` instead copies the data to be reported (and grabs a reference to the
+// `shared_exporter` to report it with) into a `queued_export`, and hands it over to a native background thread that
+// does not interact with the Ruby VM. The queue is bounded at
+// `max_queued_exports`; when it's full, the oldest queued export gets dropped (and counted) to make room for the new
+// one.
+//
+// The background thread reports queued exports in order. Exports that fail due to network errors, or due to the server
+// replying with a 408, 429 or 5xx status code, get retried after an exponential backoff (starting at
+// `initial_backoff_milliseconds`, doubling on every attempt up to `max_backoff_milliseconds`) until they either succeed
+// or reach `max_attempts`. Other failures are final. While an export is being retried, the remaining exports wait.
+//
+// Because the background thread can't log, the result of its work is available via the stats, which include the
+// queue depth, drop counters and the last failure.
+//
+// Stopping is explicit (`HttpTransport#shutdown!`), and is final: once it starts, no more exports get queued. The
+// exporter first drains the queue: it waits (up to a deadline) for queued exports to be reported, without any further
+// backoff waits for failing exports. After the deadline, the in-flight request (if any) gets cancelled, the background
+// thread gets joined, and any remaining exports get dropped (and counted).
+//
+// If an AsyncExporter gets garbage collected without being stopped, its dfree function can't block waiting for the
+// background thread, so it only asks the thread to stop (cancelling the in-flight request, if any) and detaches it;
+// the background thread then takes ownership of the state, and frees it on its way out.
+//
+// The background thread is started when the first export gets queued, and is not inherited by forked child
+// processes. After a fork, the exports queued by the parent stay the parent's responsibility: the child discards its
+// copies of them (they're reported by `reset_after_fork` so the caller can log it), and starts a new thread once
+// needed. (A copy of an export may have been in the middle of being reported by the parent at the time of the fork,
+// so the exporter it references is not reused by the child either, see "Long-lived exporters" above.)
+//
+// ---
 
 static VALUE ok_symbol = Qnil; // :ok in Ruby
 static VALUE error_symbol = Qnil; // :error in Ruby
 
 static ID agentless_id; // id of :agentless in Ruby
 static ID agent_id; // id of :agent in Ruby
+static ID agent_uds_id; // id of :agent_uds in Ruby
 
 static ID log_failure_to_process_tag_id; // id of :log_failure_to_process_tag in Ruby
 
 static VALUE http_transport_class = Qnil;
+static VALUE native_exporter_class = Qnil;
 static VALUE library_version_string = Qnil;
 
-struct call_exporter_without_gvl_arguments {
+#define ASYNC_EXPORT_MAX_FILES 2
+#define ASYNC_EXPORT_FAILURE_MESSAGE_SIZE 256
+
+typedef struct {
+  char *name;
+  size_t name_len;
+  uint8_t *data;
+  size_t data_len;
+} queued_file;
+
+// Contains the native state for the Datadog::Profiling::HttpTransport::NativeExporter class; see "Long-lived
+// exporters" notes above
+typedef struct {
   ddog_prof_Exporter *exporter;
-  ddog_prof_Exporter_Request_BuildResult *build_result;
+  pthread_mutex_t mutex; // Held while building and sending a request
+  atomic_uint references;
+} shared_exporter;
+
+typedef struct {
+  shared_exporter *exporter;
+  ddog_Timespec start;
+  ddog_Timespec finish;
+  uint64_t timeout_milliseconds;
+  queued_file files[ASYNC_EXPORT_MAX_FILES];
+  int files_count;
+  unsigned int attempts;
+} queued_export;
+
+struct async_exporter_stats {
+  unsigned long exports_queued;
+  unsigned long exports_succeeded;
+  unsigned long exports_failed;
+  unsigned long export_retries;
+  unsigned long exports_dropped_queue_full;
+  unsigned long exports_dropped_on_stop;
+  bool has_failure;
+  char last_failure[ASYNC_EXPORT_FAILURE_MESSAGE_SIZE];
+};
+
+// Contains the native state for the Datadog::Profiling::HttpTransport::AsyncExporter class
+struct async_exporter_state {
+  // Set when initialized, read-only afterwards
+  unsigned int max_queued_exports;
+  unsigned int max_attempts;
+  unsigned int initial_backoff_milliseconds;
+  unsigned int max_backoff_milliseconds;
+
+  // Everything below is protected by the mutex
+  pthread_mutex_t mutex;
+  // Signaled whenever exports get queued or finish, as well as when draining or stopping
+  pthread_cond_t state_changed;
+
+  queued_export **queue; // Ring buffer with max_queued_exports entries
+  unsigned int queue_head;
+  unsigned int queue_count;
+  queued_export *in_flight; // Only touched by the background thread while it's running
+
+  bool thread_running;
+  pthread_t thread;
+  pid_t thread_pid;
+  bool draining;
+  bool stop_requested;
+  bool shut_down; // Set when stopping starts; no more exports get queued after that
+  bool orphaned; // The Ruby object was garbage collected, and the background thread now owns the state
+  ddog_CancellationToken *cancel_token; // For the request currently being sent, if any
+
+  struct async_exporter_stats stats;
+};
+
+struct call_exporter_without_gvl_arguments {
+  // Set by caller
+  shared_exporter *exporter;
+  ddog_Timespec start;
+  ddog_Timespec finish;
+  ddog_prof_Exporter_Slice_File slice_files;
+  ddog_Vec_Tag *additional_tags;
+  uint64_t timeout_milliseconds;
   ddog_CancellationToken *cancel_token;
+
+  // Set by callee
+  ddog_prof_Exporter_Request_BuildResult build_result;
   ddog_prof_Exporter_SendResult result;
-  bool send_ran;
+  bool export_ran;
 };
 
-inline static ddog_ByteSlice byte_slice_from_ruby_string(VALUE string);
+static ddog_ByteSlice byte_slice_from_pprof_data(VALUE pprof_data);
 static VALUE _native_validate_exporter(VALUE self, VALUE exporter_configuration);
 static ddog_prof_Exporter_NewResult create_exporter(VALUE exporter_configuration, VALUE tags_as_array);
 static VALUE handle_exporter_failure(ddog_prof_Exporter_NewResult exporter_result);
@@ -36,7 +177,7 @@ static ddog_Vec_Tag convert_tags(VALUE tags_as_array);
 static void safely_log_failure_to_process_tag(ddog_Vec_Tag tags, VALUE err_details);
 static VALUE _native_do_export(
   VALUE self,
-  VALUE exporter_configuration,
+  VALUE native_exporter,
   VALUE upload_timeout_milliseconds,
   VALUE start_timespec_seconds,
   VALUE start_timespec_nanoseconds,
@@ -45,33 +186,110 @@ static VALUE _native_do_export(
   VALUE pprof_file_name,
   VALUE pprof_data,
   VALUE code_provenance_file_name,
-  VALUE code_provenance_data,
-  VALUE tags_as_array
+  VALUE code_provenance_data
+);
+static VALUE _native_exporter_new(DDTRACE_UNUSED VALUE _self, VALUE exporter_configuration, VALUE tags_as_array);
+static void native_exporter_typed_data_free(void *exporter_ptr);
+static shared_exporter *shared_exporter_for(VALUE native_exporter);
+static shared_exporter *shared_exporter_acquire(shared_exporter *exporter);
+static void shared_exporter_release(shared_exporter *exporter);
+static void shared_exporter_send(
+  shared_exporter *exporter,
+  ddog_Timespec start,
+  ddog_Timespec finish,
+  ddog_prof_Exporter_Slice_File slice_files,
+  ddog_Vec_Tag *additional_tags,
+  uint64_t timeout_milliseconds,
+  ddog_CancellationToken *cancel_token,
+  ddog_prof_Exporter_Request_BuildResult *build_result,
+  ddog_prof_Exporter_SendResult *send_result
 );
 static void *call_exporter_without_gvl(void *call_args);
 static void interrupt_exporter_call(void *cancel_token);
 static VALUE ddtrace_version(void);
+static VALUE _native_async_exporter_new(VALUE klass);
+static void async_exporter_typed_data_free(void *state_ptr);
+static VALUE _native_async_exporter_initialize(
+  DDTRACE_UNUSED VALUE _self,
+  VALUE async_exporter,
+  VALUE max_queued_exports,
+  VALUE max_attempts,
+  VALUE initial_backoff_milliseconds,
+  VALUE max_backoff_milliseconds
+);
+static VALUE _native_async_exporter_enqueue(
+  DDTRACE_UNUSED VALUE _self,
+  VALUE async_exporter,
+  VALUE native_exporter,
+  VALUE upload_timeout_milliseconds,
+  VALUE start_timespec_seconds,
+  VALUE start_timespec_nanoseconds,
+  VALUE finish_timespec_seconds,
+  VALUE finish_timespec_nanoseconds,
+  VALUE pprof_file_name,
+  VALUE pprof_data,
+  VALUE code_provenance_file_name,
+  VALUE code_provenance_data
+);
+static VALUE _native_async_exporter_stop(DDTRACE_UNUSED VALUE _self, VALUE async_exporter, VALUE timeout_milliseconds);
+static VALUE _native_async_exporter_reset_after_fork(DDTRACE_UNUSED VALUE _self, VALUE async_exporter);
+static VALUE _native_async_exporter_stats(DDTRACE_UNUSED VALUE _self, VALUE async_exporter);
+static struct async_exporter_state *async_exporter_state_for(VALUE async_exporter);
+static queued_export *queued_export_new(
+  ddog_Timespec start,
+  ddog_Timespec finish,
+  uint64_t timeout_milliseconds,
+  ddog_prof_Exporter_Slice_File files
+);
+static void queued_export_free(queued_export *export);
+static void async_exporter_push(struct async_exporter_state *state, queued_export *export);
+static queued_export *async_exporter_pop(struct async_exporter_state *state);
+static unsigned long async_exporter_drop_all(struct async_exporter_state *state);
+static void *async_exporter_thread_main(void *state_ptr);
+static bool async_export_attempt(queued_export *export, ddog_CancellationToken *cancel_token, bool *retryable, char *failure, size_t failure_size);
+static void async_exporter_wait_for_retry(struct async_exporter_state *state, unsigned int attempts);
+static void *async_exporter_stop_without_gvl(void *call_args);
+static void async_exporter_state_free(struct async_exporter_state *state);
+static struct timespec deadline_after_milliseconds(uint64_t milliseconds);
 
 void http_transport_init(VALUE profiling_module) {
   http_transport_class = rb_define_class_under(profiling_module, "HttpTransport", rb_cObject);
 
   rb_define_singleton_method(http_transport_class, "_native_validate_exporter",  _native_validate_exporter, 1);
-  rb_define_singleton_method(http_transport_class, "_native_do_export",  _native_do_export, 11);
+  rb_define_singleton_method(http_transport_class, "_native_do_export",  _native_do_export, 10);
+
+  native_exporter_class = rb_define_class_under(http_transport_class, "NativeExporter", rb_cObject);
+  rb_global_variable(&native_exporter_class);
+  // Instances can only be created via _native_new
+  rb_undef_alloc_func(native_exporter_class);
+  rb_define_singleton_method(native_exporter_class, "_native_new", _native_exporter_new, 2);
+
+  VALUE async_exporter_class = rb_define_class_under(http_transport_class, "AsyncExporter", rb_cObject);
+  // See stack_recorder.c for why we need to define the allocation function for TypedData objects
+  rb_define_alloc_func(async_exporter_class, _native_async_exporter_new);
+  rb_define_singleton_method(async_exporter_class, "_native_initialize", _native_async_exporter_initialize, 5);
+  rb_define_singleton_method(async_exporter_class, "_native_enqueue", _native_async_exporter_enqueue, 11);
+  rb_define_singleton_method(async_exporter_class, "_native_stop", _native_async_exporter_stop, 2);
+  rb_define_singleton_method(async_exporter_class, "_native_reset_after_fork", _native_async_exporter_reset_after_fork, 1);
+  rb_define_singleton_method(async_exporter_class, "_native_stats", _native_async_exporter_stats, 1);
 
   ok_symbol = ID2SYM(rb_intern_const("ok"));
   error_symbol = ID2SYM(rb_intern_const("error"));
   agentless_id = rb_intern_const("agentless");
   agent_id = rb_intern_const("agent");
+  agent_uds_id = rb_intern_const("agent_uds");
   log_failure_to_process_tag_id = rb_intern_const("log_failure_to_process_tag");
 
   library_version_string = ddtrace_version();
   rb_global_variable(&library_version_string);
 }
 
-inline static ddog_ByteSlice byte_slice_from_ruby_string(VALUE string) {
-  ENFORCE_TYPE(string, T_STRING);
-  ddog_ByteSlice byte_slice = {.ptr = (uint8_t *) StringValuePtr(string), .len = RSTRING_LEN(string)};
-  return byte_slice;
+// The pprof data can either be a Ruby string, or a StackRecorder::EncodedProfile, in which case we use its native
+// buffer directly, without needing to copy it into a Ruby string first
+static ddog_ByteSlice byte_slice_from_pprof_data(VALUE pprof_data) {
+  ddog_ByteSlice byte_slice;
+  if (encoded_profile_byte_slice(pprof_data, &byte_slice)) return byte_slice;
+  return byte_slice_from_ruby_string(pprof_data);
 }
 
 static VALUE _native_validate_exporter(DDTRACE_UNUSED VALUE _self, VALUE exporter_configuration) {
@@ -121,8 +339,11 @@ static ddog_Endpoint endpoint_from(VALUE exporter_configuration) {
 
   ID working_mode = SYM2ID(rb_ary_entry(exporter_configuration, 0)); // SYM2ID verifies its input so we can do this safely
 
-  if (working_mode != agentless_id && working_mode != agent_id) {
-    rb_raise(rb_eArgError, "Failed to initialize transport: Unexpected working mode, expected :agentless or :agent");
+  if (working_mode != agentless_id && working_mode != agent_id && working_mode != agent_uds_id) {
+    rb_raise(
+      rb_eArgError,
+      "Failed to initialize transport: Unexpected working mode, expected :agentless, :agent or :agent_uds"
+    );
   }
 
   if (working_mode == agentless_id) {
@@ -132,6 +353,29 @@ static ddog_Endpoint endpoint_from(VALUE exporter_configuration) {
     ENFORCE_TYPE(api_key, T_STRING);
 
     return ddog_Endpoint_agentless(char_slice_from_ruby_string(site), char_slice_from_ruby_string(api_key));
+  } else if (working_mode == agent_uds_id) {
+    VALUE uds_path = rb_ary_entry(exporter_configuration, 1);
+    ENFORCE_TYPE(uds_path, T_STRING);
+
+    // Validate the path upfront, as otherwise we'd only find out about these issues when trying to connect
+    if (RSTRING_LEN(uds_path) == 0) {
+      rb_raise(rb_eArgError, "Failed to initialize transport: Unix domain socket path is empty");
+    }
+    if ((size_t) RSTRING_LEN(uds_path) >= sizeof(((struct sockaddr_un *) 0)->sun_path)) {
+      rb_raise(
+        rb_eArgError,
+        "Failed to initialize transport: Unix domain socket path is too long (%ld bytes, max is %zu)",
+        RSTRING_LEN(uds_path),
+        sizeof(((struct sockaddr_un *) 0)->sun_path) - 1
+      );
+    }
+
+    // libdatadog picks its unix domain socket connector based on the url scheme
+    VALUE base_url = rb_str_plus(rb_str_new_cstr("unix://"), uds_path);
+    ddog_Endpoint endpoint = ddog_Endpoint_agent(char_slice_from_ruby_string(base_url));
+    RB_GC_GUARD(base_url);
+
+    return endpoint;
   } else { // agent_id
     VALUE base_url = rb_ary_entry(exporter_configuration, 1);
     ENFORCE_TYPE(base_url, T_STRING);
@@ -197,28 +441,30 @@ static void safely_log_failure_to_process_tag(ddog_Vec_Tag tags, VALUE err_detai
 // Note: This function handles a bunch of libdatadog dynamically-allocated objects, so it MUST not use any Ruby APIs
 // which can raise exceptions, otherwise the objects will be leaked.
 static VALUE perform_export(
-  ddog_prof_Exporter *exporter,
+  shared_exporter *exporter,
   ddog_Timespec start,
   ddog_Timespec finish,
   ddog_prof_Exporter_Slice_File slice_files,
   ddog_Vec_Tag *additional_tags,
   uint64_t timeout_milliseconds
 ) {
-  ddog_prof_ProfiledEndpointsStats *endpoints_stats = NULL; // Not in use yet
-  ddog_prof_Exporter_Request_BuildResult build_result =
-    ddog_prof_Exporter_Request_build(exporter, start, finish, slice_files, additional_tags, endpoints_stats, timeout_milliseconds);
-
-  if (build_result.tag == DDOG_PROF_EXPORTER_REQUEST_BUILD_RESULT_ERR) {
-    ddog_prof_Exporter_drop(exporter);
-    return rb_ary_new_from_args(2, error_symbol, get_error_details_and_drop(&build_result.err));
-  }
-
   ddog_CancellationToken *cancel_token = ddog_CancellationToken_new();
 
-  // We'll release the Global VM Lock while we're calling send, so that the Ruby VM can continue to work while this
-  // is pending
-  struct call_exporter_without_gvl_arguments args =
-    {.exporter = exporter, .build_result = &build_result, .cancel_token = cancel_token, .send_ran = false};
+  // We'll release the Global VM Lock while we're building the request (which is where libdatadog compresses the files
+  // being reported) and calling send, so that the Ruby VM can continue to work while this is pending.
+  //
+  // Note that the files being reported may point at Ruby strings: these are kept alive (and pinned) by being arguments
+  // to _native_do_export, which is on the stack until we return.
+  struct call_exporter_without_gvl_arguments args = {
+    .exporter = exporter,
+    .start = start,
+    .finish = finish,
+    .slice_files = slice_files,
+    .additional_tags = additional_tags,
+    .timeout_milliseconds = timeout_milliseconds,
+    .cancel_token = cancel_token,
+    .export_ran = false,
+  };
 
   // We use rb_thread_call_without_gvl2 instead of rb_thread_call_without_gvl as the gvl2 variant never raises any
   // exceptions.
@@ -234,27 +480,24 @@ static VALUE perform_export(
   // and in that case we also give up and break out of the loop.
   int pending_exception = 0;
 
-  while (!args.send_ran && !pending_exception) {
+  while (!args.export_ran && !pending_exception) {
     rb_thread_call_without_gvl2(call_exporter_without_gvl, &args, interrupt_exporter_call, cancel_token);
 
-    // To make sure we don't leak memory, we never check for pending exceptions if send ran
-    if (!args.send_ran) pending_exception = check_if_pending_exception();
+    // To make sure we don't leak memory, we never check for pending exceptions if the export ran
+    if (!args.export_ran) pending_exception = check_if_pending_exception();
   }
 
-  // Cleanup exporter and token, no longer needed
+  // Cleanup token, no longer needed
   ddog_CancellationToken_drop(cancel_token);
-  ddog_prof_Exporter_drop(exporter);
 
-  if (pending_exception) {
-    // If we got here send did not run, so we need to explicitly dispose of the request
-    ddog_prof_Exporter_Request_drop(&build_result.ok);
+  // If we got here without the export having run, no request was built, so there's nothing else to clean up.
+  // Let Ruby propagate the exception. This will not return.
+  if (pending_exception) rb_jump_tag(pending_exception);
 
-    // Let Ruby propagate the exception. This will not return.
-    rb_jump_tag(pending_exception);
+  if (args.build_result.tag == DDOG_PROF_EXPORTER_REQUEST_BUILD_RESULT_ERR) {
+    return rb_ary_new_from_args(2, error_symbol, get_error_details_and_drop(&args.build_result.err));
   }
 
-  // The request itself does not need to be freed as libdatadog takes ownership of it as part of sending.
-
   ddog_prof_Exporter_SendResult result = args.result;
 
   return result.tag == DDOG_PROF_EXPORTER_SEND_RESULT_HTTP_RESPONSE ?
@@ -264,7 +507,7 @@ static VALUE perform_export(
 
 static VALUE _native_do_export(
   DDTRACE_UNUSED VALUE _self,
-  VALUE exporter_configuration,
+  VALUE native_exporter,
   VALUE upload_timeout_milliseconds,
   VALUE start_timespec_seconds,
   VALUE start_timespec_nanoseconds,
@@ -273,16 +516,15 @@ static VALUE _native_do_export(
   VALUE pprof_file_name,
   VALUE pprof_data,
   VALUE code_provenance_file_name,
-  VALUE code_provenance_data,
-  VALUE tags_as_array
+  VALUE code_provenance_data
 ) {
+  shared_exporter *exporter = shared_exporter_for(native_exporter);
   ENFORCE_TYPE(upload_timeout_milliseconds, T_FIXNUM);
   ENFORCE_TYPE(start_timespec_seconds, T_FIXNUM);
   ENFORCE_TYPE(start_timespec_nanoseconds, T_FIXNUM);
   ENFORCE_TYPE(finish_timespec_seconds, T_FIXNUM);
   ENFORCE_TYPE(finish_timespec_nanoseconds, T_FIXNUM);
   ENFORCE_TYPE(pprof_file_name, T_STRING);
-  ENFORCE_TYPE(pprof_data, T_STRING);
   ENFORCE_TYPE(code_provenance_file_name, T_STRING);
 
   // Code provenance can be disabled and in that case will be set to nil
@@ -302,7 +544,7 @@ static VALUE _native_do_export(
 
   files[0] = (ddog_prof_Exporter_File) {
     .name = char_slice_from_ruby_string(pprof_file_name),
-    .file = byte_slice_from_ruby_string(pprof_data)
+    .file = byte_slice_from_pprof_data(pprof_data)
   };
   if (have_code_provenance) {
     files[1] = (ddog_prof_Exporter_File) {
@@ -313,22 +555,121 @@ static VALUE _native_do_export(
 
   ddog_Vec_Tag *null_additional_tags = NULL;
 
+  return perform_export(exporter, start, finish, slice_files, null_additional_tags, timeout_milliseconds);
+}
+
+static void *call_exporter_without_gvl(void *call_args) {
+  struct call_exporter_without_gvl_arguments *args = (struct call_exporter_without_gvl_arguments*) call_args;
+
+  shared_exporter_send(
+    args->exporter,
+    args->start,
+    args->finish,
+    args->slice_files,
+    args->additional_tags,
+    args->timeout_milliseconds,
+    args->cancel_token,
+    &args->build_result,
+    &args->result
+  );
+  args->export_ran = true;
+
+  return NULL; // Unused
+}
+
+// This structure is used to define a Ruby object that holds a reference to a shared_exporter
+static const rb_data_type_t native_exporter_typed_data = {
+  .wrap_struct_name = "Datadog::Profiling::HttpTransport::NativeExporter",
+  .function = {
+    .dfree = native_exporter_typed_data_free,
+    .dsize = NULL, // We don't track memory usage (although it'd be cool if we did!)
+    // No need to provide dmark nor dcompact, as there are no Ruby VALUEs being referenced
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+// Returns [:ok, native_exporter] or [:error, error_details]
+static VALUE _native_exporter_new(DDTRACE_UNUSED VALUE _self, VALUE exporter_configuration, VALUE tags_as_array) {
+  // Allocated before the exporter gets created, so we never need to raise while holding on to it
+  VALUE native_exporter = TypedData_Wrap_Struct(native_exporter_class, &native_exporter_typed_data, NULL);
+
   ddog_prof_Exporter_NewResult exporter_result = create_exporter(exporter_configuration, tags_as_array);
   // Note: Do not add anything that can raise exceptions after this line, as otherwise the exporter memory will leak
 
   VALUE failure_tuple = handle_exporter_failure(exporter_result);
   if (!NIL_P(failure_tuple)) return failure_tuple;
 
-  return perform_export(exporter_result.ok, start, finish, slice_files, null_additional_tags, timeout_milliseconds);
+  shared_exporter *exporter = calloc(1, sizeof(shared_exporter));
+  if (exporter == NULL || pthread_mutex_init(&exporter->mutex, NULL) != 0) {
+    free(exporter);
+    ddog_prof_Exporter_drop(exporter_result.ok);
+    return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr("Failed to allocate memory for exporter"));
+  }
+
+  exporter->exporter = exporter_result.ok;
+  atomic_init(&exporter->references, 1);
+  DATA_PTR(native_exporter) = exporter;
+
+  return rb_ary_new_from_args(2, ok_symbol, native_exporter);
 }
 
-static void *call_exporter_without_gvl(void *call_args) {
-  struct call_exporter_without_gvl_arguments *args = (struct call_exporter_without_gvl_arguments*) call_args;
+static void native_exporter_typed_data_free(void *exporter_ptr) {
+  if (exporter_ptr != NULL) shared_exporter_release((shared_exporter *) exporter_ptr);
+}
+
+static shared_exporter *shared_exporter_for(VALUE native_exporter) {
+  shared_exporter *exporter;
+  TypedData_Get_Struct(native_exporter, shared_exporter, &native_exporter_typed_data, exporter);
+  if (exporter == NULL) rb_raise(rb_eRuntimeError, "Unexpected uninitialized NativeExporter");
+  return exporter;
+}
+
+static shared_exporter *shared_exporter_acquire(shared_exporter *exporter) {
+  atomic_fetch_add(&exporter->references, 1);
+  return exporter;
+}
 
-  args->result = ddog_prof_Exporter_send(args->exporter, &args->build_result->ok, args->cancel_token);
-  args->send_ran = true;
+// Does not raise, safe to call without the GVL
+static void shared_exporter_release(shared_exporter *exporter) {
+  if (atomic_fetch_sub(&exporter->references, 1) != 1) return;
 
-  return NULL; // Unused
+  ddog_prof_Exporter_drop(exporter->exporter);
+  pthread_mutex_destroy(&exporter->mutex);
+  free(exporter);
+}
+
+// Builds the request (which is where libdatadog compresses the files being reported) and sends it.
+// Does not interact with the Ruby VM and does not raise, so it's safe to call without the GVL.
+static void shared_exporter_send(
+  shared_exporter *exporter,
+  ddog_Timespec start,
+  ddog_Timespec finish,
+  ddog_prof_Exporter_Slice_File slice_files,
+  ddog_Vec_Tag *additional_tags,
+  uint64_t timeout_milliseconds,
+  ddog_CancellationToken *cancel_token,
+  ddog_prof_Exporter_Request_BuildResult *build_result,
+  ddog_prof_Exporter_SendResult *send_result
+) {
+  pthread_mutex_lock(&exporter->mutex);
+
+  ddog_prof_ProfiledEndpointsStats *endpoints_stats = NULL; // Not in use yet
+  *build_result = ddog_prof_Exporter_Request_build(
+    exporter->exporter,
+    start,
+    finish,
+    slice_files,
+    additional_tags,
+    endpoints_stats,
+    timeout_milliseconds
+  );
+
+  // The request itself does not need to be freed as libdatadog takes ownership of it as part of sending.
+  if (build_result->tag == DDOG_PROF_EXPORTER_REQUEST_BUILD_RESULT_OK) {
+    *send_result = ddog_prof_Exporter_send(exporter->exporter, &build_result->ok, cancel_token);
+  }
+
+  pthread_mutex_unlock(&exporter->mutex);
 }
 
 // Called by Ruby when it wants to interrupt call_exporter_without_gvl above, e.g. when the app wants to exit cleanly
@@ -345,3 +686,521 @@ static VALUE ddtrace_version(void) {
   ENFORCE_TYPE(version_string, T_STRING);
   return version_string;
 }
+
+// This structure is used to define a Ruby object that stores the state of an AsyncExporter
+static const rb_data_type_t async_exporter_typed_data = {
+  .wrap_struct_name = "Datadog::Profiling::HttpTransport::AsyncExporter",
+  .function = {
+    .dfree = async_exporter_typed_data_free,
+    .dsize = NULL, // We don't track memory usage (although it'd be cool if we did!)
+    // No need to provide dmark nor dcompact, as there are no Ruby VALUEs being referenced
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE _native_async_exporter_new(VALUE klass) {
+  // Note: Not allocated with ruby_xcalloc, as the state may get freed by the background thread, without the GVL
+  struct async_exporter_state *state = calloc(1, sizeof(struct async_exporter_state));
+  if (state == NULL) rb_raise(rb_eNoMemError, "Failed to allocate AsyncExporter");
+
+  ENFORCE_SUCCESS_GVL(pthread_mutex_init(&state->mutex, NULL));
+  ENFORCE_SUCCESS_GVL(pthread_cond_init(&state->state_changed, NULL));
+
+  return TypedData_Wrap_Struct(klass, &async_exporter_typed_data, state);
+}
+
+// Does not block waiting for the background thread; see "Asynchronous exports" notes above
+static void async_exporter_typed_data_free(void *state_ptr) {
+  struct async_exporter_state *state = (struct async_exporter_state *) state_ptr;
+
+  // After a fork, the background thread (if any) belongs to the parent process
+  if (state->thread_running && state->thread_pid == getpid()) {
+    pthread_mutex_lock(&state->mutex);
+    state->orphaned = true;
+    state->stop_requested = true;
+    if (state->cancel_token != NULL) ddog_CancellationToken_cancel(state->cancel_token);
+    pthread_cond_broadcast(&state->state_changed);
+    pthread_mutex_unlock(&state->mutex);
+
+    pthread_detach(state->thread);
+    return;
+  }
+
+  async_exporter_state_free(state);
+}
+
+// Does not raise, safe to call without the GVL. Any queued exports get dropped.
+static void async_exporter_state_free(struct async_exporter_state *state) {
+  async_exporter_drop_all(state);
+  free(state->queue);
+
+  pthread_mutex_destroy(&state->mutex);
+  pthread_cond_destroy(&state->state_changed);
+
+  free(state);
+}
+
+static struct async_exporter_state *async_exporter_state_for(VALUE async_exporter) {
+  struct async_exporter_state *state;
+  TypedData_Get_Struct(async_exporter, struct async_exporter_state, &async_exporter_typed_data, state);
+  return state;
+}
+
+static VALUE _native_async_exporter_initialize(
+  DDTRACE_UNUSED VALUE _self,
+  VALUE async_exporter,
+  VALUE max_queued_exports,
+  VALUE max_attempts,
+  VALUE initial_backoff_milliseconds,
+  VALUE max_backoff_milliseconds
+) {
+  ENFORCE_TYPE(max_queued_exports, T_FIXNUM);
+  ENFORCE_TYPE(max_attempts, T_FIXNUM);
+  ENFORCE_TYPE(initial_backoff_milliseconds, T_FIXNUM);
+  ENFORCE_TYPE(max_backoff_milliseconds, T_FIXNUM);
+
+  struct async_exporter_state *state = async_exporter_state_for(async_exporter);
+
+  if (state->queue != NULL) rb_raise(rb_eRuntimeError, "AsyncExporter was already initialized");
+  if (NUM2INT(max_queued_exports) < 1) rb_raise(rb_eArgError, "Unexpected max_queued_exports, must be at least 1");
+  if (NUM2INT(max_attempts) < 1) rb_raise(rb_eArgError, "Unexpected max_attempts, must be at least 1");
+
+  state->max_queued_exports = NUM2UINT(max_queued_exports);
+  state->max_attempts = NUM2UINT(max_attempts);
+  state->initial_backoff_milliseconds = NUM2UINT(initial_backoff_milliseconds);
+  state->max_backoff_milliseconds = NUM2UINT(max_backoff_milliseconds);
+
+  state->queue = calloc(state->max_queued_exports, sizeof(queued_export *));
+  if (state->queue == NULL) rb_raise(rb_eNoMemError, "Failed to allocate AsyncExporter queue");
+
+  return Qtrue;
+}
+
+static VALUE _native_async_exporter_enqueue(
+  DDTRACE_UNUSED VALUE _self,
+  VALUE async_exporter,
+  VALUE native_exporter,
+  VALUE upload_timeout_milliseconds,
+  VALUE start_timespec_seconds,
+  VALUE start_timespec_nanoseconds,
+  VALUE finish_timespec_seconds,
+  VALUE finish_timespec_nanoseconds,
+  VALUE pprof_file_name,
+  VALUE pprof_data,
+  VALUE code_provenance_file_name,
+  VALUE code_provenance_data
+) {
+  shared_exporter *exporter = shared_exporter_for(native_exporter);
+  ENFORCE_TYPE(upload_timeout_milliseconds, T_FIXNUM);
+  ENFORCE_TYPE(start_timespec_seconds, T_FIXNUM);
+  ENFORCE_TYPE(start_timespec_nanoseconds, T_FIXNUM);
+  ENFORCE_TYPE(finish_timespec_seconds, T_FIXNUM);
+  ENFORCE_TYPE(finish_timespec_nanoseconds, T_FIXNUM);
+  ENFORCE_TYPE(pprof_file_name, T_STRING);
+  ENFORCE_TYPE(code_provenance_file_name, T_STRING);
+
+  struct async_exporter_state *state = async_exporter_state_for(async_exporter);
+  if (state->queue == NULL) rb_raise(rb_eRuntimeError, "AsyncExporter was not initialized");
+
+  // Code provenance can be disabled and in that case will be set to nil
+  bool have_code_provenance = !NIL_P(code_provenance_data);
+  if (have_code_provenance) ENFORCE_TYPE(code_provenance_data, T_STRING);
+
+  uint64_t timeout_milliseconds = NUM2ULONG(upload_timeout_milliseconds);
+
+  ddog_Timespec start =
+    {.seconds = NUM2LONG(start_timespec_seconds), .nanoseconds = NUM2UINT(start_timespec_nanoseconds)};
+  ddog_Timespec finish =
+    {.seconds = NUM2LONG(finish_timespec_seconds), .nanoseconds = NUM2UINT(finish_timespec_nanoseconds)};
+
+  int files_to_report = 1 + (have_code_provenance ? 1 : 0);
+  ddog_prof_Exporter_File files[ASYNC_EXPORT_MAX_FILES];
+  ddog_prof_Exporter_Slice_File slice_files = {.ptr = files, .len = files_to_report};
+
+  files[0] = (ddog_prof_Exporter_File) {
+    .name = char_slice_from_ruby_string(pprof_file_name),
+    .file = byte_slice_from_pprof_data(pprof_data)
+  };
+  if (have_code_provenance) {
+    files[1] = (ddog_prof_Exporter_File) {
+      .name = char_slice_from_ruby_string(code_provenance_file_name),
+      .file = byte_slice_from_ruby_string(code_provenance_data)
+    };
+  }
+
+  queued_export *export = queued_export_new(start, finish, timeout_milliseconds, slice_files);
+  if (export == NULL) {
+    return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr("Failed to allocate memory for queued export"));
+  }
+  // Note: Do not add anything that can raise exceptions after this line, as otherwise the export memory will leak
+  export->exporter = shared_exporter_acquire(exporter);
+
+  pthread_mutex_lock(&state->mutex);
+
+  if (state->shut_down) {
+    pthread_mutex_unlock(&state->mutex);
+    queued_export_free(export);
+    return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr("AsyncExporter was shut down"));
+  }
+
+  int error = 0;
+  if (!state->thread_running) {
+    state->draining = false;
+    state->stop_requested = false;
+    error = pthread_create(&state->thread, NULL, async_exporter_thread_main, state);
+    if (!error) {
+      state->thread_running = true;
+      state->thread_pid = getpid();
+    }
+  }
+
+  if (!error) async_exporter_push(state, export);
+  unsigned int queue_count = state->queue_count;
+  pthread_cond_broadcast(&state->state_changed);
+
+  pthread_mutex_unlock(&state->mutex);
+
+  if (error) {
+    queued_export_free(export);
+    ENFORCE_SUCCESS_GVL(error);
+  }
+
+  return rb_ary_new_from_args(2, ok_symbol, UINT2NUM(queue_count));
+}
+
+// Does not raise, returns NULL if any allocation failed
+static queued_export *queued_export_new(
+  ddog_Timespec start,
+  ddog_Timespec finish,
+  uint64_t timeout_milliseconds,
+  ddog_prof_Exporter_Slice_File files
+) {
+  queued_export *export = calloc(1, sizeof(queued_export));
+  if (export == NULL) return NULL;
+
+  export->start = start;
+  export->finish = finish;
+  export->timeout_milliseconds = timeout_milliseconds;
+
+  for (uintptr_t i = 0; i < files.len && i < ASYNC_EXPORT_MAX_FILES; i++) {
+    queued_file *file = &export->files[i];
+    ddog_prof_Exporter_File source = files.ptr[i];
+
+    file->name = malloc(source.name.len);
+    file->data = malloc(source.file.len);
+    export->files_count++;
+
+    if ((file->name == NULL && source.name.len > 0) || (file->data == NULL && source.file.len > 0)) {
+      queued_export_free(export);
+      return NULL;
+    }
+
+    if (source.name.len > 0) memcpy(file->name, source.name.ptr, source.name.len);
+    if (source.file.len > 0) memcpy(file->data, source.file.ptr, source.file.len);
+    file->name_len = source.name.len;
+    file->data_len = source.file.len;
+  }
+
+  return export;
+}
+
+// Does not raise, safe to call without the GVL
+static void queued_export_free(queued_export *export) {
+  if (export->exporter != NULL) shared_exporter_release(export->exporter);
+
+  for (int i = 0; i < export->files_count; i++) {
+    free(export->files[i].name);
+    free(export->files[i].data);
+  }
+
+  free(export);
+}
+
+// Assumption: Called while holding the mutex
+static void async_exporter_push(struct async_exporter_state *state, queued_export *export) {
+  if (state->queue_count == state->max_queued_exports) {
+    // Make room by dropping the oldest export
+    queued_export_free(async_exporter_pop(state));
+    state->stats.exports_dropped_queue_full++;
+  }
+
+  state->queue[(state->queue_head + state->queue_count) % state->max_queued_exports] = export;
+  state->queue_count++;
+  state->stats.exports_queued++;
+}
+
+// Assumption: Called while holding the mutex
+static queued_export *async_exporter_pop(struct async_exporter_state *state) {
+  if (state->queue_count == 0) return NULL;
+
+  queued_export *export = state->queue[state->queue_head];
+  state->queue[state->queue_head] = NULL;
+  state->queue_head = (state->queue_head + 1) % state->max_queued_exports;
+  state->queue_count--;
+
+  return export;
+}
+
+// Assumption: Called while holding the mutex (or when there's no other thread), and while the background thread
+// is not running. Returns how many exports were dropped.
+static unsigned long async_exporter_drop_all(struct async_exporter_state *state) {
+  unsigned long dropped = 0;
+
+  if (state->in_flight != NULL) {
+    queued_export_free(state->in_flight);
+    state->in_flight = NULL;
+    dropped++;
+  }
+
+  queued_export *export;
+  while ((export = async_exporter_pop(state)) != NULL) {
+    queued_export_free(export);
+    dropped++;
+  }
+
+  return dropped;
+}
+
+static void *async_exporter_thread_main(void *state_ptr) {
+  struct async_exporter_state *state = (struct async_exporter_state *) state_ptr;
+  char failure[ASYNC_EXPORT_FAILURE_MESSAGE_SIZE];
+
+  pthread_mutex_lock(&state->mutex);
+
+  while (true) {
+    while (state->queue_count == 0 && !state->stop_requested) pthread_cond_wait(&state->state_changed, &state->mutex);
+    if (state->stop_requested) break;
+
+    state->in_flight = async_exporter_pop(state);
+    bool finished = false;
+
+    while (!finished && !state->stop_requested) {
+      ddog_CancellationToken *cancel_token = ddog_CancellationToken_new();
+      state->cancel_token = cancel_token;
+
+      // Only this thread touches the in-flight export, so it's safe to report it without holding the mutex
+      pthread_mutex_unlock(&state->mutex);
+      bool retryable = false;
+      bool success = async_export_attempt(state->in_flight, cancel_token, &retryable, failure, sizeof(failure));
+      pthread_mutex_lock(&state->mutex);
+
+      state->cancel_token = NULL;
+      ddog_CancellationToken_drop(cancel_token);
+      state->in_flight->attempts++;
+
+      if (success) {
+        state->stats.exports_succeeded++;
+        finished = true;
+        continue;
+      }
+
+      // The request was cancelled by the thread that's stopping us
+      if (state->stop_requested) break;
+
+      state->stats.has_failure = true;
+      memcpy(state->stats.last_failure, failure, sizeof(failure));
+
+      if (!retryable || state->in_flight->attempts >= state->max_attempts || state->draining) {
+        state->stats.exports_failed++;
+        finished = true;
+        continue;
+      }
+
+      state->stats.export_retries++;
+      async_exporter_wait_for_retry(state, state->in_flight->attempts);
+    }
+
+    if (!finished) break; // Stop was requested; the in-flight export gets dropped by the thread that's stopping us
+
+    queued_export_free(state->in_flight);
+    state->in_flight = NULL;
+    pthread_cond_broadcast(&state->state_changed);
+  }
+
+  bool orphaned = state->orphaned;
+  pthread_mutex_unlock(&state->mutex);
+
+  // See async_exporter_typed_data_free
+  if (orphaned) async_exporter_state_free(state);
+
+  return NULL;
+}
+
+// Does not interact with the Ruby VM, and does not raise. Returns true if the export was successfully reported; if not,
+// `failure` gets filled in with the reason, and `retryable` is set if it's worth retrying.
+static bool async_export_attempt(queued_export *export, ddog_CancellationToken *cancel_token, bool *retryable, char *failure, size_t failure_size) {
+  ddog_prof_Exporter_File files[ASYNC_EXPORT_MAX_FILES];
+  for (int i = 0; i < export->files_count; i++) {
+    files[i] = (ddog_prof_Exporter_File) {
+      .name = {.ptr = export->files[i].name, .len = export->files[i].name_len},
+      .file = {.ptr = export->files[i].data, .len = export->files[i].data_len},
+    };
+  }
+  ddog_prof_Exporter_Slice_File slice_files = {.ptr = files, .len = export->files_count};
+
+  ddog_Vec_Tag *null_additional_tags = NULL;
+  ddog_prof_Exporter_Request_BuildResult build_result;
+  ddog_prof_Exporter_SendResult result;
+  shared_exporter_send(
+    export->exporter,
+    export->start,
+    export->finish,
+    slice_files,
+    null_additional_tags,
+    export->timeout_milliseconds,
+    cancel_token,
+    &build_result,
+    &result
+  );
+
+  if (build_result.tag == DDOG_PROF_EXPORTER_REQUEST_BUILD_RESULT_ERR) {
+    ddog_CharSlice message = ddog_Error_message(&build_result.err);
+    snprintf(failure, failure_size, "%.*s", (int) message.len, message.ptr);
+    ddog_Error_drop(&build_result.err);
+    *retryable = false;
+    return false;
+  }
+
+  if (result.tag != DDOG_PROF_EXPORTER_SEND_RESULT_HTTP_RESPONSE) {
+    ddog_CharSlice message = ddog_Error_message(&result.err);
+    snprintf(failure, failure_size, "%.*s", (int) message.len, message.ptr);
+    ddog_Error_drop(&result.err);
+    *retryable = true;
+    return false;
+  }
+
+  uint16_t code = result.http_response.code;
+  if (code >= 200 && code <= 299) return true;
+
+  snprintf(failure, failure_size, "server returned unexpected HTTP %d status code", code);
+  *retryable = code == 408 || code == 429 || code >= 500;
+  return false;
+}
+
+// Assumption: Called while holding the mutex. Returns early if draining or stopping.
+static void async_exporter_wait_for_retry(struct async_exporter_state *state, unsigned int attempts) {
+  uint64_t backoff_milliseconds = state->initial_backoff_milliseconds;
+  for (unsigned int i = 1; i < attempts && backoff_milliseconds < state->max_backoff_milliseconds; i++) backoff_milliseconds *= 2;
+  if (backoff_milliseconds > state->max_backoff_milliseconds) backoff_milliseconds = state->max_backoff_milliseconds;
+
+  struct timespec deadline = deadline_after_milliseconds(backoff_milliseconds);
+  int error = 0;
+
+  while (!state->draining && !state->stop_requested && error != ETIMEDOUT) {
+    error = pthread_cond_timedwait(&state->state_changed, &state->mutex, &deadline);
+  }
+}
+
+// Stops the AsyncExporter for good, see "Asynchronous exports" notes above. Returns how many exports were dropped.
+static VALUE _native_async_exporter_stop(DDTRACE_UNUSED VALUE _self, VALUE async_exporter, VALUE timeout_milliseconds) {
+  ENFORCE_TYPE(timeout_milliseconds, T_FIXNUM);
+
+  struct async_exporter_state *state = async_exporter_state_for(async_exporter);
+  uint64_t timeout = NUM2ULONG(timeout_milliseconds);
+  unsigned long dropped_before = state->stats.exports_dropped_on_stop;
+
+  // This is bounded by the timeout, as well as by libdatadog reacting to the cancellation of the in-flight request, so
+  // we don't provide an interruption function.
+  void *call_args[2] = {state, &timeout};
+  rb_thread_call_without_gvl(async_exporter_stop_without_gvl, call_args, NULL, NULL);
+
+  return ULONG2NUM(state->stats.exports_dropped_on_stop - dropped_before);
+}
+
+// Drains the queue for up to the given timeout, and then stops the background thread. Does not raise.
+static void *async_exporter_stop_without_gvl(void *call_args) {
+  struct async_exporter_state *state = (struct async_exporter_state *) ((void **) call_args)[0];
+  uint64_t timeout_milliseconds = *((uint64_t *) ((void **) call_args)[1]);
+
+  pthread_mutex_lock(&state->mutex);
+
+  state->shut_down = true;
+
+  if (!state->thread_running) {
+    pthread_mutex_unlock(&state->mutex);
+    return NULL;
+  }
+
+  state->draining = true;
+  pthread_cond_broadcast(&state->state_changed);
+
+  struct timespec deadline = deadline_after_milliseconds(timeout_milliseconds);
+  int error = 0;
+  while ((state->queue_count > 0 || state->in_flight != NULL) && error != ETIMEDOUT) {
+    error = pthread_cond_timedwait(&state->state_changed, &state->mutex, &deadline);
+  }
+
+  state->stop_requested = true;
+  if (state->cancel_token != NULL) ddog_CancellationToken_cancel(state->cancel_token);
+  pthread_cond_broadcast(&state->state_changed);
+
+  pthread_mutex_unlock(&state->mutex);
+
+  pthread_join(state->thread, NULL);
+
+  pthread_mutex_lock(&state->mutex);
+  state->stats.exports_dropped_on_stop += async_exporter_drop_all(state);
+  state->thread_running = false;
+  state->draining = false;
+  state->stop_requested = false;
+  pthread_mutex_unlock(&state->mutex);
+
+  return NULL;
+}
+
+// Returns how many exports queued by the parent process were discarded, see "Asynchronous exports" notes above
+static VALUE _native_async_exporter_reset_after_fork(DDTRACE_UNUSED VALUE _self, VALUE async_exporter) {
+  struct async_exporter_state *state = async_exporter_state_for(async_exporter);
+
+  // The background thread is not inherited by the child process, and the mutex and condition variable may have been
+  // in any state at the time of the fork, so they get reinitialized here
+  ENFORCE_SUCCESS_GVL(pthread_mutex_init(&state->mutex, NULL));
+  ENFORCE_SUCCESS_GVL(pthread_cond_init(&state->state_changed, NULL));
+
+  // Any exports queued by the parent are its responsibility, so we discard them
+  unsigned long discarded = async_exporter_drop_all(state);
+  state->thread_running = false;
+  state->draining = false;
+  state->stop_requested = false;
+  state->shut_down = false; // The child gets to report its own profiles, even if the parent was stopping
+  state->cancel_token = NULL; // Owned by the parent's background thread
+  memset(&state->stats, 0, sizeof(state->stats));
+
+  return ULONG2NUM(discarded);
+}
+
+static VALUE _native_async_exporter_stats(DDTRACE_UNUSED VALUE _self, VALUE async_exporter) {
+  struct async_exporter_state *state = async_exporter_state_for(async_exporter);
+
+  // Copy everything while holding the mutex, and only then create Ruby objects, as those may raise
+  pthread_mutex_lock(&state->mutex);
+  unsigned int queue_depth = state->queue_count + (state->in_flight != NULL ? 1 : 0);
+  struct async_exporter_stats stats = state->stats;
+  pthread_mutex_unlock(&state->mutex);
+
+  VALUE stats_as_hash = rb_hash_new();
+  VALUE arguments[] = {
+    ID2SYM(rb_intern("queue_depth")),                /* => */ UINT2NUM(queue_depth),
+    ID2SYM(rb_intern("max_queued_exports")),         /* => */ UINT2NUM(state->max_queued_exports),
+    ID2SYM(rb_intern("exports_queued")),             /* => */ ULONG2NUM(stats.exports_queued),
+    ID2SYM(rb_intern("exports_succeeded")),          /* => */ ULONG2NUM(stats.exports_succeeded),
+    ID2SYM(rb_intern("exports_failed")),             /* => */ ULONG2NUM(stats.exports_failed),
+    ID2SYM(rb_intern("export_retries")),             /* => */ ULONG2NUM(stats.export_retries),
+    ID2SYM(rb_intern("exports_dropped_queue_full")), /* => */ ULONG2NUM(stats.exports_dropped_queue_full),
+    ID2SYM(rb_intern("exports_dropped_on_stop")),    /* => */ ULONG2NUM(stats.exports_dropped_on_stop),
+    ID2SYM(rb_intern("last_failure")),               /* => */ stats.has_failure ? rb_str_new_cstr(stats.last_failure) : Qnil,
+  };
+  for (long unsigned int i = 0; i < VALUE_COUNT(arguments); i += 2) rb_hash_aset(stats_as_hash, arguments[i], arguments[i+1]);
+  return stats_as_hash;
+}
+
+static struct timespec deadline_after_milliseconds(uint64_t milliseconds) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline); // pthread_cond_timedwait uses CLOCK_REALTIME by default
+
+  uint64_t nanoseconds = deadline.tv_nsec + (milliseconds % 1000) * 1000000;
+  deadline.tv_sec += milliseconds / 1000 + nanoseconds / 1000000000;
+  deadline.tv_nsec = nanoseconds % 1000000000;
+
+  return deadline;
+}
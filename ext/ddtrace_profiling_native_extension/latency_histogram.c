@@ -0,0 +1,89 @@
+#include <ruby.h>
+
+#include "latency_histogram.h"
+#include "ruby_helpers.h"
+
+// Used to keep track of the distribution of durations (such as how long sampling takes), so that we can report tail
+// latencies and not just the min/max/average.
+//
+// ---
+// ## Bucket layout
+//
+// The histogram is log-linear, similar to an HDR histogram: values below 2^(SUB_BUCKET_BITS + 1) each get their own
+// bucket, and every power of two range above that, [2^n, 2^(n+1)), gets split into 2^SUB_BUCKET_BITS equally-sized
+// buckets. Thus, the value reported for any bucket is within 1/2^SUB_BUCKET_BITS (6.25%) of the recorded values.
+//
+// Values at or above 2^MAX_VALUE_BITS nanoseconds (~18 minutes) get recorded in the last bucket (which then gets
+// reported as the highest recorded value). This keeps the memory needed by the histogram fixed, at a few KiB.
+//
+// Percentiles are reported as the highest value in the bucket they fall into, capped by the highest recorded value.
+// ---
+
+static unsigned int bucket_index_for(uint64_t value);
+static uint64_t highest_value_in_bucket(unsigned int bucket_index);
+
+void latency_histogram_record(latency_histogram *histogram, uint64_t value_ns) {
+  histogram->counts[bucket_index_for(value_ns)]++;
+  histogram->total_count++;
+  if (value_ns > histogram->max_value) histogram->max_value = value_ns;
+}
+
+uint64_t latency_histogram_percentile(latency_histogram *histogram, double percentile) {
+  if (histogram->total_count == 0) return 0;
+
+  // The rank (1-based) of the value we're looking for, e.g. with 10 values, the p90 is the 9th smallest one
+  uint64_t rank = (uint64_t) ((percentile / 100.0) * histogram->total_count + 0.5);
+  if (rank < 1) rank = 1;
+  if (rank > histogram->total_count) rank = histogram->total_count;
+
+  uint64_t seen = 0;
+  for (unsigned int i = 0; i < LATENCY_HISTOGRAM_BUCKET_COUNT; i++) {
+    seen += histogram->counts[i];
+    if (seen >= rank) {
+      // The last bucket also gets any values that were above the histogram range
+      if (i == LATENCY_HISTOGRAM_BUCKET_COUNT - 1) return histogram->max_value;
+
+      uint64_t highest_value = highest_value_in_bucket(i);
+      return highest_value < histogram->max_value ? highest_value : histogram->max_value;
+    }
+  }
+
+  return histogram->max_value; // Not expected to be reached
+}
+
+VALUE latency_histogram_percentiles_as_hash(latency_histogram *histogram) {
+  if (histogram->total_count == 0) return Qnil;
+
+  VALUE percentiles_as_hash = rb_hash_new();
+  VALUE arguments[] = {
+    ID2SYM(rb_intern("p50")),   /* => */ ULL2NUM(latency_histogram_percentile(histogram, 50)),
+    ID2SYM(rb_intern("p90")),   /* => */ ULL2NUM(latency_histogram_percentile(histogram, 90)),
+    ID2SYM(rb_intern("p99")),   /* => */ ULL2NUM(latency_histogram_percentile(histogram, 99)),
+    ID2SYM(rb_intern("p99_9")), /* => */ ULL2NUM(latency_histogram_percentile(histogram, 99.9)),
+  };
+  for (long unsigned int i = 0; i < VALUE_COUNT(arguments); i += 2) rb_hash_aset(percentiles_as_hash, arguments[i], arguments[i+1]);
+  return percentiles_as_hash;
+}
+
+static unsigned int bucket_index_for(uint64_t value) {
+  if (value >> LATENCY_HISTOGRAM_MAX_VALUE_BITS) return LATENCY_HISTOGRAM_BUCKET_COUNT - 1;
+  if (value < (1 << (LATENCY_HISTOGRAM_SUB_BUCKET_BITS + 1))) return (unsigned int) value;
+
+  unsigned int highest_bit = 63 - __builtin_clzll(value);
+  unsigned int shift = highest_bit - LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+  unsigned int sub_bucket = (value >> shift) & ((1 << LATENCY_HISTOGRAM_SUB_BUCKET_BITS) - 1);
+
+  return ((shift + 1) << LATENCY_HISTOGRAM_SUB_BUCKET_BITS) + sub_bucket;
+}
+
+static uint64_t highest_value_in_bucket(unsigned int bucket_index) {
+  unsigned int bucket_group = bucket_index >> LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+  uint64_t sub_bucket = bucket_index & ((1 << LATENCY_HISTOGRAM_SUB_BUCKET_BITS) - 1);
+
+  if (bucket_group == 0) return sub_bucket;
+
+  unsigned int shift = bucket_group - 1;
+  uint64_t lowest_value = ((1ULL << LATENCY_HISTOGRAM_SUB_BUCKET_BITS) + sub_bucket) << shift;
+
+  return lowest_value + (1ULL << shift) - 1;
+}
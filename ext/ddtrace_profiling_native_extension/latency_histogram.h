@@ -0,0 +1,24 @@
+#pragma once
+
+#include <ruby.h>
+#include <stdint.h>
+
+// See latency_histogram.c for details on the bucket layout
+#define LATENCY_HISTOGRAM_SUB_BUCKET_BITS 4
+#define LATENCY_HISTOGRAM_MAX_VALUE_BITS 40
+#define LATENCY_HISTOGRAM_BUCKET_COUNT \
+  ((LATENCY_HISTOGRAM_MAX_VALUE_BITS - LATENCY_HISTOGRAM_SUB_BUCKET_BITS + 1) << LATENCY_HISTOGRAM_SUB_BUCKET_BITS)
+
+// A fixed-memory histogram of durations in nanoseconds. Zero-initialized memory is a valid empty histogram.
+typedef struct {
+  uint64_t counts[LATENCY_HISTOGRAM_BUCKET_COUNT];
+  uint64_t total_count;
+  uint64_t max_value;
+} latency_histogram;
+
+// Safety: Does not allocate nor raise, so it's safe to call from signal handlers and during GC
+void latency_histogram_record(latency_histogram *histogram, uint64_t value_ns);
+// Returns 0 for empty histograms
+uint64_t latency_histogram_percentile(latency_histogram *histogram, double percentile);
+// Returns a hash with the p50/p90/p99/p99.9 values, or nil for empty histograms
+VALUE latency_histogram_percentiles_as_hash(latency_histogram *histogram);
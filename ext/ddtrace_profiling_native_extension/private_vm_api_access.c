@@ -245,6 +245,43 @@ bool is_thread_alive(VALUE thread) {
   return thread_struct_from_object(thread)->status != THREAD_KILLED;
 }
 
+// Returns true if the thread is blocked waiting for something (e.g. `sleep`, `Queue#pop`, `Mutex#lock`, `Thread#join`),
+// with or without a timeout. While in this state, a thread does not run any Ruby code, and thus its stack does not change.
+bool is_thread_stopped(VALUE thread) {
+  enum rb_thread_status status = thread_struct_from_object(thread)->status;
+  return status == THREAD_STOPPED || status == THREAD_STOPPED_FOREVER;
+}
+
+// Gets the owner (class or module) and the original name (e.g. ignoring aliases) of the method that the thread is
+// currently executing, e.g. `Thread::Mutex` and `lock` for a thread blocked in `Mutex#lock`. Returns false if the top
+// frame of the thread does not belong to a method (e.g. a thread that is still starting, or the top-level script).
+//
+// Unlike `ddtrace_rb_profile_frames`, this only looks at the top control frame, and does not allocate.
+bool top_method_for(VALUE thread, VALUE *owner, ID *method_id) {
+  #ifndef USE_THREAD_INSTEAD_OF_EXECUTION_CONTEXT // Modern Rubies
+    const rb_execution_context_t *ec = thread_struct_from_object(thread)->ec;
+  #else // Ruby < 2.5
+    const rb_thread_t *ec = thread_struct_from_object(thread);
+  #endif
+
+  const rb_control_frame_t *cfp = ec->cfp, *end_cfp = RUBY_VM_END_CONTROL_FRAME(ec);
+
+  // Same checks as in `ddtrace_rb_profile_frames`
+  if (end_cfp == NULL || cfp == NULL) return false;
+  end_cfp = RUBY_VM_NEXT_CONTROL_FRAME(end_cfp);
+
+  // Frames with an iseq but no pc are skipped when sampling (see `control_frame_info`), so we skip them here as well
+  while (cfp < end_cfp && cfp->iseq && !cfp->pc) cfp = RUBY_VM_PREVIOUS_CONTROL_FRAME(cfp);
+  if (cfp >= end_cfp) return false;
+
+  const rb_callable_method_entry_t *cme = rb_vm_frame_method_entry(cfp);
+  if (cme == NULL || cme->def == NULL) return false;
+
+  *owner = cme->owner;
+  *method_id = cme->def->original_id;
+  return true;
+}
+
 VALUE thread_name_for(VALUE thread) {
   return thread_struct_from_object(thread)->name;
 }
@@ -351,6 +388,161 @@ calc_lineno(const rb_iseq_t *iseq, const VALUE *pc)
     return 0;
 }
 
+// The bottom of the stack of a thread (e.g. a web server or background job worker) usually stays the same between
+// samples, yet every sample re-walks and re-computes the information for every frame.
+//
+// The stack_walk_cache keeps, for every control frame seen in the previous sample of a thread, enough information
+// to identify if it is still the same frame (iseq, pc, and the method entry/cref slot of its environment) as well as
+// the result we computed for it. Because the control frame stack is contiguous, we index frames by their distance
+// to the bottom of the stack, so that a frame keeps the same position even as the top of the stack grows and shrinks.
+//
+// When sampling, we still walk every frame, but for frames that match the cached information, we skip the (relatively
+// expensive) method entry lookup and line number calculation.
+//
+// Note that we do not stop at the first matching frame and copy the rest: a frame being the same does not mean that
+// every frame below it is the same as well (e.g. the same method may be getting called from a different caller, at the
+// same depth), so each frame gets checked.
+//
+// The cached `frame` VALUEs are not marked. This is OK because we only ever return them when the (still running)
+// control frame matches, and thus they are still alive. They can be moved by GC compaction though, so the cache must be
+// cleared whenever that happens.
+
+#define STACK_WALK_CACHE_MAX_DEPTH 10000 // Frames deeper than this (counting from the bottom) are not cached
+
+typedef struct {
+  bool valid;
+  const void *iseq;
+  const VALUE *pc;
+  VALUE me_cref;
+
+  bool has_frame; // Some control frames get skipped and thus do not have a frame
+  VALUE frame;
+  int line;
+  bool is_ruby_frame;
+} cached_control_frame;
+
+struct stack_walk_cache {
+  int capacity;
+  cached_control_frame *frames;
+};
+
+#ifndef USE_LEGACY_RB_VM_FRAME_METHOD_ENTRY
+  #define ME_CREF_FROM_EP(ep) ((ep)[VM_ENV_DATA_INDEX_ME_CREF])
+#else // Ruby < 2.4, see also the legacy version of rb_vm_frame_method_entry
+  #define ME_CREF_FROM_EP(ep) ((ep)[-1])
+#endif
+
+stack_walk_cache *stack_walk_cache_new(void) {
+  // Note: never returns NULL; if out of memory, it calls the Ruby out-of-memory handlers
+  return ruby_xcalloc(1, sizeof(stack_walk_cache));
+}
+
+void stack_walk_cache_free(stack_walk_cache *cache) {
+  ruby_xfree(cache->frames);
+  ruby_xfree(cache);
+}
+
+void stack_walk_cache_clear(stack_walk_cache *cache) {
+  if (cache->frames != NULL) memset(cache->frames, 0, cache->capacity * sizeof(cached_control_frame));
+}
+
+static void stack_walk_cache_ensure_capacity(stack_walk_cache *cache, int depth) {
+  if (depth > STACK_WALK_CACHE_MAX_DEPTH) depth = STACK_WALK_CACHE_MAX_DEPTH;
+  if (depth <= cache->capacity) return;
+
+  int new_capacity = cache->capacity == 0 ? 64 : cache->capacity;
+  while (new_capacity < depth) new_capacity *= 2;
+  if (new_capacity > STACK_WALK_CACHE_MAX_DEPTH) new_capacity = STACK_WALK_CACHE_MAX_DEPTH;
+
+  cache->frames = ruby_xrealloc2(cache->frames, new_capacity, sizeof(cached_control_frame));
+  memset(cache->frames + cache->capacity, 0, (new_capacity - cache->capacity) * sizeof(cached_control_frame));
+  cache->capacity = new_capacity;
+}
+
+// Computes the same information as the loop at the end of `ddtrace_rb_profile_frames` (minus the `start` support), for a
+// single control frame. Returns false if the control frame should be skipped.
+static bool control_frame_info(const rb_control_frame_t *cfp, VALUE *frame, int *line, bool *is_ruby_frame) {
+    const rb_callable_method_entry_t *cme;
+
+    if (cfp->iseq && !cfp->pc) {
+      return false;
+    }
+#ifndef USE_ISEQ_P_INSTEAD_OF_RUBYFRAME_P // Modern Rubies
+    else if (VM_FRAME_RUBYFRAME_P(cfp)) {
+#else // Ruby < 2.4
+    else if (RUBY_VM_NORMAL_ISEQ_P(cfp->iseq)) {
+#endif
+        cme = rb_vm_frame_method_entry(cfp);
+
+        if (cme && cme->def->type == VM_METHOD_TYPE_ISEQ && cfp->iseq->body->type != ISEQ_TYPE_EVAL) {
+            *frame = (VALUE)cme;
+        }
+        else {
+            *frame = (VALUE)cfp->iseq;
+        }
+
+        *line = calc_lineno(cfp->iseq, cfp->pc);
+        *is_ruby_frame = true;
+        return true;
+    }
+    else {
+        cme = rb_vm_frame_method_entry(cfp);
+        if (cme && cme->def->type == VM_METHOD_TYPE_CFUNC) {
+            *frame = (VALUE)cme;
+            *line = 0;
+            *is_ruby_frame = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+static int profile_frames_using_cache(
+  const rb_control_frame_t *cfp,
+  const rb_control_frame_t *end_cfp,
+  int limit,
+  VALUE *buff,
+  int *lines,
+  bool *is_ruby_frame,
+  stack_walk_cache *cache
+) {
+    int i;
+    // Position of the current control frame, counting from the bottom of the stack
+    int position = (int) (end_cfp - cfp) - 1;
+
+    stack_walk_cache_ensure_capacity(cache, position + 1);
+
+    for (i=0; i<limit && cfp != end_cfp; cfp = RUBY_VM_PREVIOUS_CONTROL_FRAME(cfp), position--) {
+        VALUE me_cref = ME_CREF_FROM_EP(cfp->ep);
+        cached_control_frame *cached = position < cache->capacity ? &cache->frames[position] : NULL;
+
+        if (cached == NULL || !cached->valid || cached->iseq != cfp->iseq || cached->pc != cfp->pc || cached->me_cref != me_cref) {
+          cached_control_frame result = {.valid = true, .iseq = cfp->iseq, .pc = cfp->pc, .me_cref = me_cref};
+          result.has_frame = control_frame_info(cfp, &result.frame, &result.line, &result.is_ruby_frame);
+
+          if (cached == NULL) {
+            if (!result.has_frame) continue;
+            buff[i] = result.frame;
+            lines[i] = result.line;
+            is_ruby_frame[i] = result.is_ruby_frame;
+            i++;
+            continue;
+          }
+
+          *cached = result;
+        }
+
+        if (!cached->has_frame) continue;
+
+        buff[i] = cached->frame;
+        lines[i] = cached->line;
+        is_ruby_frame[i] = cached->is_ruby_frame;
+        i++;
+    }
+
+    return i;
+}
+
 // Taken from upstream vm_backtrace.c at commit 5f10bd634fb6ae8f74a4ea730176233b0ca96954 (March 2022, Ruby 3.2 trunk)
 // Copyright (C) 1993-2012 Yukihiro Matsumoto
 // Modifications:
@@ -377,6 +569,8 @@ calc_lineno(const rb_iseq_t *iseq, const VALUE *pc)
 //   the `VALUE` returned by rb_profile_frames returns `(eval)` instead of the path of the file where the `eval`
 //   was called from.
 // * Imported fix from https://github.com/ruby/ruby/pull/7116 to avoid sampling threads that are still being created
+// * Optionally reuse the results for control frames that did not change since the previous sample, see
+//   `stack_walk_cache` below.
 //
 // What is rb_profile_frames?
 // `rb_profile_frames` is a Ruby VM debug API added for use by profilers for sampling the stack trace of a Ruby thread.
@@ -406,7 +600,7 @@ calc_lineno(const rb_iseq_t *iseq, const VALUE *pc)
 //    and friends). We've found quite a few situations where the data from rb_profile_frames and the reference APIs
 //    disagree, and quite a few of them seem oversights/bugs (speculation from my part) rather than deliberate
 //    decisions.
-int ddtrace_rb_profile_frames(VALUE thread, int start, int limit, VALUE *buff, int *lines, bool* is_ruby_frame)
+int ddtrace_rb_profile_frames(VALUE thread, int start, int limit, VALUE *buff, int *lines, bool* is_ruby_frame, stack_walk_cache *cache)
 {
     int i;
     // Modified from upstream: Instead of using `GET_EC` to collect info from the current thread,
@@ -447,6 +641,9 @@ int ddtrace_rb_profile_frames(VALUE thread, int start, int limit, VALUE *buff, i
     // See comment on `record_placeholder_stack_in_native_code` for a full explanation of what this means (and why we don't just return 0)
     if (end_cfp <= cfp) return PLACEHOLDER_STACK_IN_NATIVE_CODE;
 
+    // Fix: Reuse results from the previous sample, if possible. See `stack_walk_cache` below for details.
+    if (cache != NULL && start == 0) return profile_frames_using_cache(cfp, end_cfp, limit, buff, lines, is_ruby_frame, cache);
+
     for (i=0; i<limit && cfp != end_cfp;) {
         if (cfp->iseq && !cfp->pc) {
           // Fix: Do nothing -- this frame should not be used
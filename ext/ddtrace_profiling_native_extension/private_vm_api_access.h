@@ -26,9 +26,18 @@ uint64_t native_thread_id_for(VALUE thread);
 ptrdiff_t stack_depth_for(VALUE thread);
 void ddtrace_thread_list(VALUE result_array);
 bool is_thread_alive(VALUE thread);
+bool is_thread_stopped(VALUE thread);
+bool top_method_for(VALUE thread, VALUE *owner, ID *method_id);
 VALUE thread_name_for(VALUE thread);
 
-int ddtrace_rb_profile_frames(VALUE thread, int start, int limit, VALUE *buff, int *lines, bool* is_ruby_frame);
+// Used by ddtrace_rb_profile_frames to reuse information from the previous sample of a thread
+typedef struct stack_walk_cache stack_walk_cache;
+stack_walk_cache *stack_walk_cache_new(void);
+void stack_walk_cache_free(stack_walk_cache *cache);
+void stack_walk_cache_clear(stack_walk_cache *cache);
+
+// The cache argument is optional (can be NULL); when given it should always be used for the same thread
+int ddtrace_rb_profile_frames(VALUE thread, int start, int limit, VALUE *buff, int *lines, bool* is_ruby_frame, stack_walk_cache *cache);
 // Returns true if the current thread belongs to the main Ractor or if Ruby has no Ractor support
 bool ddtrace_rb_ractor_main_p(void);
 
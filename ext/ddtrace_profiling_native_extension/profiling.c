@@ -5,6 +5,7 @@
 
 #include "clock_id.h"
 #include "helpers.h"
+#include "latency_histogram.h"
 #include "private_vm_api_access.h"
 #include "ruby_helpers.h"
 #include "setup_signal_handler.h"
@@ -16,6 +17,7 @@ void collectors_dynamic_sampling_rate_init(VALUE profiling_module);
 void collectors_idle_sampling_helper_init(VALUE profiling_module);
 void collectors_stack_init(VALUE profiling_module);
 void collectors_thread_context_init(VALUE profiling_module);
+void file_sink_init(VALUE profiling_module);
 void http_transport_init(VALUE profiling_module);
 void stack_recorder_init(VALUE profiling_module);
 
@@ -33,6 +35,7 @@ static void holding_the_gvl_signal_handler(DDTRACE_UNUSED int _signal, DDTRACE_U
 static VALUE _native_trigger_holding_the_gvl_signal_handler_on(DDTRACE_UNUSED VALUE _self, VALUE background_thread);
 static VALUE _native_enforce_success(DDTRACE_UNUSED VALUE _self, VALUE syserr_errno, VALUE with_gvl);
 static void *trigger_enforce_success(void *trigger_args);
+static VALUE _native_latency_histogram_percentiles(DDTRACE_UNUSED VALUE _self, VALUE values);
 
 void DDTRACE_EXPORT Init_ddtrace_profiling_native_extension(void) {
   VALUE datadog_module = rb_define_module("Datadog");
@@ -49,6 +52,7 @@ void DDTRACE_EXPORT Init_ddtrace_profiling_native_extension(void) {
   collectors_idle_sampling_helper_init(profiling_module);
   collectors_stack_init(profiling_module);
   collectors_thread_context_init(profiling_module);
+  file_sink_init(profiling_module);
   http_transport_init(profiling_module);
   stack_recorder_init(profiling_module);
 
@@ -67,6 +71,7 @@ void DDTRACE_EXPORT Init_ddtrace_profiling_native_extension(void) {
   rb_define_singleton_method(testing_module, "_native_install_holding_the_gvl_signal_handler", _native_install_holding_the_gvl_signal_handler, 0);
   rb_define_singleton_method(testing_module, "_native_trigger_holding_the_gvl_signal_handler_on", _native_trigger_holding_the_gvl_signal_handler_on, 1);
   rb_define_singleton_method(testing_module, "_native_enforce_success", _native_enforce_success, 2);
+  rb_define_singleton_method(testing_module, "_native_latency_histogram_percentiles", _native_latency_histogram_percentiles, 1);
 }
 
 static VALUE native_working_p(DDTRACE_UNUSED VALUE _self) {
@@ -249,4 +254,13 @@ static void *trigger_enforce_success(void *trigger_args) {
   intptr_t syserr_errno = (intptr_t) trigger_args;
   ENFORCE_SUCCESS_NO_GVL(syserr_errno);
   return NULL;
+}
+
+static VALUE _native_latency_histogram_percentiles(DDTRACE_UNUSED VALUE _self, VALUE values) {
+  ENFORCE_TYPE(values, T_ARRAY);
+
+  latency_histogram histogram = {0};
+  for (long i = 0; i < RARRAY_LEN(values); i++) latency_histogram_record(&histogram, NUM2ULL(rb_ary_entry(values, i)));
+
+  return latency_histogram_percentiles_as_hash(&histogram);
 }
\ No newline at end of file
@@ -108,4 +108,35 @@ void raise_syserr(
   } else {
     grab_gvl_and_raise_syserr(syserr_errno, "Failure returned by '%s' at %s:%d:in `%s'", expression, file, line, function_name);
   }
-}
\ No newline at end of file
+}
+// Not part of public headers but is externed from Ruby (it's what ObjectSpace.memsize_of uses)
+size_t rb_obj_memsize_of(VALUE obj);
+
+size_t ruby_obj_memsize_of(VALUE obj) {
+  if (RB_SPECIAL_CONST_P(obj)) return 0;
+
+  switch (rb_type(obj)) {
+    case T_OBJECT:
+    case T_MODULE:
+    case T_CLASS:
+    case T_ICLASS:
+    case T_STRING:
+    case T_ARRAY:
+    case T_HASH:
+    case T_REGEXP:
+    case T_DATA:
+    case T_MATCH:
+    case T_FILE:
+    case T_RATIONAL:
+    case T_COMPLEX:
+    case T_IMEMO:
+    case T_FLOAT:
+    case T_SYMBOL:
+    case T_BIGNUM:
+    case T_STRUCT:
+      return rb_obj_memsize_of(obj);
+    default:
+      // Unsupported types, or objects that are not alive anymore (e.g. T_NONE, T_ZOMBIE, T_MOVED)
+      return 0;
+  }
+}
@@ -87,4 +87,7 @@ NORETURN(void raise_syserr(
   const char *file,
   int line,
   const char *function_name
-));
\ No newline at end of file
+));
+// Returns the memory used by an object (including any out-of-object memory it owns), or 0 for object types that we
+// don't know how to handle (e.g. objects that are in the process of being freed).
+size_t ruby_obj_memsize_of(VALUE obj);
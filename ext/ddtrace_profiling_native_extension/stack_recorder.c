@@ -2,10 +2,14 @@
 #include <ruby/thread.h>
 #include <pthread.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "helpers.h"
 #include "stack_recorder.h"
 #include "libdatadog_helpers.h"
 #include "ruby_helpers.h"
+#include "heap_recorder.h"
 
 // Used to wrap a ddog_prof_Profile in a Ruby object and expose Ruby-level serialization APIs
 // This file implements the native bits of the Datadog::Profiling::StackRecorder class
@@ -18,8 +22,15 @@
 // This is needed because the state is expected to be accessed, in parallel, by two different threads.
 //
 // 1. The thread that is taking a stack sample and that called `record_sample`, let's call it the **sampler thread**.
-// In the current implementation of the profiler, there can only exist one **sampler thread** at a time; if this
-// constraint changes, we should revise the design of the StackRecorder.
+// In the current implementation of the profiler, there can only exist one **sampler thread** at a time: samples only
+// get taken by threads holding the Global VM Lock (and not from other Ractors), and when deferred recording is enabled
+// (see "Deferred recording" below), only the recording thread adds them to the profiles.
+//
+// Supporting multiple concurrent sampler threads (e.g. samplers running without the GVL) would need a separate pair of
+// slots (a shard) for each of them. As libdatadog does not provide a way of merging `ddog_prof_Profile`s, shards would
+// need to keep copies of their samples, and the serializer thread would then pay for adding all of them to the profile
+// being serialized. As no sampler needs this yet, the StackRecorder does not support it; if this constraint changes,
+// we should revise the design of the StackRecorder.
 //
 // 2. The thread that serializes and reports profiles, let's call it the **serializer thread**. We enforce that there
 // cannot be more than one thread attempting to serialize profiles at a time.
@@ -123,12 +134,142 @@
 // Lock (GVL). The serializer thread flipping occurs after the serializer thread releases the GVL, and thus the
 // serializer thread will not be able to host the sampling process.
 //
+// ## Deferred recording
+//
+// When `deferred_recording_enabled` is set, `record_sample` and `record_endpoint` don't call into libdatadog directly.
+// Instead, they copy the sample (locations, labels and all the strings they point to) into a **deferred batch**, and
+// a background native thread, the **recording thread**, later does the `ddog_prof_Profile_add` (string interning,
+// aggregation, ...) work without needing the GVL. This moves most of the cost of recording a sample out of the
+// critical path of the Ruby thread that's holding the GVL.
+//
+// Frame names and filenames are still resolved while holding the GVL (the `rb_profile_frame_*` APIs need it, and the
+// referenced objects can move or be collected), but because we copy every string, nothing in a deferred batch
+// references Ruby objects and no GC marking is needed. Strings are interned per batch (see `deferred_batch_intern_string`),
+// so the same frame names, filenames and label values showing up in many samples only get copied once.
+//
+// In this mode the recording thread becomes the single **sampler thread** as seen by the locking protocol above;
+// Ruby threads only ever touch the deferred batches.
+//
+// There are two deferred batches: the **active** batch, where new samples get copied to, and the **pending** batch,
+// that was handed over to the recording thread. Both are protected by the `deferred_recording.mutex`, which is only held
+// for the time needed to copy a sample or to flip the batches. When the recording thread is idle, the next sample
+// hands over the active batch and wakes it up.
+//
+// A batch is limited to `DEFERRED_RECORDING_MAX_SAMPLES_PER_BATCH` samples and `DEFERRED_RECORDING_MAX_BYTES_PER_BATCH`
+// bytes; if the recording thread can't keep up, samples get dropped (and counted) rather than growing memory usage
+// without bounds.
+//
+// Before flipping the profile slots, the serializer thread flushes the deferred batches and waits for the recording
+// thread to be done with them, so that a serialized profile includes all samples recorded before serialization started.
+//
+// The recording thread gets started when the StackRecorder is initialized, and does not survive a fork. The deferred
+// mutex may also have been copied while being held. Thus, in a forked child the deferred state gets reset (and a new
+// recording thread started) by `reset_after_fork`. Until then, samples get dropped (and counted), and
+// `deferred_recording_flush` does not wait on a recording thread that belongs to another process. To tell these apart
+// without a syscall on every sample, the deferred state records the `fork_generation` it was started in; the
+// generation gets bumped in the child on every fork (see `on_fork_in_child`).
+//
+// ## Memory accounting
+//
+// libdatadog does not report how much memory a `ddog_prof_Profile` is using, so each profile slot keeps an estimate
+// (`slot_memory.estimated_bytes`) that gets increased when a sample is added to it, and goes back to zero when the
+// slot's profile gets reset. libdatadog stores each unique stack, each unique set of labels and each unique (stack,
+// labels) pair only once, and just sums the values of repeated samples, so the estimate (see `estimated_sample_bytes`)
+// only charges for the parts of a sample that the profile did not have yet: its locations for a new stack, its labels
+// (including label string values, e.g. endpoints, which are what makes profiles grow with high-cardinality data) for a
+// new set of labels, and its values for a new pair. To know what the profile already has, each slot keeps a set with
+// the hashes of the stacks, label sets and pairs that were added to it. Function names and filenames are ignored, as
+// they are interned and bounded by the size of the application. The estimate also includes the bytes in use by the
+// slot's pre-aggregation table (see "Pre-aggregation" below).
+//
+// Hashing samples only pays off when there is a budget to enforce, so samples that are not subject to a budget (all of
+// them when no `memory_budget_bytes` is configured, as well as the samples added right before serializing) don't get
+// hashed, and get charged in full as if the profile did not have any part of them yet. The set of hashes is also capped
+// at `SEEN_HASHES_MAX_COUNT` hashes per slot; past that, new hashes stop being remembered, and the corresponding parts
+// keep being charged in full. Either way, the estimate can only err on the high side.
+//
+// The estimates for both slots get reported in the stats, as well as via the `dsize` function (e.g. for
+// `ObjectSpace.memsize_of`), which additionally includes the memory used by the sets of hashes, the deferred recording
+// batches, and the pre-aggregation tables (see "Pre-aggregation" below).
+//
+// When a `memory_budget_bytes` is configured, a sample that would take a slot over the budget gets dropped (and counted)
+// instead of being added to the profile. Repeated samples never get dropped, as they don't make the profile grow. Heap
+// samples are not subject to the budget, as they represent a snapshot that is already bounded by the number of objects
+// being tracked. After the next serialization, the slot gets reset and starts accepting samples again.
+//
+// ## Pre-aggregation
+//
+// Before libdatadog can find out that a sample has the same stack and labels as a previous one, it needs to hash and
+// intern every string and location in the sample, which is most of the cost of `ddog_prof_Profile_add`. Web applications
+// tend to sample the same few stacks over and over (e.g. threads waiting on IO), so when `pre_aggregation_enabled` is
+// set, each profile slot gets a **pre-aggregation table** in front of its profile.
+//
+// The table keeps a `deferred_batch` (see "Deferred recording" above) with one sample per unique (stack, labels) pair,
+// indexed by an open-addressing hash table. Because the batch interns its strings, an incoming sample gets copied
+// (which mostly means looking up strings that are already interned) and then hashed and compared with the existing
+// entries using only the interned string ids, rather than the string contents. A sample that is already in the table
+// just gets its values summed into the existing entry, and its copy gets discarded. The table is protected by the mutex
+// of its slot, so the locking protocol above applies to it as-is.
+//
+// The bytes used by the table count towards the slot's `estimated_bytes` (see "Memory accounting" above). A table is
+// full once it reaches `PRE_AGGREGATION_MAX_SAMPLES` unique samples or `PRE_AGGREGATION_MAX_BYTES` bytes, or when its
+// slot reaches the memory budget; from then on, samples bypass the table and get added directly to the profile (or
+// dropped, if over the budget). This way, the sampler thread never has to pay for flushing the table.
+//
+// Instead, the table gets flushed (its samples get added to the slot's profile) by the serializer thread, without the
+// GVL, right after flipping the slots, so that the serialized profile includes every sample. Failures to add flushed
+// samples get counted in the stats rather than raised.
+//
+// The memory budget gets checked when a sample is added to the table: a sample that would become a new entry gets
+// dropped (and counted) if the bytes it takes in the table would take the slot over the budget. Samples in the table
+// were thus already accepted, and never get dropped when flushing.
+//
+// Heap samples are added directly to the profile, as they only get added once per serialization.
+//
+// ## Heap samples
+//
+// Heap samples are a snapshot of the tracked objects (see heap_recorder.c) that are alive when a profile gets
+// serialized. The snapshot needs to be taken while holding the Global VM Lock, as the Ruby GC may otherwise free
+// objects (and thus change the heap recorder) concurrently, but the serializer thread only gets to own a profile after
+// flipping the slots, which it does without the Global VM Lock.
+//
+// Thus, `record_heap_samples` copies the snapshot into the `heap_samples` batch (using the same `deferred_batch` as
+// deferred recording), and after flipping the slots (and flushing the pre-aggregation table), the serializer thread
+// adds the batch's samples to the profile it's about to serialize. This way, the serializer thread never needs to
+// grab the active slot the way the sampler thread does.
+//
+// ## Pending samples
+//
+// Collectors may hold on to samples for a while before recording them (e.g. the ThreadContext collector coalesces
+// samples for idle threads), and those samples need to make it into the profile that covers the time they represent.
+//
+// Thus, a collector can register itself with `recorder_set_pending_samples_flusher`, and `_native_serialize` calls the
+// registered function, while holding the Global VM Lock, before flipping the slots. Only one collector can be
+// registered at a time; registering a new one replaces the previous. The recorder keeps the registered collector alive.
+//
+// ## Serializing for export
+//
+// Serialized profiles can be several megabytes, and when they're only going to be reported, copying them into a Ruby
+// string just to have the HttpTransport copy them again into the request (which is where libdatadog compresses them)
+// is wasted work done while holding the Global VM Lock, as well as extra Ruby heap churn.
+//
+// Thus, when serializing for export, instead of a Ruby string we return an `EncodedProfile`: an opaque Ruby object
+// that owns the `ddog_prof_EncodedProfile` returned by libdatadog. The HttpTransport can use its buffer directly (see
+// `encoded_profile_byte_slice`), and builds (and compresses) the request without the Global VM Lock.
+// The `ddog_prof_EncodedProfile` is dropped when the Ruby object gets garbage collected.
+//
+// The `EncodedProfile` object is allocated before serializing, so that we never need to raise while holding on to
+// the serialized profile.
+//
 // ---
 
 static VALUE ok_symbol = Qnil; // :ok in Ruby
+// See "Deferred recording" notes above. Only modified in the (single-threaded) child process right after a fork.
+static unsigned long fork_generation = 0;
 static VALUE error_symbol = Qnil; // :error in Ruby
 
 static VALUE stack_recorder_class = Qnil;
+static VALUE encoded_profile_class = Qnil;
 
 // Note: Please DO NOT use `VALUE_STRING` anywhere else, instead use `DDOG_CHARSLICE_C`.
 // `VALUE_STRING` is only needed because older versions of gcc (4.9.2, used in our Ruby 2.2 CI test images)
@@ -151,34 +292,235 @@ static VALUE stack_recorder_class = Qnil;
 #define WALL_TIME_VALUE_ID 2
 #define ALLOC_SAMPLES_VALUE     {.type_ = VALUE_STRING("alloc-samples"),     .unit = VALUE_STRING("count")}
 #define ALLOC_SAMPLES_VALUE_ID 3
+#define GVL_WAIT_VALUE          {.type_ = VALUE_STRING("gvl-wait"),          .unit = VALUE_STRING("nanoseconds")}
+#define GVL_WAIT_VALUE_ID 4
+#define HEAP_SAMPLES_VALUE      {.type_ = VALUE_STRING("heap-live-samples"), .unit = VALUE_STRING("count")}
+#define HEAP_SAMPLES_VALUE_ID 5
+#define HEAP_SIZE_VALUE         {.type_ = VALUE_STRING("heap-live-size"),    .unit = VALUE_STRING("bytes")}
+#define HEAP_SIZE_VALUE_ID 6
 
-static const ddog_prof_ValueType all_value_types[] = {CPU_TIME_VALUE, CPU_SAMPLES_VALUE, WALL_TIME_VALUE, ALLOC_SAMPLES_VALUE};
+static const ddog_prof_ValueType all_value_types[] =
+  {CPU_TIME_VALUE, CPU_SAMPLES_VALUE, WALL_TIME_VALUE, ALLOC_SAMPLES_VALUE, GVL_WAIT_VALUE, HEAP_SAMPLES_VALUE, HEAP_SIZE_VALUE};
 
 // This array MUST be kept in sync with all_value_types above and is intended to act as a "hashmap" between VALUE_ID and the position it
 // occupies on the all_value_types array.
 // E.g. all_value_types_positions[CPU_TIME_VALUE_ID] => 0, means that CPU_TIME_VALUE was declared at position 0 of all_value_types.
-static const uint8_t all_value_types_positions[] = {CPU_TIME_VALUE_ID, CPU_SAMPLES_VALUE_ID, WALL_TIME_VALUE_ID, ALLOC_SAMPLES_VALUE_ID};
+static const uint8_t all_value_types_positions[] =
+  {CPU_TIME_VALUE_ID, CPU_SAMPLES_VALUE_ID, WALL_TIME_VALUE_ID, ALLOC_SAMPLES_VALUE_ID, GVL_WAIT_VALUE_ID, HEAP_SAMPLES_VALUE_ID, HEAP_SIZE_VALUE_ID};
 
 #define ALL_VALUE_TYPES_COUNT (sizeof(all_value_types) / sizeof(ddog_prof_ValueType))
 
+// See "Deferred recording" notes above
+#define DEFERRED_RECORDING_MAX_SAMPLES_PER_BATCH 10000
+#define DEFERRED_RECORDING_MAX_BYTES_PER_BATCH (16 * 1024 * 1024)
+#define INTERNED_STRINGS_MIN_BUCKETS 256 // Must be a power of two
+#define HASH_SEED 0xcbf29ce484222325ULL // Any non-zero value works
+// See "Memory accounting" notes above
+#define ESTIMATED_SAMPLE_OVERHEAD_BYTES 64 // Rough cost of the sample entry itself in libdatadog's profile
+#define NO_MEMORY_BUDGET 0
+#define SEEN_HASHES_MIN_BUCKETS 256 // Must be a power of two
+#define SEEN_HASHES_MAX_COUNT (64 * 1024) // Up to 1 MiB of buckets per slot
+// See "Pre-aggregation" notes above
+#define PRE_AGGREGATION_MAX_SAMPLES 4096
+#define PRE_AGGREGATION_MAX_BYTES (4 * 1024 * 1024)
+#define PRE_AGGREGATION_BUCKETS (PRE_AGGREGATION_MAX_SAMPLES * 2) // Must be a power of two
+
+// Strings are stored as offsets into the batch `strings` buffer, since that buffer can get reallocated as it grows
+typedef struct {
+  size_t offset;
+  size_t len;
+} deferred_string;
+
+typedef struct {
+  deferred_string name;
+  deferred_string system_name;
+  deferred_string filename;
+  int64_t start_line;
+  int64_t line;
+} deferred_line;
+
+typedef struct {
+  size_t first_line;
+  size_t lines_count;
+} deferred_location;
+
+typedef struct {
+  deferred_string key;
+  deferred_string str;
+  int64_t num;
+  deferred_string num_unit;
+} deferred_label;
+
+typedef struct {
+  size_t first_location;
+  size_t locations_count;
+  size_t first_label;
+  size_t labels_count;
+  int64_t metric_values[ALL_VALUE_TYPES_COUNT];
+} deferred_sample;
+
+typedef struct {
+  uint64_t local_root_span_id;
+  deferred_string endpoint;
+} deferred_endpoint;
+
+typedef struct {
+  deferred_string string;
+  uint64_t hash;
+} interned_string;
+
+// Note: Memory for batches is allocated with malloc/realloc (and not ruby_xmalloc) because the recording thread
+// is not a Ruby thread and does not hold the GVL.
+typedef struct {
+  deferred_sample *samples;
+  size_t samples_count, samples_capacity;
+
+  deferred_location *locations;
+  size_t locations_count, locations_capacity;
+
+  deferred_line *lines;
+  size_t lines_count, lines_capacity;
+
+  deferred_label *labels;
+  size_t labels_count, labels_capacity;
+
+  deferred_endpoint *endpoints;
+  size_t endpoints_count, endpoints_capacity;
+
+  char *strings;
+  size_t strings_count, strings_capacity;
+
+  // Every distinct string in `strings`, so that each one is only copied once per batch (see deferred_batch_intern_string).
+  // Equal strings thus always have the same `deferred_string`.
+  interned_string *interned;
+  size_t interned_count, interned_capacity;
+  uint32_t *interned_buckets;    // Index of a string in `interned` + 1, or 0 for an empty bucket; allocated on first use
+  size_t interned_buckets_count; // Power of two, kept at least twice `interned_count`
+} deferred_batch;
+
+// Used to turn samples from a deferred_batch back into libdatadog structures; reused across samples to avoid
+// allocating memory for every sample
+typedef struct {
+  ddog_prof_Location *locations;
+  size_t locations_capacity;
+  ddog_prof_Line *lines;
+  size_t lines_capacity;
+  ddog_prof_Label *labels;
+  size_t labels_capacity;
+} batch_scratch;
+
+// See "Pre-aggregation" notes above. Only accessed while holding the mutex for the corresponding slot.
+typedef struct {
+  deferred_batch batch;  // Unique samples, with their summed values
+  uint64_t *hashes;      // Hash for each sample in the batch; allocated on first use
+  uint32_t *buckets;     // Index of a sample in the batch + 1, or 0 for an empty bucket; allocated on first use
+  batch_scratch scratch; // Used when flushing
+  size_t charged_bytes;  // How much of the slot's estimated_bytes is due to the table
+
+  // Not reset together with the profile
+  struct {
+    unsigned long samples_aggregated; // Summed into a sample that was already in the table
+    unsigned long samples_flushed;    // Added to the profile when flushing
+    unsigned long samples_failed;     // Failed to be added to the profile when flushing
+    unsigned long samples_bypassed;   // Added directly to the profile due to the table being full
+  } stats;
+} pre_aggregation_table;
+
+typedef enum {
+  PRE_AGGREGATION_ADDED,
+  PRE_AGGREGATION_OVER_BUDGET, // Dropped due to the memory budget
+  PRE_AGGREGATION_FAILED,      // Failed to allocate memory
+} pre_aggregation_add_result;
+
+struct deferred_recording {
+  pthread_mutex_t mutex;
+  pthread_cond_t work_available; // Signaled to wake up the recording thread
+  pthread_cond_t work_done;      // Signaled by the recording thread when it finishes processing the pending batch
+
+  pthread_t recording_thread;
+  bool stop_requested;
+
+  deferred_batch batches[2];
+  deferred_batch *active_batch;  // Where new samples get copied to
+  deferred_batch *pending_batch; // Batch handed over to the recording thread; NULL when the recording thread is idle
+
+  // Only accessed by the recording thread
+  batch_scratch scratch;
+
+  // The recording thread only exists in the process that created it, see "Deferred recording" notes above
+  unsigned long fork_generation;
+
+  // Protected by the mutex
+  struct {
+    unsigned long samples_deferred; // Copied to a deferred batch
+    unsigned long samples_dropped;  // Not copied due to the batch being full (or failing to allocate memory)
+    unsigned long samples_recorded; // Added to the profile by the recording thread
+    unsigned long samples_failed;   // Failed to be added to the profile by the recording thread
+  } stats;
+};
+
+// See "Memory accounting" notes above. Only modified while holding the mutex for the corresponding slot.
+struct slot_memory {
+  size_t estimated_bytes;
+  unsigned long samples_over_budget; // Not reset together with the profile
+  // Open-addressing set with the hashes of the stacks, label sets and samples in the profile; 0 marks empty buckets
+  uint64_t *seen_hashes;
+  size_t seen_count;
+  size_t seen_buckets;
+};
+
+// See "Memory accounting" notes above
+typedef struct {
+  uint64_t stack;
+  uint64_t labels;
+  uint64_t sample;
+} sample_hashes;
+
 // Contains native state for each instance
 struct stack_recorder_state {
   pthread_mutex_t slot_one_mutex;
   ddog_prof_Profile *slot_one_profile;
+  struct slot_memory slot_one_memory;
+  pre_aggregation_table slot_one_pre_aggregation;
 
   pthread_mutex_t slot_two_mutex;
   ddog_prof_Profile *slot_two_profile;
+  struct slot_memory slot_two_memory;
+  pre_aggregation_table slot_two_pre_aggregation;
+
+  size_t memory_budget_bytes; // NO_MEMORY_BUDGET or the maximum estimated_bytes for each slot
+  bool pre_aggregation_enabled;
 
   short active_slot; // MUST NEVER BE ACCESSED FROM record_sample; this is NOT for the sampler thread to use.
 
   uint8_t position_for[ALL_VALUE_TYPES_COUNT];
   uint8_t enabled_values_count;
+
+  struct deferred_recording *deferred_recording; // NULL unless deferred recording is enabled
+
+  heap_recorder *heap_recorder; // NULL unless heap samples are enabled
+  // See "Pending samples" notes above
+  struct {
+    VALUE (*flush)(VALUE);
+    VALUE instance;
+  } pending_samples_flusher;
+  // See "Heap samples" notes above. Only used by the serializer thread.
+  deferred_batch heap_samples;
+  batch_scratch heap_samples_scratch;
 };
 
 // Used to return a pair of values from sampler_lock_active_profile()
 struct active_slot_pair {
   pthread_mutex_t *mutex;
   ddog_prof_Profile *profile;
+  struct slot_memory *memory;
+  pre_aggregation_table *pre_aggregation;
+};
+
+// Contains the native state for the Datadog::Profiling::StackRecorder::EncodedProfile class
+struct encoded_profile {
+  bool initialized;
+  ddog_prof_EncodedProfile profile;
 };
 
 struct call_serialize_without_gvl_arguments {
@@ -189,6 +531,8 @@ struct call_serialize_without_gvl_arguments {
   // Set by callee
   ddog_prof_Profile *profile;
   ddog_prof_Profile_SerializeResult result;
+  ddog_prof_Profile_AddResult heap_samples_result;
+  bool heap_samples_out_of_memory;
 
   // Set by both
   bool serialize_ran;
@@ -196,11 +540,43 @@ struct call_serialize_without_gvl_arguments {
 
 static VALUE _native_new(VALUE klass);
 static void initialize_slot_concurrency_control(struct stack_recorder_state *state);
+static void stack_recorder_typed_data_mark(void *data);
 static void stack_recorder_typed_data_free(void *data);
-static VALUE _native_initialize(DDTRACE_UNUSED VALUE _self, VALUE recorder_instance, VALUE cpu_time_enabled, VALUE alloc_samples_enabled);
-static VALUE _native_serialize(VALUE self, VALUE recorder_instance);
+static size_t stack_recorder_typed_data_size(const void *data);
+static VALUE _native_initialize(
+  DDTRACE_UNUSED VALUE _self,
+  VALUE recorder_instance,
+  VALUE cpu_time_enabled,
+  VALUE alloc_samples_enabled,
+  VALUE gvl_wait_enabled,
+  VALUE heap_samples_enabled,
+  VALUE deferred_recording_enabled,
+  VALUE memory_budget_bytes,
+  VALUE pre_aggregation_enabled
+);
+static void configure_enabled_value_types(
+  struct stack_recorder_state *state,
+  VALUE cpu_time_enabled,
+  VALUE alloc_samples_enabled,
+  VALUE gvl_wait_enabled,
+  VALUE heap_samples_enabled
+);
+#ifndef NO_GC_COMPACTION
+static void stack_recorder_typed_data_compact(void *data);
+#endif
+static bool copy_heap_sample(heap_recorder_live_stack live_stack, void *state_ptr);
+static void record_heap_samples(struct stack_recorder_state *state);
+static void add_heap_samples_to_profile(struct stack_recorder_state *state, struct call_serialize_without_gvl_arguments *args);
+static VALUE _native_serialize(VALUE self, VALUE recorder_instance, VALUE for_export);
+static VALUE encoded_profile_new(void);
+static void encoded_profile_typed_data_free(void *data);
+static size_t encoded_profile_typed_data_size(const void *data);
+static struct encoded_profile *encoded_profile_state(VALUE encoded_profile);
+static VALUE _native_encoded_profile_bytesize(DDTRACE_UNUSED VALUE _self, VALUE encoded_profile);
+static VALUE _native_encoded_profile_to_s(DDTRACE_UNUSED VALUE _self, VALUE encoded_profile);
 static VALUE ruby_time_from(ddog_Timespec ddprof_time);
 static void *call_serialize_without_gvl(void *call_args);
+static int lock_active_profile(struct stack_recorder_state *state, struct active_slot_pair *active_slot);
 static struct active_slot_pair sampler_lock_active_profile();
 static void sampler_unlock_active_profile(struct active_slot_pair active_slot);
 static ddog_prof_Profile *serializer_flip_active_and_inactive_slots(struct stack_recorder_state *state);
@@ -212,6 +588,63 @@ static ddog_Timespec time_now(void);
 static VALUE _native_reset_after_fork(DDTRACE_UNUSED VALUE self, VALUE recorder_instance);
 static void serializer_set_start_timestamp_for_next_profile(struct stack_recorder_state *state, ddog_Timespec timestamp);
 static VALUE _native_record_endpoint(DDTRACE_UNUSED VALUE _self, VALUE recorder_instance, VALUE local_root_span_id, VALUE endpoint);
+static VALUE _native_stats(DDTRACE_UNUSED VALUE self, VALUE recorder_instance);
+static void fill_metric_values(struct stack_recorder_state *state, sample_values values, int64_t metric_values[ALL_VALUE_TYPES_COUNT]);
+static void deferred_recording_start(struct stack_recorder_state *state);
+static void deferred_recording_start_thread(struct stack_recorder_state *state);
+static void deferred_recording_stop(struct deferred_recording *deferred);
+static void deferred_recording_stop_thread(struct deferred_recording *deferred);
+static void deferred_recording_reset_after_fork(struct stack_recorder_state *state);
+static bool deferred_recording_inherited(struct deferred_recording *deferred);
+static void on_fork_in_child(void);
+static void deferred_record_sample(struct deferred_recording *deferred, ddog_prof_Slice_Location locations, int64_t metric_values[ALL_VALUE_TYPES_COUNT], ddog_prof_Slice_Label labels);
+static void deferred_record_endpoint(struct deferred_recording *deferred, uint64_t local_root_span_id, ddog_CharSlice endpoint);
+static void deferred_recording_hand_over_active_batch(struct deferred_recording *deferred);
+static void deferred_recording_flush(struct deferred_recording *deferred);
+static void *deferred_recording_thread_main(void *state_ptr);
+static unsigned long deferred_recording_process_batch(struct stack_recorder_state *state, deferred_batch *batch);
+static bool deferred_recording_add_to_profile(struct stack_recorder_state *state, deferred_batch *batch, deferred_sample *sample);
+static bool batch_sample_to_ddog_sample(struct stack_recorder_state *state, batch_scratch *scratch, deferred_batch *batch, deferred_sample *sample, ddog_prof_Sample *result);
+static void batch_scratch_free(batch_scratch *scratch);
+static size_t deferred_batch_memory_size(const deferred_batch *batch);
+static size_t deferred_batch_used_bytes(const deferred_batch *batch);
+static size_t estimated_sample_bytes(const struct slot_memory *memory, ddog_prof_Sample sample, const sample_hashes *hashes);
+static sample_hashes hash_sample(ddog_prof_Sample sample);
+static uint64_t hash_char_slice(uint64_t hash, ddog_CharSlice string);
+static void slot_memory_charge(struct slot_memory *memory, const sample_hashes *hashes, size_t bytes);
+static bool slot_memory_seen(const struct slot_memory *memory, uint64_t hash);
+static void slot_memory_remember(struct slot_memory *memory, uint64_t hash);
+static bool slot_memory_grow_seen_hashes(struct slot_memory *memory);
+static void slot_memory_reset(struct slot_memory *memory);
+static bool add_sample_within_budget(size_t memory_budget_bytes, ddog_prof_Profile *profile, struct slot_memory *memory, ddog_prof_Sample sample, ddog_prof_Profile_AddResult *result);
+static struct slot_memory *memory_for(struct stack_recorder_state *state, ddog_prof_Profile *profile);
+static pre_aggregation_table *pre_aggregation_for(struct stack_recorder_state *state, ddog_prof_Profile *profile);
+static bool add_sample_to_slot(struct stack_recorder_state *state, struct active_slot_pair active_slot, ddog_prof_Sample sample, ddog_prof_Profile_AddResult *result);
+static bool pre_aggregation_full(struct stack_recorder_state *state, struct slot_memory *memory, pre_aggregation_table *table);
+static pre_aggregation_add_result pre_aggregation_add(pre_aggregation_table *table, struct slot_memory *memory, size_t memory_budget_bytes, ddog_prof_Sample sample);
+static void pre_aggregation_charge(pre_aggregation_table *table, struct slot_memory *memory);
+static bool pre_aggregation_entry_matches(deferred_batch *batch, deferred_sample *entry, deferred_sample *other);
+static void pre_aggregation_flush(struct stack_recorder_state *state, ddog_prof_Profile *profile, struct slot_memory *memory, pre_aggregation_table *table);
+static bool pre_aggregation_allocate(pre_aggregation_table *table);
+static void pre_aggregation_clear(pre_aggregation_table *table);
+static void pre_aggregation_free(pre_aggregation_table *table);
+static size_t pre_aggregation_memory_size(const pre_aggregation_table *table);
+static uint64_t pre_aggregation_hash(deferred_batch *batch, deferred_sample *sample);
+static uint64_t hash_bytes(uint64_t hash, const void *bytes, size_t len);
+static uint64_t hash_word(uint64_t hash, uint64_t word);
+static uint64_t hash_deferred_string(uint64_t hash, deferred_string string);
+static bool deferred_string_equals(deferred_string a, deferred_string b);
+static bool char_slice_equals(ddog_CharSlice a, ddog_CharSlice b);
+static bool deferred_batch_add_sample(deferred_batch *batch, ddog_prof_Slice_Location locations, int64_t metric_values[ALL_VALUE_TYPES_COUNT], ddog_prof_Slice_Label labels);
+static bool deferred_batch_copy_sample(deferred_batch *batch, ddog_prof_Slice_Location locations, int64_t metric_values[ALL_VALUE_TYPES_COUNT], ddog_prof_Slice_Label labels);
+static bool deferred_batch_add_endpoint(deferred_batch *batch, uint64_t local_root_span_id, ddog_CharSlice endpoint);
+static bool deferred_batch_intern_string(deferred_batch *batch, ddog_CharSlice string, deferred_string *result);
+static bool deferred_batch_grow_interned_buckets(deferred_batch *batch);
+static void deferred_batch_truncate(deferred_batch *batch, const deferred_batch *saved);
+static ddog_CharSlice deferred_batch_string(deferred_batch *batch, deferred_string string);
+static bool ensure_capacity(void **buffer, size_t *capacity, size_t needed, size_t element_size);
+static void deferred_batch_clear(deferred_batch *batch);
+static void deferred_batch_free(deferred_batch *batch);
 
 void stack_recorder_init(VALUE profiling_module) {
   stack_recorder_class = rb_define_class_under(profiling_module, "StackRecorder", rb_cObject);
@@ -228,16 +661,27 @@ void stack_recorder_init(VALUE profiling_module) {
   // https://bugs.ruby-lang.org/issues/18007 for a discussion around this.
   rb_define_alloc_func(stack_recorder_class, _native_new);
 
-  rb_define_singleton_method(stack_recorder_class, "_native_initialize", _native_initialize, 3);
-  rb_define_singleton_method(stack_recorder_class, "_native_serialize",  _native_serialize, 1);
+  rb_define_singleton_method(stack_recorder_class, "_native_initialize", _native_initialize, 8);
+  rb_define_singleton_method(stack_recorder_class, "_native_serialize",  _native_serialize, 2);
   rb_define_singleton_method(stack_recorder_class, "_native_reset_after_fork", _native_reset_after_fork, 1);
+  rb_define_singleton_method(stack_recorder_class, "_native_stats", _native_stats, 1);
   rb_define_singleton_method(testing_module, "_native_active_slot", _native_active_slot, 1);
   rb_define_singleton_method(testing_module, "_native_slot_one_mutex_locked?", _native_is_slot_one_mutex_locked, 1);
   rb_define_singleton_method(testing_module, "_native_slot_two_mutex_locked?", _native_is_slot_two_mutex_locked, 1);
   rb_define_singleton_method(testing_module, "_native_record_endpoint", _native_record_endpoint, 3);
 
+  encoded_profile_class = rb_define_class_under(stack_recorder_class, "EncodedProfile", rb_cObject);
+  rb_global_variable(&encoded_profile_class);
+  // Instances can only be created by serializing a StackRecorder
+  rb_undef_alloc_func(encoded_profile_class);
+  rb_define_singleton_method(encoded_profile_class, "_native_bytesize", _native_encoded_profile_bytesize, 1);
+  rb_define_singleton_method(encoded_profile_class, "_native_to_s", _native_encoded_profile_to_s, 1);
+
   ok_symbol = ID2SYM(rb_intern_const("ok"));
   error_symbol = ID2SYM(rb_intern_const("error"));
+
+  int error = pthread_atfork(NULL, NULL, on_fork_in_child);
+  if (error) rb_syserr_fail(error, "Failed to register fork handler for StackRecorder");
 }
 
 // This structure is used to define a Ruby object that stores a pointer to a ddog_prof_Profile instance
@@ -245,9 +689,13 @@ void stack_recorder_init(VALUE profiling_module) {
 static const rb_data_type_t stack_recorder_typed_data = {
   .wrap_struct_name = "Datadog::Profiling::StackRecorder",
   .function = {
+    .dmark = stack_recorder_typed_data_mark,
     .dfree = stack_recorder_typed_data_free,
-    .dsize = NULL, // We don't track profile memory usage (although it'd be cool if we did!)
-    // No need to provide dmark nor dcompact because we don't directly reference Ruby VALUEs from inside this object
+    .dsize = stack_recorder_typed_data_size, // See "Memory accounting" notes above
+    // Note: The objects tracked by the heap_recorder are deliberately not marked, as we don't want to keep them alive.
+    #ifndef NO_GC_COMPACTION
+      .dcompact = stack_recorder_typed_data_compact,
+    #endif
   },
   .flags = RUBY_TYPED_FREE_IMMEDIATELY
 };
@@ -260,6 +708,7 @@ static VALUE _native_new(VALUE klass) {
   initialize_slot_concurrency_control(state);
   for (uint8_t i = 0; i < ALL_VALUE_TYPES_COUNT; i++) { state->position_for[i] = all_value_types_positions[i]; }
   state->enabled_values_count = ALL_VALUE_TYPES_COUNT;
+  state->pending_samples_flusher.instance = Qnil;
 
   // Note: Don't raise exceptions after this point, since it'll lead to libdatadog memory leaking!
 
@@ -279,32 +728,105 @@ static void initialize_slot_concurrency_control(struct stack_recorder_state *sta
   state->active_slot = 1;
 }
 
+static void stack_recorder_typed_data_mark(void *state_ptr) {
+  struct stack_recorder_state *state = (struct stack_recorder_state *) state_ptr;
+
+  rb_gc_mark(state->pending_samples_flusher.instance);
+}
+
 static void stack_recorder_typed_data_free(void *state_ptr) {
   struct stack_recorder_state *state = (struct stack_recorder_state *) state_ptr;
 
+  // The recording thread may be using the profiles, so it needs to be stopped first
+  if (state->deferred_recording != NULL) deferred_recording_stop(state->deferred_recording);
+
+  heap_recorder_free(state->heap_recorder);
+
   pthread_mutex_destroy(&state->slot_one_mutex);
   ddog_prof_Profile_drop(state->slot_one_profile);
 
   pthread_mutex_destroy(&state->slot_two_mutex);
   ddog_prof_Profile_drop(state->slot_two_profile);
 
+  pre_aggregation_free(&state->slot_one_pre_aggregation);
+  pre_aggregation_free(&state->slot_two_pre_aggregation);
+
+  deferred_batch_free(&state->heap_samples);
+  batch_scratch_free(&state->heap_samples_scratch);
+
+  slot_memory_reset(&state->slot_one_memory);
+  slot_memory_reset(&state->slot_two_memory);
+
   ruby_xfree(state);
 }
 
-static VALUE _native_initialize(DDTRACE_UNUSED VALUE _self, VALUE recorder_instance, VALUE cpu_time_enabled, VALUE alloc_samples_enabled) {
+static VALUE _native_initialize(
+  DDTRACE_UNUSED VALUE _self,
+  VALUE recorder_instance,
+  VALUE cpu_time_enabled,
+  VALUE alloc_samples_enabled,
+  VALUE gvl_wait_enabled,
+  VALUE heap_samples_enabled,
+  VALUE deferred_recording_enabled,
+  VALUE memory_budget_bytes,
+  VALUE pre_aggregation_enabled
+) {
   ENFORCE_BOOLEAN(cpu_time_enabled);
   ENFORCE_BOOLEAN(alloc_samples_enabled);
+  ENFORCE_BOOLEAN(gvl_wait_enabled);
+  ENFORCE_BOOLEAN(heap_samples_enabled);
+  ENFORCE_BOOLEAN(deferred_recording_enabled);
+  ENFORCE_TYPE(memory_budget_bytes, T_FIXNUM);
+  ENFORCE_BOOLEAN(pre_aggregation_enabled);
 
   struct stack_recorder_state *state;
   TypedData_Get_Struct(recorder_instance, struct stack_recorder_state, &stack_recorder_typed_data, state);
 
-  if (cpu_time_enabled == Qtrue && alloc_samples_enabled == Qtrue) return Qtrue; // Nothing to do, this is the default
+  // The recording thread may be using the profiles, so we can't replace them below
+  if (state->deferred_recording != NULL) rb_raise(rb_eRuntimeError, "StackRecorder was already initialized");
+
+  // Heap samples are taken from the objects tracked from allocation samples
+  if (heap_samples_enabled == Qtrue && alloc_samples_enabled == Qfalse) {
+    rb_raise(rb_eArgError, "Heap samples require alloc samples to be enabled");
+  }
+
+  // Nothing to do when all are enabled, this is the default
+  if (cpu_time_enabled == Qfalse || alloc_samples_enabled == Qfalse || gvl_wait_enabled == Qfalse || heap_samples_enabled == Qfalse) {
+    configure_enabled_value_types(state, cpu_time_enabled, alloc_samples_enabled, gvl_wait_enabled, heap_samples_enabled);
+  }
+
+  if (NUM2LONG(memory_budget_bytes) < 0) rb_raise(rb_eArgError, "Expected memory_budget_bytes to be >= 0");
+  state->memory_budget_bytes = NUM2SIZET(memory_budget_bytes);
+  state->pre_aggregation_enabled = (pre_aggregation_enabled == Qtrue);
+
+  if (heap_samples_enabled == Qtrue && state->heap_recorder == NULL) {
+    state->heap_recorder = heap_recorder_new();
+    if (state->heap_recorder == NULL) rb_raise(rb_eNoMemError, "Failed to allocate memory for heap recorder");
+  }
+
+  // Note: This needs to happen last, since the recording thread starts using the profiles right away
+  if (deferred_recording_enabled == Qtrue) deferred_recording_start(state);
+
+  return Qtrue;
+}
 
+static void configure_enabled_value_types(
+  struct stack_recorder_state *state,
+  VALUE cpu_time_enabled,
+  VALUE alloc_samples_enabled,
+  VALUE gvl_wait_enabled,
+  VALUE heap_samples_enabled
+) {
   // When some sample types are disabled, we need to reconfigure libdatadog to record less types,
   // as well as reconfigure the position_for array to push the disabled types to the end so they don't get recorded.
   // See record_sample for details on the use of position_for.
 
-  state->enabled_values_count = ALL_VALUE_TYPES_COUNT - (cpu_time_enabled == Qtrue ? 0 : 1) - (alloc_samples_enabled == Qtrue? 0 : 1);
+  state->enabled_values_count =
+    ALL_VALUE_TYPES_COUNT -
+    (cpu_time_enabled == Qtrue ? 0 : 1) -
+    (alloc_samples_enabled == Qtrue? 0 : 1) -
+    (gvl_wait_enabled == Qtrue? 0 : 1) -
+    (heap_samples_enabled == Qtrue? 0 : 2);
 
   ddog_prof_ValueType enabled_value_types[ALL_VALUE_TYPES_COUNT];
   uint8_t next_enabled_pos = 0;
@@ -332,6 +854,23 @@ static VALUE _native_initialize(DDTRACE_UNUSED VALUE _self, VALUE recorder_insta
     state->position_for[ALLOC_SAMPLES_VALUE_ID] = next_disabled_pos++;
   }
 
+  if (gvl_wait_enabled == Qtrue) {
+    enabled_value_types[next_enabled_pos] = (ddog_prof_ValueType) GVL_WAIT_VALUE;
+    state->position_for[GVL_WAIT_VALUE_ID] = next_enabled_pos++;
+  } else {
+    state->position_for[GVL_WAIT_VALUE_ID] = next_disabled_pos++;
+  }
+
+  if (heap_samples_enabled == Qtrue) {
+    enabled_value_types[next_enabled_pos] = (ddog_prof_ValueType) HEAP_SAMPLES_VALUE;
+    state->position_for[HEAP_SAMPLES_VALUE_ID] = next_enabled_pos++;
+    enabled_value_types[next_enabled_pos] = (ddog_prof_ValueType) HEAP_SIZE_VALUE;
+    state->position_for[HEAP_SIZE_VALUE_ID] = next_enabled_pos++;
+  } else {
+    state->position_for[HEAP_SAMPLES_VALUE_ID] = next_disabled_pos++;
+    state->position_for[HEAP_SIZE_VALUE_ID] = next_disabled_pos++;
+  }
+
   ddog_prof_Slice_ValueType sample_types = {.ptr = enabled_value_types, .len = state->enabled_values_count};
 
   ddog_prof_Profile_drop(state->slot_one_profile);
@@ -339,21 +878,37 @@ static VALUE _native_initialize(DDTRACE_UNUSED VALUE _self, VALUE recorder_insta
 
   state->slot_one_profile = ddog_prof_Profile_new(sample_types, NULL /* period is optional */, NULL /* start_time is optional */);
   state->slot_two_profile = ddog_prof_Profile_new(sample_types, NULL /* period is optional */, NULL /* start_time is optional */);
-
-  return Qtrue;
 }
 
-static VALUE _native_serialize(DDTRACE_UNUSED VALUE _self, VALUE recorder_instance) {
+static VALUE _native_serialize(DDTRACE_UNUSED VALUE _self, VALUE recorder_instance, VALUE for_export) {
+  ENFORCE_BOOLEAN(for_export);
   struct stack_recorder_state *state;
   TypedData_Get_Struct(recorder_instance, struct stack_recorder_state, &stack_recorder_typed_data, state);
 
+  // See "Serializing for export" notes above for why this needs to be allocated before serializing
+  VALUE encoded_profile = for_export == Qtrue ? encoded_profile_new() : Qnil;
+
+  // Need to do this while still holding on to the Global VM Lock, see "Pending samples" notes above
+  if (state->pending_samples_flusher.flush != NULL) {
+    state->pending_samples_flusher.flush(state->pending_samples_flusher.instance);
+  }
+
+  // Need to do this while still holding on to the Global VM Lock, see "Heap samples" notes above
+  if (state->heap_recorder != NULL) record_heap_samples(state);
+
   ddog_Timespec finish_timestamp = time_now();
   // Need to do this while still holding on to the Global VM Lock; see comments on method for why
   serializer_set_start_timestamp_for_next_profile(state, finish_timestamp);
 
   // We'll release the Global VM Lock while we're calling serialize, so that the Ruby VM can continue to work while this
   // is pending
-  struct call_serialize_without_gvl_arguments args = {.state = state, .finish_timestamp = finish_timestamp, .serialize_ran = false};
+  struct call_serialize_without_gvl_arguments args = {
+    .state = state,
+    .finish_timestamp = finish_timestamp,
+    .heap_samples_result = {.tag = DDOG_PROF_PROFILE_ADD_RESULT_OK},
+    .heap_samples_out_of_memory = false,
+    .serialize_ran = false,
+  };
 
   while (!args.serialize_ran) {
     // Give the Ruby VM an opportunity to process any pending interruptions (including raising exceptions).
@@ -371,16 +926,37 @@ static VALUE _native_serialize(DDTRACE_UNUSED VALUE _self, VALUE recorder_instan
 
   ddog_prof_Profile_SerializeResult serialized_profile = args.result;
 
+  if (args.heap_samples_result.tag == DDOG_PROF_PROFILE_ADD_RESULT_ERR || args.heap_samples_out_of_memory) {
+    // We don't report the profile, as it would be missing heap samples. The next serialization resets the profile.
+    if (serialized_profile.tag == DDOG_PROF_PROFILE_SERIALIZE_RESULT_OK) ddog_prof_EncodedProfile_drop(&serialized_profile.ok);
+    else ddog_Error_drop(&serialized_profile.err);
+
+    VALUE error_details = args.heap_samples_out_of_memory ?
+      rb_str_new_cstr("Failed to allocate memory for heap samples") :
+      rb_sprintf("Failed to record heap sample: %"PRIsVALUE, get_error_details_and_drop(&args.heap_samples_result.err));
+    return rb_ary_new_from_args(2, error_symbol, error_details);
+  }
+
   if (serialized_profile.tag == DDOG_PROF_PROFILE_SERIALIZE_RESULT_ERR) {
     return rb_ary_new_from_args(2, error_symbol, get_error_details_and_drop(&serialized_profile.err));
   }
 
-  VALUE encoded_pprof = ruby_string_from_vec_u8(serialized_profile.ok.buffer);
-
   ddog_Timespec ddprof_start = serialized_profile.ok.start;
   ddog_Timespec ddprof_finish = serialized_profile.ok.end;
 
-  ddog_prof_EncodedProfile_drop(&serialized_profile.ok);
+  VALUE encoded_pprof;
+
+  if (for_export == Qtrue) {
+    // The EncodedProfile object takes ownership of the serialized profile, and will drop it when it gets garbage
+    // collected
+    struct encoded_profile *encoded_profile_data = encoded_profile_state(encoded_profile);
+    encoded_profile_data->profile = serialized_profile.ok;
+    encoded_profile_data->initialized = true;
+    encoded_pprof = encoded_profile;
+  } else {
+    encoded_pprof = ruby_string_from_vec_u8(serialized_profile.ok.buffer);
+    ddog_prof_EncodedProfile_drop(&serialized_profile.ok);
+  }
 
   VALUE start = ruby_time_from(ddprof_start);
   VALUE finish = ruby_time_from(ddprof_finish);
@@ -388,10 +964,72 @@ static VALUE _native_serialize(DDTRACE_UNUSED VALUE _self, VALUE recorder_instan
   if (!ddog_prof_Profile_reset(args.profile, NULL /* start_time is optional */ )) {
     return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr("Failed to reset profile"));
   }
+  slot_memory_reset(memory_for(state, args.profile));
 
   return rb_ary_new_from_args(2, ok_symbol, rb_ary_new_from_args(3, start, finish, encoded_pprof));
 }
 
+// This structure is used to define a Ruby object that owns a ddog_prof_EncodedProfile instance
+static const rb_data_type_t encoded_profile_typed_data = {
+  .wrap_struct_name = "Datadog::Profiling::StackRecorder::EncodedProfile",
+  .function = {
+    .dfree = encoded_profile_typed_data_free,
+    .dsize = encoded_profile_typed_data_size,
+    // No need to provide dmark nor dcompact, as there are no Ruby VALUEs being referenced
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE encoded_profile_new(void) {
+  struct encoded_profile *encoded_profile = ruby_xcalloc(1, sizeof(struct encoded_profile));
+  encoded_profile->initialized = false;
+  return TypedData_Wrap_Struct(encoded_profile_class, &encoded_profile_typed_data, encoded_profile);
+}
+
+static void encoded_profile_typed_data_free(void *data) {
+  struct encoded_profile *encoded_profile = (struct encoded_profile *) data;
+
+  if (encoded_profile->initialized) ddog_prof_EncodedProfile_drop(&encoded_profile->profile);
+
+  ruby_xfree(encoded_profile);
+}
+
+static size_t encoded_profile_typed_data_size(const void *data) {
+  const struct encoded_profile *encoded_profile = (const struct encoded_profile *) data;
+
+  return sizeof(struct encoded_profile) + (encoded_profile->initialized ? encoded_profile->profile.buffer.capacity : 0);
+}
+
+static struct encoded_profile *encoded_profile_state(VALUE encoded_profile) {
+  struct encoded_profile *state;
+  TypedData_Get_Struct(encoded_profile, struct encoded_profile, &encoded_profile_typed_data, state);
+  return state;
+}
+
+// Returns false if `object` is not an EncodedProfile. The returned slice is only valid while `object` is kept alive.
+bool encoded_profile_byte_slice(VALUE object, ddog_ByteSlice *result) {
+  if (!rb_typeddata_is_kind_of(object, &encoded_profile_typed_data)) return false;
+
+  struct encoded_profile *encoded_profile = encoded_profile_state(object);
+  if (!encoded_profile->initialized) rb_raise(rb_eRuntimeError, "Unexpected uninitialized EncodedProfile");
+
+  *result = (ddog_ByteSlice) {.ptr = encoded_profile->profile.buffer.ptr, .len = encoded_profile->profile.buffer.len};
+  return true;
+}
+
+static VALUE _native_encoded_profile_bytesize(DDTRACE_UNUSED VALUE _self, VALUE encoded_profile) {
+  ddog_ByteSlice bytes;
+  if (!encoded_profile_byte_slice(encoded_profile, &bytes)) rb_raise(rb_eArgError, "Expected an EncodedProfile");
+  return ULONG2NUM(bytes.len);
+}
+
+// Copies the serialized profile into a Ruby string
+static VALUE _native_encoded_profile_to_s(DDTRACE_UNUSED VALUE _self, VALUE encoded_profile) {
+  ddog_ByteSlice bytes;
+  if (!encoded_profile_byte_slice(encoded_profile, &bytes)) rb_raise(rb_eArgError, "Expected an EncodedProfile");
+  return rb_str_new((const char *) bytes.ptr, bytes.len);
+}
+
 static VALUE ruby_time_from(ddog_Timespec ddprof_time) {
   const int utc = INT_MAX - 1; // From Ruby sources
   struct timespec time = {.tv_sec = ddprof_time.seconds, .tv_nsec = ddprof_time.nanoseconds};
@@ -402,27 +1040,29 @@ void record_sample(VALUE recorder_instance, ddog_prof_Slice_Location locations,
   struct stack_recorder_state *state;
   TypedData_Get_Struct(recorder_instance, struct stack_recorder_state, &stack_recorder_typed_data, state);
 
-  struct active_slot_pair active_slot = sampler_lock_active_profile(state);
-
-  // Note: We initialize this array to have ALL_VALUE_TYPES_COUNT but only tell libdatadog to use the first
-  // state->enabled_values_count values. This simplifies handling disabled value types -- we still put them on the
-  // array, but in _native_initialize we arrange so their position starts from state->enabled_values_count and thus
-  // libdatadog doesn't touch them.
   int64_t metric_values[ALL_VALUE_TYPES_COUNT] = {0};
-  uint8_t *position_for = state->position_for;
+  fill_metric_values(state, values, metric_values);
 
-  metric_values[position_for[CPU_TIME_VALUE_ID]]      = values.cpu_time_ns;
-  metric_values[position_for[CPU_SAMPLES_VALUE_ID]]   = values.cpu_samples;
-  metric_values[position_for[WALL_TIME_VALUE_ID]]     = values.wall_time_ns;
-  metric_values[position_for[ALLOC_SAMPLES_VALUE_ID]] = values.alloc_samples;
+  // If this is an allocation sample for an object that should be tracked, this is where we get its stack
+  if (values.alloc_samples != 0 && state->heap_recorder != NULL) heap_recorder_commit_allocation(state->heap_recorder, locations);
+
+  if (state->deferred_recording != NULL) {
+    deferred_record_sample(state->deferred_recording, locations, metric_values, labels);
+    return;
+  }
 
-  ddog_prof_Profile_AddResult result = ddog_prof_Profile_add(
-    active_slot.profile,
+  struct active_slot_pair active_slot = sampler_lock_active_profile(state);
+
+  ddog_prof_Profile_AddResult result = {.tag = DDOG_PROF_PROFILE_ADD_RESULT_OK};
+  add_sample_to_slot(
+    state,
+    active_slot,
     (ddog_prof_Sample) {
       .locations = locations,
       .values = (ddog_Slice_I64) {.ptr = metric_values, .len = state->enabled_values_count},
       .labels = labels
-    }
+    },
+    &result
   );
 
   sampler_unlock_active_profile(active_slot);
@@ -432,10 +1072,115 @@ void record_sample(VALUE recorder_instance, ddog_prof_Slice_Location locations,
   }
 }
 
+// Note: We initialize this array to have ALL_VALUE_TYPES_COUNT but only tell libdatadog to use the first
+// state->enabled_values_count values. This simplifies handling disabled value types -- we still put them on the
+// array, but in _native_initialize we arrange so their position starts from state->enabled_values_count and thus
+// libdatadog doesn't touch them.
+static void fill_metric_values(struct stack_recorder_state *state, sample_values values, int64_t metric_values[ALL_VALUE_TYPES_COUNT]) {
+  uint8_t *position_for = state->position_for;
+
+  metric_values[position_for[CPU_TIME_VALUE_ID]]      = values.cpu_time_ns;
+  metric_values[position_for[CPU_SAMPLES_VALUE_ID]]   = values.cpu_samples;
+  metric_values[position_for[WALL_TIME_VALUE_ID]]     = values.wall_time_ns;
+  metric_values[position_for[ALLOC_SAMPLES_VALUE_ID]] = values.alloc_samples;
+  metric_values[position_for[GVL_WAIT_VALUE_ID]]      = values.gvl_wait_ns;
+  // Note: Heap samples don't come via sample_values, see record_heap_samples
+}
+
+// Starts tracking a sampled object, so that it can be reported in heap samples while it's alive. The object is
+// associated with the stack of the allocation sample that gets recorded next.
+//
+// Assumption: This function is called from the RUBY_INTERNAL_EVENT_NEWOBJ tracepoint, right before the allocation sample
+// for the `new_object` gets recorded.
+void track_object(VALUE recorder_instance, VALUE new_object, unsigned int sample_weight) {
+  struct stack_recorder_state *state;
+  TypedData_Get_Struct(recorder_instance, struct stack_recorder_state, &stack_recorder_typed_data, state);
+
+  if (state->heap_recorder == NULL) return;
+
+  heap_recorder_prepare_allocation(state->heap_recorder, new_object, sample_weight);
+}
+
+// Returns NULL unless heap samples are enabled. Used by the CpuAndWallTimeWorker to stop tracking objects when they
+// get freed, as it can't call any Ruby APIs (e.g. for checking the type of the `recorder_instance`) from the GC.
+heap_recorder *recorder_heap_recorder(VALUE recorder_instance) {
+  struct stack_recorder_state *state;
+  TypedData_Get_Struct(recorder_instance, struct stack_recorder_state, &stack_recorder_typed_data, state);
+
+  return state->heap_recorder;
+}
+
+// See "Pending samples" notes above
+void recorder_set_pending_samples_flusher(VALUE recorder_instance, VALUE (*flush_pending_samples)(VALUE), VALUE flusher_instance) {
+  struct stack_recorder_state *state;
+  TypedData_Get_Struct(recorder_instance, struct stack_recorder_state, &stack_recorder_typed_data, state);
+
+  state->pending_samples_flusher.flush = flush_pending_samples;
+  state->pending_samples_flusher.instance = flusher_instance;
+}
+
+#ifndef NO_GC_COMPACTION
+static void stack_recorder_typed_data_compact(void *data) {
+  struct stack_recorder_state *state = (struct stack_recorder_state *) data;
+
+  if (state->heap_recorder != NULL) heap_recorder_update_references(state->heap_recorder);
+}
+#endif
+
+// Copies the heap samples to the `heap_samples` batch, see "Heap samples" notes above.
+//
+// Assumption: This method is called with the GVL being held, see _native_serialize
+static void record_heap_samples(struct stack_recorder_state *state) {
+  deferred_batch_clear(&state->heap_samples);
+
+  if (!heap_recorder_for_each_live_stack(state->heap_recorder, copy_heap_sample, state)) {
+    deferred_batch_clear(&state->heap_samples);
+    rb_raise(rb_eNoMemError, "Failed to allocate memory for heap samples");
+  }
+}
+
+static bool copy_heap_sample(heap_recorder_live_stack live_stack, void *state_ptr) {
+  struct stack_recorder_state *state = (struct stack_recorder_state *) state_ptr;
+
+  int64_t metric_values[ALL_VALUE_TYPES_COUNT] = {0};
+  metric_values[state->position_for[HEAP_SAMPLES_VALUE_ID]] = live_stack.live_samples;
+  metric_values[state->position_for[HEAP_SIZE_VALUE_ID]] = live_stack.live_size;
+
+  return deferred_batch_add_sample(&state->heap_samples, live_stack.locations, metric_values, (ddog_prof_Slice_Label) {.ptr = NULL, .len = 0});
+}
+
+// Adds the heap samples copied by record_heap_samples to the profile that's about to be serialized, and stops at the
+// first failure. Heap samples are accounted for, but not subject to the memory budget. Does not raise, as it gets
+// called without the GVL.
+//
+// Assumption: Called by the serializer thread, after flipping the slots, so it owns `args->profile`.
+static void add_heap_samples_to_profile(struct stack_recorder_state *state, struct call_serialize_without_gvl_arguments *args) {
+  deferred_batch *batch = &state->heap_samples;
+  struct slot_memory *memory = memory_for(state, args->profile);
+
+  for (size_t i = 0; i < batch->samples_count; i++) {
+    ddog_prof_Sample sample;
+    if (!batch_sample_to_ddog_sample(state, &state->heap_samples_scratch, batch, &batch->samples[i], &sample)) {
+      args->heap_samples_out_of_memory = true;
+      break;
+    }
+
+    add_sample_within_budget(NO_MEMORY_BUDGET, args->profile, memory, sample, &args->heap_samples_result);
+    if (args->heap_samples_result.tag != DDOG_PROF_PROFILE_ADD_RESULT_OK) break;
+  }
+
+  deferred_batch_clear(batch);
+}
+
 void record_endpoint(VALUE recorder_instance, uint64_t local_root_span_id, ddog_CharSlice endpoint) {
   struct stack_recorder_state *state;
   TypedData_Get_Struct(recorder_instance, struct stack_recorder_state, &stack_recorder_typed_data, state);
 
+  if (state->deferred_recording != NULL) {
+    deferred_record_endpoint(state->deferred_recording, local_root_span_id, endpoint);
+    return;
+  }
+
   struct active_slot_pair active_slot = sampler_lock_active_profile(state);
 
   ddog_prof_Profile_set_endpoint(active_slot.profile, local_root_span_id, endpoint);
@@ -446,7 +1191,14 @@ void record_endpoint(VALUE recorder_instance, uint64_t local_root_span_id, ddog_
 static void *call_serialize_without_gvl(void *call_args) {
   struct call_serialize_without_gvl_arguments *args = (struct call_serialize_without_gvl_arguments *) call_args;
 
+  // Make sure samples that were already recorded but not yet added to the profile get included
+  if (args->state->deferred_recording != NULL) deferred_recording_flush(args->state->deferred_recording);
+
   args->profile = serializer_flip_active_and_inactive_slots(args->state);
+  if (args->state->pre_aggregation_enabled) {
+    pre_aggregation_flush(args->state, args->profile, memory_for(args->state, args->profile), pre_aggregation_for(args->state, args->profile));
+  }
+  if (args->state->heap_recorder != NULL) add_heap_samples_to_profile(args->state, args);
   args->result = ddog_prof_Profile_serialize(args->profile, &args->finish_timestamp, NULL /* duration_nanos is optional */);
   args->serialize_ran = true;
 
@@ -458,27 +1210,50 @@ VALUE enforce_recorder_instance(VALUE object) {
   return object;
 }
 
-static struct active_slot_pair sampler_lock_active_profile(struct stack_recorder_state *state) {
+// Does not raise, so it's safe to use from the recording thread. Returns 0 on success, EBUSY if no active slot
+// was found, or any other error from pthread_mutex_trylock.
+static int lock_active_profile(struct stack_recorder_state *state, struct active_slot_pair *active_slot) {
   int error;
 
   for (int attempts = 0; attempts < 2; attempts++) {
     error = pthread_mutex_trylock(&state->slot_one_mutex);
-    if (error && error != EBUSY) ENFORCE_SUCCESS_GVL(error);
+    if (error && error != EBUSY) return error;
 
     // Slot one is active
-    if (!error) return (struct active_slot_pair) {.mutex = &state->slot_one_mutex, .profile = state->slot_one_profile};
+    if (!error) {
+      *active_slot = (struct active_slot_pair) {
+        .mutex = &state->slot_one_mutex, .profile = state->slot_one_profile, .memory = &state->slot_one_memory, .pre_aggregation = &state->slot_one_pre_aggregation
+      };
+      return 0;
+    }
 
     // If we got here, slot one was not active, let's try slot two
 
     error = pthread_mutex_trylock(&state->slot_two_mutex);
-    if (error && error != EBUSY) ENFORCE_SUCCESS_GVL(error);
+    if (error && error != EBUSY) return error;
 
     // Slot two is active
-    if (!error) return (struct active_slot_pair) {.mutex = &state->slot_two_mutex, .profile = state->slot_two_profile};
+    if (!error) {
+      *active_slot = (struct active_slot_pair) {
+        .mutex = &state->slot_two_mutex, .profile = state->slot_two_profile, .memory = &state->slot_two_memory, .pre_aggregation = &state->slot_two_pre_aggregation
+      };
+      return 0;
+    }
   }
 
+  return EBUSY;
+}
+
+static struct active_slot_pair sampler_lock_active_profile(struct stack_recorder_state *state) {
+  struct active_slot_pair active_slot;
+  int error = lock_active_profile(state, &active_slot);
+
   // We already tried both multiple times, and we did not succeed. This is not expected to happen. Let's stop sampling.
-  rb_raise(rb_eRuntimeError, "Failed to grab either mutex in sampler_lock_active_profile");
+  if (error == EBUSY) rb_raise(rb_eRuntimeError, "Failed to grab either mutex in sampler_lock_active_profile");
+
+  ENFORCE_SUCCESS_GVL(error);
+
+  return active_slot;
 }
 
 static void sampler_unlock_active_profile(struct active_slot_pair active_slot) {
@@ -565,12 +1340,31 @@ static VALUE _native_reset_after_fork(DDTRACE_UNUSED VALUE self, VALUE recorder_
   struct stack_recorder_state *state;
   TypedData_Get_Struct(recorder_instance, struct stack_recorder_state, &stack_recorder_typed_data, state);
 
+  // reset_after_fork can also get called without forking (e.g. in tests), in which case the recording thread is still
+  // running, and needs to be stopped before resetting the profile slots it uses
+  if (state->deferred_recording != NULL && !deferred_recording_inherited(state->deferred_recording)) {
+    deferred_recording_stop_thread(state->deferred_recording);
+  }
+
   // In case the fork happened halfway through `serializer_flip_active_and_inactive_slots` execution and the
   // resulting state is inconsistent, we make sure to reset it back to the initial state.
   initialize_slot_concurrency_control(state);
 
   ddog_prof_Profile_reset(state->slot_one_profile, /* start_time: */ NULL);
   ddog_prof_Profile_reset(state->slot_two_profile, /* start_time: */ NULL);
+  slot_memory_reset(&state->slot_one_memory);
+  slot_memory_reset(&state->slot_two_memory);
+  state->slot_one_memory.samples_over_budget = 0;
+  state->slot_two_memory.samples_over_budget = 0;
+  pre_aggregation_clear(&state->slot_one_pre_aggregation);
+  pre_aggregation_clear(&state->slot_two_pre_aggregation);
+  memset(&state->slot_one_pre_aggregation.stats, 0, sizeof(state->slot_one_pre_aggregation.stats));
+  memset(&state->slot_two_pre_aggregation.stats, 0, sizeof(state->slot_two_pre_aggregation.stats));
+
+  if (state->heap_recorder != NULL) heap_recorder_clear(state->heap_recorder);
+
+  // The recording thread does not survive the fork, so we need to start a new one, see "Deferred recording" notes above
+  if (state->deferred_recording != NULL) deferred_recording_reset_after_fork(state);
 
   return Qtrue;
 }
@@ -582,6 +1376,7 @@ static void serializer_set_start_timestamp_for_next_profile(struct stack_recorde
   ddog_prof_Profile *next_profile = (state->active_slot == 1) ? state->slot_two_profile : state->slot_one_profile;
 
   if (!ddog_prof_Profile_reset(next_profile, &timestamp)) rb_raise(rb_eRuntimeError, "Failed to reset profile");
+  slot_memory_reset(memory_for(state, next_profile));
 }
 
 static VALUE _native_record_endpoint(DDTRACE_UNUSED VALUE _self, VALUE recorder_instance, VALUE local_root_span_id, VALUE endpoint) {
@@ -589,3 +1384,1063 @@ static VALUE _native_record_endpoint(DDTRACE_UNUSED VALUE _self, VALUE recorder_
   record_endpoint(recorder_instance, NUM2ULL(local_root_span_id), char_slice_from_ruby_string(endpoint));
   return Qtrue;
 }
+
+static VALUE _native_stats(DDTRACE_UNUSED VALUE self, VALUE recorder_instance) {
+  struct stack_recorder_state *state;
+  TypedData_Get_Struct(recorder_instance, struct stack_recorder_state, &stack_recorder_typed_data, state);
+
+  struct deferred_recording *deferred = state->deferred_recording;
+  VALUE deferred_samples_deferred = Qnil, deferred_samples_dropped = Qnil, deferred_samples_recorded = Qnil, deferred_samples_failed = Qnil;
+
+  if (deferred != NULL) {
+    // In a forked child that did not call reset_after_fork yet, the mutex may have been copied while being held (but
+    // there's also no recording thread to race with)
+    bool inherited = deferred_recording_inherited(deferred);
+
+    if (!inherited) ENFORCE_SUCCESS_GVL(pthread_mutex_lock(&deferred->mutex));
+    deferred_samples_deferred = ULONG2NUM(deferred->stats.samples_deferred);
+    deferred_samples_dropped = ULONG2NUM(deferred->stats.samples_dropped);
+    deferred_samples_recorded = ULONG2NUM(deferred->stats.samples_recorded);
+    deferred_samples_failed = ULONG2NUM(deferred->stats.samples_failed);
+    if (!inherited) ENFORCE_SUCCESS_GVL(pthread_mutex_unlock(&deferred->mutex));
+  }
+
+  // Note: We don't grab the slot mutexes here, so these may be slightly out-of-date
+  size_t estimated_memory_bytes = state->slot_one_memory.estimated_bytes + state->slot_two_memory.estimated_bytes;
+  unsigned long samples_over_memory_budget = state->slot_one_memory.samples_over_budget + state->slot_two_memory.samples_over_budget;
+
+  VALUE pre_aggregation_samples_aggregated = Qnil, pre_aggregation_samples_flushed = Qnil, pre_aggregation_samples_failed = Qnil,
+    pre_aggregation_samples_bypassed = Qnil;
+  if (state->pre_aggregation_enabled) {
+    pre_aggregation_table *one = &state->slot_one_pre_aggregation, *two = &state->slot_two_pre_aggregation;
+    pre_aggregation_samples_aggregated = ULONG2NUM(one->stats.samples_aggregated + two->stats.samples_aggregated);
+    pre_aggregation_samples_flushed = ULONG2NUM(one->stats.samples_flushed + two->stats.samples_flushed);
+    pre_aggregation_samples_failed = ULONG2NUM(one->stats.samples_failed + two->stats.samples_failed);
+    pre_aggregation_samples_bypassed = ULONG2NUM(one->stats.samples_bypassed + two->stats.samples_bypassed);
+  }
+
+  VALUE heap_tracked_objects = Qnil, heap_tracked_stacks = Qnil;
+  if (state->heap_recorder != NULL) {
+    heap_tracked_objects = ULONG2NUM(heap_recorder_tracked_objects_count(state->heap_recorder));
+    heap_tracked_stacks = ULONG2NUM(heap_recorder_tracked_stacks_count(state->heap_recorder));
+  }
+
+  VALUE stats_as_hash = rb_hash_new();
+  VALUE arguments[] = {
+    ID2SYM(rb_intern("deferred_samples_deferred")),  /* => */ deferred_samples_deferred,
+    ID2SYM(rb_intern("deferred_samples_dropped")),   /* => */ deferred_samples_dropped,
+    ID2SYM(rb_intern("deferred_samples_recorded")),  /* => */ deferred_samples_recorded,
+    ID2SYM(rb_intern("deferred_samples_failed")),    /* => */ deferred_samples_failed,
+    ID2SYM(rb_intern("heap_tracked_objects")),       /* => */ heap_tracked_objects,
+    ID2SYM(rb_intern("heap_tracked_stacks")),        /* => */ heap_tracked_stacks,
+    ID2SYM(rb_intern("memory_budget_bytes")),        /* => */ state->memory_budget_bytes == NO_MEMORY_BUDGET ? Qnil : SIZET2NUM(state->memory_budget_bytes),
+    ID2SYM(rb_intern("estimated_memory_bytes")),     /* => */ SIZET2NUM(estimated_memory_bytes),
+    ID2SYM(rb_intern("samples_over_memory_budget")), /* => */ ULONG2NUM(samples_over_memory_budget),
+    ID2SYM(rb_intern("pre_aggregation_samples_aggregated")), /* => */ pre_aggregation_samples_aggregated,
+    ID2SYM(rb_intern("pre_aggregation_samples_flushed")),    /* => */ pre_aggregation_samples_flushed,
+    ID2SYM(rb_intern("pre_aggregation_samples_failed")),     /* => */ pre_aggregation_samples_failed,
+    ID2SYM(rb_intern("pre_aggregation_samples_bypassed")),   /* => */ pre_aggregation_samples_bypassed,
+  };
+  for (long unsigned int i = 0; i < VALUE_COUNT(arguments); i += 2) rb_hash_aset(stats_as_hash, arguments[i], arguments[i+1]);
+  return stats_as_hash;
+}
+
+// Assumption: Called with the GVL held, from _native_initialize
+static void deferred_recording_start(struct stack_recorder_state *state) {
+  struct deferred_recording *deferred = calloc(1, sizeof(struct deferred_recording));
+  if (deferred == NULL) rb_raise(rb_eNoMemError, "Failed to allocate memory for deferred recording");
+
+  state->deferred_recording = deferred;
+
+  deferred_recording_start_thread(state);
+}
+
+// Assumption: Called with the GVL held, and the recording thread not running
+static void deferred_recording_start_thread(struct stack_recorder_state *state) {
+  struct deferred_recording *deferred = state->deferred_recording;
+
+  deferred->mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+  deferred->work_available = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+  deferred->work_done = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+  deferred->stop_requested = false;
+  deferred->active_batch = &deferred->batches[0];
+  deferred->pending_batch = NULL;
+  deferred->fork_generation = fork_generation;
+
+  int error = pthread_create(&deferred->recording_thread, NULL, deferred_recording_thread_main, state);
+  if (error) {
+    state->deferred_recording = NULL;
+    deferred_batch_free(&deferred->batches[0]);
+    deferred_batch_free(&deferred->batches[1]);
+    batch_scratch_free(&deferred->scratch);
+    free(deferred);
+    ENFORCE_SUCCESS_GVL(error);
+  }
+}
+
+// Assumption: Called with the GVL held (or during VM shutdown), from stack_recorder_typed_data_free
+static void deferred_recording_stop(struct deferred_recording *deferred) {
+  // A forked child that never called reset_after_fork does not have a recording thread to stop
+  if (!deferred_recording_inherited(deferred)) deferred_recording_stop_thread(deferred);
+
+  pthread_mutex_destroy(&deferred->mutex);
+  pthread_cond_destroy(&deferred->work_available);
+  pthread_cond_destroy(&deferred->work_done);
+
+  deferred_batch_free(&deferred->batches[0]);
+  deferred_batch_free(&deferred->batches[1]);
+  batch_scratch_free(&deferred->scratch);
+  free(deferred);
+}
+
+// Assumption: Called with the GVL held, and the recording thread belongs to the current process
+static void deferred_recording_stop_thread(struct deferred_recording *deferred) {
+  pthread_mutex_lock(&deferred->mutex);
+  deferred->stop_requested = true;
+  pthread_cond_signal(&deferred->work_available);
+  pthread_mutex_unlock(&deferred->mutex);
+
+  pthread_join(deferred->recording_thread, NULL);
+}
+
+// Assumption: Called with the GVL held, from _native_reset_after_fork, and the recording thread not running
+static void deferred_recording_reset_after_fork(struct stack_recorder_state *state) {
+  struct deferred_recording *deferred = state->deferred_recording;
+
+  // Any samples in the batches were recorded by the parent, so we discard them together with the profiles
+  deferred_batch_clear(&deferred->batches[0]);
+  deferred_batch_clear(&deferred->batches[1]);
+  memset(&deferred->stats, 0, sizeof(deferred->stats));
+
+  // The mutex and condition variables may have been in any state at the time of the fork, so they get reinitialized here
+  deferred_recording_start_thread(state);
+}
+
+// Returns true in a forked child that did not call reset_after_fork yet, see "Deferred recording" notes above
+static bool deferred_recording_inherited(struct deferred_recording *deferred) {
+  return deferred->fork_generation != fork_generation;
+}
+
+static void on_fork_in_child(void) {
+  fork_generation++;
+}
+
+static void deferred_record_sample(
+  struct deferred_recording *deferred,
+  ddog_prof_Slice_Location locations,
+  int64_t metric_values[ALL_VALUE_TYPES_COUNT],
+  ddog_prof_Slice_Label labels
+) {
+  // There's no recording thread (and the mutex may have been copied while being held) until reset_after_fork gets
+  // called. The stats are not protected by the mutex in this situation, as nothing else is touching them.
+  if (deferred_recording_inherited(deferred)) {
+    deferred->stats.samples_dropped++;
+    return;
+  }
+
+  ENFORCE_SUCCESS_GVL(pthread_mutex_lock(&deferred->mutex));
+
+  deferred_batch *batch = deferred->active_batch;
+
+  bool batch_full =
+    batch->samples_count >= DEFERRED_RECORDING_MAX_SAMPLES_PER_BATCH ||
+    deferred_batch_used_bytes(batch) >= DEFERRED_RECORDING_MAX_BYTES_PER_BATCH;
+
+  if (!batch_full && deferred_batch_add_sample(batch, locations, metric_values, labels)) {
+    deferred->stats.samples_deferred++;
+  } else {
+    deferred->stats.samples_dropped++;
+  }
+
+  deferred_recording_hand_over_active_batch(deferred);
+
+  ENFORCE_SUCCESS_GVL(pthread_mutex_unlock(&deferred->mutex));
+}
+
+static void deferred_record_endpoint(struct deferred_recording *deferred, uint64_t local_root_span_id, ddog_CharSlice endpoint) {
+  if (deferred_recording_inherited(deferred)) return; // Same as for deferred_record_sample
+
+  ENFORCE_SUCCESS_GVL(pthread_mutex_lock(&deferred->mutex));
+
+  // If we fail to allocate memory, the endpoint just doesn't get recorded; samples will still be recorded without it
+  deferred_batch_add_endpoint(deferred->active_batch, local_root_span_id, endpoint);
+  deferred_recording_hand_over_active_batch(deferred);
+
+  ENFORCE_SUCCESS_GVL(pthread_mutex_unlock(&deferred->mutex));
+}
+
+// Assumption: Called while holding the deferred_recording mutex
+static void deferred_recording_hand_over_active_batch(struct deferred_recording *deferred) {
+  deferred_batch *batch = deferred->active_batch;
+
+  bool recording_thread_busy = deferred->pending_batch != NULL;
+  bool batch_empty = batch->samples_count == 0 && batch->endpoints_count == 0;
+  if (recording_thread_busy || batch_empty) return;
+
+  deferred->pending_batch = batch;
+  deferred->active_batch = (batch == &deferred->batches[0]) ? &deferred->batches[1] : &deferred->batches[0];
+
+  pthread_cond_signal(&deferred->work_available);
+}
+
+// Assumption: Called from the serializer thread, without the GVL
+static void deferred_recording_flush(struct deferred_recording *deferred) {
+  // In a forked child that did not reset the deferred state yet, there's no recording thread to wait for (and the mutex
+  // may be held by a thread that no longer exists). The batches belong to the parent anyway.
+  if (deferred_recording_inherited(deferred)) return;
+
+  ENFORCE_SUCCESS_NO_GVL(pthread_mutex_lock(&deferred->mutex));
+
+  // The active batch can only be handed over once the recording thread is done with the pending batch...
+  while (deferred->pending_batch != NULL) ENFORCE_SUCCESS_NO_GVL(pthread_cond_wait(&deferred->work_done, &deferred->mutex));
+
+  deferred_recording_hand_over_active_batch(deferred);
+
+  // ...and then we need to wait for it to be done with the batch we just handed over
+  while (deferred->pending_batch != NULL) ENFORCE_SUCCESS_NO_GVL(pthread_cond_wait(&deferred->work_done, &deferred->mutex));
+
+  ENFORCE_SUCCESS_NO_GVL(pthread_mutex_unlock(&deferred->mutex));
+}
+
+// This is the recording thread. It does not hold the GVL nor is it a Ruby thread, so it MUST NOT call any Ruby APIs
+// (including raising exceptions). Instead, any failures are reflected in the stats.
+static void *deferred_recording_thread_main(void *state_ptr) {
+  struct stack_recorder_state *state = (struct stack_recorder_state *) state_ptr;
+  struct deferred_recording *deferred = state->deferred_recording;
+
+  pthread_mutex_lock(&deferred->mutex);
+
+  while (true) {
+    while (deferred->pending_batch == NULL && !deferred->stop_requested) pthread_cond_wait(&deferred->work_available, &deferred->mutex);
+
+    deferred_batch *batch = deferred->pending_batch;
+    if (batch == NULL) break; // Stop was requested and there's nothing left to do
+
+    // The sampler threads never touch the pending batch, so it's safe to process it without holding the mutex
+    pthread_mutex_unlock(&deferred->mutex);
+    unsigned long failed = deferred_recording_process_batch(state, batch);
+    pthread_mutex_lock(&deferred->mutex);
+
+    deferred->stats.samples_recorded += batch->samples_count - failed;
+    deferred->stats.samples_failed += failed;
+
+    deferred_batch_clear(batch);
+    deferred->pending_batch = NULL;
+    pthread_cond_broadcast(&deferred->work_done);
+  }
+
+  pthread_mutex_unlock(&deferred->mutex);
+
+  return NULL;
+}
+
+// Returns how many samples failed to be added to the profile
+static unsigned long deferred_recording_process_batch(struct stack_recorder_state *state, deferred_batch *batch) {
+  unsigned long failed = 0;
+
+  for (size_t i = 0; i < batch->endpoints_count; i++) {
+    deferred_endpoint *endpoint = &batch->endpoints[i];
+    struct active_slot_pair active_slot;
+    if (lock_active_profile(state, &active_slot) != 0) continue;
+
+    ddog_prof_Profile_set_endpoint(active_slot.profile, endpoint->local_root_span_id, deferred_batch_string(batch, endpoint->endpoint));
+
+    pthread_mutex_unlock(active_slot.mutex);
+  }
+
+  for (size_t i = 0; i < batch->samples_count; i++) {
+    if (!deferred_recording_add_to_profile(state, batch, &batch->samples[i])) failed++;
+  }
+
+  return failed;
+}
+
+static bool deferred_recording_add_to_profile(struct stack_recorder_state *state, deferred_batch *batch, deferred_sample *sample) {
+  ddog_prof_Sample ddog_sample;
+  if (!batch_sample_to_ddog_sample(state, &state->deferred_recording->scratch, batch, sample, &ddog_sample)) return false;
+
+  struct active_slot_pair active_slot;
+  if (lock_active_profile(state, &active_slot) != 0) return false;
+
+  ddog_prof_Profile_AddResult result = {.tag = DDOG_PROF_PROFILE_ADD_RESULT_OK};
+  bool added = add_sample_to_slot(state, active_slot, ddog_sample, &result);
+
+  pthread_mutex_unlock(active_slot.mutex);
+
+  if (result.tag == DDOG_PROF_PROFILE_ADD_RESULT_ERR) {
+    ddog_Error_drop(&result.err);
+    return false;
+  }
+
+  return added;
+}
+
+// Turns a sample copied to a deferred_batch back into a ddog_prof_Sample. The result points into both the batch and the
+// scratch, so it's only valid until either of them gets modified. Returns false if memory could not be allocated.
+static bool batch_sample_to_ddog_sample(
+  struct stack_recorder_state *state,
+  batch_scratch *scratch,
+  deferred_batch *batch,
+  deferred_sample *sample,
+  ddog_prof_Sample *result
+) {
+  deferred_location *locations = &batch->locations[sample->first_location];
+  size_t lines_count = 0;
+  for (size_t i = 0; i < sample->locations_count; i++) lines_count += locations[i].lines_count;
+
+  bool scratch_available =
+    ensure_capacity((void **) &scratch->locations, &scratch->locations_capacity, sample->locations_count, sizeof(ddog_prof_Location)) &&
+    ensure_capacity((void **) &scratch->lines, &scratch->lines_capacity, lines_count, sizeof(ddog_prof_Line)) &&
+    ensure_capacity((void **) &scratch->labels, &scratch->labels_capacity, sample->labels_count, sizeof(ddog_prof_Label));
+  if (!scratch_available) return false;
+
+  size_t next_line = 0;
+  for (size_t i = 0; i < sample->locations_count; i++) {
+    ddog_prof_Line *location_lines = &scratch->lines[next_line];
+
+    for (size_t j = 0; j < locations[i].lines_count; j++) {
+      deferred_line *line = &batch->lines[locations[i].first_line + j];
+      location_lines[j] = (ddog_prof_Line) {
+        .function = (ddog_prof_Function) {
+          .name = deferred_batch_string(batch, line->name),
+          .system_name = deferred_batch_string(batch, line->system_name),
+          .filename = deferred_batch_string(batch, line->filename),
+          .start_line = line->start_line,
+        },
+        .line = line->line,
+      };
+    }
+
+    scratch->locations[i] = (ddog_prof_Location) {.lines = {.ptr = location_lines, .len = locations[i].lines_count}};
+    next_line += locations[i].lines_count;
+  }
+
+  for (size_t i = 0; i < sample->labels_count; i++) {
+    deferred_label *label = &batch->labels[sample->first_label + i];
+    scratch->labels[i] = (ddog_prof_Label) {
+      .key = deferred_batch_string(batch, label->key),
+      .str = deferred_batch_string(batch, label->str),
+      .num = label->num,
+      .num_unit = deferred_batch_string(batch, label->num_unit),
+    };
+  }
+
+  *result = (ddog_prof_Sample) {
+    .locations = (ddog_prof_Slice_Location) {.ptr = scratch->locations, .len = sample->locations_count},
+    .values = (ddog_Slice_I64) {.ptr = sample->metric_values, .len = state->enabled_values_count},
+    .labels = (ddog_prof_Slice_Label) {.ptr = scratch->labels, .len = sample->labels_count}
+  };
+
+  return true;
+}
+
+// Adds the sample to the profile, unless it would take the slot over `memory_budget_bytes` (see "Memory accounting" notes
+// above). Returns false if the sample was dropped due to the budget. Does not raise, so it's safe to use without the GVL.
+//
+// Assumption: Called while holding the mutex for the slot that `profile` and `memory` belong to.
+static bool add_sample_within_budget(
+  size_t memory_budget_bytes,
+  ddog_prof_Profile *profile,
+  struct slot_memory *memory,
+  ddog_prof_Sample sample,
+  ddog_prof_Profile_AddResult *result
+) {
+  if (memory_budget_bytes == NO_MEMORY_BUDGET) {
+    *result = ddog_prof_Profile_add(profile, sample);
+    if (result->tag == DDOG_PROF_PROFILE_ADD_RESULT_OK) slot_memory_charge(memory, NULL, estimated_sample_bytes(memory, sample, NULL));
+    return true;
+  }
+
+  sample_hashes hashes = hash_sample(sample);
+  size_t sample_bytes = estimated_sample_bytes(memory, sample, &hashes);
+
+  if (sample_bytes > 0 && memory->estimated_bytes + sample_bytes > memory_budget_bytes) {
+    memory->samples_over_budget++;
+    return false;
+  }
+
+  *result = ddog_prof_Profile_add(profile, sample);
+  if (result->tag == DDOG_PROF_PROFILE_ADD_RESULT_OK) slot_memory_charge(memory, &hashes, sample_bytes);
+
+  return true;
+}
+
+// Adds the sample to the slot's profile, or to its pre-aggregation table when pre-aggregation is enabled (see
+// "Pre-aggregation" notes above). Returns false if the sample was dropped due to the memory budget. Does not raise, so
+// it's safe to use without the GVL.
+//
+// Assumption: Called while holding the mutex for `active_slot`.
+static bool add_sample_to_slot(
+  struct stack_recorder_state *state,
+  struct active_slot_pair active_slot,
+  ddog_prof_Sample sample,
+  ddog_prof_Profile_AddResult *result
+) {
+  if (state->pre_aggregation_enabled) {
+    pre_aggregation_table *table = active_slot.pre_aggregation;
+
+    if (pre_aggregation_full(state, active_slot.memory, table)) {
+      table->stats.samples_bypassed++;
+    } else {
+      pre_aggregation_add_result added = pre_aggregation_add(table, active_slot.memory, state->memory_budget_bytes, sample);
+      if (added != PRE_AGGREGATION_FAILED) return added == PRE_AGGREGATION_ADDED;
+    }
+
+    // Otherwise, the table is full or we failed to allocate memory for it, so let's add the sample directly instead
+  }
+
+  return add_sample_within_budget(state->memory_budget_bytes, active_slot.profile, active_slot.memory, sample, result);
+}
+
+// Assumption: Called while holding the mutex for the slot that `memory` and `table` belong to.
+static bool pre_aggregation_full(struct stack_recorder_state *state, struct slot_memory *memory, pre_aggregation_table *table) {
+  return
+    table->batch.samples_count >= PRE_AGGREGATION_MAX_SAMPLES ||
+    table->charged_bytes >= PRE_AGGREGATION_MAX_BYTES ||
+    (state->memory_budget_bytes != NO_MEMORY_BUDGET && memory->estimated_bytes >= state->memory_budget_bytes);
+}
+
+// Drops the sample if it would be a new entry that takes the slot over `memory_budget_bytes` (see "Pre-aggregation"
+// notes above).
+//
+// Assumption: The table is not full, and thus at least half of the buckets are empty, so probing always ends.
+static pre_aggregation_add_result pre_aggregation_add(
+  pre_aggregation_table *table,
+  struct slot_memory *memory,
+  size_t memory_budget_bytes,
+  ddog_prof_Sample sample
+) {
+  if (table->buckets == NULL && !pre_aggregation_allocate(table)) return PRE_AGGREGATION_FAILED;
+
+  deferred_batch *batch = &table->batch;
+  deferred_batch saved = *batch;
+
+  int64_t metric_values[ALL_VALUE_TYPES_COUNT] = {0};
+  memcpy(metric_values, sample.values.ptr, sample.values.len * sizeof(int64_t));
+
+  // Copying the sample interns its strings, so from here on it can be hashed and compared using only the interned ids
+  if (!deferred_batch_add_sample(batch, sample.locations, metric_values, sample.labels)) return PRE_AGGREGATION_FAILED;
+
+  size_t index = batch->samples_count - 1;
+  deferred_sample *copy = &batch->samples[index];
+  uint64_t hash = pre_aggregation_hash(batch, copy);
+  size_t bucket = hash & (PRE_AGGREGATION_BUCKETS - 1);
+
+  for (; table->buckets[bucket] != 0; bucket = (bucket + 1) & (PRE_AGGREGATION_BUCKETS - 1)) {
+    size_t entry_index = table->buckets[bucket] - 1;
+    deferred_sample *entry = &batch->samples[entry_index];
+
+    if (table->hashes[entry_index] == hash && pre_aggregation_entry_matches(batch, entry, copy)) {
+      for (size_t i = 0; i < sample.values.len; i++) entry->metric_values[i] += sample.values.ptr[i];
+      table->stats.samples_aggregated++;
+
+      // The copy is not needed anymore. Its strings were all interned already, as they're the same as the entry's.
+      deferred_batch_truncate(batch, &saved);
+
+      return PRE_AGGREGATION_ADDED;
+    }
+  }
+
+  if (
+    memory_budget_bytes != NO_MEMORY_BUDGET &&
+    memory->estimated_bytes + (deferred_batch_used_bytes(batch) - table->charged_bytes) > memory_budget_bytes
+  ) {
+    deferred_batch_truncate(batch, &saved);
+    memory->samples_over_budget++;
+
+    return PRE_AGGREGATION_OVER_BUDGET;
+  }
+
+  table->hashes[index] = hash;
+  table->buckets[bucket] = index + 1;
+  pre_aggregation_charge(table, memory);
+
+  return PRE_AGGREGATION_ADDED;
+}
+
+// Brings the slot's estimated_bytes up to date with the bytes used by the table
+static void pre_aggregation_charge(pre_aggregation_table *table, struct slot_memory *memory) {
+  size_t used_bytes = deferred_batch_used_bytes(&table->batch);
+  memory->estimated_bytes += used_bytes - table->charged_bytes;
+  table->charged_bytes = used_bytes;
+}
+
+// Both samples must belong to `batch`, so that equal strings have the same deferred_string
+static bool pre_aggregation_entry_matches(deferred_batch *batch, deferred_sample *entry, deferred_sample *other) {
+  if (entry->locations_count != other->locations_count || entry->labels_count != other->labels_count) return false;
+
+  for (size_t i = 0; i < entry->locations_count; i++) {
+    deferred_location *location = &batch->locations[entry->first_location + i];
+    deferred_location *other_location = &batch->locations[other->first_location + i];
+
+    if (location->lines_count != other_location->lines_count) return false;
+
+    for (size_t j = 0; j < location->lines_count; j++) {
+      deferred_line *line = &batch->lines[location->first_line + j];
+      deferred_line *other_line = &batch->lines[other_location->first_line + j];
+
+      bool matches =
+        line->line == other_line->line &&
+        line->start_line == other_line->start_line &&
+        deferred_string_equals(line->name, other_line->name) &&
+        deferred_string_equals(line->filename, other_line->filename) &&
+        deferred_string_equals(line->system_name, other_line->system_name);
+      if (!matches) return false;
+    }
+  }
+
+  for (size_t i = 0; i < entry->labels_count; i++) {
+    deferred_label *label = &batch->labels[entry->first_label + i];
+    deferred_label *other_label = &batch->labels[other->first_label + i];
+
+    bool matches =
+      label->num == other_label->num &&
+      deferred_string_equals(label->key, other_label->key) &&
+      deferred_string_equals(label->str, other_label->str) &&
+      deferred_string_equals(label->num_unit, other_label->num_unit);
+    if (!matches) return false;
+  }
+
+  return true;
+}
+
+// Adds all samples in the table to the profile, and empties the table. Does not raise, so it's safe to use without
+// the GVL.
+//
+// Assumption: Called while holding the mutex for the slot that `profile`, `memory` and `table` belong to.
+static void pre_aggregation_flush(
+  struct stack_recorder_state *state,
+  ddog_prof_Profile *profile,
+  struct slot_memory *memory,
+  pre_aggregation_table *table
+) {
+  deferred_batch *batch = &table->batch;
+
+  // From now on, the samples get accounted for as part of the profile
+  memory->estimated_bytes -= table->charged_bytes;
+  table->charged_bytes = 0;
+
+  for (size_t i = 0; i < batch->samples_count; i++) {
+    ddog_prof_Sample sample;
+    if (!batch_sample_to_ddog_sample(state, &table->scratch, batch, &batch->samples[i], &sample)) {
+      table->stats.samples_failed++;
+      continue;
+    }
+
+    // Samples in the table were already checked against the budget when they got added, so they never get dropped here
+    ddog_prof_Profile_AddResult result = {.tag = DDOG_PROF_PROFILE_ADD_RESULT_OK};
+    add_sample_within_budget(NO_MEMORY_BUDGET, profile, memory, sample, &result);
+
+    if (result.tag == DDOG_PROF_PROFILE_ADD_RESULT_ERR) {
+      ddog_Error_drop(&result.err);
+      table->stats.samples_failed++;
+    } else {
+      table->stats.samples_flushed++;
+    }
+  }
+
+  pre_aggregation_clear(table);
+}
+
+static bool pre_aggregation_allocate(pre_aggregation_table *table) {
+  table->hashes = malloc(PRE_AGGREGATION_MAX_SAMPLES * sizeof(uint64_t));
+  table->buckets = calloc(PRE_AGGREGATION_BUCKETS, sizeof(uint32_t));
+
+  if (table->hashes == NULL || table->buckets == NULL) {
+    free(table->hashes);
+    free(table->buckets);
+    table->hashes = NULL;
+    table->buckets = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+// Keeps the memory around, so it can be reused by the next samples
+static void pre_aggregation_clear(pre_aggregation_table *table) {
+  deferred_batch_clear(&table->batch);
+  table->charged_bytes = 0;
+  if (table->buckets != NULL) memset(table->buckets, 0, PRE_AGGREGATION_BUCKETS * sizeof(uint32_t));
+}
+
+static void pre_aggregation_free(pre_aggregation_table *table) {
+  deferred_batch_free(&table->batch);
+  free(table->hashes);
+  free(table->buckets);
+  batch_scratch_free(&table->scratch);
+  *table = (pre_aggregation_table) {0};
+}
+
+// Does not include the bytes that are already accounted for in the slot's estimated_bytes
+static size_t pre_aggregation_memory_size(const pre_aggregation_table *table) {
+  size_t size = deferred_batch_memory_size(&table->batch) - table->charged_bytes;
+  if (table->buckets != NULL) size += PRE_AGGREGATION_MAX_SAMPLES * sizeof(uint64_t) + PRE_AGGREGATION_BUCKETS * sizeof(uint32_t);
+  return size;
+}
+
+// Hashes everything that pre_aggregation_entry_matches compares
+static uint64_t pre_aggregation_hash(deferred_batch *batch, deferred_sample *sample) {
+  uint64_t hash = HASH_SEED;
+
+  for (size_t i = 0; i < sample->locations_count; i++) {
+    deferred_location *location = &batch->locations[sample->first_location + i];
+    hash = hash_word(hash, location->lines_count);
+
+    for (size_t j = 0; j < location->lines_count; j++) {
+      deferred_line *line = &batch->lines[location->first_line + j];
+      hash = hash_word(hash, (uint64_t) line->line);
+      hash = hash_word(hash, (uint64_t) line->start_line);
+      hash = hash_deferred_string(hash, line->name);
+      hash = hash_deferred_string(hash, line->filename);
+      hash = hash_deferred_string(hash, line->system_name);
+    }
+  }
+
+  for (size_t i = 0; i < sample->labels_count; i++) {
+    deferred_label *label = &batch->labels[sample->first_label + i];
+    hash = hash_word(hash, (uint64_t) label->num);
+    hash = hash_deferred_string(hash, label->key);
+    hash = hash_deferred_string(hash, label->str);
+    hash = hash_deferred_string(hash, label->num_unit);
+  }
+
+  return hash;
+}
+
+// Works on 8 bytes at a time, as strings (e.g. frame names and filenames) are usually much longer than that
+static uint64_t hash_bytes(uint64_t hash, const void *bytes, size_t len) {
+  const unsigned char *next = (const unsigned char *) bytes;
+
+  for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t), next += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, next, sizeof(word));
+    hash = hash_word(hash, word);
+  }
+
+  uint64_t remaining = 0;
+  if (len > 0) memcpy(&remaining, next, len);
+
+  return hash_word(hash, remaining);
+}
+
+// The xor-shift makes the higher bits affect the lower bits, which are the ones used to pick a bucket
+static uint64_t hash_word(uint64_t hash, uint64_t word) {
+  hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+  return hash ^ (hash >> 32);
+}
+
+// Only meaningful for interned strings, where the offset identifies the string
+static uint64_t hash_deferred_string(uint64_t hash, deferred_string string) {
+  return hash_word(hash_word(hash, string.offset), string.len);
+}
+
+static bool deferred_string_equals(deferred_string a, deferred_string b) {
+  return a.offset == b.offset && a.len == b.len;
+}
+
+static bool char_slice_equals(ddog_CharSlice a, ddog_CharSlice b) {
+  return a.len == b.len && (a.len == 0 || memcmp(a.ptr, b.ptr, a.len) == 0);
+}
+
+// How much the profile will grow by when the sample gets added to it; zero for a sample that the profile already has.
+//
+// Assumption: Called while holding the mutex for the slot that `memory` belongs to.
+// When `hashes` is NULL, the whole sample gets charged (see "Memory accounting" notes above)
+static size_t estimated_sample_bytes(const struct slot_memory *memory, ddog_prof_Sample sample, const sample_hashes *hashes) {
+  size_t bytes = 0;
+
+  if (hashes == NULL || !slot_memory_seen(memory, hashes->stack)) {
+    bytes += sample.locations.len * sizeof(uint64_t); // libdatadog keeps an id for each location
+  }
+
+  if (hashes == NULL || !slot_memory_seen(memory, hashes->labels)) {
+    for (size_t i = 0; i < sample.labels.len; i++) bytes += sizeof(ddog_prof_Label) + sample.labels.ptr[i].str.len;
+  }
+
+  if (hashes == NULL || !slot_memory_seen(memory, hashes->sample)) {
+    bytes += ESTIMATED_SAMPLE_OVERHEAD_BYTES + sample.values.len * sizeof(int64_t);
+  }
+
+  return bytes;
+}
+
+// Hashes what libdatadog uses to tell stacks, label sets and samples apart
+static sample_hashes hash_sample(ddog_prof_Sample sample) {
+  uint64_t stack = HASH_SEED;
+
+  for (size_t i = 0; i < sample.locations.len; i++) {
+    ddog_prof_Slice_Line lines = sample.locations.ptr[i].lines;
+    stack = hash_word(stack, lines.len);
+
+    for (size_t j = 0; j < lines.len; j++) {
+      const ddog_prof_Line *line = &lines.ptr[j];
+      stack = hash_word(stack, (uint64_t) line->line);
+      stack = hash_word(stack, (uint64_t) line->function.start_line);
+      stack = hash_char_slice(stack, line->function.name);
+      stack = hash_char_slice(stack, line->function.filename);
+      stack = hash_char_slice(stack, line->function.system_name);
+    }
+  }
+
+  // Seeded differently, so that an empty stack and an empty set of labels don't get mixed up
+  uint64_t labels = hash_word(HASH_SEED, sample.labels.len);
+
+  for (size_t i = 0; i < sample.labels.len; i++) {
+    const ddog_prof_Label *label = &sample.labels.ptr[i];
+    labels = hash_word(labels, (uint64_t) label->num);
+    labels = hash_char_slice(labels, label->key);
+    labels = hash_char_slice(labels, label->str);
+    labels = hash_char_slice(labels, label->num_unit);
+  }
+
+  return (sample_hashes) {.stack = stack, .labels = labels, .sample = hash_word(stack, labels)};
+}
+
+static uint64_t hash_char_slice(uint64_t hash, ddog_CharSlice string) {
+  return hash_bytes(hash_word(hash, string.len), string.ptr, string.len);
+}
+
+// Assumption: Called while holding the mutex for the slot that `memory` belongs to.
+static void slot_memory_charge(struct slot_memory *memory, const sample_hashes *hashes, size_t bytes) {
+  memory->estimated_bytes += bytes;
+
+  if (hashes == NULL) return;
+
+  slot_memory_remember(memory, hashes->stack);
+  slot_memory_remember(memory, hashes->labels);
+  slot_memory_remember(memory, hashes->sample);
+}
+
+static bool slot_memory_seen(const struct slot_memory *memory, uint64_t hash) {
+  if (memory->seen_buckets == 0) return false;
+  if (hash == 0) hash = 1; // 0 marks empty buckets
+
+  for (size_t bucket = hash & (memory->seen_buckets - 1); memory->seen_hashes[bucket] != 0; bucket = (bucket + 1) & (memory->seen_buckets - 1)) {
+    if (memory->seen_hashes[bucket] == hash) return true;
+  }
+
+  return false;
+}
+
+// If the set is full or we fail to allocate memory, the hash does not get remembered, which only means that it will get
+// charged again
+static void slot_memory_remember(struct slot_memory *memory, uint64_t hash) {
+  if (memory->seen_count >= SEEN_HASHES_MAX_COUNT) return;
+  if (hash == 0) hash = 1; // 0 marks empty buckets
+  if ((memory->seen_count + 1) * 2 > memory->seen_buckets && !slot_memory_grow_seen_hashes(memory)) return;
+
+  size_t bucket = hash & (memory->seen_buckets - 1);
+  for (; memory->seen_hashes[bucket] != 0; bucket = (bucket + 1) & (memory->seen_buckets - 1)) {
+    if (memory->seen_hashes[bucket] == hash) return;
+  }
+
+  memory->seen_hashes[bucket] = hash;
+  memory->seen_count++;
+}
+
+static bool slot_memory_grow_seen_hashes(struct slot_memory *memory) {
+  size_t new_buckets = memory->seen_buckets == 0 ? SEEN_HASHES_MIN_BUCKETS : memory->seen_buckets * 2;
+  uint64_t *new_hashes = calloc(new_buckets, sizeof(uint64_t)); // Does not raise, unlike ruby_xcalloc
+  if (new_hashes == NULL) return false;
+
+  for (size_t i = 0; i < memory->seen_buckets; i++) {
+    uint64_t hash = memory->seen_hashes[i];
+    if (hash == 0) continue;
+
+    size_t bucket = hash & (new_buckets - 1);
+    while (new_hashes[bucket] != 0) bucket = (bucket + 1) & (new_buckets - 1);
+    new_hashes[bucket] = hash;
+  }
+
+  free(memory->seen_hashes);
+  memory->seen_hashes = new_hashes;
+  memory->seen_buckets = new_buckets;
+
+  return true;
+}
+
+// Goes together with resetting the slot's profile. Keeps samples_over_budget, as it's not reset together with the profile.
+static void slot_memory_reset(struct slot_memory *memory) {
+  free(memory->seen_hashes);
+  memory->seen_hashes = NULL;
+  memory->seen_count = 0;
+  memory->seen_buckets = 0;
+  memory->estimated_bytes = 0;
+}
+
+static struct slot_memory *memory_for(struct stack_recorder_state *state, ddog_prof_Profile *profile) {
+  return (profile == state->slot_one_profile) ? &state->slot_one_memory : &state->slot_two_memory;
+}
+
+static pre_aggregation_table *pre_aggregation_for(struct stack_recorder_state *state, ddog_prof_Profile *profile) {
+  return (profile == state->slot_one_profile) ? &state->slot_one_pre_aggregation : &state->slot_two_pre_aggregation;
+}
+
+// Called by the Ruby GC (e.g. for ObjectSpace.memsize_of), so it must not allocate memory nor raise. Values being
+// concurrently updated by other threads may be slightly out-of-date.
+static size_t stack_recorder_typed_data_size(const void *state_ptr) {
+  const struct stack_recorder_state *state = (const struct stack_recorder_state *) state_ptr;
+
+  size_t size = sizeof(struct stack_recorder_state) + state->slot_one_memory.estimated_bytes + state->slot_two_memory.estimated_bytes;
+  size += (state->slot_one_memory.seen_buckets + state->slot_two_memory.seen_buckets) * sizeof(uint64_t);
+
+  if (state->deferred_recording != NULL) {
+    size += sizeof(struct deferred_recording);
+    size += deferred_batch_memory_size(&state->deferred_recording->batches[0]);
+    size += deferred_batch_memory_size(&state->deferred_recording->batches[1]);
+  }
+
+  size += deferred_batch_memory_size(&state->heap_samples);
+  size += pre_aggregation_memory_size(&state->slot_one_pre_aggregation);
+  size += pre_aggregation_memory_size(&state->slot_two_pre_aggregation);
+
+  return size;
+}
+
+static size_t deferred_batch_memory_size(const deferred_batch *batch) {
+  return
+    batch->samples_capacity * sizeof(deferred_sample) +
+    batch->locations_capacity * sizeof(deferred_location) +
+    batch->lines_capacity * sizeof(deferred_line) +
+    batch->labels_capacity * sizeof(deferred_label) +
+    batch->endpoints_capacity * sizeof(deferred_endpoint) +
+    batch->strings_capacity +
+    batch->interned_capacity * sizeof(interned_string) +
+    batch->interned_buckets_count * sizeof(uint32_t);
+}
+
+// Unlike deferred_batch_memory_size, only counts what's in use, as cleared batches keep their memory around
+static size_t deferred_batch_used_bytes(const deferred_batch *batch) {
+  return
+    batch->samples_count * sizeof(deferred_sample) +
+    batch->locations_count * sizeof(deferred_location) +
+    batch->lines_count * sizeof(deferred_line) +
+    batch->labels_count * sizeof(deferred_label) +
+    batch->endpoints_count * sizeof(deferred_endpoint) +
+    batch->strings_count +
+    batch->interned_count * sizeof(interned_string);
+}
+
+static void batch_scratch_free(batch_scratch *scratch) {
+  free(scratch->locations);
+  free(scratch->lines);
+  free(scratch->labels);
+  *scratch = (batch_scratch) {0};
+}
+
+static bool deferred_batch_add_sample(
+  deferred_batch *batch,
+  ddog_prof_Slice_Location locations,
+  int64_t metric_values[ALL_VALUE_TYPES_COUNT],
+  ddog_prof_Slice_Label labels
+) {
+  size_t locations_count = batch->locations_count;
+  size_t lines_count = batch->lines_count;
+  size_t labels_count = batch->labels_count;
+
+  if (deferred_batch_copy_sample(batch, locations, metric_values, labels)) return true;
+
+  // We failed to allocate memory halfway through copying the sample, so let's leave the batch as it was before. Strings
+  // that already got interned are kept, as they're still valid (and may get used by the next samples).
+  batch->locations_count = locations_count;
+  batch->lines_count = lines_count;
+  batch->labels_count = labels_count;
+
+  return false;
+}
+
+static bool deferred_batch_copy_sample(
+  deferred_batch *batch,
+  ddog_prof_Slice_Location locations,
+  int64_t metric_values[ALL_VALUE_TYPES_COUNT],
+  ddog_prof_Slice_Label labels
+) {
+  bool capacity_available =
+    ensure_capacity((void **) &batch->samples, &batch->samples_capacity, batch->samples_count + 1, sizeof(deferred_sample)) &&
+    ensure_capacity((void **) &batch->locations, &batch->locations_capacity, batch->locations_count + locations.len, sizeof(deferred_location)) &&
+    ensure_capacity((void **) &batch->labels, &batch->labels_capacity, batch->labels_count + labels.len, sizeof(deferred_label));
+  if (!capacity_available) return false;
+
+  deferred_sample *sample = &batch->samples[batch->samples_count];
+  *sample = (deferred_sample) {
+    .first_location = batch->locations_count,
+    .locations_count = locations.len,
+    .first_label = batch->labels_count,
+    .labels_count = labels.len,
+  };
+  memcpy(sample->metric_values, metric_values, sizeof(sample->metric_values));
+
+  for (size_t i = 0; i < locations.len; i++) {
+    ddog_prof_Slice_Line lines = locations.ptr[i].lines;
+
+    if (!ensure_capacity((void **) &batch->lines, &batch->lines_capacity, batch->lines_count + lines.len, sizeof(deferred_line))) return false;
+
+    batch->locations[batch->locations_count++] = (deferred_location) {.first_line = batch->lines_count, .lines_count = lines.len};
+
+    for (size_t j = 0; j < lines.len; j++) {
+      const ddog_prof_Line *line = &lines.ptr[j];
+      deferred_line *copy = &batch->lines[batch->lines_count++];
+
+      copy->start_line = line->function.start_line;
+      copy->line = line->line;
+
+      bool copied =
+        deferred_batch_intern_string(batch, line->function.name, &copy->name) &&
+        deferred_batch_intern_string(batch, line->function.system_name, &copy->system_name) &&
+        deferred_batch_intern_string(batch, line->function.filename, &copy->filename);
+      if (!copied) return false;
+    }
+  }
+
+  for (size_t i = 0; i < labels.len; i++) {
+    const ddog_prof_Label *label = &labels.ptr[i];
+    deferred_label *copy = &batch->labels[batch->labels_count++];
+
+    copy->num = label->num;
+
+    bool copied =
+      deferred_batch_intern_string(batch, label->key, &copy->key) &&
+      deferred_batch_intern_string(batch, label->str, &copy->str) &&
+      deferred_batch_intern_string(batch, label->num_unit, &copy->num_unit);
+    if (!copied) return false;
+  }
+
+  batch->samples_count++;
+
+  return true;
+}
+
+static bool deferred_batch_add_endpoint(deferred_batch *batch, uint64_t local_root_span_id, ddog_CharSlice endpoint) {
+  if (!ensure_capacity((void **) &batch->endpoints, &batch->endpoints_capacity, batch->endpoints_count + 1, sizeof(deferred_endpoint))) return false;
+
+  deferred_endpoint *copy = &batch->endpoints[batch->endpoints_count];
+  copy->local_root_span_id = local_root_span_id;
+  if (!deferred_batch_intern_string(batch, endpoint, &copy->endpoint)) return false;
+
+  batch->endpoints_count++;
+
+  return true;
+}
+
+// Copies the string to the batch, unless an equal string was already copied, in which case that one gets reused.
+// Returns false if memory could not be allocated.
+static bool deferred_batch_intern_string(deferred_batch *batch, ddog_CharSlice string, deferred_string *result) {
+  if (string.len == 0) {
+    *result = (deferred_string) {.offset = 0, .len = 0};
+    return true;
+  }
+
+  if ((batch->interned_count + 1) * 2 > batch->interned_buckets_count && !deferred_batch_grow_interned_buckets(batch)) return false;
+
+  uint64_t hash = hash_bytes(HASH_SEED, string.ptr, string.len);
+  size_t mask = batch->interned_buckets_count - 1;
+  size_t bucket = hash & mask;
+
+  for (; batch->interned_buckets[bucket] != 0; bucket = (bucket + 1) & mask) {
+    interned_string *interned = &batch->interned[batch->interned_buckets[bucket] - 1];
+
+    if (interned->hash == hash && char_slice_equals(deferred_batch_string(batch, interned->string), string)) {
+      *result = interned->string;
+      return true;
+    }
+  }
+
+  bool capacity_available =
+    ensure_capacity((void **) &batch->strings, &batch->strings_capacity, batch->strings_count + string.len, sizeof(char)) &&
+    ensure_capacity((void **) &batch->interned, &batch->interned_capacity, batch->interned_count + 1, sizeof(interned_string));
+  if (!capacity_available) return false;
+
+  memcpy(batch->strings + batch->strings_count, string.ptr, string.len);
+  *result = (deferred_string) {.offset = batch->strings_count, .len = string.len};
+  batch->strings_count += string.len;
+
+  batch->interned[batch->interned_count++] = (interned_string) {.string = *result, .hash = hash};
+  batch->interned_buckets[bucket] = batch->interned_count;
+
+  return true;
+}
+
+// Doubles the number of buckets (or allocates them the first time), rehashing the strings that were already interned.
+// Returns false if memory could not be allocated.
+static bool deferred_batch_grow_interned_buckets(deferred_batch *batch) {
+  size_t buckets_count = batch->interned_buckets_count > 0 ? batch->interned_buckets_count * 2 : INTERNED_STRINGS_MIN_BUCKETS;
+  uint32_t *buckets = calloc(buckets_count, sizeof(uint32_t));
+  if (buckets == NULL) return false;
+
+  for (size_t i = 0; i < batch->interned_count; i++) {
+    size_t bucket = batch->interned[i].hash & (buckets_count - 1);
+    while (buckets[bucket] != 0) bucket = (bucket + 1) & (buckets_count - 1);
+    buckets[bucket] = i + 1;
+  }
+
+  free(batch->interned_buckets);
+  batch->interned_buckets = buckets;
+  batch->interned_buckets_count = buckets_count;
+
+  return true;
+}
+
+// Discards the samples that were copied to the batch after `saved` (a copy of the batch struct) was taken, together with
+// the strings that got interned for them. Strings get discarded newest first, so the remaining ones are still found when
+// probing: a string's probe sequence never goes past the bucket of a string that was interned after it.
+static void deferred_batch_truncate(deferred_batch *batch, const deferred_batch *saved) {
+  size_t mask = batch->interned_buckets_count - 1;
+
+  for (; batch->interned_count > saved->interned_count; batch->interned_count--) {
+    size_t bucket = batch->interned[batch->interned_count - 1].hash & mask;
+    while (batch->interned_buckets[bucket] != batch->interned_count) bucket = (bucket + 1) & mask;
+    batch->interned_buckets[bucket] = 0;
+  }
+
+  batch->samples_count = saved->samples_count;
+  batch->locations_count = saved->locations_count;
+  batch->lines_count = saved->lines_count;
+  batch->labels_count = saved->labels_count;
+  batch->strings_count = saved->strings_count;
+}
+
+static ddog_CharSlice deferred_batch_string(deferred_batch *batch, deferred_string string) {
+  if (string.len == 0) return DDOG_CHARSLICE_C("");
+  return (ddog_CharSlice) {.ptr = batch->strings + string.offset, .len = string.len};
+}
+
+// Grows `*buffer` (if needed) so it can hold at least `needed` elements. Returns false if memory could not be allocated.
+static bool ensure_capacity(void **buffer, size_t *capacity, size_t needed, size_t element_size) {
+  if (needed <= *capacity) return true;
+
+  size_t new_capacity = *capacity > 0 ? *capacity : 64;
+  while (new_capacity < needed) new_capacity *= 2;
+
+  void *new_buffer = realloc(*buffer, new_capacity * element_size);
+  if (new_buffer == NULL) return false;
+
+  *buffer = new_buffer;
+  *capacity = new_capacity;
+
+  return true;
+}
+
+// Keeps the memory around, so it can be reused by the next samples
+static void deferred_batch_clear(deferred_batch *batch) {
+  batch->samples_count = 0;
+  batch->locations_count = 0;
+  batch->lines_count = 0;
+  batch->labels_count = 0;
+  batch->endpoints_count = 0;
+  batch->strings_count = 0;
+  batch->interned_count = 0;
+  if (batch->interned_buckets != NULL) memset(batch->interned_buckets, 0, batch->interned_buckets_count * sizeof(uint32_t));
+}
+
+static void deferred_batch_free(deferred_batch *batch) {
+  free(batch->samples);
+  free(batch->locations);
+  free(batch->lines);
+  free(batch->labels);
+  free(batch->endpoints);
+  free(batch->strings);
+  free(batch->interned);
+  free(batch->interned_buckets);
+  *batch = (deferred_batch) {0};
+}
@@ -1,14 +1,20 @@
 #pragma once
 
 #include <datadog/profiling.h>
+#include "heap_recorder.h"
 
 typedef struct sample_values {
   int64_t cpu_time_ns;
   int64_t wall_time_ns;
   uint32_t cpu_samples;
   uint32_t alloc_samples;
+  int64_t gvl_wait_ns;
 } sample_values;
 
 void record_sample(VALUE recorder_instance, ddog_prof_Slice_Location locations, sample_values values, ddog_prof_Slice_Label labels);
 void record_endpoint(VALUE recorder_instance, uint64_t local_root_span_id, ddog_CharSlice endpoint);
+void track_object(VALUE recorder_instance, VALUE new_object, unsigned int sample_weight);
+heap_recorder *recorder_heap_recorder(VALUE recorder_instance);
+void recorder_set_pending_samples_flusher(VALUE recorder_instance, VALUE (*flush_pending_samples)(VALUE), VALUE flusher_instance);
 VALUE enforce_recorder_instance(VALUE object);
+bool encoded_profile_byte_slice(VALUE object, ddog_ByteSlice *result);
@@ -4,14 +4,57 @@
 #include "ruby_helpers.h"
 #include "time_helpers.h"
 
-// Safety: This function is assumed never to raise exceptions by callers when raise_on_failure == false
-long monotonic_wall_time_now_ns(bool raise_on_failure) {
-  struct timespec current_monotonic;
+#ifdef HAVE_TIMER_CREATE
+  #include <signal.h>
+
+  // glibc only started exposing `sigev_notify_thread_id` in 2.35, so on older versions we use the underlying field
+  // directly (extconf.rb checks that one of them is available)
+  #ifndef sigev_notify_thread_id
+    #define sigev_notify_thread_id _sigev_un._tid
+  #endif
+#endif
 
-  if (clock_gettime(CLOCK_MONOTONIC, &current_monotonic) != 0) {
+static long clock_now_ns(clockid_t clock_id, bool raise_on_failure) {
+  struct timespec current_time;
+
+  if (clock_gettime(clock_id, &current_time) != 0) {
     if (raise_on_failure) ENFORCE_SUCCESS_GVL(errno);
     return 0;
   }
 
-  return current_monotonic.tv_nsec + SECONDS_AS_NS(current_monotonic.tv_sec);
+  return current_time.tv_nsec + SECONDS_AS_NS(current_time.tv_sec);
 }
+
+// Safety: This function is assumed never to raise exceptions by callers when raise_on_failure == false
+long monotonic_wall_time_now_ns(bool raise_on_failure) { return clock_now_ns(CLOCK_MONOTONIC, raise_on_failure); }
+
+// Safety: This function is assumed never to raise exceptions by callers when raise_on_failure == false
+long process_cpu_time_now_ns(bool raise_on_failure) { return clock_now_ns(CLOCK_PROCESS_CPUTIME_ID, raise_on_failure); }
+
+// Safety: This function is assumed never to raise exceptions by callers when raise_on_failure == false
+long current_thread_cpu_time_now_ns(bool raise_on_failure) { return clock_now_ns(CLOCK_THREAD_CPUTIME_ID, raise_on_failure); }
+
+#ifdef HAVE_TIMER_CREATE
+  // Creates a POSIX timer that sends `signal` to the thread with Linux thread id `tid` (`SIGEV_THREAD_ID`, which is
+  // Linux-specific) every `interval_ns` of `clock_id` time. The `signal_value` is made available to the signal handler
+  // as `siginfo_t.si_value.sival_int`.
+  //
+  // Returns 0 on success, or the errno of the call that failed otherwise.
+  int thread_timer_create(clockid_t clock_id, pid_t tid, int signal, int signal_value, long interval_ns, timer_t *timer_id) {
+    struct sigevent timer_event = {.sigev_notify = SIGEV_THREAD_ID, .sigev_signo = signal, .sigev_value = {.sival_int = signal_value}};
+    timer_event.sigev_notify_thread_id = tid;
+
+    if (timer_create(clock_id, &timer_event, timer_id) != 0) return errno;
+
+    struct timespec interval = {.tv_sec = interval_ns / SECONDS_AS_NS(1), .tv_nsec = interval_ns % SECONDS_AS_NS(1)};
+    struct itimerspec timer_settings = {.it_interval = interval, .it_value = interval};
+
+    if (timer_settime(*timer_id, 0, &timer_settings, NULL) != 0) {
+      int error = errno;
+      timer_delete(*timer_id);
+      return error;
+    }
+
+    return 0;
+  }
+#endif
@@ -1,5 +1,12 @@
 #pragma once
 
+#include "extconf.h"
+
+#ifdef HAVE_TIMER_CREATE
+  #include <sys/types.h>
+  #include <time.h>
+#endif
+
 #define SECONDS_AS_NS(value) (value * 1000 * 1000 * 1000L)
 #define MILLIS_AS_NS(value) (value * 1000 * 1000L)
 
@@ -8,3 +15,11 @@
 
 // Safety: This function is assumed never to raise exceptions by callers when raise_on_failure == false
 long monotonic_wall_time_now_ns(bool raise_on_failure);
+// Safety: These functions are assumed never to raise exceptions by callers when raise_on_failure == false
+long process_cpu_time_now_ns(bool raise_on_failure);
+long current_thread_cpu_time_now_ns(bool raise_on_failure);
+
+#ifdef HAVE_TIMER_CREATE
+  // Safety: This function is assumed never to raise exceptions by callers
+  int thread_timer_create(clockid_t clock_id, pid_t tid, int signal, int signal_value, long interval_ns, timer_t *timer_id);
+#endif
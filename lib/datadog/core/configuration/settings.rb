@@ -289,6 +289,141 @@ module Datadog
             # If you use Ruby 3.x and your application does not use Ractors (or if your Ruby has been patched), the
             # feature is fully safe to enable and this toggle can be used to do so.
             option :allocation_counting_enabled, default: RUBY_VERSION.start_with?('2.')
+
+            # Enables allocation profiling: a sample of object allocations gets recorded, including the stack and the
+            # class of the object being allocated, as the "alloc-samples" profile type.
+            #
+            # Same caveats as for `allocation_counting_enabled` apply regarding Ruby 3.x and Ractors.
+            option :allocation_profiling_enabled do |o|
+              o.default { env_to_bool('DD_PROFILING_ALLOCATION_ENABLED', false) }
+              o.lazy
+            end
+
+            # Controls how often allocations get sampled when `allocation_profiling_enabled` is set: on average, one
+            # in every `allocation_sample_every` allocations gets sampled. Lower values increase accuracy but also
+            # overhead. Must be >= 1.
+            option :allocation_sample_every do |o|
+              o.default { env_to_int('DD_PROFILING_ALLOCATION_SAMPLE_EVERY', 50) }
+              o.lazy
+            end
+
+            # Enables live heap profiling: objects picked by allocation profiling are tracked until they get garbage
+            # collected, and the ones still alive get reported as the "heap-live-samples" and "heap-live-size" profile
+            # types.
+            #
+            # Requires `allocation_profiling_enabled` to also be enabled.
+            option :heap_profiling_enabled do |o|
+              o.default { env_to_bool('DD_PROFILING_HEAP_ENABLED', false) }
+              o.lazy
+            end
+
+            # Uses a kernel timer (POSIX `timer_create`) to send the sampling signals directly to the thread holding the
+            # Global VM Lock, instead of having a background thread wake up and send them. This makes the time between
+            # samples more regular.
+            #
+            # Only supported on Linux.
+            option :timer_trigger_enabled do |o|
+              o.default { env_to_bool('DD_PROFILING_TIMER_TRIGGER_ENABLED', false) }
+              o.lazy
+            end
+
+            # Additionally samples each thread every time it uses 10ms of cpu-time, using per-thread cpu-time kernel
+            # timers. Threads then get sampled in proportion to how busy they are, and short bursts of cpu usage are
+            # less likely to be missed. Wall-time keeps being sampled, but at a lower rate.
+            #
+            # Only supported on Linux with Ruby 3.1 and above.
+            option :cpu_time_sampling_enabled do |o|
+              o.default { env_to_bool('DD_PROFILING_CPU_TIME_SAMPLING_ENABLED', false) }
+              o.lazy
+            end
+
+            # Paces samples based on the cpu-time used by the profiler (compared to the cpu-time used by the whole
+            # process and, if any, the cgroup cpu quota), rather than on the wall-time samples take. This is a better
+            # fit for containers with cpu limits, as throttling makes samples take longer without using more cpu.
+            option :cpu_overhead_controller_enabled do |o|
+              o.default { env_to_bool('DD_PROFILING_CPU_OVERHEAD_CONTROLLER_ENABLED', false) }
+              o.lazy
+            end
+
+            # The overhead (as a percentage) the profiler targets when deciding how often to take samples. This is
+            # a % of wall-time spent sampling by default, or a % of cpu-time when `cpu_overhead_controller_enabled`
+            # is set. Must be greater than 0 and at most 100.
+            option :overhead_target_percentage do |o|
+              o.default { env_to_float('DD_PROFILING_OVERHEAD_TARGET_PERCENTAGE', 2.0) }
+              o.lazy
+            end
+
+            # Enables coalescing samples of blocked threads (e.g. idle thread pool threads) whose stack did not change
+            # since their previous sample into a single sample. This reduces the cost of sampling applications with many
+            # mostly-idle threads.
+            option :idle_sample_coalescing_enabled do |o|
+              o.default { env_to_bool('DD_PROFILING_IDLE_SAMPLE_COALESCING_ENABLED', false) }
+              o.lazy
+            end
+
+            # Enables folding repeated sequences of frames in recursive code (e.g. A -> B -> A -> B -> ...) into a
+            # single copy, followed by a "recursion xN" frame. This reduces the size of profiles for deeply recursive
+            # code.
+            option :recursion_folding_enabled do |o|
+              o.default { env_to_bool('DD_PROFILING_RECURSION_FOLDING_ENABLED', false) }
+              o.lazy
+            end
+
+            # Path prefixes (e.g. where a gem is installed, such as `/usr/local/bundle/gems/graphql-`) for which a run
+            # of consecutive frames gets reduced to its outermost frame (e.g. where the application called into the
+            # gem). Empty (the default) keeps every frame.
+            option :pruned_frame_prefixes do |o|
+              o.default { env_to_list('DD_PROFILING_PRUNED_FRAME_PREFIXES', [], comma_separated_only: true) }
+              o.lazy
+            end
+
+            # Enables adding a "wait reason" label to wall-time samples, which tells if the thread was running, waiting
+            # for the Global VM Lock, in garbage collection, or blocked in IO, a mutex (or similar) or sleep.
+            option :wait_reason_labels_enabled do |o|
+              o.default { env_to_bool('DD_PROFILING_WAIT_REASON_LABELS_ENABLED', false) }
+              o.lazy
+            end
+
+            # Enables adding samples to the profile from a background native thread, instead of doing it while holding
+            # the Global VM Lock. This reduces the time application threads are paused while the profiler takes samples.
+            #
+            # Samples are buffered until the background thread gets to them; if it can't keep up, samples get dropped.
+            option :deferred_recording_enabled do |o|
+              o.default { env_to_bool('DD_PROFILING_DEFERRED_RECORDING_ENABLED', false) }
+              o.lazy
+            end
+
+            # Limits how much memory (in megabytes) the profiler can use to hold samples between reports. Once the
+            # estimated memory usage reaches this limit, new samples get dropped until the next report.
+            #
+            # The estimate errs on the side of over-counting. Set to 0 (the default) to disable the limit.
+            option :memory_budget_mb do |o|
+              o.default { env_to_int('DD_PROFILING_MEMORY_BUDGET_MB', 0) }
+              o.lazy
+            end
+
+            # Enables summing up samples with the same stack and labels before adding them to the profile. This reduces
+            # the cost of recording samples for applications that keep sampling the same stacks (e.g. web servers).
+            option :pre_aggregation_enabled do |o|
+              o.default { env_to_bool('DD_PROFILING_PRE_AGGREGATION_ENABLED', false) }
+              o.lazy
+            end
+
+            # Enables recording time that threads spend waiting to acquire the Global VM Lock, as a new "gvl-wait"
+            # profile type.
+            #
+            # This feature is only available on Ruby 3.2+, and is ignored on older Rubies.
+            option :gvl_profiling_enabled do |o|
+              o.default { env_to_bool('DD_PROFILING_GVL_ENABLED', false) }
+              o.lazy
+            end
+
+            # Reports profiles from a background native thread, instead of blocking the profiler's scheduler for the
+            # duration of the upload. Failed reports are retried with exponential backoff.
+            option :async_export_enabled do |o|
+              o.default { env_to_bool('DD_PROFILING_ASYNC_EXPORT_ENABLED', false) }
+              o.lazy
+            end
           end
 
           # @public_api
@@ -298,6 +433,15 @@ module Datadog
               o.default { env_to_float(Profiling::Ext::ENV_UPLOAD_TIMEOUT, 30.0) }
               o.lazy
             end
+
+            # Writes profiles to a local directory, given as a `file:///path/to/directory` url, instead of reporting
+            # them to Datadog. Useful for profiling benchmarks, or on hosts without an agent.
+            #
+            # @default `DD_PROFILING_UPLOAD_FILE_SINK_URL` environment variable, otherwise `nil`
+            option :file_sink_url do |o|
+              o.default { ENV.fetch(Profiling::Ext::ENV_UPLOAD_FILE_SINK_URL, nil) }
+              o.lazy
+            end
           end
         end
 
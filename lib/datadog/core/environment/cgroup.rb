@@ -5,10 +5,12 @@ module Datadog
     module Environment
       # Reads information from Linux cgroups.
       # This information is used to extract information
-      # about the current Linux container identity.
+      # about the current Linux container identity, as well
+      # as the CPU quota (if any) the current process is subject to.
       # @see https://man7.org/linux/man-pages/man7/cgroups.7.html
       module Cgroup
         LINE_REGEX = /^(\d+):([^:]*):(.+)$/.freeze
+        DEFAULT_CGROUP_ROOT = '/sys/fs/cgroup'.freeze
 
         Descriptor = Struct.new(
           :id,
@@ -38,6 +40,38 @@ module Datadog
           end
         end
 
+        # Returns the CPU quota of the current process, in number of cores (e.g. 0.5 means "half a core"), or nil if
+        # there's no quota or it could not be read.
+        #
+        # Both cgroup v2 (`cpu.max`) and cgroup v1 (`cpu.cfs_quota_us` and `cpu.cfs_period_us`) are supported. Since the
+        # cgroup filesystem mounted inside a container usually only shows the container's own cgroup, we look for the
+        # files both under the path listed in `/proc/self/cgroup` and at the root of the cgroup filesystem.
+        def cpu_quota_cores(process = 'self', cgroup_root: DEFAULT_CGROUP_ROOT)
+          descriptors(process).each do |descriptor|
+            next if descriptor.groups.nil?
+
+            quota_and_period =
+              if descriptor.id == '0' && descriptor.groups.empty?
+                read_cgroup_v2_cpu_max(cgroup_root, descriptor.path)
+              elsif descriptor.controllers.include?('cpu')
+                read_cgroup_v1_cpu_quota(cgroup_root, descriptor.groups, descriptor.path)
+              end
+
+            next unless quota_and_period
+
+            quota, period = quota_and_period
+            return quota.to_f / period if quota > 0 && period > 0
+          end
+
+          nil
+        rescue StandardError => e
+          Datadog.logger.error(
+            "Error while reading cgroup CPU quota. Cause: #{e.class.name} #{e.message} " \
+            "Location: #{Array(e.backtrace).first}"
+          )
+          nil
+        end
+
         def parse(line)
           id, groups, path = line.scan(LINE_REGEX).first
 
@@ -45,6 +79,36 @@ module Datadog
             descriptor.controllers = groups.split(',') unless groups.nil?
           end
         end
+
+        # `cpu.max` contains "$MAX $PERIOD", where $MAX is "max" when there's no quota
+        def read_cgroup_v2_cpu_max(cgroup_root, path)
+          content = read_first_existing(candidate_paths(cgroup_root, path, 'cpu.max'))
+          return unless content
+
+          quota, period = content.split
+          return if quota.nil? || quota == 'max'
+
+          [Integer(quota), Integer(period)]
+        end
+
+        # `cpu.cfs_quota_us` is -1 when there's no quota
+        def read_cgroup_v1_cpu_quota(cgroup_root, groups, path)
+          base = File.join(cgroup_root, groups)
+          quota = read_first_existing(candidate_paths(base, path, 'cpu.cfs_quota_us'))
+          period = read_first_existing(candidate_paths(base, path, 'cpu.cfs_period_us'))
+          return if quota.nil? || period.nil?
+
+          [Integer(quota), Integer(period)]
+        end
+
+        def candidate_paths(base, path, file_name)
+          [File.join(base, path, file_name), File.join(base, file_name)].uniq
+        end
+
+        def read_first_existing(paths)
+          path = paths.find { |candidate| File.exist?(candidate) }
+          File.read(path).strip if path
+        end
       end
     end
   end
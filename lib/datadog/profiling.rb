@@ -1,6 +1,7 @@
 
 require_relative 'core'
 require_relative 'core/environment/variable_helpers'
+require_relative 'core/environment/cgroup'
 require_relative 'core/utils/only_once'
 
 module Datadog
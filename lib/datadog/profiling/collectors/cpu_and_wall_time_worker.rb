@@ -20,7 +20,27 @@ module Datadog
           tracer:,
           gc_profiling_enabled:,
           allocation_counting_enabled:,
-          thread_context_collector: ThreadContext.new(recorder: recorder, max_frames: max_frames, tracer: tracer),
+          gvl_profiling_enabled: false,
+          allocation_sample_every: nil,
+          heap_profiling_enabled: false,
+          timer_trigger_enabled: false,
+          cpu_time_sampling_enabled: false,
+          cpu_overhead_controller_enabled: false,
+          overhead_target_percentage: 2.0,
+          cpu_quota_cores: nil,
+          idle_sample_coalescing_enabled: false,
+          recursion_folding_enabled: false,
+          pruned_frame_prefixes: [],
+          wait_reason_labels_enabled: false,
+          thread_context_collector: ThreadContext.new(
+            recorder: recorder,
+            max_frames: max_frames,
+            tracer: tracer,
+            idle_sample_coalescing_enabled: idle_sample_coalescing_enabled,
+            recursion_folding_enabled: recursion_folding_enabled,
+            pruned_frame_prefixes: pruned_frame_prefixes,
+            wait_reason_labels_enabled: wait_reason_labels_enabled,
+          ),
           idle_sampling_helper: IdleSamplingHelper.new
         )
           self.class._native_initialize(
@@ -28,7 +48,15 @@ module Datadog
             thread_context_collector,
             gc_profiling_enabled,
             idle_sampling_helper,
-            allocation_counting_enabled
+            allocation_counting_enabled,
+            gvl_profiling_enabled,
+            allocation_sample_every,
+            heap_profiling_enabled,
+            timer_trigger_enabled,
+            cpu_time_sampling_enabled,
+            cpu_overhead_controller_enabled,
+            Float(overhead_target_percentage),
+            cpu_quota_cores && Float(cpu_quota_cores),
           )
           @worker_thread = nil
           @failure_exception = nil
@@ -44,6 +72,10 @@ module Datadog
 
             @idle_sampling_helper.start
 
+            # Have traces publish their root and active spans directly to the profiler, instead of having the profiler
+            # look them up on every sample
+            Datadog::Tracing::TraceOperation.profiling_slot_class = ThreadContext::TraceIdentifiersSlot
+
             @worker_thread = Thread.new do
               begin
                 Thread.current.name = self.class.name
@@ -74,6 +106,9 @@ module Datadog
 
             @idle_sampling_helper.stop
 
+            # Traces that were already started keep their slots, but they don't get used for anything else
+            Datadog::Tracing::TraceOperation.profiling_slot_class = nil
+
             return unless @worker_thread
 
             self.class._native_stop(self, @worker_thread)
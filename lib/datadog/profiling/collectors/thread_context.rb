@@ -15,9 +15,26 @@ module Datadog
       #
       # Methods prefixed with _native_ are implemented in `collectors_thread_context.c`
       class ThreadContext
-        def initialize(recorder:, max_frames:, tracer:)
+        def initialize(
+          recorder:,
+          max_frames:,
+          tracer:,
+          idle_sample_coalescing_enabled: false,
+          recursion_folding_enabled: false,
+          pruned_frame_prefixes: [],
+          wait_reason_labels_enabled: false
+        )
           tracer_context_key = safely_extract_context_key_from(tracer)
-          self.class._native_initialize(self, recorder, max_frames, tracer_context_key)
+          self.class._native_initialize(
+            self,
+            recorder,
+            max_frames,
+            tracer_context_key,
+            idle_sample_coalescing_enabled,
+            recursion_folding_enabled,
+            pruned_frame_prefixes,
+            wait_reason_labels_enabled,
+          )
         end
 
         def inspect
@@ -41,6 +58,19 @@ module Datadog
           context = provider.instance_variable_get(:@context)
           context && context.instance_variable_get(:@key)
         end
+
+        # Used by Datadog::Tracing::TraceOperation to publish its root and active spans to the profiler, so that the
+        # ThreadContext doesn't need to look them up on every sample.
+        # See the "Trace identifiers slot" section in `collectors_thread_context.c` for details.
+        class TraceIdentifiersSlot
+          def initialize(trace_operation)
+            self.class._native_initialize(self, trace_operation)
+          end
+
+          def publish(root_span, active_span)
+            self.class._native_publish(self, root_span, active_span)
+          end
+        end
       end
     end
   end
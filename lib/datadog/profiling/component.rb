@@ -64,9 +64,20 @@ module Datadog
         if settings.profiling.advanced.force_enable_new_profiler
           print_new_profiler_warnings
 
+          gvl_profiling_enabled = should_enable_gvl_profiling?(settings)
+          allocation_profiling_enabled = settings.profiling.advanced.allocation_profiling_enabled
+          allocation_sample_every =
+            allocation_profiling_enabled ? settings.profiling.advanced.allocation_sample_every : nil
+          heap_profiling_enabled = should_enable_heap_profiling?(settings, allocation_profiling_enabled)
+
           recorder = Datadog::Profiling::StackRecorder.new(
             cpu_time_enabled: RUBY_PLATFORM.include?('linux'), # Only supported on Linux currently
-            alloc_samples_enabled: false, # Always disabled for now -- work in progress
+            alloc_samples_enabled: allocation_profiling_enabled,
+            gvl_wait_enabled: gvl_profiling_enabled,
+            heap_samples_enabled: heap_profiling_enabled,
+            deferred_recording_enabled: settings.profiling.advanced.deferred_recording_enabled,
+            memory_budget_bytes: settings.profiling.advanced.memory_budget_mb * 1024 * 1024,
+            pre_aggregation_enabled: settings.profiling.advanced.pre_aggregation_enabled,
           )
           collector = Datadog::Profiling::Collectors::CpuAndWallTimeWorker.new(
             recorder: recorder,
@@ -74,6 +85,18 @@ module Datadog
             tracer: tracer,
             gc_profiling_enabled: should_enable_gc_profiling?(settings),
             allocation_counting_enabled: settings.profiling.advanced.allocation_counting_enabled,
+            gvl_profiling_enabled: gvl_profiling_enabled,
+            allocation_sample_every: allocation_sample_every,
+            heap_profiling_enabled: heap_profiling_enabled,
+            timer_trigger_enabled: should_enable_timer_trigger?(settings),
+            cpu_time_sampling_enabled: should_enable_cpu_time_sampling?(settings),
+            cpu_overhead_controller_enabled: settings.profiling.advanced.cpu_overhead_controller_enabled,
+            overhead_target_percentage: settings.profiling.advanced.overhead_target_percentage,
+            cpu_quota_cores: cpu_quota_cores_if_needed(settings),
+            idle_sample_coalescing_enabled: settings.profiling.advanced.idle_sample_coalescing_enabled,
+            recursion_folding_enabled: settings.profiling.advanced.recursion_folding_enabled,
+            pruned_frame_prefixes: settings.profiling.advanced.pruned_frame_prefixes,
+            wait_reason_labels_enabled: settings.profiling.advanced.wait_reason_labels_enabled,
           )
         else
           trace_identifiers_helper = Profiling::TraceIdentifiers::Helper.new(
@@ -120,6 +143,8 @@ module Datadog
             site: settings.site,
             api_key: settings.api_key,
             upload_timeout_seconds: settings.profiling.upload.timeout_seconds,
+            async_export_enabled: settings.profiling.advanced.async_export_enabled,
+            file_sink_url: settings.profiling.upload.file_sink_url,
           )
       end
 
@@ -139,6 +164,69 @@ module Datadog
         end
       end
 
+      def should_enable_gvl_profiling?(settings)
+        return false unless settings.profiling.advanced.gvl_profiling_enabled
+
+        if Gem::Version.new(RUBY_VERSION) < Gem::Version.new('3.2')
+          Datadog.logger.warn(
+            'GVL profiling was requested but is only supported on Ruby 3.2 and above; ignoring setting.'
+          )
+
+          false
+        else
+          true
+        end
+      end
+
+      def should_enable_heap_profiling?(settings, allocation_profiling_enabled)
+        return false unless settings.profiling.advanced.heap_profiling_enabled
+
+        if allocation_profiling_enabled
+          true
+        else
+          Datadog.logger.warn(
+            'Heap profiling was requested but allocation profiling is disabled; ignoring setting. ' \
+            'Heap profiling requires `allocation_profiling_enabled` to also be set.'
+          )
+
+          false
+        end
+      end
+
+      def should_enable_timer_trigger?(settings)
+        return false unless settings.profiling.advanced.timer_trigger_enabled
+
+        if RUBY_PLATFORM.include?('linux')
+          true
+        else
+          Datadog.logger.warn(
+            'The timer sampling trigger was requested but is only supported on Linux; ignoring setting.'
+          )
+
+          false
+        end
+      end
+
+      def should_enable_cpu_time_sampling?(settings)
+        return false unless settings.profiling.advanced.cpu_time_sampling_enabled
+
+        if RUBY_PLATFORM.include?('linux') && Gem::Version.new(RUBY_VERSION) >= Gem::Version.new('3.1')
+          true
+        else
+          Datadog.logger.warn(
+            'CPU-time sampling was requested but is only supported on Linux with Ruby 3.1 and above; ignoring setting.'
+          )
+
+          false
+        end
+      end
+
+      def cpu_quota_cores_if_needed(settings)
+        return unless settings.profiling.advanced.cpu_overhead_controller_enabled
+
+        Datadog::Core::Environment::Cgroup.cpu_quota_cores
+      end
+
       def print_new_profiler_warnings
         if Gem::Version.new(RUBY_VERSION) >= Gem::Version.new('2.6')
           Datadog.logger.warn(
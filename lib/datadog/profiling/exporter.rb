@@ -42,7 +42,7 @@ module Datadog
       end
 
       def flush
-        start, finish, uncompressed_pprof = pprof_recorder.serialize
+        start, finish, uncompressed_pprof = serialize_pprof_recorder
         @last_flush_finish_at = finish
 
         return if uncompressed_pprof.nil? # We don't want to report empty profiles
@@ -58,7 +58,7 @@ module Datadog
           start: start,
           finish: finish,
           pprof_file_name: Datadog::Profiling::Ext::Transport::HTTP::PPROF_DEFAULT_FILENAME,
-          pprof_data: uncompressed_pprof.to_s,
+          pprof_data: uncompressed_pprof,
           code_provenance_file_name: Datadog::Profiling::Ext::Transport::HTTP::CODE_PROVENANCE_FILENAME,
           code_provenance_data: uncompressed_code_provenance,
           tags_as_array: Datadog::Profiling::TagBuilder.call(settings: Datadog.configuration).to_a,
@@ -76,6 +76,16 @@ module Datadog
 
       private
 
+      # The StackRecorder can hand over the pprof without copying it into a Ruby string (see EncodedProfile)
+      def serialize_pprof_recorder
+        if pprof_recorder.respond_to?(:serialize_for_export)
+          pprof_recorder.serialize_for_export
+        else
+          start, finish, uncompressed_pprof = pprof_recorder.serialize
+          [start, finish, uncompressed_pprof && uncompressed_pprof.to_s]
+        end
+      end
+
       def duration_below_threshold?(start, finish)
         (finish - start) < minimum_duration_seconds
       end
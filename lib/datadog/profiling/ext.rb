@@ -4,6 +4,7 @@ module Datadog
     module Ext
       ENV_ENABLED = 'DD_PROFILING_ENABLED'.freeze
       ENV_UPLOAD_TIMEOUT = 'DD_PROFILING_UPLOAD_TIMEOUT'.freeze
+      ENV_UPLOAD_FILE_SINK_URL = 'DD_PROFILING_UPLOAD_FILE_SINK_URL'.freeze
       ENV_MAX_FRAMES = 'DD_PROFILING_MAX_FRAMES'.freeze
       ENV_AGENTLESS = 'DD_PROFILING_AGENTLESS'.freeze
       ENV_ENDPOINT_COLLECTION_ENABLED = 'DD_PROFILING_ENDPOINT_COLLECTION_ENABLED'.freeze
@@ -10,7 +10,7 @@ module Datadog
         :start,
         :finish,
         :pprof_file_name,
-        :pprof_data, # gzipped pprof bytes
+        :pprof_data, # pprof bytes, either as a String or as a StackRecorder::EncodedProfile
         :code_provenance_file_name,
         :code_provenance_data, # gzipped json bytes
         :tags_as_array
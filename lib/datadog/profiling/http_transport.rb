@@ -1,47 +1,78 @@
 
+require 'uri'
+
 module Datadog
   module Profiling
-    # Used to report profiling data to Datadog.
+    # Used to report profiling data to Datadog (or, when given a `file_sink_url`, to write it to a local directory).
     # Methods prefixed with _native_ are implemented in `http_transport.c`
     class HttpTransport
-      def initialize(agent_settings:, site:, api_key:, upload_timeout_seconds:)
+      # How long #shutdown! waits for queued exports to be reported, when async export is enabled
+      ASYNC_EXPORT_SHUTDOWN_TIMEOUT_SECONDS = 5
+
+      def initialize(
+        agent_settings:,
+        site:,
+        api_key:,
+        upload_timeout_seconds:,
+        async_export_enabled: false,
+        file_sink_url: nil
+      )
         @upload_timeout_milliseconds = (upload_timeout_seconds * 1_000).to_i
 
-        validate_agent_settings(agent_settings)
+        if file_sink_url
+          @file_sink = FileSink.new(directory: file_sink_directory_from(file_sink_url))
+        else
+          validate_agent_settings(agent_settings)
 
-        @exporter_configuration =
-          if agentless?(site, api_key)
-            [:agentless, site, api_key]
-          else
-            [:agent, base_url_from(agent_settings)]
-          end
+          @exporter_configuration =
+            if agentless?(site, api_key)
+              [:agentless, site, api_key]
+            elsif agent_settings.adapter == Datadog::Transport::Ext::UnixSocket::ADAPTER
+              [:agent_uds, agent_settings.uds_path]
+            else
+              [:agent, base_url_from(agent_settings)]
+            end
+
+          status, result = validate_exporter(@exporter_configuration)
 
-        status, result = validate_exporter(@exporter_configuration)
+          raise(ArgumentError, "Failed to initialize transport: #{result}") if status == :error
 
-        raise(ArgumentError, "Failed to initialize transport: #{result}") if status == :error
+          @async_exporter = AsyncExporter.new if async_export_enabled
+        end
+
+        @native_exporter = nil
+        @native_exporter_tags = nil
       end
 
       def export(flush)
-        status, result = do_export(
-          exporter_configuration: @exporter_configuration,
-          upload_timeout_milliseconds: @upload_timeout_milliseconds,
+        return write_to_file_sink(flush) if @file_sink
 
-          # why "timespec"?
-          # libdatadog represents time using POSIX's struct timespec, see
-          # https://www.gnu.org/software/libc/manual/html_node/Time-Types.html
-          # aka it represents the seconds part separate from the nanoseconds part
-          start_timespec_seconds: flush.start.tv_sec,
-          start_timespec_nanoseconds: flush.start.tv_nsec,
-          finish_timespec_seconds: flush.finish.tv_sec,
-          finish_timespec_nanoseconds: flush.finish.tv_nsec,
-
-          pprof_file_name: flush.pprof_file_name,
-          pprof_data: flush.pprof_data,
-          code_provenance_file_name: flush.code_provenance_file_name,
-          code_provenance_data: flush.code_provenance_data,
-
-          tags_as_array: flush.tags_as_array,
-        )
+        status, result = native_exporter_for(flush.tags_as_array)
+
+        if status == :ok
+          native_exporter = result
+
+          return enqueue_export(native_exporter, flush) if @async_exporter
+
+          status, result = do_export(
+            native_exporter: native_exporter,
+            upload_timeout_milliseconds: @upload_timeout_milliseconds,
+
+            # why "timespec"?
+            # libdatadog represents time using POSIX's struct timespec, see
+            # https://www.gnu.org/software/libc/manual/html_node/Time-Types.html
+            # aka it represents the seconds part separate from the nanoseconds part
+            start_timespec_seconds: flush.start.tv_sec,
+            start_timespec_nanoseconds: flush.start.tv_nsec,
+            finish_timespec_seconds: flush.finish.tv_sec,
+            finish_timespec_nanoseconds: flush.finish.tv_nsec,
+
+            pprof_file_name: flush.pprof_file_name,
+            pprof_data: flush.pprof_data,
+            code_provenance_file_name: flush.code_provenance_file_name,
+            code_provenance_data: flush.code_provenance_data,
+          )
+        end
 
         if status == :ok
           if (200..299).cover?(result)
@@ -57,6 +88,36 @@ module Datadog
         end
       end
 
+      # When async export is enabled, waits (up to the given timeout) for queued exports to be reported, and then stops
+      # the background exporter thread. This is final: any later exports get rejected, rather than starting a new
+      # thread.
+      def shutdown!(timeout_seconds = ASYNC_EXPORT_SHUTDOWN_TIMEOUT_SECONDS)
+        return unless @async_exporter
+
+        dropped = @async_exporter.stop(timeout_seconds)
+
+        Datadog.logger.warn("Dropped #{dropped} profile(s) that were not reported before shutdown") if dropped > 0
+
+        nil
+      end
+
+      def reset_after_fork
+        if @async_exporter
+          # Profiles queued by the parent process are still reported by the parent, so the child drops its copies
+          discarded = @async_exporter.reset_after_fork
+          Datadog.logger.debug { "Discarded #{discarded} profile(s) queued by the parent process" } if discarded > 0
+        end
+
+        # The connection pool should not be shared with the parent process
+        @native_exporter = nil
+        @native_exporter_tags = nil
+      end
+
+      # Returns the async exporter stats (or nil when async export is disabled)
+      def stats
+        @async_exporter.stats if @async_exporter
+      end
+
       # Used to log soft failures in `ddog_Vec_tag_push` (e.g. we still report the profile in these cases)
       # Called from native code
       def self.log_failure_to_process_tag(failure_details)
@@ -66,14 +127,7 @@ module Datadog
       private
 
       def base_url_from(agent_settings)
-        case agent_settings.adapter
-        when Datadog::Transport::Ext::HTTP::ADAPTER
-          "#{agent_settings.ssl ? 'https' : 'http'}://#{agent_settings.hostname}:#{agent_settings.port}/"
-        when Datadog::Transport::Ext::UnixSocket::ADAPTER
-          "unix://#{agent_settings.uds_path}"
-        else
-          raise ArgumentError, "Unexpected adapter: #{agent_settings.adapter}"
-        end
+        "#{agent_settings.ssl ? 'https' : 'http'}://#{agent_settings.hostname}:#{agent_settings.port}/"
       end
 
       def validate_agent_settings(agent_settings)
@@ -91,6 +145,16 @@ module Datadog
         end
       end
 
+      def file_sink_directory_from(file_sink_url)
+        uri = URI(file_sink_url)
+
+        unless uri.scheme == 'file' && (uri.host.nil? || uri.host.empty?) && !uri.path.empty?
+          raise ArgumentError, "Unsupported file sink url: #{file_sink_url.inspect}, expected file:///path/to/directory"
+        end
+
+        uri.path
+      end
+
       def agentless?(site, api_key)
         site && api_key && Core::Environment::VariableHelpers.env_to_bool(Profiling::Ext::ENV_AGENTLESS, false)
       end
@@ -99,8 +163,50 @@ module Datadog
         self.class._native_validate_exporter(exporter_configuration)
       end
 
+      # The native exporter (and its connection pool) is kept across exports. Because its tags are set when it gets
+      # created, a new one is only needed when the tags change.
+      def native_exporter_for(tags_as_array)
+        unless @native_exporter && @native_exporter_tags == tags_as_array
+          status, result = NativeExporter._native_new(@exporter_configuration, tags_as_array)
+          return [status, result] unless status == :ok
+
+          @native_exporter = result
+          @native_exporter_tags = tags_as_array
+        end
+
+        [:ok, @native_exporter]
+      end
+
+      def write_to_file_sink(flush)
+        status, result = @file_sink.export(upload_timeout_milliseconds: @upload_timeout_milliseconds, flush: flush)
+
+        if status == :ok
+          Datadog.logger.debug { "Successfully wrote profiling data to #{result.join(', ')}" }
+          true
+        else
+          Datadog.logger.error("Failed to write profiling data: #{result}")
+          false
+        end
+      end
+
+      def enqueue_export(native_exporter, flush)
+        status, result = @async_exporter.enqueue(
+          native_exporter: native_exporter,
+          upload_timeout_milliseconds: @upload_timeout_milliseconds,
+          flush: flush,
+        )
+
+        if status == :ok
+          Datadog.logger.debug { "Queued profiling data to be reported (#{result} queued)" }
+          true
+        else
+          Datadog.logger.error("Failed to queue profiling data to be reported: #{result}")
+          false
+        end
+      end
+
       def do_export(
-        exporter_configuration:,
+        native_exporter:,
         upload_timeout_milliseconds:,
         start_timespec_seconds:,
         start_timespec_nanoseconds:,
@@ -109,11 +215,10 @@ module Datadog
         pprof_file_name:,
         pprof_data:,
         code_provenance_file_name:,
-        code_provenance_data:,
-        tags_as_array:
+        code_provenance_data:
       )
         self.class._native_do_export(
-          exporter_configuration,
+          native_exporter,
           upload_timeout_milliseconds,
           start_timespec_seconds,
           start_timespec_nanoseconds,
@@ -123,9 +228,91 @@ module Datadog
           pprof_data,
           code_provenance_file_name,
           code_provenance_data,
-          tags_as_array,
         )
       end
+
+      # Reports profiles from a native background thread, retrying failed reports with exponential backoff, so that
+      # the `Scheduler` is never blocked waiting for the network. See `http_transport.c` for details.
+      # Methods prefixed with _native_ are implemented in `http_transport.c`
+      class AsyncExporter
+        MAX_QUEUED_EXPORTS = 5
+        MAX_ATTEMPTS = 4
+        INITIAL_BACKOFF_MILLISECONDS = 1_000
+        MAX_BACKOFF_MILLISECONDS = 30_000
+
+        def initialize(
+          max_queued_exports: MAX_QUEUED_EXPORTS,
+          max_attempts: MAX_ATTEMPTS,
+          initial_backoff_milliseconds: INITIAL_BACKOFF_MILLISECONDS,
+          max_backoff_milliseconds: MAX_BACKOFF_MILLISECONDS
+        )
+          self.class._native_initialize(
+            self,
+            max_queued_exports,
+            max_attempts,
+            initial_backoff_milliseconds,
+            max_backoff_milliseconds,
+          )
+        end
+
+        def enqueue(native_exporter:, upload_timeout_milliseconds:, flush:)
+          self.class._native_enqueue(
+            self,
+            native_exporter,
+            upload_timeout_milliseconds,
+            flush.start.tv_sec,
+            flush.start.tv_nsec,
+            flush.finish.tv_sec,
+            flush.finish.tv_nsec,
+            flush.pprof_file_name,
+            flush.pprof_data,
+            flush.code_provenance_file_name,
+            flush.code_provenance_data,
+          )
+        end
+
+        # Returns how many queued exports were dropped because they could not be reported before the timeout.
+        # The AsyncExporter can't be used again after being stopped, other than in a forked child process.
+        def stop(timeout_seconds)
+          self.class._native_stop(self, (timeout_seconds * 1_000).to_i)
+        end
+
+        # Returns how many exports queued by the parent process were discarded
+        def reset_after_fork
+          self.class._native_reset_after_fork(self)
+        end
+
+        def stats
+          self.class._native_stats(self)
+        end
+      end
+
+      # Writes profiles to a local directory, as atomically-renamed (and gzip-compressed, when available) files, keeping
+      # only the most recent `max_reports` reports. See `file_sink.c` for details.
+      # Methods prefixed with _native_ are implemented in `file_sink.c`
+      class FileSink
+        MAX_RETAINED_REPORTS = 100
+
+        def initialize(directory:, max_reports: MAX_RETAINED_REPORTS)
+          self.class._native_initialize(self, directory, max_reports)
+        end
+
+        # Returns [:ok, written_file_paths] or [:error, error_details]
+        def export(upload_timeout_milliseconds:, flush:)
+          self.class._native_do_export(
+            self,
+            upload_timeout_milliseconds,
+            flush.start.tv_sec,
+            flush.start.tv_nsec,
+            flush.finish.tv_sec,
+            flush.finish.tv_nsec,
+            flush.pprof_file_name,
+            flush.pprof_data,
+            flush.code_provenance_file_name,
+            flush.code_provenance_data,
+          )
+        end
+      end
     end
   end
 end
\ No newline at end of file
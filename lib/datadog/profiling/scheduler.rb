@@ -49,6 +49,17 @@ module Datadog
         perform
       end
 
+      def stop(*args)
+        stopped = super
+
+        # Report anything still queued by the transport (e.g. the profile flushed when stopping). The transport rejects
+        # any exports after this, so a flush still in progress (e.g. if the worker did not stop in time) can't leave
+        # behind work that never gets stopped.
+        transport.shutdown! if transport.respond_to?(:shutdown!)
+
+        stopped
+      end
+
       def perform
         # A profiling flush may be called while the VM is shutting down, to report the last profile. When we do so,
         # we impose a strict timeout. This means this last profile may or may not be sent, depending on if the flush can
@@ -79,6 +90,7 @@ module Datadog
 
       def reset_after_fork
         exporter.reset_after_fork
+        transport.reset_after_fork if transport.respond_to?(:reset_after_fork)
       end
 
       private
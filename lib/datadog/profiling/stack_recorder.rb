@@ -4,7 +4,15 @@ module Datadog
     # Note that `record_sample` is only accessible from native code.
     # Methods prefixed with _native_ are implemented in `stack_recorder.c`
     class StackRecorder
-      def initialize(cpu_time_enabled:, alloc_samples_enabled:)
+      def initialize(
+        cpu_time_enabled:,
+        alloc_samples_enabled:,
+        gvl_wait_enabled: false,
+        heap_samples_enabled: false,
+        deferred_recording_enabled: false,
+        memory_budget_bytes: 0,
+        pre_aggregation_enabled: false
+      )
         # This mutex works in addition to the fancy C-level mutexes we have in the native side (see the docs there).
         # It prevents multiple Ruby threads calling serialize at the same time -- something like
         # `10.times { Thread.new { stack_recorder.serialize } }`.
@@ -13,29 +21,30 @@ module Datadog
         # accidentally happening.
         @no_concurrent_synchronize_mutex = Mutex.new
 
-        self.class._native_initialize(self, cpu_time_enabled, alloc_samples_enabled)
+        self.class._native_initialize(
+          self,
+          cpu_time_enabled,
+          alloc_samples_enabled,
+          gvl_wait_enabled,
+          heap_samples_enabled,
+          deferred_recording_enabled,
+          memory_budget_bytes,
+          pre_aggregation_enabled,
+        )
       end
 
       def serialize
-        status, result = @no_concurrent_synchronize_mutex.synchronize { self.class._native_serialize(self) }
-
-        if status == :ok
-          start, finish, encoded_pprof = result
-
-          Datadog.logger.debug { "Encoded profile covering #{start.iso8601} to #{finish.iso8601}" }
-
-          [start, finish, encoded_pprof]
-        else
-          error_message = result
-
-          Datadog.logger.error("Failed to serialize profiling data: #{error_message}")
+        serialize_profile(for_export: false)
+      end
 
-          nil
-        end
+      # Same as #serialize, but returns the pprof as an EncodedProfile, which keeps it in native memory so it can be
+      # handed over to the HttpTransport without being copied into a Ruby string
+      def serialize_for_export
+        serialize_profile(for_export: true)
       end
 
       def serialize!
-        status, result = @no_concurrent_synchronize_mutex.synchronize { self.class._native_serialize(self) }
+        status, result = @no_concurrent_synchronize_mutex.synchronize { self.class._native_serialize(self, false) }
 
         if status == :ok
           _start, _finish, encoded_pprof = result
@@ -69,6 +78,43 @@ module Datadog
       def reset_after_fork
         self.class._native_reset_after_fork(self)
       end
+
+      def stats
+        self.class._native_stats(self)
+      end
+
+      private
+
+      def serialize_profile(for_export:)
+        status, result = @no_concurrent_synchronize_mutex.synchronize { self.class._native_serialize(self, for_export) }
+
+        if status == :ok
+          start, finish, encoded_pprof = result
+
+          Datadog.logger.debug { "Encoded profile covering #{start.iso8601} to #{finish.iso8601}" }
+
+          [start, finish, encoded_pprof]
+        else
+          error_message = result
+
+          Datadog.logger.error("Failed to serialize profiling data: #{error_message}")
+
+          nil
+        end
+      end
+
+      # A serialized pprof, kept in native memory. Instances are created by StackRecorder#serialize_for_export.
+      # Methods prefixed with _native_ are implemented in `stack_recorder.c`
+      class EncodedProfile
+        def bytesize
+          self.class._native_bytesize(self)
+        end
+
+        # Copies the pprof into a Ruby string
+        def to_s
+          self.class._native_to_s(self)
+        end
+      end
     end
   end
 end
@@ -27,6 +27,12 @@ module Datadog
 
       DEFAULT_MAX_LENGTH = 100_000
 
+      class << self
+        # When set (by the profiler), every trace creates an instance of this class and notifies it whenever the
+        # active span changes. See Datadog::Profiling::Collectors::ThreadContext::TraceIdentifiersSlot.
+        attr_accessor :profiling_slot_class
+      end
+
       attr_accessor \
         :agent_sample_rate,
         :hostname,
@@ -45,7 +51,6 @@ module Datadog
 
       attr_writer \
         :name,
-        :resource,
         :sampled,
         :service
 
@@ -97,6 +102,8 @@ module Datadog
         @events = events || Events.new
         @finished = false
         @spans = []
+        profiling_slot_class = TraceOperation.profiling_slot_class
+        @profiling_slot = profiling_slot_class && profiling_slot_class.new(self)
       end
 
       def full?
@@ -156,6 +163,13 @@ module Datadog
         !@resource.nil?
       end
 
+      def resource=(resource)
+        @resource = resource
+
+        # The profiler reads the endpoint from what gets published, see #publish_to_profiling_slot
+        publish_to_profiling_slot
+      end
+
       def service
         @service || (root_span && root_span.service)
       end
@@ -377,6 +391,8 @@ module Datadog
         @active_span = span_op
 
         set_root_span!(span_op) unless root_span
+
+        publish_to_profiling_slot
       end
 
       def deactivate_span!(span_op)
@@ -385,6 +401,12 @@ module Datadog
         # when spans finish out of order.
         span_op = span_op.send(:parent) while !span_op.nil? && span_op.finished?
         @active_span = span_op
+
+        publish_to_profiling_slot
+      end
+
+      def publish_to_profiling_slot
+        @profiling_slot.publish(root_span, @active_span) if @profiling_slot
       end
 
       def start_span(span_op)
@@ -468,6 +490,8 @@ module Datadog
         @active_span_count = 0
         @finished = false
         @spans = []
+
+        publish_to_profiling_slot
       end
     end
   end
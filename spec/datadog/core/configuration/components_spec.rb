@@ -1013,6 +1013,8 @@ RSpec.describe Datadog::Core::Configuration::Components do
           allow(Datadog.logger).to receive(:warn)
         end
 
+        after { Datadog::Tracing::TraceOperation.profiling_slot_class = nil }
+
         it 'does not initialize the OldStack collector' do
           expect(Datadog::Profiling::Collectors::OldStack).to_not receive(:new)
 
@@ -1032,11 +1034,29 @@ RSpec.describe Datadog::Core::Configuration::Components do
             tracer: tracer,
             gc_profiling_enabled: anything,
             allocation_counting_enabled: anything,
+            gvl_profiling_enabled: anything,
+            allocation_sample_every: anything,
+            heap_profiling_enabled: anything,
+            timer_trigger_enabled: anything,
+            cpu_time_sampling_enabled: anything,
+            cpu_overhead_controller_enabled: anything,
+            overhead_target_percentage: anything,
+            cpu_quota_cores: anything,
+            idle_sample_coalescing_enabled: anything,
+            recursion_folding_enabled: anything,
+            pruned_frame_prefixes: anything,
+            wait_reason_labels_enabled: anything,
           )
 
           build_profiler
         end
 
+        it 'only makes traces publish their identifiers to the profiler once the profiler gets started' do
+          build_profiler
+
+          expect(Datadog::Tracing::TraceOperation.profiling_slot_class).to be nil
+        end
+
         context 'on Ruby 2.6 and above' do
           before { skip 'Behavior does not apply to current Ruby version' if RUBY_VERSION < '2.6.' }
 
@@ -1139,6 +1159,71 @@ RSpec.describe Datadog::Core::Configuration::Components do
           build_profiler
         end
 
+        it 'sets up the StackRecorder with the memory_budget_mb setting' do
+          settings.profiling.advanced.memory_budget_mb = 2
+
+          expect(Datadog::Profiling::StackRecorder)
+            .to receive(:new).with(hash_including(memory_budget_bytes: 2 * 1024 * 1024)).and_call_original
+
+          build_profiler
+        end
+
+        it 'sets up the StackRecorder with the deferred_recording_enabled setting' do
+          settings.profiling.advanced.deferred_recording_enabled = true
+
+          expect(Datadog::Profiling::StackRecorder)
+            .to receive(:new).with(hash_including(deferred_recording_enabled: true)).and_call_original
+
+          build_profiler
+        end
+
+        it 'sets up the StackRecorder with the pre_aggregation_enabled setting' do
+          settings.profiling.advanced.pre_aggregation_enabled = true
+
+          expect(Datadog::Profiling::StackRecorder)
+            .to receive(:new).with(hash_including(pre_aggregation_enabled: true)).and_call_original
+
+          build_profiler
+        end
+
+        context 'when gvl_profiling_enabled is true' do
+          before { settings.profiling.advanced.gvl_profiling_enabled = true }
+
+          context 'on Ruby 3.2 or newer' do
+            before do
+              if Gem::Version.new(RUBY_VERSION) < Gem::Version.new('3.2')
+                skip 'Behavior does not apply to current Ruby version'
+              end
+            end
+
+            it 'enables GVL profiling in the CpuAndWallTimeWorker and the StackRecorder' do
+              expect(Datadog::Profiling::StackRecorder)
+                .to receive(:new).with(hash_including(gvl_wait_enabled: true)).and_call_original
+              expect(Datadog::Profiling::Collectors::CpuAndWallTimeWorker)
+                .to receive(:new).with(hash_including(gvl_profiling_enabled: true)).and_call_original
+
+              build_profiler
+            end
+          end
+
+          context 'on Ruby older than 3.2' do
+            before do
+              if Gem::Version.new(RUBY_VERSION) >= Gem::Version.new('3.2')
+                skip 'Behavior does not apply to current Ruby version'
+              end
+            end
+
+            it 'does not enable GVL profiling and logs a warning' do
+              allow(Datadog.logger).to receive(:warn)
+              expect(Datadog.logger).to receive(:warn).with(/GVL profiling/)
+              expect(Datadog::Profiling::Collectors::CpuAndWallTimeWorker)
+                .to receive(:new).with(hash_including(gvl_profiling_enabled: false)).and_call_original
+
+              build_profiler
+            end
+          end
+        end
+
         it 'sets up the StackRecorder with alloc_samples_enabled: false' do
           expect(Datadog::Profiling::StackRecorder)
             .to receive(:new).with(hash_including(alloc_samples_enabled: false)).and_call_original
@@ -1146,6 +1231,206 @@ RSpec.describe Datadog::Core::Configuration::Components do
           build_profiler
         end
 
+        it 'sets up the CpuAndWallTimeWorker with allocation sampling disabled' do
+          expect(Datadog::Profiling::Collectors::CpuAndWallTimeWorker)
+            .to receive(:new).with(hash_including(allocation_sample_every: nil)).and_call_original
+
+          build_profiler
+        end
+
+        context 'when allocation_profiling_enabled is true' do
+          before do
+            settings.profiling.advanced.allocation_profiling_enabled = true
+            settings.profiling.advanced.allocation_sample_every = 123
+          end
+
+          it 'enables allocation sampling in the StackRecorder and the CpuAndWallTimeWorker' do
+            expect(Datadog::Profiling::StackRecorder)
+              .to receive(:new).with(hash_including(alloc_samples_enabled: true)).and_call_original
+            expect(Datadog::Profiling::Collectors::CpuAndWallTimeWorker)
+              .to receive(:new).with(hash_including(allocation_sample_every: 123)).and_call_original
+
+            build_profiler
+          end
+
+          context 'and heap_profiling_enabled is true' do
+            before { settings.profiling.advanced.heap_profiling_enabled = true }
+
+            it 'enables heap profiling in the StackRecorder and the CpuAndWallTimeWorker' do
+              expect(Datadog::Profiling::StackRecorder)
+                .to receive(:new).with(hash_including(heap_samples_enabled: true)).and_call_original
+              expect(Datadog::Profiling::Collectors::CpuAndWallTimeWorker)
+                .to receive(:new).with(hash_including(heap_profiling_enabled: true)).and_call_original
+
+              build_profiler
+            end
+          end
+        end
+
+        context 'when timer_trigger_enabled is true' do
+          before { settings.profiling.advanced.timer_trigger_enabled = true }
+
+          context 'on Linux' do
+            before { stub_const('RUBY_PLATFORM', 'some-linux-based-platform') }
+
+            it 'sets up the CpuAndWallTimeWorker with timer_trigger_enabled: true' do
+              expect(Datadog::Profiling::Collectors::CpuAndWallTimeWorker)
+                .to receive(:new).with(hash_including(timer_trigger_enabled: true))
+
+              build_profiler
+            end
+          end
+
+          context 'when not on Linux' do
+            before { stub_const('RUBY_PLATFORM', 'some-other-os') }
+
+            it 'logs a warning and sets up the CpuAndWallTimeWorker with timer_trigger_enabled: false' do
+              allow(Datadog.logger).to receive(:warn)
+              expect(Datadog.logger).to receive(:warn).with(/timer sampling trigger .* only supported on Linux/)
+              expect(Datadog::Profiling::Collectors::CpuAndWallTimeWorker)
+                .to receive(:new).with(hash_including(timer_trigger_enabled: false))
+
+              build_profiler
+            end
+          end
+        end
+
+        context 'when cpu_overhead_controller_enabled is true' do
+          before do
+            settings.profiling.advanced.cpu_overhead_controller_enabled = true
+            settings.profiling.advanced.overhead_target_percentage = 1.5
+          end
+
+          it 'sets up the CpuAndWallTimeWorker with the overhead target and the cgroup cpu quota' do
+            expect(Datadog::Core::Environment::Cgroup).to receive(:cpu_quota_cores).and_return(0.5)
+            expect(Datadog::Profiling::Collectors::CpuAndWallTimeWorker).to receive(:new).with(
+              hash_including(
+                cpu_overhead_controller_enabled: true,
+                overhead_target_percentage: 1.5,
+                cpu_quota_cores: 0.5,
+              )
+            )
+
+            build_profiler
+          end
+        end
+
+        context 'when cpu_overhead_controller_enabled is false' do
+          it 'does not read the cgroup cpu quota' do
+            expect(Datadog::Core::Environment::Cgroup).to_not receive(:cpu_quota_cores)
+            expect(Datadog::Profiling::Collectors::CpuAndWallTimeWorker)
+              .to receive(:new).with(hash_including(cpu_overhead_controller_enabled: false, cpu_quota_cores: nil))
+
+            build_profiler
+          end
+        end
+
+        context 'when idle_sample_coalescing_enabled is true' do
+          before { settings.profiling.advanced.idle_sample_coalescing_enabled = true }
+
+          it 'sets up the CpuAndWallTimeWorker with idle_sample_coalescing_enabled: true' do
+            expect(Datadog::Profiling::Collectors::CpuAndWallTimeWorker)
+              .to receive(:new).with(hash_including(idle_sample_coalescing_enabled: true))
+
+            build_profiler
+          end
+        end
+
+        context 'when stack compaction is configured' do
+          before do
+            settings.profiling.advanced.recursion_folding_enabled = true
+            settings.profiling.advanced.pruned_frame_prefixes = ['/gems/']
+          end
+
+          it 'sets up the CpuAndWallTimeWorker with the stack compaction settings' do
+            expect(Datadog::Profiling::Collectors::CpuAndWallTimeWorker)
+              .to receive(:new).with(hash_including(recursion_folding_enabled: true, pruned_frame_prefixes: ['/gems/']))
+
+            build_profiler
+          end
+        end
+
+        context 'when wait_reason_labels_enabled is true' do
+          before { settings.profiling.advanced.wait_reason_labels_enabled = true }
+
+          it 'sets up the CpuAndWallTimeWorker with wait_reason_labels_enabled: true' do
+            expect(Datadog::Profiling::Collectors::CpuAndWallTimeWorker)
+              .to receive(:new).with(hash_including(wait_reason_labels_enabled: true))
+
+            build_profiler
+          end
+        end
+
+        context 'when cpu_time_sampling_enabled is true' do
+          before { settings.profiling.advanced.cpu_time_sampling_enabled = true }
+
+          context 'on Linux with Ruby 3.1 or newer' do
+            before do
+              stub_const('RUBY_PLATFORM', 'some-linux-based-platform')
+              stub_const('RUBY_VERSION', '3.1.0')
+            end
+
+            it 'sets up the CpuAndWallTimeWorker with cpu_time_sampling_enabled: true' do
+              expect(Datadog::Profiling::Collectors::CpuAndWallTimeWorker)
+                .to receive(:new).with(hash_including(cpu_time_sampling_enabled: true))
+
+              build_profiler
+            end
+          end
+
+          context 'on Linux with Ruby older than 3.1' do
+            before do
+              stub_const('RUBY_PLATFORM', 'some-linux-based-platform')
+              stub_const('RUBY_VERSION', '3.0.0')
+            end
+
+            it 'logs a warning and sets up the CpuAndWallTimeWorker with cpu_time_sampling_enabled: false' do
+              allow(Datadog.logger).to receive(:warn)
+              expect(Datadog.logger).to receive(:warn).with(/CPU-time sampling .* only supported on Linux/)
+              expect(Datadog::Profiling::Collectors::CpuAndWallTimeWorker)
+                .to receive(:new).with(hash_including(cpu_time_sampling_enabled: false))
+
+              build_profiler
+            end
+          end
+
+          context 'when not on Linux' do
+            before { stub_const('RUBY_PLATFORM', 'some-other-os') }
+
+            it 'logs a warning and sets up the CpuAndWallTimeWorker with cpu_time_sampling_enabled: false' do
+              allow(Datadog.logger).to receive(:warn)
+              expect(Datadog.logger).to receive(:warn).with(/CPU-time sampling .* only supported on Linux/)
+              expect(Datadog::Profiling::Collectors::CpuAndWallTimeWorker)
+                .to receive(:new).with(hash_including(cpu_time_sampling_enabled: false))
+
+              build_profiler
+            end
+          end
+        end
+
+        context 'when heap_profiling_enabled is true but allocation_profiling_enabled is false' do
+          before do
+            settings.profiling.advanced.heap_profiling_enabled = true
+            settings.profiling.advanced.allocation_profiling_enabled = false
+          end
+
+          it 'logs a warning message mentioning that heap profiling requires allocation profiling' do
+            allow(Datadog.logger).to receive(:warn)
+            expect(Datadog.logger).to receive(:warn).with(/requires `allocation_profiling_enabled`/)
+
+            build_profiler
+          end
+
+          it 'sets up the StackRecorder and the CpuAndWallTimeWorker with heap profiling disabled' do
+            expect(Datadog::Profiling::StackRecorder)
+              .to receive(:new).with(hash_including(heap_samples_enabled: false)).and_call_original
+            expect(Datadog::Profiling::Collectors::CpuAndWallTimeWorker)
+              .to receive(:new).with(hash_including(heap_profiling_enabled: false)).and_call_original
+
+            build_profiler
+          end
+        end
+
         context 'when on Linux' do
           before { stub_const('RUBY_PLATFORM', 'some-linux-based-platform') }
 
@@ -1181,6 +1466,8 @@ RSpec.describe Datadog::Core::Configuration::Components do
           site: settings.site,
           api_key: settings.api_key,
           upload_timeout_seconds: settings.profiling.upload.timeout_seconds,
+          async_export_enabled: settings.profiling.advanced.async_export_enabled,
+          file_sink_url: settings.profiling.upload.file_sink_url,
         )
 
         build_profiler
@@ -522,6 +522,189 @@ RSpec.describe Datadog::Core::Configuration::Settings do
             .to(false)
         end
       end
+
+      # Boolean settings that can also be set via an environment variable, and that default to false
+      {
+        deferred_recording_enabled: 'DD_PROFILING_DEFERRED_RECORDING_ENABLED',
+        gvl_profiling_enabled: 'DD_PROFILING_GVL_ENABLED',
+        allocation_profiling_enabled: 'DD_PROFILING_ALLOCATION_ENABLED',
+        heap_profiling_enabled: 'DD_PROFILING_HEAP_ENABLED',
+        timer_trigger_enabled: 'DD_PROFILING_TIMER_TRIGGER_ENABLED',
+        cpu_time_sampling_enabled: 'DD_PROFILING_CPU_TIME_SAMPLING_ENABLED',
+        idle_sample_coalescing_enabled: 'DD_PROFILING_IDLE_SAMPLE_COALESCING_ENABLED',
+        async_export_enabled: 'DD_PROFILING_ASYNC_EXPORT_ENABLED',
+        cpu_overhead_controller_enabled: 'DD_PROFILING_CPU_OVERHEAD_CONTROLLER_ENABLED',
+        pre_aggregation_enabled: 'DD_PROFILING_PRE_AGGREGATION_ENABLED',
+        recursion_folding_enabled: 'DD_PROFILING_RECURSION_FOLDING_ENABLED',
+        wait_reason_labels_enabled: 'DD_PROFILING_WAIT_REASON_LABELS_ENABLED',
+      }.each do |setting, environment_variable|
+        describe "##{setting}" do
+          subject { settings.profiling.advanced.public_send(setting) }
+
+          context "when #{environment_variable}" do
+            around do |example|
+              ClimateControl.modify(environment_variable => environment) do
+                example.run
+              end
+            end
+
+            context 'is not defined' do
+              let(:environment) { nil }
+
+              it { is_expected.to be false }
+            end
+
+            { 'true' => true, 'false' => false }.each do |string, value|
+              context "is defined as #{string}" do
+                let(:environment) { string }
+
+                it { is_expected.to be value }
+              end
+            end
+          end
+        end
+
+        describe "##{setting}=" do
+          it "updates the ##{setting} setting" do
+            expect { settings.profiling.advanced.public_send("#{setting}=", true) }
+              .to change { settings.profiling.advanced.public_send(setting) }
+              .from(false)
+              .to(true)
+          end
+        end
+      end
+
+      describe '#allocation_sample_every' do
+        subject(:allocation_sample_every) { settings.profiling.advanced.allocation_sample_every }
+
+        context 'when DD_PROFILING_ALLOCATION_SAMPLE_EVERY' do
+          around do |example|
+            ClimateControl.modify('DD_PROFILING_ALLOCATION_SAMPLE_EVERY' => environment) do
+              example.run
+            end
+          end
+
+          context 'is not defined' do
+            let(:environment) { nil }
+
+            it { is_expected.to be 50 }
+          end
+
+          context 'is defined' do
+            let(:environment) { '123' }
+
+            it { is_expected.to be 123 }
+          end
+        end
+      end
+
+      describe '#allocation_sample_every=' do
+        it 'updates the #allocation_sample_every setting' do
+          expect { settings.profiling.advanced.allocation_sample_every = 10 }
+            .to change { settings.profiling.advanced.allocation_sample_every }
+            .from(50)
+            .to(10)
+        end
+      end
+
+      describe '#memory_budget_mb' do
+        subject(:memory_budget_mb) { settings.profiling.advanced.memory_budget_mb }
+
+        context 'when DD_PROFILING_MEMORY_BUDGET_MB' do
+          around do |example|
+            ClimateControl.modify('DD_PROFILING_MEMORY_BUDGET_MB' => environment) do
+              example.run
+            end
+          end
+
+          context 'is not defined' do
+            let(:environment) { nil }
+
+            it { is_expected.to be 0 }
+          end
+
+          context 'is defined' do
+            let(:environment) { '256' }
+
+            it { is_expected.to be 256 }
+          end
+        end
+      end
+
+      describe '#memory_budget_mb=' do
+        it 'updates the #memory_budget_mb setting' do
+          expect { settings.profiling.advanced.memory_budget_mb = 128 }
+            .to change { settings.profiling.advanced.memory_budget_mb }
+            .from(0)
+            .to(128)
+        end
+      end
+
+      describe '#overhead_target_percentage' do
+        subject(:overhead_target_percentage) { settings.profiling.advanced.overhead_target_percentage }
+
+        context 'when DD_PROFILING_OVERHEAD_TARGET_PERCENTAGE' do
+          around do |example|
+            ClimateControl.modify('DD_PROFILING_OVERHEAD_TARGET_PERCENTAGE' => environment) do
+              example.run
+            end
+          end
+
+          context 'is not defined' do
+            let(:environment) { nil }
+
+            it { is_expected.to be 2.0 }
+          end
+
+          context 'is defined' do
+            let(:environment) { '0.5' }
+
+            it { is_expected.to be 0.5 }
+          end
+        end
+      end
+
+      describe '#overhead_target_percentage=' do
+        it 'updates the #overhead_target_percentage setting' do
+          expect { settings.profiling.advanced.overhead_target_percentage = 5.0 }
+            .to change { settings.profiling.advanced.overhead_target_percentage }
+            .from(2.0)
+            .to(5.0)
+        end
+      end
+
+      describe '#pruned_frame_prefixes' do
+        subject(:pruned_frame_prefixes) { settings.profiling.advanced.pruned_frame_prefixes }
+
+        context 'when DD_PROFILING_PRUNED_FRAME_PREFIXES' do
+          around do |example|
+            ClimateControl.modify('DD_PROFILING_PRUNED_FRAME_PREFIXES' => environment) do
+              example.run
+            end
+          end
+
+          context 'is not defined' do
+            let(:environment) { nil }
+
+            it { is_expected.to eq [] }
+          end
+
+          context 'is defined' do
+            let(:environment) { '/gems/graphql-, /gems/json-' }
+
+            it { is_expected.to eq ['/gems/graphql-', '/gems/json-'] }
+          end
+        end
+      end
+
+      describe '#pruned_frame_prefixes=' do
+        it 'updates the #pruned_frame_prefixes setting' do
+          expect { settings.profiling.advanced.pruned_frame_prefixes = ['/gems/'] }
+            .to change { settings.profiling.advanced.pruned_frame_prefixes }
+            .from([])
+            .to(['/gems/'])
+        end
+      end
     end
 
     describe '#upload' do
@@ -565,6 +748,39 @@ RSpec.describe Datadog::Core::Configuration::Settings do
           end
         end
       end
+
+      describe '#file_sink_url' do
+        subject(:file_sink_url) { settings.profiling.upload.file_sink_url }
+
+        context "when #{Datadog::Profiling::Ext::ENV_UPLOAD_FILE_SINK_URL}" do
+          around do |example|
+            ClimateControl.modify(Datadog::Profiling::Ext::ENV_UPLOAD_FILE_SINK_URL => environment) do
+              example.run
+            end
+          end
+
+          context 'is not defined' do
+            let(:environment) { nil }
+
+            it { is_expected.to be nil }
+          end
+
+          context 'is defined' do
+            let(:environment) { 'file:///tmp/profiles' }
+
+            it { is_expected.to eq('file:///tmp/profiles') }
+          end
+        end
+      end
+
+      describe '#file_sink_url=' do
+        it 'updates the #file_sink_url setting' do
+          expect { settings.profiling.upload.file_sink_url = 'file:///tmp/profiles' }
+            .to change { settings.profiling.upload.file_sink_url }
+            .from(nil)
+            .to('file:///tmp/profiles')
+        end
+      end
     end
   end
 
@@ -2,6 +2,9 @@
 require 'spec_helper'
 require 'datadog/core/environment/cgroup'
 
+require 'fileutils'
+require 'tmpdir'
+
 # rubocop:disable Layout/LineLength
 RSpec.describe Datadog::Core::Environment::Cgroup do
   describe '::descriptors' do
@@ -112,6 +115,86 @@ RSpec.describe Datadog::Core::Environment::Cgroup do
     end
   end
 
+  describe '::cpu_quota_cores' do
+    subject(:cpu_quota_cores) { described_class.cpu_quota_cores(cgroup_root: cgroup_root) }
+
+    let(:cgroup_root) { Dir.mktmpdir }
+
+    before do
+      allow(described_class).to receive(:descriptors).and_return(cgroup_lines.map { |line| described_class.parse(line) })
+    end
+
+    after { FileUtils.remove_entry(cgroup_root) }
+
+    def write_cgroup_file(path, content)
+      full_path = File.join(cgroup_root, path)
+      FileUtils.mkdir_p(File.dirname(full_path))
+      File.write(full_path, content)
+    end
+
+    context 'with cgroup v2' do
+      let(:cgroup_lines) { ['0::/kubepods/pod1'] }
+
+      context 'when there is a quota' do
+        before { write_cgroup_file('kubepods/pod1/cpu.max', "50000 100000\n") }
+
+        it { is_expected.to eq 0.5 }
+      end
+
+      context 'when the quota is only visible at the root of the cgroup filesystem' do
+        before { write_cgroup_file('cpu.max', "250000 100000\n") }
+
+        it { is_expected.to eq 2.5 }
+      end
+
+      context 'when there is no quota' do
+        before { write_cgroup_file('kubepods/pod1/cpu.max', "max 100000\n") }
+
+        it { is_expected.to be nil }
+      end
+    end
+
+    context 'with cgroup v1' do
+      let(:cgroup_lines) { ['4:cpu,cpuacct:/docker/abc', '3:memory:/docker/abc'] }
+
+      context 'when there is a quota' do
+        before do
+          write_cgroup_file('cpu,cpuacct/docker/abc/cpu.cfs_quota_us', "150000\n")
+          write_cgroup_file('cpu,cpuacct/docker/abc/cpu.cfs_period_us', "100000\n")
+        end
+
+        it { is_expected.to eq 1.5 }
+      end
+
+      context 'when there is no quota' do
+        before do
+          write_cgroup_file('cpu,cpuacct/docker/abc/cpu.cfs_quota_us', "-1\n")
+          write_cgroup_file('cpu,cpuacct/docker/abc/cpu.cfs_period_us', "100000\n")
+        end
+
+        it { is_expected.to be nil }
+      end
+    end
+
+    context 'when the cgroup files do not exist' do
+      let(:cgroup_lines) { ['0::/', '4:cpu,cpuacct:/'] }
+
+      it { is_expected.to be nil }
+    end
+
+    context 'when the cgroup files cannot be parsed' do
+      let(:cgroup_lines) { ['0::/'] }
+
+      before { write_cgroup_file('cpu.max', "garbage\n") }
+
+      it 'logs an error and returns nil' do
+        expect(Datadog.logger).to receive(:error).with(/Error while reading cgroup CPU quota/)
+
+        is_expected.to be nil
+      end
+    end
+  end
+
   describe '::parse' do
     subject(:parse) { described_class.parse(line) }
 
@@ -25,6 +25,16 @@ RSpec.describe Datadog::Profiling::Collectors::CpuAndWallTimeWorker do
     it 'creates the garbage collection tracepoint in the disabled state' do
       expect(described_class::Testing._native_gc_tracepoint(cpu_and_wall_time_worker)).to_not be_enabled
     end
+
+    [0, -1, 100.1].each do |invalid_overhead_target_percentage|
+      context "when overhead_target_percentage is #{invalid_overhead_target_percentage}" do
+        let(:options) { { overhead_target_percentage: invalid_overhead_target_percentage } }
+
+        it do
+          expect { cpu_and_wall_time_worker }.to raise_error(ArgumentError, /overhead_target_percentage/)
+        end
+      end
+    end
   end
 
   describe '#start' do
@@ -72,6 +82,13 @@ RSpec.describe Datadog::Profiling::Collectors::CpuAndWallTimeWorker do
       expect(described_class::Testing._native_current_sigprof_signal_handler).to be :profiling
     end
 
+    it 'makes traces publish their identifiers to the profiler' do
+      start
+
+      expect(Datadog::Tracing::TraceOperation.profiling_slot_class)
+        .to be Datadog::Profiling::Collectors::ThreadContext::TraceIdentifiersSlot
+    end
+
     context 'when gc_profiling_enabled is true' do
       let(:gc_profiling_enabled) { true }
 
@@ -92,6 +109,283 @@ RSpec.describe Datadog::Profiling::Collectors::CpuAndWallTimeWorker do
       end
     end
 
+    context 'when timer_trigger_enabled is true' do
+      let(:options) { { timer_trigger_enabled: true } }
+
+      context 'on Linux' do
+        before { skip 'Behavior does not apply to current platform' unless RUBY_PLATFORM.include?('linux') }
+
+        it 'triggers sampling using a timer targeting the thread holding the GVL' do
+          start
+
+          all_samples = try_wait_until do
+            samples = samples_from_pprof_without_gc_and_overhead(recorder.serialize!)
+            samples if samples.any?
+          end
+
+          cpu_and_wall_time_worker.stop
+
+          expect(samples_for_thread(all_samples, Thread.current)).to_not be_empty
+          expect(cpu_and_wall_time_worker.stats.fetch(:timer_retargeted)).to be >= 1
+        end
+
+        it 'disarms the timer when the thread it targets releases the GVL' do
+          start
+
+          try_wait_until(backoff: 0.01) { cpu_and_wall_time_worker.stats.fetch(:timer_retargeted) >= 1 }
+          sleep 0.1 # Releases the GVL
+
+          expect(cpu_and_wall_time_worker.stats.fetch(:timer_disarmed)).to be >= 1
+        end
+      end
+
+      context 'when not on Linux' do
+        before { skip 'Behavior does not apply to current platform' if RUBY_PLATFORM.include?('linux') }
+
+        it do
+          expect { cpu_and_wall_time_worker }.to raise_error(ArgumentError, /timer sampling trigger/)
+        end
+      end
+    end
+
+    context 'when cpu_time_sampling_enabled is true' do
+      let(:thread_context_collector) do
+        Datadog::Profiling::Collectors::ThreadContext.new(recorder: recorder, max_frames: 400, tracer: nil)
+      end
+      let(:options) { { cpu_time_sampling_enabled: true, thread_context_collector: thread_context_collector } }
+
+      context 'on Linux with Ruby 3.1 or newer' do
+        before do
+          unless RUBY_PLATFORM.include?('linux') && Gem::Version.new(RUBY_VERSION) >= Gem::Version.new('3.1')
+            skip 'Behavior does not apply to current platform/Ruby version'
+          end
+        end
+
+        let(:busy_thread) do
+          Thread.new do
+            i = 0
+            loop { (i = (i + 1) % 2) }
+          end
+        end
+
+        after { busy_thread.kill.join }
+
+        it 'samples threads based on the cpu-time they use' do
+          busy_thread
+
+          start
+
+          all_samples = try_wait_until do
+            samples = samples_from_pprof_without_gc_and_overhead(recorder.serialize!)
+            samples if samples_for_thread(samples, busy_thread).any?
+          end
+
+          cpu_and_wall_time_worker.stop
+
+          expect(samples_for_thread(all_samples, busy_thread)).to_not be_empty
+          expect(cpu_and_wall_time_worker.stats.fetch(:cpu_time_sampled)).to be >= 1
+          expect(Datadog::Profiling::Collectors::ThreadContext::Testing._native_stats(thread_context_collector))
+            .to include(cpu_timer_failures: 0, cpu_timer_last_error: nil)
+        end
+      end
+
+      context 'when not on Linux or on Ruby older than 3.1' do
+        before do
+          if RUBY_PLATFORM.include?('linux') && Gem::Version.new(RUBY_VERSION) >= Gem::Version.new('3.1')
+            skip 'Behavior does not apply to current platform/Ruby version'
+          end
+        end
+
+        it do
+          expect { cpu_and_wall_time_worker }.to raise_error(ArgumentError, /CPU-time sampling/)
+        end
+      end
+    end
+
+    context 'when cpu_overhead_controller_enabled is true' do
+      let(:options) { { cpu_overhead_controller_enabled: true, cpu_quota_cores: 0.5 } }
+
+      it 'reports the achieved overhead' do
+        start
+
+        achieved_overhead_percentage = try_wait_until do
+          cpu_and_wall_time_worker.stats.fetch(:achieved_overhead_percentage)
+        end
+
+        cpu_and_wall_time_worker.stop
+
+        expect(achieved_overhead_percentage).to be >= 0
+      end
+    end
+
+    context 'when cpu_overhead_controller_enabled is false' do
+      it 'does not report the achieved overhead' do
+        start
+
+        try_wait_until do
+          samples = samples_from_pprof_without_gc_and_overhead(recorder.serialize!)
+          samples if samples.any?
+        end
+
+        cpu_and_wall_time_worker.stop
+
+        expect(cpu_and_wall_time_worker.stats.fetch(:achieved_overhead_percentage)).to be nil
+      end
+    end
+
+    context 'when gvl_profiling_enabled is true' do
+      let(:recorder) { build_stack_recorder(gvl_wait_enabled: true) }
+      let(:options) { { gvl_profiling_enabled: true } }
+
+      context 'on Ruby 3.2 or newer' do
+        before do
+          if Gem::Version.new(RUBY_VERSION) < Gem::Version.new('3.2')
+            skip 'Behavior does not apply to current Ruby version'
+          end
+        end
+
+        let(:ready_queue) { Queue.new }
+        let(:contending_threads) do
+          Array.new(2) do
+            Thread.new do
+              ready_queue << true
+              i = 0
+              loop { (i = (i + 1) % 2) }
+            end
+          end
+        end
+
+        after do
+          contending_threads.each(&:kill).each(&:join)
+        end
+
+        it 'records time spent waiting on the Global VM Lock' do
+          contending_threads
+          2.times { ready_queue.pop }
+
+          start
+          wait_until_running
+
+          all_samples = try_wait_until do
+            samples = samples_from_pprof_without_gc_and_overhead(recorder.serialize!)
+            samples if samples.any? { |it| it.values.fetch(:'gvl-wait') > 0 }
+          end
+
+          cpu_and_wall_time_worker.stop
+
+          gvl_wait_samples = all_samples.select { |it| it.values.fetch(:'gvl-wait') > 0 }
+
+          gvl_waiting_threads = gvl_wait_samples.map { |it| object_id_from(it.labels.fetch(:'thread id')) }
+
+          expect(gvl_waiting_threads & contending_threads.map(&:object_id)).to_not be_empty
+          expect(cpu_and_wall_time_worker.stats.fetch(:gvl_wait_sampled)).to be >= gvl_wait_samples.size
+        end
+      end
+
+      context 'on Ruby older than 3.2' do
+        before do
+          if Gem::Version.new(RUBY_VERSION) >= Gem::Version.new('3.2')
+            skip 'Behavior does not apply to current Ruby version'
+          end
+        end
+
+        it do
+          expect { cpu_and_wall_time_worker }.to raise_error(ArgumentError, /GVL profiling/)
+        end
+      end
+    end
+
+    context 'when allocation_sample_every is set' do
+      let(:options) { { allocation_sample_every: 10 } }
+      let(:allocation_counting_enabled) { false }
+
+      before { stub_const('AllocationSampledObject', Class.new) }
+
+      it 'records sampled allocations, including their class, with upscaled weights' do
+        start
+        wait_until_running
+
+        10_000.times { AllocationSampledObject.new }
+
+        cpu_and_wall_time_worker.stop
+
+        allocation_samples = samples_from_pprof(recorder.serialize!)
+          .select { |it| it.labels[:'allocation class'] == 'AllocationSampledObject' }
+        total_weight = allocation_samples.map { |it| it.values.fetch(:'alloc-samples') }.reduce(0, :+)
+
+        expect(allocation_samples).to_not be_empty
+        expect(cpu_and_wall_time_worker.stats.fetch(:allocation_sampled)).to be >= allocation_samples.size
+        # Sampling is random, but the upscaled weights should get us in the right ballpark
+        expect(total_weight).to be_within(5_000).of(10_000)
+      end
+    end
+
+    [0, 2**32].each do |invalid_allocation_sample_every|
+      context "when allocation_sample_every is #{invalid_allocation_sample_every}" do
+        let(:options) { { allocation_sample_every: invalid_allocation_sample_every } }
+
+        it do
+          expect { cpu_and_wall_time_worker }.to raise_error(ArgumentError, /allocation_sample_every/)
+        end
+      end
+    end
+
+    context 'when heap_profiling_enabled is true' do
+      let(:recorder) { build_stack_recorder(heap_samples_enabled: true) }
+      let(:options) { { allocation_sample_every: 10, heap_profiling_enabled: true } }
+      let(:allocation_counting_enabled) { false }
+
+      it 'stops tracking sampled objects once they get garbage collected' do
+        start
+        wait_until_running
+
+        10_000.times { Object.new }
+        GC.start
+
+        heap_tracked_objects = recorder.stats.fetch(:heap_tracked_objects)
+        cpu_and_wall_time_worker.stop
+
+        allocation_sampled = cpu_and_wall_time_worker.stats.fetch(:allocation_sampled)
+
+        expect(allocation_sampled).to be > 0
+        expect(heap_tracked_objects).to be < (allocation_sampled / 2)
+      end
+
+      it 'reports the sampled objects that are still alive as heap samples' do
+        start
+        wait_until_running
+
+        retained_objects = Array.new(10_000) { Object.new }
+
+        total_live_samples =
+          samples_from_pprof(recorder.serialize!).map { |it| it.values.fetch(:'heap-live-samples') }.reduce(0, :+)
+
+        cpu_and_wall_time_worker.stop
+
+        # Sampling is random, but the upscaled weights should get us in the right ballpark
+        expect(total_live_samples).to be >= 5_000
+        expect(retained_objects.size).to be 10_000
+      end
+
+      it 'stops reporting heap samples once it stops getting notified of objects being freed' do
+        start
+        wait_until_running
+
+        retained_objects = Array.new(10_000) { Object.new }
+
+        cpu_and_wall_time_worker.stop
+
+        # These get freed after the worker stopped listening for objects being freed
+        retained_objects.clear
+        GC.start
+
+        heap_samples = samples_from_pprof(recorder.serialize!).select { |it| it.values.fetch(:'heap-live-samples') > 0 }
+
+        expect(heap_samples).to be_empty
+        expect(recorder.stats.fetch(:heap_tracked_objects)).to be 0
+      end
+    end
+
     context 'when a previous signal handler existed' do
       before do
         described_class::Testing._native_install_testing_signal_handler
@@ -181,6 +475,25 @@ RSpec.describe Datadog::Profiling::Collectors::CpuAndWallTimeWorker do
       expect(sampling_time_ns_max).to be < one_second_in_ns, "A single sample should not take longer than 1s, #{stats}"
     end
 
+    it 'keeps histograms of how long sampling is taking and of the delay until sampling starts' do
+      start
+
+      try_wait_until do
+        samples = samples_from_pprof_without_gc_and_overhead(recorder.serialize!)
+        samples if samples.any?
+      end
+
+      cpu_and_wall_time_worker.stop
+
+      stats = cpu_and_wall_time_worker.stats
+      sampling_time_ns_percentiles = stats.fetch(:sampling_time_ns_percentiles)
+
+      expect(sampling_time_ns_percentiles.keys).to eq [:p50, :p90, :p99, :p99_9]
+      expect(sampling_time_ns_percentiles.values).to eq sampling_time_ns_percentiles.values.sort
+      expect(sampling_time_ns_percentiles.fetch(:p99_9)).to be <= stats.fetch(:sampling_time_ns_max)
+      expect(stats.fetch(:signal_to_sample_delay_ns_percentiles)).to include(:p50, :p99)
+    end
+
     it 'records garbage collection cycles' do
       if RUBY_VERSION.start_with?('3.')
         skip(
@@ -217,6 +530,7 @@ RSpec.describe Datadog::Profiling::Collectors::CpuAndWallTimeWorker do
       expect(
         current_thread_gc_samples.inject(0) { |sum, sample| sum + sample.values.fetch(:'cpu-samples') }
       ).to be >= invoke_gc_times
+      expect(cpu_and_wall_time_worker.stats.fetch(:gc_sampling_time_ns_percentiles)).to include(:p50, :p99)
     end
 
     context 'when the background thread dies without cleaning up (after Ruby forks)' do
@@ -338,6 +652,20 @@ RSpec.describe Datadog::Profiling::Collectors::CpuAndWallTimeWorker do
         expect(sample_count).to be >= 5, "sample_count: #{sample_count}, stats: #{stats}, debug_failures: #{debug_failures}"
         expect(trigger_sample_attempts).to be >= sample_count
       end
+
+      it 'keeps a histogram of the delay between asking the IdleSamplingHelper to sample and sampling' do
+        start
+        wait_until_running
+
+        sleep 0.2
+
+        cpu_and_wall_time_worker.stop
+
+        idle_sample_delay_ns_percentiles = cpu_and_wall_time_worker.stats.fetch(:idle_sample_delay_ns_percentiles)
+
+        expect(idle_sample_delay_ns_percentiles.keys).to eq [:p50, :p90, :p99, :p99_9]
+        expect(idle_sample_delay_ns_percentiles.values).to eq idle_sample_delay_ns_percentiles.values.sort
+      end
     end
   end
 
@@ -441,6 +769,12 @@ RSpec.describe Datadog::Profiling::Collectors::CpuAndWallTimeWorker do
         expect(described_class::Testing._native_gc_tracepoint(cpu_and_wall_time_worker)).to_not be_enabled
       end
 
+      it 'stops traces from publishing their identifiers to the profiler' do
+        stop
+
+        expect(Datadog::Tracing::TraceOperation.profiling_slot_class).to be nil
+      end
+
       it 'leaves behind an empty SIGPROF signal handler' do
         stop
 
@@ -527,6 +861,18 @@ RSpec.describe Datadog::Profiling::Collectors::CpuAndWallTimeWorker do
         sampling_time_ns_max: nil,
         sampling_time_ns_total: nil,
         sampling_time_ns_avg: nil,
+        gvl_wait_sampled: 0,
+        allocation_sampled: 0,
+        signal_handler_forwarded: 0,
+        timer_retargeted: 0,
+        timer_disarmed: 0,
+        cpu_time_timer_wrong_thread: 0,
+        cpu_time_sampled: 0,
+        sampling_time_ns_percentiles: nil,
+        gc_sampling_time_ns_percentiles: nil,
+        signal_to_sample_delay_ns_percentiles: nil,
+        idle_sample_delay_ns_percentiles: nil,
+        achieved_overhead_percentage: nil,
       )
     end
   end
@@ -8,7 +8,7 @@ RSpec.describe Datadog::Profiling::Collectors::DynamicSamplingRate do
     let(:current_monotonic_wall_time_ns) { 123 }
 
     it 'sets the next_sample_after_monotonic_wall_time_ns based on the current timestamp and max overhead target' do
-      max_overhead_target = 2.0 # WALL_TIME_OVERHEAD_TARGET_PERCENTAGE
+      max_overhead_target = 2.0 # DEFAULT_OVERHEAD_TARGET_PERCENTAGE
       sampling_time_ns = 456
 
       # The idea here is -- if sampling_time_ns is 2% of the time we spend working, how much is the 98% we should spend
@@ -84,4 +84,107 @@ RSpec.describe Datadog::Profiling::Collectors::DynamicSamplingRate do
       it { is_expected.to be 0 }
     end
   end
+
+  describe 'dynamic_sampling_rate_update_controller' do
+    let(:overhead_target_percentage) { 2.0 }
+    let(:cpu_quota_cores) { 0.0 }
+    let(:one_second_ns) { 1_000_000_000 }
+    let(:min_sample_interval_ns) { 10_000_000 } # MIN_SAMPLE_INTERVAL_NS
+
+    subject(:sample_interval_ns_and_achieved_overhead_percentage) do
+      described_class::Testing._native_cpu_overhead_controller(overhead_target_percentage, cpu_quota_cores, windows)
+    end
+
+    # Builds consecutive 1 second windows, where in each the process uses `process_cores` of cpu, and the profiler
+    # uses `profiler_cpu_time_ns` (half on the worker thread, half sampling on application threads)
+    def build_windows(count:, process_cores:, profiler_cpu_time_ns:)
+      Array.new(count + 1) do |index|
+        [
+          1 + (index * one_second_ns),
+          index * (process_cores * one_second_ns).to_i,
+          index * (profiler_cpu_time_ns / 2),
+          index.zero? ? 0 : profiler_cpu_time_ns / 2,
+        ]
+      end
+    end
+
+    context 'before any window has been completed' do
+      let(:windows) { [[1, 0, 0, 0]] }
+
+      it { is_expected.to eq [0, nil] }
+    end
+
+    context 'when the window has not yet been completed' do
+      let(:windows) { [[1, 0, 0, 0], [one_second_ns, 100, 100, 100]] }
+
+      it { is_expected.to eq [0, nil] }
+    end
+
+    context 'when the profiler overhead is below the target' do
+      let(:windows) { build_windows(count: 5, process_cores: 2, profiler_cpu_time_ns: 10_000_000) }
+
+      it 'does not slow down sampling' do
+        sample_interval_ns, achieved_overhead_percentage = sample_interval_ns_and_achieved_overhead_percentage
+
+        expect(sample_interval_ns).to be 0
+        expect(achieved_overhead_percentage).to be_within(0.01).of(0.5)
+      end
+    end
+
+    context 'when the profiler overhead is above the target' do
+      let(:windows) { build_windows(count: 1, process_cores: 1, profiler_cpu_time_ns: 80_000_000) }
+
+      it 'slows down sampling' do
+        sample_interval_ns, achieved_overhead_percentage = sample_interval_ns_and_achieved_overhead_percentage
+
+        expect(sample_interval_ns).to be > min_sample_interval_ns
+        expect(achieved_overhead_percentage).to be_within(0.01).of(8.0)
+      end
+
+      context 'for several windows in a row' do
+        let(:windows) { build_windows(count: 5, process_cores: 1, profiler_cpu_time_ns: 80_000_000) }
+
+        it 'keeps slowing down sampling, up to MAX_SAMPLE_INTERVAL_NS' do
+          single_window_sample_interval_ns, = described_class::Testing._native_cpu_overhead_controller(
+            overhead_target_percentage, cpu_quota_cores, windows.first(2)
+          )
+          sample_interval_ns, = sample_interval_ns_and_achieved_overhead_percentage
+
+          expect(sample_interval_ns).to be > single_window_sample_interval_ns
+          expect(sample_interval_ns).to be <= 10_000_000_000
+        end
+      end
+
+      context 'when a higher overhead target is configured' do
+        let(:overhead_target_percentage) { 10.0 }
+
+        it 'does not slow down sampling' do
+          expect(sample_interval_ns_and_achieved_overhead_percentage.first).to be 0
+        end
+      end
+    end
+
+    context 'when the process is mostly idle' do
+      # The process cpu-time gets considered as at least one core
+      let(:windows) { build_windows(count: 1, process_cores: 0.01, profiler_cpu_time_ns: 10_000_000) }
+
+      it 'computes the overhead based on one core' do
+        sample_interval_ns, achieved_overhead_percentage = sample_interval_ns_and_achieved_overhead_percentage
+
+        expect(sample_interval_ns).to be 0
+        expect(achieved_overhead_percentage).to be_within(0.01).of(1.0)
+      end
+
+      context 'when the cgroup cpu quota is below one core' do
+        let(:cpu_quota_cores) { 0.25 }
+
+        it 'computes the overhead based on the cpu quota' do
+          sample_interval_ns, achieved_overhead_percentage = sample_interval_ns_and_achieved_overhead_percentage
+
+          expect(sample_interval_ns).to be > min_sample_interval_ns
+          expect(achieved_overhead_percentage).to be_within(0.01).of(4.0)
+        end
+      end
+    end
+  end
 end
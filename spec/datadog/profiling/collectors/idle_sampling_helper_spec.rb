@@ -68,6 +68,32 @@ RSpec.describe Datadog::Profiling::Collectors::IdleSamplingHelper do
 
       $idle_sampling_helper_testing_action = nil
     end
+
+    it 'runs functions requested after the previous one ran' do
+      action_ran = Queue.new
+      $idle_sampling_helper_testing_action = proc { action_ran << true }
+
+      3.times do
+        described_class::Testing._native_idle_sampling_helper_request_action(idle_sampling_helper)
+        action_ran.pop
+      end
+
+      $idle_sampling_helper_testing_action = nil
+    end
+
+    it 'runs the requested function after the IdleSamplingHelper gets restarted' do
+      idle_sampling_helper.stop
+      idle_sampling_helper.start
+
+      action_ran = Queue.new
+      $idle_sampling_helper_testing_action = proc { action_ran << true }
+
+      described_class::Testing._native_idle_sampling_helper_request_action(idle_sampling_helper)
+
+      action_ran.pop
+
+      $idle_sampling_helper_testing_action = nil
+    end
     # rubocop:enable Style/GlobalVars
   end
 end
@@ -64,8 +64,12 @@ RSpec.describe Datadog::Profiling::Collectors::ThreadContext do
     described_class::Testing._native_sample_after_gc(cpu_and_wall_time_collector)
   end
 
-  def sample_allocation(weight:)
-    described_class::Testing._native_sample_allocation(cpu_and_wall_time_collector, weight)
+  def sample_allocation(weight:, new_object: Object.new)
+    described_class::Testing._native_sample_allocation(cpu_and_wall_time_collector, weight, new_object)
+  end
+
+  def sample_gvl_wait(gvl_wait_ns:)
+    described_class::Testing._native_sample_gvl_wait(cpu_and_wall_time_collector, gvl_wait_ns)
   end
 
   def thread_list
@@ -107,6 +111,85 @@ RSpec.describe Datadog::Profiling::Collectors::ThreadContext do
         .to include(*[Thread.main, t1, t2, t3].map(&:object_id))
     end
 
+    context 'when many threads start and finish' do
+      let!(:many_threads) do
+        Array.new(50) do
+          ready_queue = Queue.new
+          thread = Thread.new do
+            ready_queue << true
+            sleep
+          end
+          ready_queue.pop
+          thread
+        end
+      end
+
+      after do
+        many_threads.each(&:kill).each(&:join)
+      end
+
+      it 'keeps the contexts for threads that are still alive, and removes the contexts for dead threads' do
+        sample
+        thread_ids_before = per_thread_context.map { |thread, context| [thread, context.fetch(:thread_id)] }.to_h
+        expect(thread_ids_before.keys).to include(*many_threads)
+
+        dead_threads, alive_threads = many_threads.partition.with_index { |_, index| index.even? }
+        dead_threads.each(&:kill).each(&:join)
+
+        # On older Rubies, dead threads are only cleaned up every 100 samples
+        100.times { sample }
+
+        expect(per_thread_context.keys).to include(*alive_threads)
+        expect(per_thread_context.keys).to_not include(*dead_threads)
+        alive_threads.each do |thread|
+          expect(per_thread_context.fetch(thread).fetch(:thread_id)).to eq thread_ids_before.fetch(thread)
+        end
+      end
+
+      it 'keeps tagging samples with the right thread ids as contexts get added and removed' do
+        sample # Grows the table past its initial capacity
+
+        dead_threads, alive_threads = many_threads.partition.with_index { |_, index| index.even? }
+        dead_threads.each(&:kill).each(&:join)
+
+        # Removes the contexts for dead threads (on older Rubies, only every 100 samples), moving other contexts around
+        100.times { sample }
+        recorder.serialize # Discard the samples taken so far
+
+        sample
+
+        alive_threads.each do |thread|
+          thread_samples = samples_for_thread(samples, thread)
+
+          expect(thread_samples.size).to be 1
+          expect(thread_samples.first.values).to include(:'cpu-samples' => 1)
+          expect(thread_samples.first.labels.fetch(:'thread id'))
+            .to eq per_thread_context.fetch(thread).fetch(:thread_id)
+        end
+      end
+
+      context 'on Ruby 3.2 and above' do
+        before do
+          if Gem::Version.new(RUBY_VERSION) < Gem::Version.new('3.2')
+            skip 'Behavior does not apply to current Ruby version'
+          end
+        end
+
+        it 'removes the contexts for dead threads on the next sample after they finish' do
+          sample
+          expect(per_thread_context.keys).to include(*many_threads)
+
+          dead_thread = many_threads.first
+          dead_thread.kill.join
+
+          sample
+
+          expect(per_thread_context.keys).to_not include(dead_thread)
+          expect(per_thread_context.keys).to include(*many_threads[1..-1])
+        end
+      end
+    end
+
     it 'includes the thread names, if available' do
       t1.name = 'thread t1'
       t2.name = nil
@@ -149,6 +232,45 @@ RSpec.describe Datadog::Profiling::Collectors::ThreadContext do
       expect(t1_sample.values).to include(:'cpu-samples' => 5)
     end
 
+    it 'caches the names and filenames of frames across samples' do
+      sample
+
+      misses_after_first_sample = stats.fetch(:frame_cache_misses)
+
+      expect(misses_after_first_sample).to be > 0
+      expect { sample }.to change { stats.fetch(:frame_cache_hits) }
+
+      # Apart from the rspec thread, which called `sample` from a slightly different place, all stacks stay the same
+      expect(stats.fetch(:frame_cache_misses) - misses_after_first_sample).to be < misses_after_first_sample
+    end
+
+    it 'samples the current stack of a thread when only the top of its stack changed since the previous sample' do
+      continue_queue = Queue.new
+      thread = Thread.new do
+        inside_t1 { continue_queue.pop }
+        continue_queue.pop
+      end
+
+      begin
+        Thread.pass until thread.status == 'sleep'
+        sample
+
+        continue_queue << true
+        Thread.pass until thread.status == 'sleep'
+        sample
+
+        expected_stack = thread.backtrace_locations.map(&:base_label)
+        thread_stacks = samples_for_thread(samples, thread).map { |it| it.locations.map(&:base_label) }
+
+        expect(thread_stacks.size).to be 2
+        expect(thread_stacks).to include(expected_stack)
+        expect(thread_stacks.find { |it| it != expected_stack }).to include('inside_t1')
+      ensure
+        thread.kill
+        thread.join
+      end
+    end
+
     [:before, :after].each do |on_gc_finish_order|
       context "when a thread is marked as being in garbage collection, #{on_gc_finish_order} on_gc_finish" do
         # Until sample_after_gc gets called, the state left over by both on_gc_start and on_gc_finish "blocks" time
@@ -470,6 +592,67 @@ RSpec.describe Datadog::Profiling::Collectors::ThreadContext do
               end
             end
           end
+
+          context 'when the trace publishes its identifiers to a TraceIdentifiersSlot' do
+            let(:root_span_type) { 'web' }
+
+            around do |example|
+              begin
+                Datadog::Tracing::TraceOperation.profiling_slot_class = described_class::TraceIdentifiersSlot
+                example.run
+              ensure
+                Datadog::Tracing::TraceOperation.profiling_slot_class = nil
+              end
+            end
+
+            it 'includes the "local root span id", "span id" and "trace endpoint" labels in the samples' do
+              expect(@t1_trace.instance_variable_get(:@profiling_slot)).to be_a(described_class::TraceIdentifiersSlot)
+
+              sample
+
+              expect(t1_sample.labels).to include(
+                :'local root span id' => @t1_local_root_span_id.to_i,
+                :'span id' => @t1_span_id.to_i,
+                :'trace endpoint' => 'profiler.test',
+              )
+            end
+
+            it 'does not need to look up the spans in the trace' do
+              @t1_trace.instance_variable_set(:@active_span, nil)
+
+              sample
+
+              expect(t1_sample.labels).to include(:'span id' => @t1_span_id.to_i)
+            end
+
+            it 'does not need to look up the trace endpoint in the trace' do
+              @t1_trace.instance_variable_set(:@resource, 'not_published')
+
+              sample
+
+              expect(t1_sample.labels).to include(:'trace endpoint' => 'profiler.test')
+            end
+
+            context 'when the trace resource changes after the spans were published' do
+              it 'includes the new "trace endpoint" label in the samples' do
+                @t1_trace.resource = 'changed_after_publishing'
+
+                sample
+
+                expect(t1_sample.labels).to include(:'trace endpoint' => 'changed_after_publishing')
+              end
+            end
+
+            context 'when the root span type is not web' do
+              let(:root_span_type) { 'not-web' }
+
+              it 'does not include the "trace endpoint" label' do
+                sample
+
+                expect(t1_sample.labels.keys).to_not include(:'trace endpoint')
+              end
+            end
+          end
         end
       end
     end
@@ -515,6 +698,189 @@ RSpec.describe Datadog::Profiling::Collectors::ThreadContext do
       expect(second_sample_stack.first.labels).to_not include(:'profiler overhead' => anything)
       expect(profiler_overhead_stack.first.labels).to include(:'profiler overhead' => 1)
     end
+
+    context 'when idle_sample_coalescing_enabled is true' do
+      subject(:cpu_and_wall_time_collector) do
+        described_class.new(
+          recorder: recorder,
+          max_frames: max_frames,
+          tracer: tracer,
+          idle_sample_coalescing_enabled: true,
+        )
+      end
+
+      it 'records a single sample for an idle thread while its stack stays the same' do
+        continue_queue = Queue.new
+        thread = Thread.new do
+          inside_t1 { continue_queue.pop }
+          continue_queue.pop
+        end
+
+        begin
+          Thread.pass until thread.status == 'sleep'
+          3.times { sample }
+
+          expect(stats.fetch(:idle_samples_coalesced)).to be > 0
+
+          # Once the stack of the thread changes, the pending sample gets recorded
+          continue_queue << true
+          left_inside_t1 = -> { thread.backtrace_locations.none? { |it| it.label == 'inside_t1' } }
+          Thread.pass until thread.status == 'sleep' && left_inside_t1.call
+          sample
+
+          thread_samples = samples_for_thread(samples, thread)
+            .select { |it| it.locations.find { |frame| frame.base_label == 'inside_t1' } }
+
+          expect(thread_samples.size).to be 1
+          expect(thread_samples.first.values).to include(:'cpu-samples' => 3)
+        ensure
+          thread.kill
+          thread.join
+        end
+      end
+
+      it 'keeps recording samples for threads that are not idle' do
+        3.times { sample }
+
+        expect(samples_for_thread(samples, Thread.current).size).to be >= 1
+        expect(samples_for_thread(samples, t1).size).to be 1
+      end
+
+      it 'records the pending sample for an idle thread when the profile gets serialized' do
+        3.times { sample }
+
+        t1_samples = samples_for_thread(samples, t1)
+
+        expect(t1_samples.size).to be 1
+        expect(t1_samples.first.values).to include(:'cpu-samples' => 3)
+
+        # The pending sample was recorded, so it doesn't show up again in the next profile
+        expect(samples_for_thread(samples_from_pprof(recorder.serialize!), t1)).to be_empty
+      end
+    end
+
+    context 'when stack compaction is enabled' do
+      let(:recursion_folding_enabled) { true }
+      let(:pruned_frame_prefixes) { [] }
+      let(:recursion_depth) { 50 }
+      let(:recursive_thread) do
+        recurse = proc { |n| n > 0 ? recurse.call(n - 1) : sleep }
+        Thread.new { recurse.call(recursion_depth) }
+      end
+
+      subject(:cpu_and_wall_time_collector) do
+        described_class.new(
+          recorder: recorder,
+          max_frames: max_frames,
+          tracer: tracer,
+          recursion_folding_enabled: recursion_folding_enabled,
+          pruned_frame_prefixes: pruned_frame_prefixes,
+        )
+      end
+
+      before { Thread.pass until recursive_thread.status == 'sleep' }
+
+      after do
+        recursive_thread.kill
+        recursive_thread.join
+      end
+
+      def recursive_thread_stack
+        sample
+        samples_for_thread(samples, recursive_thread).first.locations
+      end
+
+      it 'folds the recursive calls into a single copy followed by a recursion marker' do
+        stack = recursive_thread_stack
+
+        expect(stack.size).to be < recursion_depth
+        expect(stack).to include(have_attributes(base_label: '', path: match(/\Arecursion x\d+\z/), lineno: 0))
+      end
+
+      context 'when pruned_frame_prefixes are configured' do
+        let(:recursion_folding_enabled) { false }
+        let(:pruned_frame_prefixes) { [__FILE__] }
+
+        it 'reduces consecutive frames from the pruned paths to their bottom frame, keeping the top frame' do
+          stack = recursive_thread_stack
+
+          # Every frame of the thread comes from this file (including `sleep`, as native frames get the path of their
+          # caller), so only the top and bottom frames are left
+          expect(stack.size).to be 2
+          expect(stack.first.base_label).to eq 'sleep'
+          expect(stack.map(&:path)).to all eq(__FILE__)
+        end
+      end
+
+      context 'when pruned_frame_prefixes contains an empty prefix' do
+        let(:pruned_frame_prefixes) { [''] }
+
+        it do
+          expect { cpu_and_wall_time_collector }.to raise_error(ArgumentError)
+        end
+      end
+    end
+
+    it 'does not include the "wait reason" label in the samples' do
+      sample
+
+      expect(samples.flat_map { |it| it.labels.keys }).to_not include(:'wait reason')
+    end
+
+    context 'when wait_reason_labels_enabled is true' do
+      subject(:cpu_and_wall_time_collector) do
+        described_class.new(
+          recorder: recorder,
+          max_frames: max_frames,
+          tracer: tracer,
+          wait_reason_labels_enabled: true,
+        )
+      end
+
+      let(:mutex) { Mutex.new }
+      let(:pipe) { IO.pipe }
+      let(:blocked_threads) do
+        {
+          'mutex' => Thread.new { mutex.synchronize {} },
+          'io' => Thread.new { pipe.first.read(1) },
+        }
+      end
+
+      before do
+        mutex.lock
+        blocked_threads.each_value { |thread| Thread.pass until thread.status == 'sleep' }
+      end
+
+      after do
+        blocked_threads.each_value(&:kill).each_value(&:join)
+        pipe.each(&:close)
+      end
+
+      def wait_reason_for(thread)
+        samples_for_thread(samples, thread).map { |it| it.labels.fetch(:'wait reason') }.uniq
+      end
+
+      it 'labels the thread taking the sample as running, and threads blocked in sleep as sleep' do
+        sample
+
+        expect(wait_reason_for(Thread.current)).to eq ['running']
+        expect(wait_reason_for(t1)).to eq ['sleep']
+      end
+
+      it 'labels threads blocked in a mutex or in IO with the matching wait reason' do
+        sample
+
+        blocked_threads.each do |wait_reason, thread|
+          expect(wait_reason_for(thread)).to eq [wait_reason]
+        end
+      end
+
+      it 'labels samples recording time waiting for the Global VM Lock as gvl' do
+        sample_gvl_wait(gvl_wait_ns: 123)
+
+        expect(wait_reason_for(Thread.current)).to eq ['gvl']
+      end
+    end
   end
 
   describe '#on_gc_start' do
@@ -839,6 +1205,39 @@ RSpec.describe Datadog::Profiling::Collectors::ThreadContext do
       expect(single_sample.values).to include(:'alloc-samples' => 123)
     end
 
+    it 'tags the sample with the class of the allocated object' do
+      sample_allocation(weight: 123, new_object: 'a string')
+
+      expect(single_sample.labels).to include(:'allocation class' => 'String')
+    end
+
+    it 'tags samples for anonymous classes' do
+      sample_allocation(weight: 123, new_object: Class.new.new)
+
+      expect(single_sample.labels).to include(:'allocation class' => '(Anonymous)')
+    end
+
+    context 'when heap samples are enabled' do
+      let(:recorder) { build_stack_recorder(heap_samples_enabled: true) }
+      let(:retained_objects) { Array.new(3) { Object.new } }
+
+      it 'tracks the sampled objects' do
+        retained_objects.each { |object| sample_allocation(weight: 10, new_object: object) }
+
+        expect(recorder.stats).to include(heap_tracked_objects: 3, heap_tracked_stacks: 1)
+      end
+
+      it 'includes the objects that are still alive in the heap samples' do
+        retained_objects.each { |object| sample_allocation(weight: 10, new_object: object) }
+
+        heap_sample = samples.find { |it| it.values.fetch(:'heap-live-samples') > 0 }
+
+        expect(heap_sample.values).to include(:'heap-live-samples' => 30, :'alloc-samples' => 0)
+        expect(heap_sample.values.fetch(:'heap-live-size')).to be > 0
+        expect(heap_sample.locations.first.lineno).to be > 0
+      end
+    end
+
     it 'includes the thread names, if available' do
       thread_with_name = Thread.new do
         Thread.current.name = 'thread_with_name'
@@ -890,6 +1289,26 @@ RSpec.describe Datadog::Profiling::Collectors::ThreadContext do
     end
   end
 
+  describe '#sample_gvl_wait' do
+    let(:recorder) { build_stack_recorder(gvl_wait_enabled: true) }
+    let(:single_sample) do
+      expect(samples.size).to be 1
+      samples.first
+    end
+
+    it 'samples the caller thread' do
+      sample_gvl_wait(gvl_wait_ns: 123)
+
+      expect(object_id_from(single_sample.labels.fetch(:'thread id'))).to be Thread.current.object_id
+    end
+
+    it 'tags the sample with the provided gvl wait time, and no cpu/wall-time' do
+      sample_gvl_wait(gvl_wait_ns: 123)
+
+      expect(single_sample.values).to include(:'gvl-wait' => 123, :'cpu-time' => 0, :'wall-time' => 0)
+    end
+  end
+
   describe '#thread_list' do
     it "returns the same as Ruby's Thread.list" do
       expect(thread_list).to eq Thread.list
@@ -1045,6 +1464,13 @@ RSpec.describe Datadog::Profiling::Collectors::ThreadContext do
       expect { reset_after_fork }.to change { stats.fetch(:gc_samples) }.from(1).to(0)
     end
 
+    it 'clears the frame cache' do
+      reset_after_fork
+
+      # Since the cache is empty, frames that had been seen before the fork need to be resolved again
+      expect { sample }.to change { stats.fetch(:frame_cache_misses) }.from(0)
+    end
+
     it 'resets the stack recorder' do
       expect(recorder).to receive(:reset_after_fork)
 
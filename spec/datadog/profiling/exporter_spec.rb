@@ -1,6 +1,7 @@
 
 require 'datadog/profiling/exporter'
 require 'datadog/profiling/old_recorder'
+require 'datadog/profiling/stack_recorder'
 require 'datadog/profiling/collectors/code_provenance'
 require 'datadog/core/logger'
 
@@ -44,6 +45,23 @@ RSpec.describe Datadog::Profiling::Exporter do
       it { is_expected.to be nil }
     end
 
+    context 'when pprof recorder supports serializing for export' do
+      let(:pprof_data) { instance_double(Datadog::Profiling::StackRecorder::EncodedProfile) }
+      let(:pprof_recorder) do
+        instance_double(Datadog::Profiling::StackRecorder, serialize_for_export: pprof_recorder_serialize)
+      end
+
+      it 'returns a flush containing the pprof data as returned by the recorder' do
+        expect(flush.pprof_data).to be pprof_data
+      end
+
+      context 'when pprof recorder has no data' do
+        let(:pprof_recorder_serialize) { nil }
+
+        it { is_expected.to be nil }
+      end
+    end
+
     context 'when no code provenance collector was provided' do
       let(:code_provenance_collector) { nil }
 
@@ -5,7 +5,9 @@ require 'datadog/profiling'
 
 require 'json'
 require 'socket'
+require 'tmpdir'
 require 'webrick'
+require 'zlib'
 
 # Design note for this class's specs: from the Ruby code side, we're treating the `_native_` methods as an API
 # between the Ruby code and the native methods, and thus in this class we have a bunch of tests to make sure the
@@ -22,6 +24,8 @@ RSpec.describe Datadog::Profiling::HttpTransport do
       site: site,
       api_key: api_key,
       upload_timeout_seconds: upload_timeout_seconds,
+      async_export_enabled: async_export_enabled,
+      file_sink_url: file_sink_url,
     )
   end
 
@@ -45,6 +49,8 @@ RSpec.describe Datadog::Profiling::HttpTransport do
   let(:site) { nil }
   let(:api_key) { nil }
   let(:upload_timeout_seconds) { 10 }
+  let(:async_export_enabled) { false }
+  let(:file_sink_url) { nil }
 
   let(:flush) do
     Datadog::Profiling::Flush.new(
@@ -95,14 +101,30 @@ RSpec.describe Datadog::Profiling::HttpTransport do
         let(:adapter) { Datadog::Transport::Ext::UnixSocket::ADAPTER }
         let(:uds_path) { '/var/run/datadog/apm.socket' }
 
-        it 'picks the :agent working mode with unix domain stocket reporting' do
+        it 'picks the :agent_uds working mode with the unix domain socket path' do
           expect(described_class)
             .to receive(:_native_validate_exporter)
-            .with([:agent, 'unix:///var/run/datadog/apm.socket'])
+            .with([:agent_uds, '/var/run/datadog/apm.socket'])
             .and_return([:ok, nil])
 
           http_transport
         end
+
+        context 'when the unix domain socket path is empty' do
+          let(:uds_path) { '' }
+
+          it do
+            expect { http_transport }.to raise_error(ArgumentError, /Unix domain socket path is empty/)
+          end
+        end
+
+        context 'when the unix domain socket path is too long' do
+          let(:uds_path) { "/#{'a' * 200}" }
+
+          it do
+            expect { http_transport }.to raise_error(ArgumentError, /Unix domain socket path is too long/)
+          end
+        end
       end
 
       context 'when agent_settings includes a deprecated_for_removal_transport_configuration_proc' do
@@ -187,7 +209,7 @@ RSpec.describe Datadog::Profiling::HttpTransport do
       finish_timespec_nanoseconds = 123456789
 
       expect(described_class).to receive(:_native_do_export).with(
-        kind_of(Array), # exporter_configuration
+        kind_of(described_class::NativeExporter),
         upload_timeout_milliseconds,
         start_timespec_seconds,
         start_timespec_nanoseconds,
@@ -196,13 +218,75 @@ RSpec.describe Datadog::Profiling::HttpTransport do
         pprof_file_name,
         pprof_data,
         code_provenance_file_name,
-        code_provenance_data,
-        tags_as_array
+        code_provenance_data
       ).and_return([:ok, 200])
 
       export
     end
 
+    describe 'native exporter reuse' do
+      before { allow(described_class).to receive(:_native_do_export).and_return([:ok, 200]) }
+
+      it 'creates the native exporter with the flush tags' do
+        expect(described_class::NativeExporter).to receive(:_native_new).with(kind_of(Array), tags_as_array)
+          .and_call_original
+
+        export
+      end
+
+      it 'reuses the native exporter across exports' do
+        expect(described_class::NativeExporter).to receive(:_native_new).once.and_call_original
+
+        http_transport.export(flush)
+        http_transport.export(flush)
+      end
+
+      context 'when the tags change' do
+        let(:other_flush) do
+          Datadog::Profiling::Flush.new(
+            start: start,
+            finish: finish,
+            pprof_file_name: pprof_file_name,
+            pprof_data: pprof_data,
+            code_provenance_file_name: code_provenance_file_name,
+            code_provenance_data: code_provenance_data,
+            tags_as_array: [%w[tag_a other_value]],
+          )
+        end
+
+        it 'creates a new native exporter' do
+          expect(described_class::NativeExporter).to receive(:_native_new).twice.and_call_original
+
+          http_transport.export(flush)
+          http_transport.export(other_flush)
+        end
+      end
+
+      context 'after a fork' do
+        it 'creates a new native exporter' do
+          expect(described_class::NativeExporter).to receive(:_native_new).twice.and_call_original
+
+          http_transport.export(flush)
+          http_transport.reset_after_fork
+          http_transport.export(flush)
+        end
+      end
+
+      context 'when creating the native exporter fails' do
+        before do
+          expect(described_class::NativeExporter).to receive(:_native_new).and_return([:error, 'test error message'])
+        end
+
+        it 'logs an error message' do
+          expect(Datadog.logger).to receive(:error).with(/test error message/)
+
+          export
+        end
+
+        it { is_expected.to be false }
+      end
+    end
+
     context 'when successful' do
       before do
         expect(described_class).to receive(:_native_do_export).and_return([:ok, 200])
@@ -231,6 +315,201 @@ RSpec.describe Datadog::Profiling::HttpTransport do
 
       it { is_expected.to be false }
     end
+
+    context 'when async export is enabled' do
+      let(:async_export_enabled) { true }
+
+      it 'queues the flush to be reported by the async exporter' do
+        expect(described_class).to_not receive(:_native_do_export)
+        expect(described_class::AsyncExporter).to receive(:_native_enqueue).with(
+          kind_of(described_class::AsyncExporter),
+          kind_of(described_class::NativeExporter),
+          10_000,
+          1644249593,
+          987654321,
+          1699718400,
+          123456789,
+          pprof_file_name,
+          pprof_data,
+          code_provenance_file_name,
+          code_provenance_data
+        ).and_return([:ok, 1])
+
+        expect(export).to be true
+      end
+
+      context 'when queueing fails' do
+        before do
+          expect(described_class::AsyncExporter).to receive(:_native_enqueue).and_return([:error, 'test error message'])
+        end
+
+        it 'logs an error message' do
+          expect(Datadog.logger).to receive(:error).with(/test error message/)
+
+          export
+        end
+
+        it { is_expected.to be false }
+      end
+    end
+  end
+
+  describe '#shutdown!' do
+    context 'when async export is disabled' do
+      it { expect(http_transport.shutdown!).to be nil }
+    end
+  end
+
+  describe '#stats' do
+    context 'when async export is disabled' do
+      it { expect(http_transport.stats).to be nil }
+    end
+
+    context 'when async export is enabled' do
+      let(:async_export_enabled) { true }
+
+      it 'returns the async exporter stats' do
+        expect(http_transport.stats).to match(
+          queue_depth: 0,
+          max_queued_exports: described_class::AsyncExporter::MAX_QUEUED_EXPORTS,
+          exports_queued: 0,
+          exports_succeeded: 0,
+          exports_failed: 0,
+          export_retries: 0,
+          exports_dropped_queue_full: 0,
+          exports_dropped_on_stop: 0,
+          last_failure: nil,
+        )
+      end
+    end
+  end
+
+  describe 'file sink' do
+    let(:directory) { Dir.mktmpdir }
+    let(:file_sink_url) { "file://#{directory}" }
+
+    after { FileUtils.remove_entry(directory) if File.exist?(directory) }
+
+    def written_files
+      Dir.entries(directory).reject { |entry| entry.start_with?('.') }.sort
+    end
+
+    def read_written_file(path)
+      path.end_with?('.gz') ? Zlib::GzipReader.open(path, &:read) : File.binread(path)
+    end
+
+    it 'does not validate the agent settings' do
+      expect(described_class).to_not receive(:_native_validate_exporter)
+
+      http_transport
+    end
+
+    context 'when the url is not a file url' do
+      let(:file_sink_url) { "http://#{directory}" }
+
+      it { expect { http_transport }.to raise_error(ArgumentError, /Unsupported file sink url/) }
+    end
+
+    context 'when the directory does not exist' do
+      let(:file_sink_url) { "file://#{directory}/does_not_exist" }
+
+      it { expect { http_transport }.to raise_error(ArgumentError, /is not a directory/) }
+    end
+
+    it 'writes the pprof and code provenance files to the directory' do
+      expect(described_class).to_not receive(:_native_do_export)
+
+      expect(http_transport.export(flush)).to be true
+
+      expect(written_files).to match(
+        [
+          /\Addprof-\d{19}-#{Process.pid}-#{code_provenance_file_name}(\.gz)?\z/,
+          /\Addprof-\d{19}-#{Process.pid}-#{pprof_file_name}(\.gz)?\z/,
+        ]
+      )
+      expect(written_files.map { |file| read_written_file("#{directory}/#{file}") })
+        .to eq [code_provenance_data, pprof_data]
+    end
+
+    context 'when code provenance data is not available' do
+      let(:code_provenance_data) { nil }
+
+      it 'only writes the pprof file' do
+        http_transport.export(flush)
+
+        expect(written_files).to match([/#{pprof_file_name}/])
+      end
+    end
+
+    context 'when pprof data is a StackRecorder::EncodedProfile' do
+      let(:pprof_data) do
+        Datadog::Profiling::StackRecorder.new(cpu_time_enabled: false, alloc_samples_enabled: false)
+          .serialize_for_export.last
+      end
+
+      it 'writes the encoded profile' do
+        http_transport.export(flush)
+
+        pprof_file = written_files.find { |file| file.include?(pprof_file_name) }
+
+        expect(read_written_file("#{directory}/#{pprof_file}").bytesize).to eq pprof_data.bytesize
+      end
+    end
+
+    context 'when more than MAX_RETAINED_REPORTS reports were written' do
+      before { stub_const("#{described_class}::FileSink::MAX_RETAINED_REPORTS", 2) }
+
+      it 'deletes the oldest reports' do
+        3.times do |i|
+          http_transport.export(
+            Datadog::Profiling::Flush.new(
+              start: start,
+              finish: finish + i,
+              pprof_file_name: pprof_file_name,
+              pprof_data: pprof_data,
+              code_provenance_file_name: code_provenance_file_name,
+              code_provenance_data: code_provenance_data,
+              tags_as_array: tags_as_array,
+            )
+          )
+        end
+
+        expect(written_files.size).to be 4
+        expect(written_files).to_not include(/\Addprof-#{finish.tv_sec}/)
+      end
+    end
+
+    context 'when writing fails' do
+      before do
+        http_transport
+        FileUtils.remove_entry(directory)
+      end
+
+      it 'logs an error' do
+        expect(Datadog.logger).to receive(:error).with(/Failed to write profiling data/)
+
+        expect(http_transport.export(flush)).to be false
+      end
+    end
+
+    context 'when writing the code provenance file fails' do
+      before do
+        # Having a directory where the temporary file should go makes creating the temporary file fail
+        timestamp = format('%010d%09d', finish.tv_sec, finish.tv_nsec)
+        ['', '.gz'].each do |suffix|
+          Dir.mkdir("#{directory}/.ddprof-#{timestamp}-#{Process.pid}-#{code_provenance_file_name}#{suffix}.tmp")
+        end
+      end
+
+      it 'does not leave the pprof file behind' do
+        expect(Datadog.logger).to receive(:error).with(/Failed to write profiling data/)
+
+        expect(http_transport.export(flush)).to be false
+
+        expect(written_files).to be_empty
+        expect(Dir.children(directory)).to_not include(/#{pprof_file_name}/)
+      end
+    end
   end
 
   context 'integration testing' do
@@ -323,6 +602,26 @@ RSpec.describe Datadog::Profiling::HttpTransport do
         expect(LZ4.decode(body.fetch(pprof_file_name))).to eq pprof_data
         expect(LZ4.decode(body.fetch(code_provenance_file_name))).to eq code_provenance_data
       end
+
+      context 'when pprof data is a StackRecorder::EncodedProfile' do
+        let(:pprof_data) do
+          Datadog::Profiling::StackRecorder.new(cpu_time_enabled: true, alloc_samples_enabled: false)
+            .serialize_for_export.last
+        end
+
+        it 'reports the encoded profile contents' do
+          success = http_transport.export(flush)
+
+          expect(success).to be true
+
+          boundary = request['content-type'][%r{^multipart/form-data; boundary=(.+)}, 1]
+          body = WEBrick::HTTPUtils.parse_form_data(StringIO.new(request.body), boundary)
+
+          require 'extlz4' # Lazily required, to avoid trying to load it on JRuby
+
+          expect(LZ4.decode(body.fetch(pprof_file_name))).to eq pprof_data.to_s
+        end
+      end
     end
 
     include_examples 'correctly reports profiling data'
@@ -386,6 +685,34 @@ RSpec.describe Datadog::Profiling::HttpTransport do
       end
 
       include_examples 'correctly reports profiling data'
+
+      context 'when async export is enabled' do
+        let(:async_export_enabled) { true }
+
+        after { http_transport.shutdown!(0) }
+
+        it 'reports the profile via the unix domain socket' do
+          http_transport.export(flush)
+
+          try_wait_until { http_transport.stats[:exports_succeeded] == 1 }
+
+          expect(request.header).to include('dd-evp-origin' => ['dd-trace-rb'])
+        end
+      end
+
+      context 'when nothing is listening on the socket' do
+        before do
+          server.shutdown
+          @server_thread.join
+          File.delete(socket_path) if File.exist?(socket_path)
+        end
+
+        it 'logs an error' do
+          expect(Datadog.logger).to receive(:error).with(/Failed to report profiling data/)
+
+          expect(http_transport.export(flush)).to be false
+        end
+      end
     end
 
     context 'when agent is down' do
@@ -458,6 +785,132 @@ RSpec.describe Datadog::Profiling::HttpTransport do
       end
     end
 
+    describe 'async export' do
+      let(:async_export_enabled) { true }
+
+      after { http_transport.shutdown!(0) }
+
+      it 'reports the flush in the background' do
+        expect(http_transport.export(flush)).to be true
+
+        try_wait_until { http_transport.stats[:exports_succeeded] == 1 }
+
+        expect(request.header).to include('dd-evp-origin' => ['dd-trace-rb'])
+        expect(http_transport.stats).to include(queue_depth: 0, exports_queued: 1, exports_failed: 0)
+      end
+
+      context 'when server returns a 5xx failure' do
+        let(:attempts) { Queue.new }
+        let(:server_proc) do
+          proc do |req, res|
+            attempts << true
+            messages << req.tap { req.body }
+            res.status = attempts.size == 1 ? 503 : 200
+          end
+        end
+
+        before { stub_const("#{described_class}::AsyncExporter::INITIAL_BACKOFF_MILLISECONDS", 10) }
+
+        it 'retries the export' do
+          http_transport.export(flush)
+
+          try_wait_until { http_transport.stats[:exports_succeeded] == 1 }
+
+          expect(messages.size).to be 2
+          expect(http_transport.stats).to include(export_retries: 1, last_failure: /unexpected HTTP 503/)
+        end
+      end
+
+      context 'when server returns a 4xx failure' do
+        let(:server_proc) { proc { |_req, res| res.status = 418 } }
+
+        it 'does not retry the export' do
+          http_transport.export(flush)
+
+          try_wait_until { http_transport.stats[:exports_failed] == 1 }
+
+          expect(http_transport.stats).to include(export_retries: 0, last_failure: /unexpected HTTP 418/)
+        end
+      end
+
+      context 'when the server is slow' do
+        let!(:request_received_queue) { Queue.new }
+        let!(:request_finish_queue) { Queue.new }
+        let(:server_proc) do
+          proc do |req, res|
+            request_received_queue << true
+            request_finish_queue.pop
+            messages << req.tap { req.body }
+            res.body = '{}'
+          end
+        end
+
+        after { request_finish_queue.close }
+
+        it 'does not block the caller' do
+          http_transport.export(flush)
+          request_received_queue.pop
+
+          expect(http_transport.export(flush)).to be true
+          expect(http_transport.stats).to include(queue_depth: 2)
+        end
+
+        it 'drops the oldest queued export when the queue is full' do
+          http_transport.export(flush)
+          request_received_queue.pop
+
+          (described_class::AsyncExporter::MAX_QUEUED_EXPORTS + 1).times { http_transport.export(flush) }
+
+          expect(http_transport.stats).to include(
+            queue_depth: described_class::AsyncExporter::MAX_QUEUED_EXPORTS + 1,
+            exports_dropped_queue_full: 1,
+          )
+        end
+
+        it 'waits for queued exports to be reported when shutting down' do
+          http_transport.export(flush)
+          request_received_queue.pop
+          request_finish_queue << true
+
+          http_transport.shutdown!
+
+          expect(http_transport.stats).to include(exports_succeeded: 1, exports_dropped_on_stop: 0)
+        end
+
+        it 'drops any exports that were not reported before the shutdown timeout' do
+          http_transport.export(flush)
+          request_received_queue.pop
+          http_transport.export(flush)
+
+          expect(Datadog.logger).to receive(:warn).with(/Dropped 2 profile/)
+
+          http_transport.shutdown!(0.1)
+
+          expect(http_transport.stats).to include(queue_depth: 0, exports_dropped_on_stop: 2)
+        end
+
+        it 'discards the exports queued by the parent process after a fork' do
+          http_transport.export(flush)
+          request_received_queue.pop
+          http_transport.export(flush)
+
+          expect_in_fork do
+            expect(http_transport.instance_variable_get(:@async_exporter).reset_after_fork).to be 2
+            expect(http_transport.stats).to include(queue_depth: 0)
+          end
+        end
+      end
+
+      it 'does not queue exports after being shut down' do
+        http_transport.shutdown!
+
+        expect(Datadog.logger).to receive(:error).with(/AsyncExporter was shut down/)
+
+        expect(http_transport.export(flush)).to be false
+        expect(http_transport.stats).to include(exports_queued: 0)
+      end
+    end
+
     describe 'cancellation behavior' do
       let!(:request_received_queue) { Queue.new }
       let!(:request_finish_queue) { Queue.new }
@@ -333,4 +333,49 @@ RSpec.describe Datadog::Profiling::NativeExtension do
       end
     end
   end
+
+  describe 'latency_histogram' do
+    subject(:percentiles) { described_class::Testing._native_latency_histogram_percentiles(values) }
+
+    context 'when no values were recorded' do
+      let(:values) { [] }
+
+      it { is_expected.to be nil }
+    end
+
+    context 'when small values were recorded' do
+      let(:values) { (1..10).to_a }
+
+      it 'reports them exactly' do
+        expect(percentiles).to eq(p50: 5, p90: 9, p99: 10, p99_9: 10)
+      end
+    end
+
+    context 'when large values were recorded' do
+      let(:values) { [1_000] * 980 + [50_000] * 19 + [3_000_000] }
+
+      it 'reports them within the histogram precision' do
+        expect(percentiles.fetch(:p50)).to be_within(1_000 * 0.0625).of(1_000)
+        expect(percentiles.fetch(:p90)).to be_within(1_000 * 0.0625).of(1_000)
+        expect(percentiles.fetch(:p99)).to be_within(50_000 * 0.0625).of(50_000)
+        expect(percentiles.fetch(:p99_9)).to be_within(50_000 * 0.0625).of(50_000)
+      end
+    end
+
+    context 'when a single value was recorded' do
+      let(:values) { [3_000_000] }
+
+      it 'never reports values above it' do
+        expect(percentiles).to eq(p50: 3_000_000, p90: 3_000_000, p99: 3_000_000, p99_9: 3_000_000)
+      end
+    end
+
+    context 'when values above the histogram range were recorded' do
+      let(:values) { [2**50] }
+
+      it 'reports the highest recorded value' do
+        expect(percentiles.fetch(:p99_9)).to eq 2**50
+      end
+    end
+  end
 end
\ No newline at end of file
@@ -32,6 +32,22 @@ RSpec.describe Datadog::Profiling::Scheduler do
     end
   end
 
+  describe '#stop' do
+    subject(:stop) { scheduler.stop(true) }
+
+    it 'shuts down the transport' do
+      expect(transport).to receive(:shutdown!)
+
+      stop
+    end
+
+    context 'when the transport does not support being shut down' do
+      let(:transport) { double('Custom transport') } # rubocop:disable RSpec/VerifiedDoubles
+
+      it { expect { stop }.to_not raise_error }
+    end
+  end
+
   describe '#perform' do
     subject(:perform) { scheduler.perform }
 
@@ -204,8 +220,9 @@ RSpec.describe Datadog::Profiling::Scheduler do
   describe '#reset_after_fork' do
     subject(:reset_after_fork) { scheduler.reset_after_fork }
 
-    it 'resets the exporter' do
+    it 'resets the exporter and the transport' do
       expect(exporter).to receive(:reset_after_fork)
+      expect(transport).to receive(:reset_after_fork)
 
       reset_after_fork
     end
@@ -90,8 +90,13 @@ module ProfileHelpers
     samples.select { |sample| object_id_from(sample.labels.fetch(:'thread id')) == thread.object_id }
   end
 
-  def build_stack_recorder
-    Datadog::Profiling::StackRecorder.new(cpu_time_enabled: true, alloc_samples_enabled: true)
+  def build_stack_recorder(gvl_wait_enabled: false, heap_samples_enabled: false)
+    Datadog::Profiling::StackRecorder.new(
+      cpu_time_enabled: true,
+      alloc_samples_enabled: true,
+      gvl_wait_enabled: gvl_wait_enabled,
+      heap_samples_enabled: heap_samples_enabled,
+    )
   end
 end
 
@@ -8,9 +8,22 @@ RSpec.describe Datadog::Profiling::StackRecorder do
   let(:numeric_labels) { [] }
   let(:cpu_time_enabled) { true }
   let(:alloc_samples_enabled) { true }
+  let(:gvl_wait_enabled) { false }
+  let(:heap_samples_enabled) { false }
+  let(:deferred_recording_enabled) { false }
+  let(:memory_budget_bytes) { 0 }
+  let(:pre_aggregation_enabled) { false }
 
   subject(:stack_recorder) do
-    described_class.new(cpu_time_enabled: cpu_time_enabled, alloc_samples_enabled: alloc_samples_enabled)
+    described_class.new(
+      cpu_time_enabled: cpu_time_enabled,
+      alloc_samples_enabled: alloc_samples_enabled,
+      gvl_wait_enabled: gvl_wait_enabled,
+      heap_samples_enabled: heap_samples_enabled,
+      deferred_recording_enabled: deferred_recording_enabled,
+      memory_budget_bytes: memory_budget_bytes,
+      pre_aggregation_enabled: pre_aggregation_enabled,
+    )
   end
 
   # NOTE: A lot of libdatadog integration behaviors are tested in the Collectors::Stack specs, since we need actual
@@ -115,8 +128,37 @@ RSpec.describe Datadog::Profiling::StackRecorder do
       context 'when all profile types are enabled' do
         let(:cpu_time_enabled) { true }
         let(:alloc_samples_enabled) { true }
+        let(:gvl_wait_enabled) { true }
+        let(:heap_samples_enabled) { true }
 
         it 'returns a pprof with the configured sample types' do
+          expect(sample_types_from(decoded_profile)).to eq(
+            'cpu-time' => 'nanoseconds',
+            'cpu-samples' => 'count',
+            'wall-time' => 'nanoseconds',
+            'alloc-samples' => 'count',
+            'gvl-wait' => 'nanoseconds',
+            'heap-live-samples' => 'count',
+            'heap-live-size' => 'bytes',
+          )
+        end
+      end
+
+      context 'when heap samples are enabled but alloc-samples is disabled' do
+        let(:alloc_samples_enabled) { false }
+        let(:heap_samples_enabled) { true }
+
+        it do
+          expect { stack_recorder }.to raise_error(ArgumentError, /require alloc samples/)
+        end
+      end
+
+      context 'when gvl-wait is disabled' do
+        let(:cpu_time_enabled) { true }
+        let(:alloc_samples_enabled) { true }
+        let(:gvl_wait_enabled) { false }
+
+        it 'returns a pprof without the gvl-wait type' do
           expect(sample_types_from(decoded_profile)).to eq(
             'cpu-time' => 'nanoseconds',
             'cpu-samples' => 'count',
@@ -202,6 +244,19 @@ RSpec.describe Datadog::Profiling::StackRecorder do
           .to eq(:'cpu-time' => 123, :'cpu-samples' => 456, :'wall-time' => 789, :'alloc-samples' => 4242)
       end
 
+      context 'when gvl-wait is enabled' do
+        let(:gvl_wait_enabled) { true }
+        let(:metric_values) do
+          { 'cpu-time' => 123, 'cpu-samples' => 456, 'wall-time' => 789, 'alloc-samples' => 4242, 'gvl-wait' => 1234 }
+        end
+
+        it 'encodes the sample with the gvl-wait metric provided' do
+          expect(samples.first.values).to eq(
+            :'cpu-time' => 123, :'cpu-samples' => 456, :'wall-time' => 789, :'alloc-samples' => 4242, :'gvl-wait' => 1234
+          )
+        end
+      end
+
       context 'when disabling an optional profile sample type' do
         let(:cpu_time_enabled) { false }
 
@@ -215,6 +270,36 @@ RSpec.describe Datadog::Profiling::StackRecorder do
         expect(samples.first.labels).to eq(label_a: 'value_a', label_b: 'value_b')
       end
 
+      context 'when deferred recording is enabled' do
+        let(:deferred_recording_enabled) { true }
+
+        it 'encodes the sample with the metrics and labels provided' do
+          expect(samples.first.values)
+            .to eq(:'cpu-time' => 123, :'cpu-samples' => 456, :'wall-time' => 789, :'alloc-samples' => 4242)
+          expect(samples.first.labels).to eq(label_a: 'value_a', label_b: 'value_b')
+        end
+
+        it 'encodes the same stack as when deferred recording is disabled' do
+          immediate_recorder = described_class.new(cpu_time_enabled: true, alloc_samples_enabled: true)
+          Datadog::Profiling::Collectors::Stack::Testing
+            ._native_sample(Thread.current, immediate_recorder, metric_values, labels, numeric_labels, 400, false)
+          immediate_samples = samples_from_pprof(immediate_recorder.serialize.last)
+
+          # The stacks were taken from different places, so only the bottom frames will match
+          expect(samples.first.locations.last(3)).to eq(immediate_samples.first.locations.last(3))
+        end
+      end
+
+      context 'when pre-aggregation is enabled' do
+        let(:pre_aggregation_enabled) { true }
+
+        it 'encodes the sample with the metrics and labels provided' do
+          expect(samples.first.values)
+            .to eq(:'cpu-time' => 123, :'cpu-samples' => 456, :'wall-time' => 789, :'alloc-samples' => 4242)
+          expect(samples.first.labels).to eq(label_a: 'value_a', label_b: 'value_b')
+        end
+      end
+
       it 'encodes a single empty mapping' do
         expect(decoded_profile.mapping.size).to be 1
 
@@ -284,6 +369,19 @@ RSpec.describe Datadog::Profiling::StackRecorder do
           end
         ).to have(2).items
       end
+
+      context 'when deferred recording is enabled' do
+        let(:deferred_recording_enabled) { true }
+
+        it 'includes the endpoint for matching samples' do
+          Datadog::Profiling::Collectors::Stack::Testing._native_sample(
+            Thread.current, stack_recorder, metric_values, [], { 'local root span id' => 123 }.to_a, 400, false
+          )
+          described_class::Testing._native_record_endpoint(stack_recorder, 123, 'recorded-endpoint')
+
+          expect(samples.first[:labels]).to eq(:'local root span id' => 123, :'trace endpoint' => 'recorded-endpoint')
+        end
+      end
     end
 
     context 'when there is a failure during serialization' do
@@ -330,6 +428,50 @@ RSpec.describe Datadog::Profiling::StackRecorder do
     end
   end
 
+  describe '#serialize_for_export' do
+    subject(:serialize_for_export) { stack_recorder.serialize_for_export }
+
+    let(:metric_values) { { 'cpu-time' => 123, 'cpu-samples' => 456, 'wall-time' => 789, 'alloc-samples' => 4242 } }
+    let(:labels) { { 'label_a' => 'value_a', 'label_b' => 'value_b' }.to_a }
+
+    before do
+      Datadog::Profiling::Collectors::Stack::Testing
+        ._native_sample(Thread.current, stack_recorder, metric_values, labels, numeric_labels, 400, false)
+    end
+
+    it 'returns the start and finish timestamps, and the pprof as an EncodedProfile' do
+      start, finish, encoded_profile = serialize_for_export
+
+      expect(start).to be_a_kind_of(Time)
+      expect(finish).to be_a_kind_of(Time)
+      expect(encoded_profile).to be_a_kind_of(described_class::EncodedProfile)
+    end
+
+    it 'returns an EncodedProfile with the same data that #serialize would return' do
+      encoded_profile = serialize_for_export.last
+
+      expect(encoded_profile.bytesize).to eq encoded_profile.to_s.bytesize
+      expect(samples_from_pprof(encoded_profile.to_s).first.values)
+        .to eq(:'cpu-time' => 123, :'cpu-samples' => 456, :'wall-time' => 789, :'alloc-samples' => 4242)
+    end
+
+    it 'resets the profile, like #serialize does' do
+      serialize_for_export
+
+      expect(samples_from_pprof(stack_recorder.serialize.last)).to be_empty
+    end
+
+    context 'when there is a failure during serialization' do
+      before do
+        allow(Datadog.logger).to receive(:error)
+        expect(described_class).to receive(:_native_serialize).with(stack_recorder, true)
+          .and_return([:error, 'test error message'])
+      end
+
+      it { is_expected.to be nil }
+    end
+  end
+
   describe '#serialize!' do
     subject(:serialize!) { stack_recorder.serialize! }
 
@@ -406,6 +548,44 @@ RSpec.describe Datadog::Profiling::StackRecorder do
       end
     end
 
+    context 'when deferred recording is enabled' do
+      let(:deferred_recording_enabled) { true }
+      let(:metric_values) { { 'cpu-time' => 123, 'cpu-samples' => 456, 'wall-time' => 789 } }
+
+      it 'makes the next calls to serialize return no data, and keeps recording new samples' do
+        Datadog::Profiling::Collectors::Stack::Testing
+          ._native_sample(Thread.current, stack_recorder, metric_values, [], numeric_labels, 400, false)
+
+        reset_after_fork
+
+        expect(samples_from_pprof(stack_recorder.serialize.last)).to be_empty
+
+        Datadog::Profiling::Collectors::Stack::Testing
+          ._native_sample(Thread.current, stack_recorder, metric_values, [], numeric_labels, 400, false)
+
+        expect(samples_from_pprof(stack_recorder.serialize.last).size).to be 1
+      end
+
+      it 'drops samples in a forked child until reset_after_fork gets called' do
+        Datadog::Profiling::Collectors::Stack::Testing
+          ._native_sample(Thread.current, stack_recorder, metric_values, [], numeric_labels, 400, false)
+
+        expect_in_fork do
+          Datadog::Profiling::Collectors::Stack::Testing
+            ._native_sample(Thread.current, stack_recorder, metric_values, [], numeric_labels, 400, false)
+
+          expect(stack_recorder.stats).to include(deferred_samples_dropped: 1)
+
+          reset_after_fork
+
+          Datadog::Profiling::Collectors::Stack::Testing
+            ._native_sample(Thread.current, stack_recorder, metric_values, [], numeric_labels, 400, false)
+
+          expect(samples_from_pprof(stack_recorder.serialize.last).size).to be 1
+        end
+      end
+    end
+
     it 'sets the start_time of the active profile to the time of the reset_after_fork' do
       stack_recorder # Initialize instance
 
@@ -415,4 +595,283 @@ RSpec.describe Datadog::Profiling::StackRecorder do
       expect(stack_recorder.serialize.first).to be >= now
     end
   end
-end
\ No newline at end of file
+
+  describe 'pre-aggregation' do
+    let(:pre_aggregation_enabled) { true }
+    let(:metric_values) { { 'cpu-time' => 10, 'cpu-samples' => 1, 'wall-time' => 100 } }
+
+    def sample(labels = [])
+      Datadog::Profiling::Collectors::Stack::Testing
+        ._native_sample(Thread.current, stack_recorder, metric_values, labels, numeric_labels, 400, false)
+    end
+
+    it 'sums the values of samples with the same stack and labels' do
+      3.times { sample }
+
+      samples = samples_from_pprof(stack_recorder.serialize.last)
+
+      expect(samples.size).to be 1
+      expect(samples.first.values).to include(:'cpu-time' => 30, :'cpu-samples' => 3, :'wall-time' => 300)
+      expect(stack_recorder.stats).to include(
+        pre_aggregation_samples_aggregated: 2,
+        pre_aggregation_samples_flushed: 1,
+        pre_aggregation_samples_failed: 0,
+        pre_aggregation_samples_bypassed: 0,
+      )
+    end
+
+    it 'counts the pre-aggregated samples towards the estimated memory usage' do
+      expect { sample }.to change { stack_recorder.stats.fetch(:estimated_memory_bytes) }.from(0)
+    end
+
+    it 'keeps samples with different labels apart' do
+      2.times { |i| sample([['label_a', "value_#{i}"]]) }
+
+      samples = samples_from_pprof(stack_recorder.serialize.last)
+
+      expect(samples.map(&:labels)).to contain_exactly({ label_a: 'value_0' }, { label_a: 'value_1' })
+    end
+
+    it 'does not include the samples again in the next serialization' do
+      sample
+      stack_recorder.serialize
+
+      expect(samples_from_pprof(stack_recorder.serialize.last)).to be_empty
+    end
+
+    it 'counts samples that libdatadog failed to record' do
+      sample({ 'local root span id' => 'incorrect' }.to_a)
+      stack_recorder.serialize
+
+      expect(stack_recorder.stats).to include(pre_aggregation_samples_flushed: 0, pre_aggregation_samples_failed: 1)
+    end
+
+    it 'discards the pre-aggregated samples on reset_after_fork' do
+      sample
+      stack_recorder.reset_after_fork
+
+      expect(samples_from_pprof(stack_recorder.serialize.last)).to be_empty
+      expect(stack_recorder.stats).to include(pre_aggregation_samples_aggregated: 0, pre_aggregation_samples_flushed: 0)
+    end
+  end
+
+  describe 'memory accounting' do
+    let(:metric_values) { { 'cpu-time' => 123, 'cpu-samples' => 456, 'wall-time' => 789 } }
+
+    it 'reports the estimated memory usage of the profiles to Ruby' do
+      require 'objspace'
+
+      empty_size = ObjectSpace.memsize_of(stack_recorder)
+      Datadog::Profiling::Collectors::Stack::Testing
+        ._native_sample(Thread.current, stack_recorder, metric_values, [], numeric_labels, 400, false)
+
+      expect(ObjectSpace.memsize_of(stack_recorder)).to be > empty_size
+    end
+  end
+
+  describe '#stats' do
+    subject(:stats) { stack_recorder.stats }
+
+    let(:metric_values) { { 'cpu-time' => 123, 'cpu-samples' => 456, 'wall-time' => 789 } }
+
+    def sample(labels = [])
+      Datadog::Profiling::Collectors::Stack::Testing
+        ._native_sample(Thread.current, stack_recorder, metric_values, labels, numeric_labels, 400, false)
+    end
+
+    context 'when heap samples are disabled' do
+      it 'does not include heap stats' do
+        expect(stats).to include(heap_tracked_objects: nil, heap_tracked_stacks: nil)
+      end
+    end
+
+    context 'when heap samples are enabled' do
+      let(:heap_samples_enabled) { true }
+
+      it 'starts with no tracked objects' do
+        expect(stats).to include(heap_tracked_objects: 0, heap_tracked_stacks: 0)
+      end
+    end
+
+    context 'when pre-aggregation is disabled' do
+      it 'does not include pre-aggregation stats' do
+        sample
+
+        expect(stats).to include(
+          pre_aggregation_samples_aggregated: nil,
+          pre_aggregation_samples_flushed: nil,
+          pre_aggregation_samples_failed: nil,
+          pre_aggregation_samples_bypassed: nil,
+        )
+      end
+    end
+
+    context 'when there is no memory budget' do
+      it 'does not drop samples' do
+        3.times { sample }
+
+        expect(stats).to include(memory_budget_bytes: nil, samples_over_memory_budget: 0)
+        expect(stats.fetch(:estimated_memory_bytes)).to be > 0
+      end
+
+      # Samples always get taken from the same line, as otherwise their stacks would be different
+
+      it 'charges every sample in full, without checking what the profile already has' do
+        estimated_memory_bytes = Array.new(2) do
+          sample
+          stats.fetch(:estimated_memory_bytes)
+        end
+
+        expect(estimated_memory_bytes.last).to eq(estimated_memory_bytes.first * 2)
+      end
+    end
+
+    context 'when there is a memory budget that does not get reached' do
+      let(:memory_budget_bytes) { 1024 * 1024 * 1024 }
+
+      # Samples always get taken from the same line, as otherwise their stacks would be different
+
+      it 'does not charge again for samples that the profile already has' do
+        estimated_memory_bytes = Array.new(3) do
+          sample
+          stats.fetch(:estimated_memory_bytes)
+        end
+
+        expect(estimated_memory_bytes.uniq).to eq [estimated_memory_bytes.first]
+      end
+
+      it 'charges less for a sample that only has new labels than for the first sample' do
+        first_sample_bytes, new_labels_bytes = [[], [['unique', 'value_1']]].map do |labels|
+          estimated_memory_bytes_before = stats.fetch(:estimated_memory_bytes)
+          sample(labels)
+          stats.fetch(:estimated_memory_bytes) - estimated_memory_bytes_before
+        end
+
+        expect(new_labels_bytes).to be_between(1, first_sample_bytes - 1)
+      end
+    end
+
+    context 'when there is a memory budget' do
+      # Fits two samples with the same stack but different labels
+      let(:memory_budget_bytes) do
+        # Samples only get charged for the parts the profile doesn't have yet when there is a budget
+        recorder_measuring_samples = described_class.new(
+          cpu_time_enabled: true, alloc_samples_enabled: true, memory_budget_bytes: 1024 * 1024 * 1024
+        )
+        2.times { |i| sample_background_thread("value_#{i + 1}", recorder: recorder_measuring_samples) }
+        recorder_measuring_samples.stats.fetch(:estimated_memory_bytes)
+      end
+      # The stack of a sleeping background thread is the same regardless of where it gets sampled from
+      let(:ready_queue) { Queue.new }
+      let(:background_thread) do
+        Thread.new(ready_queue) do |ready_queue|
+          ready_queue << true
+          sleep
+        end
+      end
+
+      before do
+        background_thread
+        ready_queue.pop
+      end
+
+      after do
+        background_thread.kill
+        background_thread.join
+      end
+
+      def sample_background_thread(label_value, recorder: stack_recorder)
+        Datadog::Profiling::Collectors::Stack::Testing._native_sample(
+          background_thread, recorder, metric_values, [['unique', label_value]], numeric_labels, 400, false
+        )
+      end
+
+      it 'drops samples that would go over the budget' do
+        3.times { |i| sample_background_thread("value_#{i + 1}") }
+
+        expect(stats).to include(memory_budget_bytes: memory_budget_bytes, samples_over_memory_budget: 1)
+        expect(stats.fetch(:estimated_memory_bytes)).to be <= memory_budget_bytes
+      end
+
+      it 'does not drop samples that the profile already has' do
+        3.times { |i| sample_background_thread("value_#{i + 1}") }
+        sample_background_thread('value_1')
+
+        expect(stats).to include(samples_over_memory_budget: 1)
+        expect(samples_from_pprof(stack_recorder.serialize.last).map { |it| it.values.fetch(:'cpu-samples') })
+          .to contain_exactly(456 * 2, 456)
+      end
+
+      it 'starts accepting samples again after serialization' do
+        3.times { |i| sample_background_thread("value_#{i + 1}") }
+        stack_recorder.serialize
+        sample_background_thread('value_1')
+
+        expect(samples_from_pprof(stack_recorder.serialize.last).size).to be 1
+        expect(stats).to include(samples_over_memory_budget: 1)
+      end
+
+      context 'when pre-aggregation is enabled' do
+        let(:pre_aggregation_enabled) { true }
+        let(:memory_budget_bytes) do
+          recorder_measuring_samples =
+            described_class.new(cpu_time_enabled: true, alloc_samples_enabled: true, pre_aggregation_enabled: true)
+          2.times { |i| sample_background_thread("value_#{i + 1}", recorder: recorder_measuring_samples) }
+          recorder_measuring_samples.stats.fetch(:estimated_memory_bytes)
+        end
+
+        it 'drops samples that would go over the budget before they get pre-aggregated' do
+          3.times { |i| sample_background_thread("value_#{i + 1}") }
+
+          expect(stats).to include(samples_over_memory_budget: 1)
+          expect(stats.fetch(:estimated_memory_bytes)).to be <= memory_budget_bytes
+        end
+
+        it 'does not drop any of the pre-aggregated samples when serializing' do
+          3.times { |i| sample_background_thread("value_#{i + 1}") }
+
+          expect(samples_from_pprof(stack_recorder.serialize.last).size).to be 2
+          expect(stats).to include(samples_over_memory_budget: 1, pre_aggregation_samples_flushed: 2)
+        end
+      end
+    end
+
+    context 'when deferred recording is disabled' do
+      it 'does not include deferred recording stats' do
+        sample
+
+        expect(stats).to include(
+          deferred_samples_deferred: nil,
+          deferred_samples_dropped: nil,
+          deferred_samples_recorded: nil,
+          deferred_samples_failed: nil,
+        )
+      end
+    end
+
+    context 'when deferred recording is enabled' do
+      let(:deferred_recording_enabled) { true }
+
+      it 'counts the samples that were deferred and later recorded' do
+        3.times { sample }
+        stack_recorder.serialize
+
+        expect(stats).to include(
+          deferred_samples_deferred: 3,
+          deferred_samples_dropped: 0,
+          deferred_samples_recorded: 3,
+          deferred_samples_failed: 0,
+        )
+      end
+
+      it 'counts samples that libdatadog failed to record' do
+        Datadog::Profiling::Collectors::Stack::Testing._native_sample(
+          Thread.current, stack_recorder, metric_values, { 'local root span id' => 'incorrect' }.to_a, [], 400, false
+        )
+        stack_recorder.serialize
+
+        expect(stats).to include(deferred_samples_recorded: 0, deferred_samples_failed: 1)
+      end
+    end
+  end
+end
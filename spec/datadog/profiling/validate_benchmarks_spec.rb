@@ -21,7 +21,23 @@ RSpec.describe 'Profiling benchmarks', if: (RUBY_VERSION >= '2.4.0') do
     it('runs without raising errors') { expect_in_fork { load './benchmarks/profiler_sample_loop_v2.rb' } }
   end
 
+  describe 'profiler_sample_many_threads' do
+    it('runs without raising errors') { expect_in_fork { load './benchmarks/profiler_sample_many_threads.rb' } }
+  end
+
   describe 'profiler_http_transport' do
     it('runs without raising errors') { expect_in_fork { load './benchmarks/profiler_http_transport.rb' } }
   end
+
+  describe 'profiler_sampling_trigger' do
+    it('runs without raising errors') { expect_in_fork { load './benchmarks/profiler_sampling_trigger.rb' } }
+  end
+
+  describe 'profiler_idle_sampling' do
+    it('runs without raising errors') { expect_in_fork { load './benchmarks/profiler_idle_sampling.rb' } }
+  end
+
+  describe 'profiler_pre_aggregation' do
+    it('runs without raising errors') { expect_in_fork { load './benchmarks/profiler_pre_aggregation.rb' } }
+  end
 end
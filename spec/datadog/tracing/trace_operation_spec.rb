@@ -2348,6 +2348,49 @@ RSpec.describe Datadog::Tracing::TraceOperation do
     end
   end
 
+  describe '.profiling_slot_class' do
+    let(:profiling_slot_class) do
+      Class.new do
+        attr_reader :trace_op, :published
+
+        def initialize(trace_op)
+          @trace_op = trace_op
+          @published = []
+        end
+
+        def publish(root_span, active_span)
+          @published << [root_span && root_span.name, active_span && active_span.name]
+        end
+      end
+    end
+
+    around do |example|
+      begin
+        described_class.profiling_slot_class = profiling_slot_class
+        example.run
+      ensure
+        described_class.profiling_slot_class = nil
+      end
+    end
+
+    it 'publishes the root and active spans whenever the active span changes' do
+      trace_op.measure('root') { trace_op.measure('inner') {} }
+
+      slot = trace_op.instance_variable_get(:@profiling_slot)
+
+      expect(slot.trace_op).to be trace_op
+      expect(slot.published).to eq [%w[root root], %w[root inner], %w[root root], ['root', nil]]
+    end
+
+    it 'publishes the root and active spans again when the resource changes' do
+      trace_op.measure('root') { trace_op.resource = 'changed' }
+
+      slot = trace_op.instance_variable_get(:@profiling_slot)
+
+      expect(slot.published).to eq [%w[root root], %w[root root], ['root', nil]]
+    end
+  end
+
   describe 'integration tests' do
     context 'service_entry attributes' do
       context 'when service not given' do